@@ -62,6 +62,11 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 293807 $")
 #include <sys/stat.h>
 #include <math.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <dahdi/user.h>
 #include <dahdi/tonezone.h>
@@ -127,9 +132,6 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 293807 $")
 #include "asterisk/devicestate.h"
 #include "asterisk/paths.h"
 
-#define PDU_LENGTH_7BIT 153
-#define PDU_LENGTH_UCS2 134 //FIXME: Actually 134 but msg are failing with 134.
-
 #if (ASTERISK_VERSION_NUM >= 120000)
 #include "asterisk/stasis_channels.h"
 #endif
@@ -137,8 +139,6 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 293807 $")
 #include "asterisk/format_cache.h"
 #endif
 
-#define PDU_LENGTH_7BIT 153 //sms PDU mode
-
 static const char * const lbostr[] = {
 "0 db (CSU)/0-133 feet (DSX-1)",
 "133-266 feet (DSX-1)",
@@ -157,13 +157,17 @@ static const char tdesc[] = "GSM Telephony Driver FOR Asterisk"
 ;
 
 static char *app_sendsms = "SendSMS";
-static char *sendsms_synopsis = "SendSMS(Span,Dest,Message,[ID])";
+static char *sendsms_synopsis = "SendSMS(Span,Dest,Message,[ID],[Priority])";
 static char *sendsms_desc =
 "SendSMS(Span,Dest,Message)\n"
-"  Span - Id of device from chan-allogsm.conf\n"
+"  Span - Id of device from chan-allogsm.conf, or auto for the span with the\n"
+"         shortest SMS queue and best signal. A single part SMS sent with\n"
+"         auto that fails is sent again on another span.\n"
 "  Dest - destination\n"
 "  Message - text of the message\n"
-"  ID - Indentification of this sms\n";
+"  ID - Indentification of this sms\n"
+"  Priority - high (or otp), normal or bulk, default normal.\n"
+"             Queued high messages are sent before normal and bulk ones.\n";
 
 static char *app_sendpdu = "SendPDU";
 static char *sendpdu_synopsis = "SendPDU(Span,PDU,[ID])";
@@ -332,6 +336,9 @@ static inline int allochan_wait_event(int fd)
 /*! Chunk size to read -- we use 20ms chunks to make things happy. */
 #define READ_SIZE 160
 
+/* Max events handled per D-channel wakeup */
+#define GSM_EVENT_BATCH 16
+
 struct allochan_pvt;
 
 #ifdef HAVE_ALLOGSMAT
@@ -379,6 +386,11 @@ struct allochan_gsm {
 #endif
 
 	ast_mutex_t ussd_mutex;
+	ast_mutex_t sms_result_lock;		/*!< Guards the SMS send result queue */
+	struct gsm_sms_result *sms_result_head;	/*!< SMS send results waiting for their dialplan run */
+	struct gsm_sms_result *sms_result_tail;
+	int sms_result_len;
+	int sms_result_running;			/*!< The result worker is draining the queue */
 	ast_mutex_t operator_list_mutex;
 	ast_mutex_t safe_at_mutex;
 	ast_cond_t ussd_cond;
@@ -409,9 +421,17 @@ struct allochan_gsm {
 	int call_waiting_enabled;
 	int auto_modem_reset;
 
+	int rxbacklog;					/*!< Lines left in the library after a full event batch */
+	struct gsm_reactor *reactor;	/*!< Reactor polling the D-channel, NULL if it has its own thread */
+	int reactor_idx;				/*!< Index in reactor->spans */
+	short reactor_events;			/*!< poll() events the fd is registered for */
+	int reactor_woken;				/*!< Handled on the last reactor wakeup */
+	int reactor_dirty;				/*!< Changed by another thread, prepared again on the next wakeup */
+	struct timeval reactor_due;		/*!< Wakeup without fd activity, zero for none */
 };
 
 static struct allochan_gsm gsms[NUM_SPANS];
+static void gsm_reactor_wake(struct gsm_reactor *reactor);
 
 /* FIXME - Change debug defs when they are done... */
 #if 0
@@ -1035,6 +1055,10 @@ static inline int gsm_grab(struct allochan_pvt *pvt, struct allochan_gsm *gsm)
 	/* Then break the poll */
 	if (gsm->master != AST_PTHREADT_NULL)
 		pthread_kill(gsm->master, SIGURG);
+	else if (gsm->reactor) {
+		gsm->reactor_dirty = 1;
+		gsm_reactor_wake(gsm->reactor);
+	}
 	return 0;
 }
 #endif
@@ -6498,44 +6522,10 @@ e_return:
 	return NULL;
 }
 ////////////////////////////////////////////////////////////////////////////////
-#if 1
-static void allochan_save_sms(int span, char* date, char* sender, char* msg, char* pdu)
-{
-        char filename[128]="/mnt/sms_bak/";
-
-        struct timeval tv;
-        gettimeofday(&tv,NULL);
-
-        char name[64];
-	sprintf(name,"/%d/%ld_%ld.sms", span,  tv.tv_sec, tv.tv_usec );
-        //sprintf(name,"/%d/%u.sms", span, (unsigned)time(NULL));
-        strcat(filename, name);
-
-        FILE *f=fopen(filename, "w+");
-
-        if (!f) {
-                ast_log(LOG_WARNING,"cannot save sms at (%s) error (%s)\n",filename, strerror(errno));
-                return;
-        }
-
-        fprintf(f,"Span: %d\n", span);
-        fprintf(f,"Sender: %s\n", sender);
-        fprintf(f,"Date: %s\n", date);
-        fprintf(f,"PDU: %s\n", pdu);
-        fprintf(f,"Text: %s\n", msg);
-
-        fclose(f);
-	
-        /*generate a Manager Event*/
-#if 0
-        if (gsm_cfg[port].sms_pdu_mode)
-                manager_event(EVENT_FLAG_CALL, "NewSMS_PDU", "Port: %d\r\nPDU_LEN: %d\r\nText: %s\r\n", port, msg->pdu_len, msg->text);
-        else
-                manager_event(EVENT_FLAG_CALL, "NewSMS", "Port: %d\r\nCallerID: %s\r\nDate: %s\r\nText: %s\r\n", port, msg->number, msg->date, msg->text);
-#endif
-
-}
-#endif
+/* Received SMS are journaled in <dir>/<span>, see allogsm_journal_open() */
+#define SMSJOURNALDIR "/mnt/sms_bak"
+/* Sent and failed SMS per id, also exported as <dir>/success/<id> and <dir>/fail/<id> */
+#define SMSCOUNTDIR "/mnt/smsout_count"
 
 int write_sms_file(char* msg, char *filename);
 int write_sms_mail_file (int span, char* date, char* sender, char* msg, char* pdu, char *filename);
@@ -6847,237 +6837,709 @@ init_virtual_end:
 }
 #endif
 
-static void *gsm_dchannel(void *vgsm)
-{
-	struct allochan_gsm *gsm = vgsm;
-	allogsm_event *e;
-	struct pollfd fds[1];
-	int res;
-	int chanpos = 0;
-	int x;
-	struct ast_channel *c;
-	struct timeval tv, lowest, *next;
-	struct timeval lastidle = ast_tvnow();
-	time_t t;
+/* A failed "auto" SMS, moved to another span once the failing span is unlocked */
+struct gsm_sms_failover {
+	int pending;
+	int prio;
+	char dest[512];
+	char text[1024];
+	char id[512];
+};
+
+static void gsm_sms_failover(struct gsm_sms_failover *f, int from_span);
+static void gsm_bulk_result(int span, sms_info_u *sms_info, int ok);
+
 /*
-	FILE *sms_r;
-	FILE *sms_w;
-*/
-	char date[64];	
-	pthread_t threadid;
-	char* context_name;
-	char cmd[1024];
-	
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+ * Hooks are the scripts run for events, e.g. dbWriteSMS for every SMS
+ * received.  A D-channel thread never forks: gsm_hook_run() copies the
+ * command line into a slot of a lock-free ring and wakes the hook thread.
+ * That thread starts hooks with posix_spawn(), no more than GSM_HOOK_RUNNING
+ * at once, reaps them, and stops any that run past their timeout.  A hook is
+ * dropped if the ring is full.
+ */
+#define GSM_HOOK_SLOTS		64		/* Hooks waiting to start, a power of 2 */
+#define GSM_HOOK_RUNNING	4		/* Hooks running at once */
+#define GSM_HOOK_ARGS		8		/* Arguments of a hook, with the program */
+#define GSM_HOOK_BUF		2048	/* Bytes of those arguments */
+#define GSM_HOOK_TIMEOUT	60000	/* ms a hook may run for */
+#define GSM_HOOK_KILL_MS	2000	/* ms from SIGTERM to SIGKILL */
+#define GSM_HOOK_REAP_MS	100		/* Poll for exits this often while hooks run */
+
+struct gsm_hook {
+	unsigned int seq;				/* Position of the ring the slot is free or full for */
+	int timeout;					/* ms */
+	int argc;						/* 0 if the arguments did not fit */
+	char *argv[GSM_HOOK_ARGS + 1];	/* Into buf */
+	char buf[GSM_HOOK_BUF];
+};
 
-	gettimeofday(&lastidle, NULL);
+struct gsm_hook_child {
+	pid_t pid;
+	char name[64];
+	struct timeval deadline;
+	int killed;						/* SIGTERM sent */
+};
+
+static struct gsm_hook hook_ring[GSM_HOOK_SLOTS];
+static unsigned int hook_head;		/* Next slot to fill, claimed by the producers */
+static unsigned int hook_tail;		/* Next slot to start, hook thread only */
+static unsigned int hook_dropped;
+static int hook_pipe[2] = { -1, -1 };	/* Wakes the hook thread */
+static int hook_stop;
+static pthread_t hook_thread = AST_PTHREADT_NULL;
+
+extern char **environ;
+
+/******************************************************************************
+ * Run a program in the background, never forks the calling thread
+ * param:
+ *		timeout: ms the program may run for before it is stopped
+ *		path: program, then its arguments, then NULL
+ * return:
+ *		0: queued
+ *		-1: hook thread not running, too many hooks waiting
+ * e.g.
+ *		gsm_hook_run(GSM_HOOK_TIMEOUT, "/var/scripts/SmsClear.sh", "1", NULL);
+ ******************************************************************************/
+static int gsm_hook_run(int timeout, const char *path, ...)
+{
+	struct gsm_hook *hook;
+	unsigned int pos, seq;
+	const char *arg;
+	va_list ap;
+	int len = 0, n;
+
+	if (hook_stop || hook_pipe[1] < 0) {
+		return -1;
+	}
 
+	/* Claim a slot: free while its seq equals the position taking it */
+	pos = __atomic_load_n(&hook_head, __ATOMIC_RELAXED);
 	for (;;) {
-		if (!gsm->dchannel)
+		hook = &hook_ring[pos & (GSM_HOOK_SLOTS - 1)];
+		seq = __atomic_load_n(&hook->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&hook_head, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if ((int)(seq - pos) < 0) {
+			__atomic_add_fetch(&hook_dropped, 1, __ATOMIC_RELAXED);
+			ast_log(LOG_WARNING, "Too many hooks waiting, not running %s\n", path);
+			return -1;
+		} else {
+			pos = __atomic_load_n(&hook_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	hook->timeout = timeout;
+	hook->argc = 0;
+	va_start(ap, path);
+	for (arg = path; arg; arg = va_arg(ap, const char *)) {
+		n = strlen(arg) + 1;
+		if (hook->argc == GSM_HOOK_ARGS || len + n > GSM_HOOK_BUF) {
+			ast_log(LOG_WARNING, "Arguments of hook %s too long, not running it\n", path);
+			hook->argc = 0;
 			break;
+		}
+		memcpy(hook->buf + len, arg, n);
+		hook->argv[hook->argc++] = hook->buf + len;
+		len += n;
+	}
+	va_end(ap);
+	hook->argv[hook->argc] = NULL;
 
-		fds[0].fd = gsm->fd;
-		fds[0].events = POLLIN | POLLPRI;
-		fds[0].revents = 0;
+	/* Publish, the slot is now full for position pos */
+	__atomic_store_n(&hook->seq, pos + 1, __ATOMIC_RELEASE);
+	if (write(hook_pipe[1], "", 1) < 0) {
+		/* Pipe full, the hook thread has wakeups pending already */
+	}
 
-		time(&t);
-		ast_mutex_lock(&gsm->lock);
+	return 0;
+}
 
-		if (gsm->resetinterval > 0) {
-			if (gsm->resetting && gsm_is_up(gsm)) {
-				if (gsm->resetpos < 0)
-					gsm_check_restart(gsm);
-			} else {
-				if (!gsm->resetting	&& (t - gsm->lastreset) >= gsm->resetinterval) {
-					gsm->resetting = 1;
-					gsm->resetpos = -1;
-				}
+/* Oldest full slot, NULL if none */
+static struct gsm_hook *gsm_hook_next(void)
+{
+	struct gsm_hook *hook = &hook_ring[hook_tail & (GSM_HOOK_SLOTS - 1)];
+
+	if (__atomic_load_n(&hook->seq, __ATOMIC_ACQUIRE) != hook_tail + 1) {
+		return NULL;
+	}
+
+	return hook;
+}
+
+/* Free the slot gsm_hook_next() gave for the lap after this one */
+static void gsm_hook_free(struct gsm_hook *hook)
+{
+	__atomic_store_n(&hook->seq, hook_tail + GSM_HOOK_SLOTS, __ATOMIC_RELEASE);
+	hook_tail++;
+}
+
+static int gsm_hook_spawn(struct gsm_hook *hook, struct gsm_hook_child *child)
+{
+	static const int reset[] = { SIGPIPE, SIGCHLD, SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2, SIGURG, SIGWINCH };
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	int i, res;
+
+	/* Signals Asterisk blocks or ignores would stay that way in the hook */
+	posix_spawnattr_init(&attr);
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	for (i = 0; i < ARRAY_LEN(reset); i++) {
+		sigaddset(&mask, reset[i]);
+	}
+	posix_spawnattr_setsigdefault(&attr, &mask);
+	/* In a group of its own so a timeout stops whatever the hook started too */
+	posix_spawnattr_setpgroup(&attr, 0);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+	res = posix_spawn(&child->pid, hook->argv[0], NULL, &attr, hook->argv, environ);
+	posix_spawnattr_destroy(&attr);
+	if (res) {
+		ast_log(LOG_WARNING, "Can't run hook %s: %s\n", hook->argv[0], strerror(res));
+		return -1;
+	}
+
+	ast_copy_string(child->name, hook->argv[0], sizeof(child->name));
+	child->deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(hook->timeout, 1000));
+	child->killed = 0;
+	ast_debug(1, "Hook %s started, pid %d\n", child->name, (int)child->pid);
+
+	return 0;
+}
+
+/* Reap the hooks that exited, stop the ones past their deadline, returns ms to the next deadline */
+static int gsm_hook_reap(struct gsm_hook_child *running, int *nrunning)
+{
+	struct timeval now = ast_tvnow();
+	int i, status, left, next = GSM_HOOK_REAP_MS;
+	pid_t pid;
+
+	for (i = 0; i < *nrunning; ) {
+		pid = waitpid(running[i].pid, &status, WNOHANG);
+		if (pid == running[i].pid || (pid < 0 && errno == ECHILD)) {
+			if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status)) {
+				ast_log(LOG_NOTICE, "Hook %s exited with status %d\n", running[i].name, WEXITSTATUS(status));
+			} else if (pid > 0 && WIFSIGNALED(status) && !running[i].killed) {
+				ast_log(LOG_NOTICE, "Hook %s killed by signal %d\n", running[i].name, WTERMSIG(status));
 			}
+			running[i] = running[--(*nrunning)];
+			continue;
 		}
-		/* Start with reasonable max */
-		lowest = ast_tv(1, 500000);
-		if ((next = allogsm_schedule_next(gsm->dchan))) {
-			/* We need relative time here */
-			tv = ast_tvsub(*next, ast_tvnow());
-			if (tv.tv_sec < 0) {
-				tv = ast_tv(0,0);
-			}
-			if (gsm->resetting) {
-				if (tv.tv_sec > 1) {
-					tv = ast_tv(1, 500000);
-				}
+
+		left = ast_tvdiff_ms(running[i].deadline, now);
+		if (left <= 0) {
+			if (!running[i].killed) {
+				ast_log(LOG_WARNING, "Hook %s ran too long, stopping it\n", running[i].name);
+				kill(-running[i].pid, SIGTERM);
+				running[i].killed = 1;
 			} else {
-				if (tv.tv_sec > 1) {
-					tv = ast_tv(1, 500000);
-				}
+				kill(-running[i].pid, SIGKILL);
 			}
-		} else if (gsm->resetting) {
-			/* Make sure we stop at least once per second if we're
-			   monitoring idle channels */
-			tv = ast_tv(1,0);
-		} else {
-			/* Don't poll for more than 10 seconds */
-			tv = ast_tv(1, 500000);
-		}
-		if (ast_tvcmp(tv, lowest) < 0) {
-			lowest = tv;
+			running[i].deadline = ast_tvadd(now, ast_samp2tv(GSM_HOOK_KILL_MS, 1000));
+		} else if (left < next) {
+			next = left;
 		}
-		ast_mutex_unlock(&gsm->lock);
+		i++;
+	}
 
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-		pthread_testcancel();
-		
-		e = NULL;
+	return next;
+}
 
-		res = poll(fds, 1, lowest.tv_sec * 1000 + lowest.tv_usec / 1000);
+static void *gsm_hook_thread(void *data)
+{
+	struct gsm_hook_child running[GSM_HOOK_RUNNING];
+	struct gsm_hook *hook;
+	struct pollfd pfd;
+	char buf[64];
+	int nrunning = 0, timeout = 0;
 
-		pthread_testcancel();
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-		
-		ast_mutex_lock(&gsm->lock);
-	
-		if ((gsm->dchan->sanidx > 0)){
-			e = allogsm_check_event(gsm->dchan);
-		} else if (!res) {
-			if(gsm->gsm_init_flag == 0) {
-				gsm->gsm_reinit++;
-				if(gsm->gsm_reinit%5 == 0) {
-					if(gsm->gsm_reinit%30 == 0) {
-						gsm->gsm_init_flag = 1;
-						gsm->gsm_reinit = 0;
-					} else if(gsm->gsm_reinit%15 == 0) {
-						ioctl(gsm->fd, ALLOG4C_SPAN_INIT, 1);
-						ast_log(LOG_NOTICE, "GSM reset power of module on D-channel of span %d\n", gsm->span);
-					} else {
-						ast_log(LOG_NOTICE, "GSM detect module on D-channel of span %d\n", gsm->span);
-						allogsm_module_start(gsm->dchan);
-					}
-				}
+	pfd.fd = hook_pipe[0];
+	pfd.events = POLLIN;
+
+	for (;;) {
+		while (!hook_stop && nrunning < GSM_HOOK_RUNNING && (hook = gsm_hook_next())) {
+			/* Keep Asterisk's SIGCHLD handler from reaping our children */
+			if (!nrunning) {
+				ast_replace_sigchld();
 			}
-			e = allogsm_schedule_run(gsm->dchan);
-		} else if (res > -1) {
-			if (fds[0].revents & POLLIN) {
-//                        printf("send data from chan_allogsm  %s  with length is %d\n ",gsm->dchan->at_last_recv,gsm->dchan->at_last_recv_idx);
-				e = allogsm_check_event(gsm->dchan);
-			} else if (fds[0].revents & POLLPRI) {
-				/* Check for an event */
-				x = 0;
-				res = ioctl(gsm->fd, DAHDI_GETEVENT, &x);
-				if (x) {
-					ast_log(LOG_NOTICE, "GSM got event: %s (%d) on D-channel of span %d\n", event2str(x), x, gsm->span);
-					manager_event(EVENT_FLAG_SYSTEM, "GSMEvent",
-						"GSMEvent: %s\r\n"
-						"GSMEventCode: %d\r\n"
-						"Span: %d\r\n",
-						event2str(x),
-						x,
-						gsm->span
-						);
-				}
-				/* Keep track of alarm state */	
-				if (x == DAHDI_EVENT_ALARM) {
-					gsm->dchanavail &= ~(DCHAN_NOTINALARM | DCHAN_UP);
-				} else if (x == DAHDI_EVENT_NOALARM) {
-					gsm->dchanavail |= DCHAN_NOTINALARM;
-					allogsm_restart(gsm->dchan);
-				}
-			
-				ast_debug(1, "Got event %s (%d) on D-channel for span %d\n", event2str(x), x, gsm->span);
+			if (hook->argc && !gsm_hook_spawn(hook, &running[nrunning])) {
+				nrunning++;
+			} else if (!nrunning) {
+				ast_unreplace_sigchld();
 			}
-		} else if (errno != EINTR) {
-			ast_log(LOG_WARNING, "allogsm_event returned error %d (%s)\n", errno, strerror(errno));
+			gsm_hook_free(hook);
 		}
 
-		if (e) {
-			if (gsm->debug)
-				allogsm_dump_event(gsm->dchan, e);
-/** Generate a manager Event**********/
-			if (e->e!=ALLOGSM_EVENT_SMS_RECEIVED) {
-				manager_event(EVENT_FLAG_SYSTEM, "GSMEventLib",
-					"GSMEvent: %s\r\n"
-					"GSMEventCode: %d\r\n"
-					"Span: %d\r\n",
-					allogsm_event2str(e->e),
-					e->e,
-					gsm->span
-				);
+		if (nrunning) {
+			timeout = gsm_hook_reap(running, &nrunning);
+			if (!nrunning) {
+				ast_unreplace_sigchld();
 			}
-/*******************///////
-			if (ALLOGSM_EVENT_DCHAN_UP == e->e) {
-				if (!(gsm->dchanavail & DCHAN_UP)) {
-					ast_verb(2, "D-Channel on span %d up\n", gsm->span);
-				}
-				gsm->dchanavail |= DCHAN_UP;
-			} else if ((ALLOGSM_EVENT_DCHAN_DOWN == e->e)||(ALLOGSM_EVENT_NO_SIGNAL== e->e) \
-				||(ALLOGSM_EVENT_SIM_FAILED== e->e)||(ALLOGSM_EVENT_PIN_ERROR== e->e)){
-				if (gsm->dchanavail & DCHAN_UP) {
-					ast_verb(2, "D-Channel on span %d down\n", gsm->span);
-				}
-				gsm->dchanavail &= ~DCHAN_UP;
+		}
+		if (hook_stop && !nrunning) {
+			break;
+		}
+		/* Room freed for a hook that is waiting */
+		if (!hook_stop && nrunning < GSM_HOOK_RUNNING && gsm_hook_next()) {
+			continue;
+		}
+
+		pfd.revents = 0;
+		if (poll(&pfd, 1, nrunning ? timeout : -1) > 0 && (pfd.revents & POLLIN)) {
+			while (read(hook_pipe[0], buf, sizeof(buf)) > 0) {
 			}
+		}
+	}
 
-			switch (e->e) {
-			case ALLOGSM_EVENT_DCHAN_UP:
+	/* Never started */
+	while ((hook = gsm_hook_next())) {
+		hook_dropped++;
+		gsm_hook_free(hook);
+	}
 
-				/* Note presense of D-channel */
-				time(&gsm->lastreset);
+	return NULL;
+}
 
-				/* Restart in 5 seconds */
-				if (gsm->resetinterval > -1) {
-					gsm->lastreset -= gsm->resetinterval;
-					gsm->lastreset += 5;
-				}
+static int gsm_hook_start(void)
+{
+	int i;
 
-				gsm->resetting = 0;
-				
-				/* Take the channel from inalarm condition */
-				if (gsm->pvt) {
-					gsm->pvt->inalarm = 0;
-				}
-				break;
-			case ALLOGSM_EVENT_DETECT_MODULE_OK:
-				gsm->dchanavail |= DCHAN_POWER;
-				gsm->gsm_init_flag=1;
-				break;
-			case ALLOGSM_EVENT_DCHAN_DOWN:
-				if (!gsm_is_up(gsm)) {
-					gsm->resetting = 0;
-					/* Hangup active channels and put them in alarm mode */
-					struct allochan_pvt *p = gsm->pvt;
-					if (p) {
-						if (!p->gsm || !p->gsm->gsm || allogsm_get_timer(p->gsm->gsm, ALLOGSM_TIMER_T309) < 0) {
-							/* T309 is not enabled : hangup calls when alarm occurs */
-							if (p->gsmcall) {
-								if (p->gsm && p->gsm->gsm) {
-									allogsm_hangup(p->gsm->gsm, p->gsmcall, -1);
-									allogsm_destroycall(p->gsm->gsm, p->gsmcall);
-									p->gsmcall = NULL;
-								} else
-									ast_log(LOG_WARNING, "The GSM Call have not been destroyed\n");
-							}
-							gsm_hangup_all(p, gsm);
+	for (i = 0; i < GSM_HOOK_SLOTS; i++) {
+		hook_ring[i].seq = i;
+	}
+	hook_head = hook_tail = 0;
+	hook_stop = 0;
+
+	if (pipe(hook_pipe)) {
+		ast_log(LOG_ERROR, "Can't make hook pipe: %s\n", strerror(errno));
+		hook_pipe[0] = hook_pipe[1] = -1;
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(hook_pipe[i], F_SETFL, fcntl(hook_pipe[i], F_GETFL) | O_NONBLOCK);
+		fcntl(hook_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	if (ast_pthread_create_background(&hook_thread, NULL, gsm_hook_thread, NULL)) {
+		ast_log(LOG_ERROR, "Can't start hook thread: %s\n", strerror(errno));
+		close(hook_pipe[0]);
+		close(hook_pipe[1]);
+		hook_pipe[0] = hook_pipe[1] = -1;
+		hook_thread = AST_PTHREADT_NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Start no more hooks, wait for the running ones to end or be stopped */
+static void gsm_hook_stop(void)
+{
+	if (hook_thread == AST_PTHREADT_NULL) {
+		return;
+	}
+
+	hook_stop = 1;
+	if (write(hook_pipe[1], "", 1) < 0) {
+	}
+	pthread_join(hook_thread, NULL);
+	hook_thread = AST_PTHREADT_NULL;
+
+	if (hook_dropped) {
+		ast_log(LOG_NOTICE, "%u hooks were dropped\n", hook_dropped);
+	}
+	close(hook_pipe[0]);
+	close(hook_pipe[1]);
+	hook_pipe[0] = hook_pipe[1] = -1;
+}
+
+#if (ASTERISK_VERSION_NUM > 10444)
+/*
+ * The sms_send_ok/sms_send_failed dialplan runs without the span lock, so the
+ * D-channel (and every span sharing its reactor) keeps going.  Each result is
+ * copied off the span onto the span's result queue; one worker thread per
+ * span, started when the queue was idle, drains it and exits.  The runs of a span
+ * are serial anyway as they all use its SUB_SMSSEND channel.  A result is
+ * dropped if GSM_SMS_RESULT_QUEUE are waiting already.
+ */
+#define GSM_SMS_RESULT_QUEUE	64
+
+/* SMS send result for the sms_send_ok/sms_send_failed dialplan, copied off the span */
+struct gsm_sms_result {
+	struct gsm_sms_result *next;
+	struct allochan_gsm *gsm;
+	const char *context_name;
+	const char *type;
+	char *sender;
+	char *text;
+	char *pdu;
+	char *id;
+};
+
+static void gsm_sms_result_free(struct gsm_sms_result *r)
+{
+	ast_free(r->sender);
+	ast_free(r->text);
+	ast_free(r->pdu);
+	ast_free(r->id);
+	ast_free(r);
+}
+
+/* Runs the result dialplan of r, span unlocked */
+static void gsm_sms_result_run(struct gsm_sms_result *r)
+{
+	struct allochan_gsm *gsm = r->gsm;
+	struct ast_pbx_args args;
+	struct ast_channel *c = NULL;
+
+	ast_mutex_lock(&gsm->lock);
+	if (gsm->pvt) {
+		c = sms_send_new(AST_STATE_DOWN, gsm->pvt, SUB_SMSSEND, NULL, NULL);
+	}
+	ast_mutex_unlock(&gsm->lock);
+	if (!c) {
+		ast_debug(1, "Span %d: error creating %s message channel\n", gsm->span, r->context_name);
+		return;
+	}
 
-							if (p->owner)
 #if (ASTERISK_VERSION_NUM >= 110000)
-								ast_channel_softhangup_internal_flag_add(p->owner, AST_SOFTHANGUP_DEV);
+	ast_channel_exten_set(c, r->context_name);
 #else
-								p->owner->_softhangup |= AST_SOFTHANGUP_DEV;
+	strcpy(c->exten, r->context_name);
 #endif
-						}
-						p->inalarm = 1;
-					}
-				}
-				break;
-			case ALLOGSM_EVENT_RESTART:
-				ast_verb(3, "Restart on requested on span %d\n", gsm->span);
-				if (gsm->pvt) {
-					ast_mutex_lock(&gsm->pvt->lock);
-					if (gsm->pvt->gsmcall) {
-						allogsm_destroycall(gsm->gsm, gsm->pvt->gsmcall);
-						gsm->pvt->gsmcall = NULL;
-					}
-					gsm_hangup_all(gsm->pvt, gsm);
-					if (gsm->pvt->owner)
+	if (r->type) {
+		pbx_builtin_setvar_helper(c, "SMS_SEND_TYPE", r->type);
+		pbx_builtin_setvar_helper(c, "SMS_SEND_SENDER", r->sender);
+		pbx_builtin_setvar_helper(c, "SMS_SEND_TXT", r->text);
+		pbx_builtin_setvar_helper(c, "SMS_SEND_PDU", r->pdu);
+		pbx_builtin_setvar_helper(c, "SMS_SEND_ID", r->id);
+	}
+	pbx_builtin_setvar_helper(c, "DIALSTATUS", "SMS_SEND_END");
+
+	memset(&args, 0, sizeof(args));
+	args.no_hangup_chan = 1;
+	if (ast_pbx_run_args(c, &args)) {
+		ast_log(LOG_ERROR, "Span %d: unable to start pbx on %s\n", gsm->span, r->context_name);
+	}
+	ast_hangup(c);
+}
+
+/* Result worker of the span in data, runs its queued results in order and exits when none are left */
+static void *gsm_sms_result_thread(void *data)
+{
+	struct allochan_gsm *gsm = data;
+	struct gsm_sms_result *r;
+
+	for (;;) {
+		ast_mutex_lock(&gsm->sms_result_lock);
+		if (!(r = gsm->sms_result_head)) {
+			gsm->sms_result_running = 0;
+			ast_mutex_unlock(&gsm->sms_result_lock);
+			break;
+		}
+		if (!(gsm->sms_result_head = r->next)) {
+			gsm->sms_result_tail = NULL;
+		}
+		gsm->sms_result_len--;
+		ast_mutex_unlock(&gsm->sms_result_lock);
+
+		gsm_sms_result_run(r);
+		gsm_sms_result_free(r);
+	}
+
+	return NULL;
+}
+
+/* Called with the span locked, queues the SMS in sms_info for the span's result worker */
+static void gsm_sms_result_start(struct allochan_gsm *gsm, const char *context_name)
+{
+	struct gsm_sms_result *r;
+	sms_info_u *sms_info = gsm->gsm->sms_info;
+	pthread_t threadid;
+
+	if (!(r = ast_calloc(1, sizeof(*r)))) {
+		return;
+	}
+	r->gsm = gsm;
+	r->context_name = context_name;
+	if (sms_info) {
+		if (gsm->gsm->sms_mod_flag == SMS_TEXT) {
+			r->type = "text";
+			r->sender = ast_strdup(sms_info->txt_info.destination);
+			r->text = ast_strdup(sms_info->txt_info.message);
+			r->pdu = ast_strdup("");
+			r->id = ast_strdup(sms_info->txt_info.id);
+		} else {
+			r->type = "pdu";
+			r->sender = ast_strdup(sms_info->pdu_info.destination);
+			r->text = ast_strdup(sms_info->pdu_info.text);
+			r->pdu = ast_strdup(sms_info->pdu_info.message);
+			r->id = ast_strdup(sms_info->pdu_info.id);
+		}
+	}
+
+	ast_mutex_lock(&gsm->sms_result_lock);
+	if (gsm->sms_result_len >= GSM_SMS_RESULT_QUEUE) {
+		ast_mutex_unlock(&gsm->sms_result_lock);
+		ast_log(LOG_WARNING, "Span %d: too many SMS send results waiting, not running %s\n", gsm->span, context_name);
+		gsm_sms_result_free(r);
+		return;
+	}
+	if (gsm->sms_result_tail) {
+		gsm->sms_result_tail->next = r;
+	} else {
+		gsm->sms_result_head = r;
+	}
+	gsm->sms_result_tail = r;
+	gsm->sms_result_len++;
+
+	/* Left queued if the worker can't start, the next result tries again */
+	if (!gsm->sms_result_running) {
+		if (ast_pthread_create_detached(&threadid, NULL, gsm_sms_result_thread, gsm)) {
+			ast_log(LOG_ERROR, "Span %d: unable to start SMS send result thread\n", gsm->span);
+		} else {
+			gsm->sms_result_running = 1;
+		}
+	}
+	ast_mutex_unlock(&gsm->sms_result_lock);
+}
+#endif
+
+/* Reset checks on a D-channel wakeup, then how long it may sleep and what to wait
+   for on its fd; timer is set if its library timerfd is polled as well */
+static int gsm_dchannel_prepare(struct allochan_gsm *gsm, int timer, short *events)
+{
+	int timeout;
+	time_t t;
+
+	*events = POLLIN | POLLPRI;
+
+	time(&t);
+	ast_mutex_lock(&gsm->lock);
+
+	if (gsm->resetinterval > 0) {
+		if (gsm->resetting && gsm_is_up(gsm)) {
+			if (gsm->resetpos < 0)
+				gsm_check_restart(gsm);
+		} else {
+			if (!gsm->resetting	&& (t - gsm->lastreset) >= gsm->resetinterval) {
+				gsm->resetting = 1;
+				gsm->resetpos = -1;
+			}
+		}
+	}
+	/* Timers are covered by the timerfd; only fall back to their deadline without it */
+	timeout = timer ? -1 : allogsm_schedule_next_ms(gsm->dchan);
+	if (gsm->resetting) {
+		/* Make sure we stop at least once per second if we're
+		   monitoring idle channels */
+		if ((timeout < 0) || (timeout > 1000)) {
+			timeout = 1000;
+		}
+	} else if (!gsm->gsm_init_flag || (gsm->resetinterval > 0)) {
+		/* Module detection and reset checks run on idle wakeups */
+		if ((timeout < 0) || (timeout > 1500)) {
+			timeout = 1500;
+		}
+	}
+	/* Lines still buffered in the library are handled without waiting */
+	if (gsm->rxbacklog) {
+		timeout = 0;
+	}
+	/* AT data the driver had no room for goes out once it can take more */
+	if (allogsm_tx_pending(gsm->dchan)) {
+		*events |= POLLOUT;
+	}
+	ast_mutex_unlock(&gsm->lock);
+
+	return timeout;
+}
+
+/* Handle a D-channel wakeup, res and revents are what poll() returned for its fd:
+   0 when it timed out or only its timerfd fired */
+static void gsm_dchannel_events(struct allochan_gsm *gsm, int res, short revents)
+{
+	allogsm_event *e;
+	allogsm_event evs[GSM_EVENT_BATCH];
+	int nev = 0, evidx, timers;
+	int chanpos = 0;
+	int x;
+	struct ast_channel *c;
+	time_t t;
+/*
+	FILE *sms_r;
+	FILE *sms_w;
+*/
+	char date[64];	
+	pthread_t threadid;
+	char* context_name;
+	char cmd[1024];
+	struct gsm_sms_failover failover;
+
+	failover.pending = 0;
+
+	time(&t);
+	ast_mutex_lock(&gsm->lock);
+
+	if ((res > 0) && (revents & POLLOUT)) {
+		allogsm_tx_flush(gsm->dchan);
+	}
+
+	if (gsm->rxbacklog) {
+		nev = allogsm_check_event_batch(gsm->dchan, evs, GSM_EVENT_BATCH);
+	} else if ((res > -1) && !(revents & ~POLLOUT)) {
+		/* Nothing from the module: timeout, timer or only POLLOUT */
+		if(gsm->gsm_init_flag == 0) {
+			gsm->gsm_reinit++;
+			if(gsm->gsm_reinit%5 == 0) {
+				if(gsm->gsm_reinit%30 == 0) {
+					gsm->gsm_init_flag = 1;
+					gsm->gsm_reinit = 0;
+				} else if(gsm->gsm_reinit%15 == 0) {
+					ioctl(gsm->fd, ALLOG4C_SPAN_INIT, 1);
+					ast_log(LOG_NOTICE, "GSM reset power of module on D-channel of span %d\n", gsm->span);
+				} else {
+					ast_log(LOG_NOTICE, "GSM detect module on D-channel of span %d\n", gsm->span);
+					allogsm_module_start(gsm->dchan);
+				}
+			}
+		}
+	} else if (res > -1) {
+		if (revents & POLLIN) {
+//                        printf("send data from chan_allogsm  %s  with length is %d\n ",gsm->dchan->at_last_recv,gsm->dchan->at_last_recv_idx);
+			nev = allogsm_check_event_batch(gsm->dchan, evs, GSM_EVENT_BATCH);
+		} else if (revents & POLLPRI) {
+			/* Check for an event */
+			x = 0;
+			res = ioctl(gsm->fd, DAHDI_GETEVENT, &x);
+			if (x) {
+				ast_log(LOG_NOTICE, "GSM got event: %s (%d) on D-channel of span %d\n", event2str(x), x, gsm->span);
+				manager_event(EVENT_FLAG_SYSTEM, "GSMEvent",
+					"GSMEvent: %s\r\n"
+					"GSMEventCode: %d\r\n"
+					"Span: %d\r\n",
+					event2str(x),
+					x,
+					gsm->span
+					);
+			}
+			/* Keep track of alarm state */	
+			if (x == DAHDI_EVENT_ALARM) {
+				gsm->dchanavail &= ~(DCHAN_NOTINALARM | DCHAN_UP);
+			} else if (x == DAHDI_EVENT_NOALARM) {
+				gsm->dchanavail |= DCHAN_NOTINALARM;
+				allogsm_restart(gsm->dchan);
+			}
+		
+			ast_debug(1, "Got event %s (%d) on D-channel for span %d\n", event2str(x), x, gsm->span);
+		}
+	} else if (errno != EINTR) {
+		ast_log(LOG_WARNING, "allogsm_event returned error %d (%s)\n", errno, strerror(errno));
+	}
+
+	/* A full batch may have left lines queued, take them before polling again */
+	gsm->rxbacklog = (nev == GSM_EVENT_BATCH) && (gsm->dchan->sanidx > 0);
+
+	/* Line events are handled before the timers due on this wakeup: gsm_dequeue_sms
+	   puts the next SMS in sms_info, which SMS_SEND_* of the last one still reads */
+	for (timers = 0; timers < 2; timers++) {
+		if (timers)
+			nev = allogsm_schedule_run_batch(gsm->dchan, evs, GSM_EVENT_BATCH);
+
+		for (evidx = 0; evidx < nev; evidx++) {
+			e = &evs[evidx];
+			if (gsm->debug)
+				allogsm_dump_event(gsm->dchan, e);
+/** Generate a manager Event**********/
+			if (e->e!=ALLOGSM_EVENT_SMS_RECEIVED) {
+				manager_event(EVENT_FLAG_SYSTEM, "GSMEventLib",
+					"GSMEvent: %s\r\n"
+					"GSMEventCode: %d\r\n"
+					"Span: %d\r\n",
+					allogsm_event2str(e->e),
+					e->e,
+					gsm->span
+				);
+			}
+/*******************///////
+			if (ALLOGSM_EVENT_DCHAN_UP == e->e) {
+				if (!(gsm->dchanavail & DCHAN_UP)) {
+					ast_verb(2, "D-Channel on span %d up\n", gsm->span);
+				}
+				gsm->dchanavail |= DCHAN_UP;
+			} else if ((ALLOGSM_EVENT_DCHAN_DOWN == e->e)||(ALLOGSM_EVENT_NO_SIGNAL== e->e) \
+				||(ALLOGSM_EVENT_SIM_FAILED== e->e)||(ALLOGSM_EVENT_PIN_ERROR== e->e)){
+				if (gsm->dchanavail & DCHAN_UP) {
+					ast_verb(2, "D-Channel on span %d down\n", gsm->span);
+				}
+				gsm->dchanavail &= ~DCHAN_UP;
+			}
+
+			switch (e->e) {
+			case ALLOGSM_EVENT_DCHAN_UP:
+
+				/* Note presense of D-channel */
+				time(&gsm->lastreset);
+
+				/* Restart in 5 seconds */
+				if (gsm->resetinterval > -1) {
+					gsm->lastreset -= gsm->resetinterval;
+					gsm->lastreset += 5;
+				}
+
+				gsm->resetting = 0;
+				
+				/* Take the channel from inalarm condition */
+				if (gsm->pvt) {
+					gsm->pvt->inalarm = 0;
+				}
+				break;
+			case ALLOGSM_EVENT_DETECT_MODULE_OK:
+				gsm->dchanavail |= DCHAN_POWER;
+				gsm->gsm_init_flag=1;
+				break;
+			case ALLOGSM_EVENT_DCHAN_DOWN:
+				if (!gsm_is_up(gsm)) {
+					gsm->resetting = 0;
+					/* Hangup active channels and put them in alarm mode */
+					struct allochan_pvt *p = gsm->pvt;
+					if (p) {
+						if (!p->gsm || !p->gsm->gsm || allogsm_get_timer(p->gsm->gsm, ALLOGSM_TIMER_T309) < 0) {
+							/* T309 is not enabled : hangup calls when alarm occurs */
+							if (p->gsmcall) {
+								if (p->gsm && p->gsm->gsm) {
+									allogsm_hangup(p->gsm->gsm, p->gsmcall, -1);
+									allogsm_destroycall(p->gsm->gsm, p->gsmcall);
+									p->gsmcall = NULL;
+								} else
+									ast_log(LOG_WARNING, "The GSM Call have not been destroyed\n");
+							}
+							gsm_hangup_all(p, gsm);
+
+							if (p->owner)
+#if (ASTERISK_VERSION_NUM >= 110000)
+								ast_channel_softhangup_internal_flag_add(p->owner, AST_SOFTHANGUP_DEV);
+#else
+								p->owner->_softhangup |= AST_SOFTHANGUP_DEV;
+#endif
+						}
+						p->inalarm = 1;
+					}
+				}
+				break;
+			case ALLOGSM_EVENT_RESTART:
+				ast_verb(3, "Restart on requested on span %d\n", gsm->span);
+				if (gsm->pvt) {
+					ast_mutex_lock(&gsm->pvt->lock);
+					if (gsm->pvt->gsmcall) {
+						allogsm_destroycall(gsm->gsm, gsm->pvt->gsmcall);
+						gsm->pvt->gsmcall = NULL;
+					}
+					gsm_hangup_all(gsm->pvt, gsm);
+					if (gsm->pvt->owner)
 #if (ASTERISK_VERSION_NUM >= 110000)
 						ast_channel_softhangup_internal_flag_add(gsm->pvt->owner, AST_SOFTHANGUP_DEV);
 #else
@@ -7768,8 +8230,8 @@ ast_verbose("%s %d: chanpos %d\n",__func__, __LINE__, chanpos); //pawan print
 							}
 							/* Bring voice path up */
 #if (ASTERISK_VERSION_NUM >= 10800)
-	/* pawan: here AST_CONTROL_PROGRESS is sent instead of AST_CONTROL_PROCEEDING so that call
-	proceeding tones coming from GSM can be fed as early media on other side.*/
+/* pawan: here AST_CONTROL_PROGRESS is sent instead of AST_CONTROL_PROCEEDING so that call
+proceeding tones coming from GSM can be fed as early media on other side.*/
 							
                                                 //        f.subclass.integer = AST_CONTROL_PROCEEDING;
                                                       f.subclass.integer = AST_CONTROL_PROGRESS; //pawan commented
@@ -7997,7 +8459,7 @@ ast_verbose("%s %d: chanpos %d\n",__func__, __LINE__, chanpos); //pawan print
                                 // e->sms_received.sender, gsm->span, e->sms_received.text);
                                 //                                 //sprintf(cmd, "/var/scripts/dbWriteSMS/dbWriteSMS \"%s\" %d \"%s\"\n", e->sms_received.sender, gsm->span, e->sms_received.text);
                                 strftime( date, sizeof(date), "%F %T", localtime(&t) );
-                                allochan_save_sms(gsm->span, date, e->sms_received.sender,e->sms_received.text, e->sms_received.pdu);
+                                allogsm_journal_append(gsm->dchan, &e->sms_received, date);
 #endif
                                 /*SMS to AMI*/
                                 manager_event(EVENT_FLAG_SYSTEM, "GSMEventSMS",
@@ -8039,13 +8501,13 @@ ast_verbose("%s %d: chanpos %d\n",__func__, __LINE__, chanpos); //pawan print
                                 ast_log(LOG_NOTICE, "sqlstring: >>%s<< \n", cmd);
 #else
                                 char filename[64];
+                                char span_str[16];
                                 memset (filename, 0, sizeof(filename));
                                 write_sms_file(e->sms_received.text, filename);
 
-                                memset (cmd,0,sizeof(cmd));
-                                sprintf(cmd, "/var/scripts/dbWriteSMS/dbWriteSMS \"%s\" %d \"%s\" &\n", e->sms_received.sender, gsm->span, filename);
-                                if (system(cmd)){}
-                                ast_log(LOG_NOTICE, "sqlstring: >>%s<< \n", cmd);
+                                snprintf(span_str, sizeof(span_str), "%d", gsm->span);
+                                gsm_hook_run(GSM_HOOK_TIMEOUT, "/var/scripts/dbWriteSMS/dbWriteSMS", e->sms_received.sender, span_str, filename, NULL);
+                                ast_log(LOG_NOTICE, "dbWriteSMS: >>%s %s %s<< \n", e->sms_received.sender, span_str, filename);
 #endif
 
                                 /*SMS to Email*/
@@ -8055,18 +8517,11 @@ ast_verbose("%s %d: chanpos %d\n",__func__, __LINE__, chanpos); //pawan print
                                         memset (filename, 0, sizeof(filename));
                                         write_sms_mail_file (gsm->span, date, e->sms_received.sender, e->sms_received.text, e->sms_received.pdu, filename);
 
-                                        memset (cmd,0,sizeof(cmd));
-                                        sprintf(cmd, "/var/scripts/sendEmail.sh 4 %s \"%d\" \"%s\" &\n",gsm->smstoemail, gsm->span, filename);
-					if (system(cmd)){}
-                                        ast_log(LOG_NOTICE, "SMS to email query: >>%s<< \n", cmd);
+                                        gsm_hook_run(GSM_HOOK_TIMEOUT, "/var/scripts/sendEmail.sh", "4", gsm->smstoemail, span_str, filename, NULL);
+                                        ast_log(LOG_NOTICE, "SMS to email query: >>%s %s %s<< \n", gsm->smstoemail, span_str, filename);
                                 }
 #endif
-#if 1				/* Delete SMS from memory once read */
-				memset (cmd,0,sizeof(cmd));
-				sprintf(cmd, "/var/scripts/SmsClear.sh \"%d\" &\n",gsm->span);
-				if (system(cmd)){}
-                                        ast_log(LOG_NOTICE, "SMS Clear: >>%s<< \n", cmd);
-#endif
+				/* Stored SMS are read and deleted by the library, see gsmstore.c */
                                 /*SMS to Dialplan*/
 #if 0
                                 context_name = "sms";
@@ -8113,79 +8568,38 @@ ast_verbose("%s %d: chanpos %d\n",__func__, __LINE__, chanpos); //pawan print
 				else 
 					context_name = "sms_send_failed";
 /***** updating to fail file *////////
-#define SMSOUTDIRFAIL "/mnt/smsout_fail/"
+				/* The failed SMS itself is saved by the library, in /mnt/smsout_fail/<id> */
 				if(ALLOGSM_EVENT_SMS_SEND_OK == e->e) {
 					/*Success*/
 				}else{
 					/*Failed*/
-					if(gsm->gsm->sms_mod_flag == SMS_TEXT) {
-						sprintf(cmd, "cat >> %s << EOF\n\"%d\",\"%s\",\"%s\",\"%s\"\r\n",
-							SMSOUTDIRFAIL, 
-							gsm->span, 
-							gsm->gsm->sms_info->txt_info.destination, 
-							gsm->gsm->sms_info->txt_info.message, 
-							"FAILED");
-					}else{
-						sprintf(cmd, "cat >> %s << EOF\n\"%d\",\"%s\",\"%s\",\"%s\"\r\n",
-							SMSOUTDIRFAIL, 
-							gsm->span, 
-							gsm->gsm->sms_info->pdu_info.destination, 
-							gsm->gsm->sms_info->pdu_info.text, 
-							"FAILED");
+					/* Sent to "auto", try once more on another span */
+					if (gsm->gsm->sms_info && (gsm->gsm->sms_info->txt_info.flags & ALLOGSM_SMS_FAILOVER)) {
+						if (failover.pending) {
+							ast_log(LOG_WARNING, "Span %d: SMS failover already pending, not retrying SMS to %s\n",
+								gsm->span, gsm->gsm->sms_info->txt_info.destination);
+							/* Not retried, so this failure is final */
+							allogsm_count_add(gsm->gsm, gsm->gsm->sms_info->txt_info.id, 0, 1);
+						} else {
+							failover.pending = 1;
+							failover.prio = gsm->gsm->sms_info->txt_info.prio;
+							ast_copy_string(failover.dest, gsm->gsm->sms_info->txt_info.destination, sizeof(failover.dest));
+							ast_copy_string(failover.text, (gsm->gsm->sms_mod_flag == SMS_TEXT) ?
+								gsm->gsm->sms_info->txt_info.message : gsm->gsm->sms_info->pdu_info.text, sizeof(failover.text));
+							ast_copy_string(failover.id, gsm->gsm->sms_info->txt_info.id, sizeof(failover.id));
+						}
 					}
-					if (system(cmd)){}
 				}
 /************************/
 				if (ast_exists_extension(NULL, gsm->pvt->context, context_name, 1, NULL)) {
-					if (!(c = sms_send_new(AST_STATE_DOWN, gsm->pvt, SUB_SMSSEND,NULL, NULL))) {
-						ast_debug(1, "[%s] error creating %s message channel, disconnecting\n",gsm->pvt->accountcode,context_name);
-						if(gsm->gsm->sms_info) {
-							free(gsm->gsm->sms_info);
-							gsm->gsm->sms_info = NULL;
-						}
-						break;
-					}
-					
-#if (ASTERISK_VERSION_NUM >= 110000)
-					ast_channel_exten_set (c, context_name);
-#else
-					strcpy(c->exten, context_name);
-#endif					
-					if(gsm->dchan->sms_info) {
-						if(gsm->gsm->sms_mod_flag == SMS_TEXT) {
-							pbx_builtin_setvar_helper(c, "SMS_SEND_TYPE","text");
-							pbx_builtin_setvar_helper(c, "SMS_SEND_SENDER",gsm->gsm->sms_info->txt_info.destination);
-							pbx_builtin_setvar_helper(c, "SMS_SEND_TXT",gsm->gsm->sms_info->txt_info.message);
-							pbx_builtin_setvar_helper(c, "SMS_SEND_PDU","");
-							pbx_builtin_setvar_helper(c, "SMS_SEND_ID",gsm->gsm->sms_info->txt_info.id);
-						} else {
-							pbx_builtin_setvar_helper(c, "SMS_SEND_TYPE","pdu");
-							pbx_builtin_setvar_helper(c, "SMS_SEND_SENDER",gsm->gsm->sms_info->pdu_info.destination);
-							pbx_builtin_setvar_helper(c, "SMS_SEND_TXT",gsm->gsm->sms_info->pdu_info.text);
-							pbx_builtin_setvar_helper(c, "SMS_SEND_PDU",gsm->gsm->sms_info->pdu_info.message);
-							pbx_builtin_setvar_helper(c, "SMS_SEND_ID",gsm->gsm->sms_info->pdu_info.id);
-						}
-					}
-
-					pbx_builtin_setvar_helper(c, "DIALSTATUS", "SMS_SEND_END");
-					
-					struct ast_pbx_args args;
-					memset(&args, 0, sizeof(args));
-					args.no_hangup_chan = 1;
-					if (ast_pbx_run_args(c, &args) /*ast_pbx_start(c)*/) {
-						ast_log(LOG_ERROR, "[%s] unable to start pbx on %s\n", gsm->pvt->accountcode,context_name);
-						if(gsm->pvt->owner)
-							ast_hangup(gsm->pvt->owner);
-					} else {
-						ast_hangup(c);
-					}
+					gsm_sms_result_start(gsm, context_name);
 				}
 #endif
 
-				if(gsm->gsm->sms_info) {
-					free(gsm->gsm->sms_info);
-					gsm->gsm->sms_info = NULL;
+				if (gsm->gsm->sms_info) {
+					gsm_bulk_result(gsm->span, gsm->gsm->sms_info, ALLOGSM_EVENT_SMS_SEND_OK == e->e);
 				}
+				allogsm_sms_release(gsm->gsm);
 				break;
 			///////////////////////////////////////////////////////////////////////////////
 			case ALLOGSM_EVENT_USSD_RECEIVED:
@@ -8514,12 +8928,320 @@ ast_verbose("%s %d: chanpos %d\n",__func__, __LINE__, chanpos); //pawan print
 				ast_debug(1, "Event: %d\n", e->e);
 			}
 		}	
-		
-		ast_mutex_unlock(&gsm->lock);
+	}
+	
+	ast_mutex_unlock(&gsm->lock);
+
+	/* Other spans are locked, so only with ours released */
+	if (failover.pending) {
+		gsm_sms_failover(&failover, gsm->span);
+		failover.pending = 0;
+	}
+}
+
+static void *gsm_dchannel(void *vgsm)
+{
+	struct allochan_gsm *gsm = vgsm;
+	struct pollfd fds[3];
+	int nfds;
+	int timer;
+	int timeout;
+	int res;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	for (;;) {
+		if (!gsm->dchannel)
+			break;
+
+		fds[0].fd = gsm->fd;
+		fds[0].revents = 0;
+		nfds = 1;
+
+		/* The library timerfd wakes us exactly when the next timer is due */
+		timer = -1;
+		if ((fds[nfds].fd = allogsm_timer_fd(gsm->dchan)) > -1) {
+			fds[nfds].events = POLLIN;
+			fds[nfds].revents = 0;
+			timer = nfds++;
+		}
+		/* And its wake fd when another thread queued AT data for POLLOUT */
+		if ((fds[nfds].fd = allogsm_wake_fd(gsm->dchan)) > -1) {
+			fds[nfds].events = POLLIN;
+			fds[nfds].revents = 0;
+			nfds++;
+		}
+
+		timeout = gsm_dchannel_prepare(gsm, timer > -1, &fds[0].events);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		pthread_testcancel();
+
+		res = poll(fds, nfds, timeout);
+
+		pthread_testcancel();
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		/* Only woken up to poll for POLLOUT */
+		if ((res > 0) && !fds[0].revents && ((timer < 0) || !fds[timer].revents))
+			continue;
+
+		gsm_dchannel_events(gsm, res, fds[0].revents);
 	}
 	/* Never reached */
 	return NULL;
 }
+/*
+ * D-channel reactor, enabled by dchanreactor in chan_allogsm.conf.  Instead of a
+ * gsm_dchannel thread per span, one thread (or a few, each pinned to a CPU)
+ * waits in epoll on the D-channel fds and library timerfds of its spans and
+ * runs gsm_dchannel_events for the ones that woke up or whose idle timeout
+ * passed.  Only those, and spans changed by another thread since (gsm_grab or
+ * AT data queued to the library), go through gsm_dchannel_prepare again; the
+ * others keep the deadline they had.  Span n goes to reactor (n - 1) % dchanreactor.
+ */
+#define GSM_REACTOR_MAX		8			/* Reactor threads at most */
+#define GSM_REACTOR_WAKE	0xffffffffu	/* epoll data of the reactor's own eventfd */
+#define GSM_REACTOR_TIMER	0x10000u	/* Set in the epoll data of a span's timerfd */
+#define GSM_REACTOR_TXWAKE	0x20000u	/* Set in the epoll data of a span's library wake fd */
+
+struct gsm_reactor {
+	pthread_t thread;
+	int epfd;
+	int wakefd;								/* eventfd that breaks epoll_wait */
+	int cpu;								/* Pinned to, -1 for any */
+	int nspans;
+	struct allochan_gsm *spans[NUM_SPANS];
+};
+
+static struct gsm_reactor gsm_reactors[GSM_REACTOR_MAX];
+static int gsm_reactor_threads;				/* 0 for a gsm_dchannel thread per span */
+
+static void gsm_reactor_wake(struct gsm_reactor *reactor)
+{
+	uint64_t one = 1;
+
+	if (write(reactor->wakefd, &one, sizeof(one)) < 0) {
+		/* Counter full, it is awake anyway */
+	}
+}
+
+/* Register the fd for the poll() events asked, which have the same values in epoll */
+static int gsm_reactor_watch(struct gsm_reactor *reactor, struct allochan_gsm *gsm, short events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u32 = gsm->reactor_idx;
+	if (epoll_ctl(reactor->epfd, gsm->reactor_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, gsm->fd, &ev)) {
+		return -1;
+	}
+	gsm->reactor_events = events;
+	return 0;
+}
+
+static void *gsm_reactor_thread(void *data)
+{
+	struct gsm_reactor *reactor = data;
+	struct epoll_event evs[NUM_SPANS * 3 + 1];
+	short revents[NUM_SPANS];
+	int timer[NUM_SPANS];
+	struct allochan_gsm *gsm;
+	struct timeval now, due;
+	short events;
+	uint64_t count;
+	int timeout, ms, n, i, idx;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	for (;;) {
+		timeout = -1;
+		now = ast_tvnow();
+		for (i = 0; i < reactor->nspans; i++) {
+			gsm = reactor->spans[i];
+			if (gsm->reactor_woken || gsm->reactor_dirty) {
+				gsm->reactor_dirty = 0;
+				ms = gsm_dchannel_prepare(gsm, allogsm_timer_fd(gsm->dchan) > -1, &events);
+				if ((events != gsm->reactor_events) && gsm_reactor_watch(reactor, gsm, events)) {
+					ast_log(LOG_WARNING, "Unable to poll D-channel of span %d: %s\n", gsm->span, strerror(errno));
+				}
+
+				/* A span that was only changed must not have its deadline pushed back */
+				due = (ms < 0) ? ast_tv(0, 0) : ast_tvadd(now, ast_samp2tv(ms, 1000));
+				if (gsm->reactor_woken || !gsm->reactor_due.tv_sec
+					|| (due.tv_sec && (ast_tvdiff_ms(due, gsm->reactor_due) < 0))) {
+					gsm->reactor_due = due;
+				}
+			}
+			if (gsm->reactor_due.tv_sec) {
+				ms = ast_tvdiff_ms(gsm->reactor_due, now);
+				if (ms < 0)
+					ms = 0;
+				if ((timeout < 0) || (ms < timeout))
+					timeout = ms;
+			}
+			revents[i] = 0;
+			timer[i] = 0;
+		}
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		pthread_testcancel();
+
+		n = epoll_wait(reactor->epfd, evs, ARRAY_LEN(evs), timeout);
+
+		pthread_testcancel();
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if ((n < 0) && (errno != EINTR)) {
+			ast_log(LOG_WARNING, "D-channel reactor epoll_wait returned error %d (%s)\n", errno, strerror(errno));
+		}
+		for (i = 0; i < n; i++) {
+			if (evs[i].data.u32 == GSM_REACTOR_WAKE) {
+				if (read(reactor->wakefd, &count, sizeof(count)) < 0) {
+					/* Already read, nothing to do */
+				}
+				continue;
+			}
+			idx = evs[i].data.u32 & ~(GSM_REACTOR_TIMER | GSM_REACTOR_TXWAKE);
+			if (evs[i].data.u32 & GSM_REACTOR_TXWAKE)
+				reactor->spans[idx]->reactor_dirty = 1;
+			else if (evs[i].data.u32 & GSM_REACTOR_TIMER)
+				timer[idx] = 1;
+			else
+				revents[idx] = evs[i].events;
+		}
+
+		now = ast_tvnow();
+		for (i = 0; i < reactor->nspans; i++) {
+			gsm = reactor->spans[i];
+			gsm->reactor_woken = revents[i] || timer[i]
+				|| (gsm->reactor_due.tv_sec && (ast_tvdiff_ms(gsm->reactor_due, now) <= 0));
+			if (gsm->reactor_woken) {
+				gsm_dchannel_events(gsm, (revents[i] || timer[i]) ? 1 : 0, revents[i]);
+			}
+		}
+	}
+	/* Never reached */
+	return NULL;
+}
+
+/* Give the D-channel of a started span to its reactor, which runs from gsm_reactor_start() */
+static int gsm_reactor_add(struct allochan_gsm *gsm)
+{
+	struct gsm_reactor *reactor = &gsm_reactors[(gsm->span - 1) % gsm_reactor_threads];
+	struct epoll_event ev;
+	int timerfd, wakefd;
+
+	if (!reactor->nspans) {
+		reactor->thread = AST_PTHREADT_NULL;
+		reactor->cpu = -1;
+		reactor->wakefd = -1;
+		if ((reactor->epfd = epoll_create(NUM_SPANS * 3 + 1)) < 0) {
+			return -1;
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = GSM_REACTOR_WAKE;
+		if (((reactor->wakefd = eventfd(0, EFD_NONBLOCK)) < 0)
+			|| epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wakefd, &ev)) {
+			if (reactor->wakefd > -1)
+				close(reactor->wakefd);
+			close(reactor->epfd);
+			return -1;
+		}
+	}
+
+	gsm->reactor_idx = reactor->nspans;
+	gsm->reactor_events = 0;
+	gsm->reactor_woken = 1;
+	gsm->reactor_dirty = 0;
+	if (gsm_reactor_watch(reactor, gsm, POLLIN | POLLPRI)) {
+		return -1;
+	}
+	if ((timerfd = allogsm_timer_fd(gsm->dchan)) > -1) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = gsm->reactor_idx | GSM_REACTOR_TIMER;
+		if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, timerfd, &ev)) {
+			epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, gsm->fd, &ev);
+			return -1;
+		}
+	}
+	/* Readable when AT data waits for room in the driver, see allogsm_wake_fd() */
+	if ((wakefd = allogsm_wake_fd(gsm->dchan)) > -1) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = gsm->reactor_idx | GSM_REACTOR_TXWAKE;
+		if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, wakefd, &ev)) {
+			if (timerfd > -1)
+				epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, timerfd, &ev);
+			epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, gsm->fd, &ev);
+			return -1;
+		}
+	}
+	reactor->spans[reactor->nspans++] = gsm;
+	gsm->reactor = reactor;
+	return 0;
+}
+
+/* Start the reactors spans were added to, each on its own CPU if there are several */
+static int gsm_reactor_start(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct gsm_reactor *reactor;
+	cpu_set_t set;
+	int i;
+
+	for (i = 0; i < gsm_reactor_threads; i++) {
+		reactor = &gsm_reactors[i];
+		if (!reactor->nspans || (reactor->thread != AST_PTHREADT_NULL)) {
+			continue;
+		}
+		if (ast_pthread_create_background(&reactor->thread, NULL, gsm_reactor_thread, reactor)) {
+			reactor->thread = AST_PTHREADT_NULL;
+			ast_log(LOG_ERROR, "Unable to spawn D-channel reactor %d: %s\n", i, strerror(errno));
+			return -1;
+		}
+		if ((gsm_reactor_threads > 1) && (cpus > 1)) {
+			reactor->cpu = i % cpus;
+			CPU_ZERO(&set);
+			CPU_SET(reactor->cpu, &set);
+			if (pthread_setaffinity_np(reactor->thread, sizeof(set), &set)) {
+				ast_log(LOG_WARNING, "Unable to pin D-channel reactor %d to CPU %d\n", i, reactor->cpu);
+				reactor->cpu = -1;
+			}
+		}
+		ast_verb(2, "D-channel reactor %d polling %d span%s\n", i, reactor->nspans, (reactor->nspans == 1) ? "" : "s");
+	}
+	return 0;
+}
+
+/* Stop every reactor thread, before the D-channels are closed */
+static void gsm_reactor_stop(void)
+{
+	struct gsm_reactor *reactor;
+	int i;
+
+	for (i = 0; i < GSM_REACTOR_MAX; i++) {
+		reactor = &gsm_reactors[i];
+		if (!reactor->nspans) {
+			continue;
+		}
+		if (reactor->thread != AST_PTHREADT_NULL) {
+			pthread_cancel(reactor->thread);
+			gsm_reactor_wake(reactor);
+			pthread_join(reactor->thread, NULL);
+		}
+		while (reactor->nspans > 0) {
+			reactor->spans[--reactor->nspans]->reactor = NULL;
+		}
+		close(reactor->wakefd);
+		close(reactor->epfd);
+		memset(reactor, 0, sizeof(*reactor));
+	}
+}
+
 static int start_gsm(struct allochan_gsm *gsm)
 {
 	int res, x;
@@ -8583,6 +9305,15 @@ static int start_gsm(struct allochan_gsm *gsm)
 	}
 	allogsm_set_debug(gsm->dchan, DEFAULT_GSM_DEBUG);
 
+	/* SMS bodies are never split into frames larger than the driver buffers */
+	if (!ioctl(gsm->fd, DAHDI_GET_BUFINFO, &bi)) {
+		allogsm_set_tx_fifo(gsm->dchan, bi.bufsize);
+	}
+
+	if (allogsm_journal_open(gsm->dchan, SMSJOURNALDIR, 0, 0)) {
+		ast_log(LOG_WARNING, "SMS received on span %d won't be saved in %s\n", gsm->span, SMSJOURNALDIR);
+	}
+
 	/* Assume primary is the one we use */
 	gsm->gsm = gsm->dchan;
         gsm->dchan->vol=gsm->vol;
@@ -8590,6 +9321,14 @@ static int start_gsm(struct allochan_gsm *gsm)
         gsm->dchan->echocanval=gsm->echocanval;
         strncpy(gsm->dchan->sms_text_coding,gsm->send_sms.coding,strlen(gsm->send_sms.coding));
 	gsm->resetpos = -1;
+	if (gsm_reactor_threads > 0) {
+		if (gsm_reactor_add(gsm)) {
+			allochan_close_gsm_fd(gsm);
+			ast_log(LOG_ERROR, "Unable to add D-channel to reactor: %s\n", strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
 	if (ast_pthread_create_background(&gsm->master, NULL, gsm_dchannel, gsm)) {
 		allochan_close_gsm_fd(gsm);
 		ast_log(LOG_ERROR, "Unable to spawn D-channel: %s\n", strerror(errno));
@@ -8658,6 +9397,371 @@ static int is_dchan_span(int span, int fd)
         return 1;       //Valid span of dchannel
 }
 
+/*
+ * Span for an SMS sent to "auto": the lowest allogsm_sms_load() wins, so the
+ * shortest queue and then the best signal, ties go round robin so equally
+ * loaded SIMs share the traffic.  skip is a span not to use, 0 for none.
+ * Returns the span number or -1 if no span can send now.
+ */
+static int gsm_sms_pick_span(int skip)
+{
+	static int next = 0;
+	int i, span, load;
+	int first, best = -1, best_load = 0;
+
+	/* Called from every span thread, the CLI and AMI; each caller gets its own start */
+	first = __sync_fetch_and_add(&next, 1);
+
+	for (i = 0; i < NUM_SPANS; i++) {
+		span = (first + i) % NUM_SPANS;
+		if ((span + 1 == skip) || !gsms[span].gsm || !gsms[span].dchan) {
+			continue;
+		}
+		ast_mutex_lock(&gsms[span].lock);
+		load = allogsm_sms_load(gsms[span].dchan);
+		ast_mutex_unlock(&gsms[span].lock);
+		if (load < 0) {
+			continue;
+		}
+		if ((best < 0) || (load < best_load)) {
+			best = span;
+			best_load = load;
+		}
+	}
+
+	if (best < 0) {
+		return -1;
+	}
+
+	return best + 1;
+}
+
+/* <span> argument of the send sms commands, a number or "auto", 0 if unusable */
+static int gsm_cli_sms_span(const char *arg, int fd)
+{
+	int span;
+
+	if (!strcasecmp(arg, "auto")) {
+		span = gsm_sms_pick_span(0);
+		if (span < 0) {
+			ast_cli(fd, "No span can send SMS now\n");
+			return 0;
+		}
+		ast_cli(fd, "Sending on span %d\n", span);
+		return span;
+	}
+
+	span = atoi(arg);
+	if (!is_dchan_span(span, fd)) {
+		return 0;
+	}
+
+	return span;
+}
+
+/*
+ * Send a failed single part SMS again on the best span other than from_span.
+ * The library left the failure uncounted, so it is counted here when the SMS
+ * is not retried; a retry counts its own outcome.
+ */
+static void gsm_sms_failover(struct gsm_sms_failover *f, int from_span)
+{
+	int span = gsm_sms_pick_span(from_span);
+	unsigned char pdu[1024];
+	gsm_sms_pdu long_pdu;
+	int res = -1;
+
+	if (span < 0) {
+		ast_log(LOG_WARNING, "SMS to %s failed on span %d and no other span can send it\n", f->dest, from_span);
+		ast_mutex_lock(&gsms[from_span-1].lock);
+		allogsm_count_add(gsms[from_span-1].gsm, f->id, 0, 1);
+		ast_mutex_unlock(&gsms[from_span-1].lock);
+		return;
+	}
+	ast_verb(3, "SMS to %s failed on span %d, sending it on span %d\n", f->dest, from_span, span);
+
+	ast_mutex_lock(&gsms[span-1].lock);
+	if (gsms[span-1].send_sms.mode == SEND_SMS_MODE_PDU) {
+		struct allogsm_sms_plan plan;
+
+		long_pdu.total_parts = 1;
+		long_pdu.part_num = 1;
+		ast_copy_string((char*)long_pdu.message_split[0], f->text, sizeof(long_pdu.message_split[0]));
+		allogsm_sms_classify_coding(long_pdu.message_split[0], gsms[span-1].send_sms.coding, &plan);
+		if (allogsm_encode_pdu_ucs2(gsms[span-1].send_sms.smsc, f->dest, long_pdu.message_split[0], plan.coding, &long_pdu, pdu)) {
+			res = allogsm_send_pdu_prio(gsms[span-1].dchan, (char*)pdu, long_pdu.message_split[0], f->id, f->prio);
+		} else {
+			ast_log(LOG_WARNING, "Encode pdu error\n");
+		}
+	} else {
+		res = allogsm_send_text_prio(gsms[span-1].dchan, f->dest, (unsigned char*)f->text, f->id, f->prio);
+	}
+	if (res) {
+		ast_log(LOG_WARNING, "SMS to %s could not be queued on span %d\n", f->dest, span);
+		allogsm_count_add(gsms[span-1].gsm, f->id, 0, 1);
+	}
+	ast_mutex_unlock(&gsms[span-1].lock);
+}
+
+/*
+ * Bulk jobs send one message to every number of a list file.  A job thread
+ * tops up the queue of each usable span to GSM_BULK_BACKLOG messages from
+ * the list, so faster spans take more of the list and other traffic is not
+ * stuck behind the whole campaign.  Results come back as SMS_SEND_OK/FAILED
+ * events on the spans and are matched to the job by the ALLOGSM_SMS_TAG() of
+ * its number, so an SMS sent with the same id outside the job does not count
+ * for it.  The list is read with no lock held; the job's counts are written
+ * and read under bulk_lock only, taken after the span lock.  A PDU job
+ * is encoded once with the send sms settings of the first running span, so
+ * it only goes out on spans with the same mode, SMSC and coding.
+ */
+#define GSM_BULK_JOBS		8		/* Jobs running at once */
+#define GSM_BULK_BACKLOG	16		/* Bulk messages queued per span */
+#define GSM_BULK_TIMEOUT	300		/* Seconds to wait for the last results */
+#define GSM_BULK_PROGRESS	10		/* Seconds between GSMBulkProgress events */
+
+struct gsm_bulk_job {
+	int num;					/* Job number, 0 when the slot is free */
+	int cancel;
+	struct allogsm_bulk *bulk;
+	struct send_sms_cfg send_sms;	/* Settings the job was made with */
+	int sent;					/* SMS reported sent */
+	int failed;					/* SMS reported failed */
+	time_t start;
+	time_t last_result;
+};
+
+static struct gsm_bulk_job bulk_jobs[GSM_BULK_JOBS];
+static int bulk_next_num = 1;
+AST_MUTEX_DEFINE_STATIC(bulk_lock);
+
+static void gsm_bulk_event(const char *event, struct gsm_bulk_job *job)
+{
+	manager_event(EVENT_FLAG_SYSTEM, event,
+		"Job: %d\r\n"
+		"ID: %s\r\n"
+		"Read: %d\r\n"
+		"Invalid: %d\r\n"
+		"Queued: %d\r\n"
+		"SMS: %d\r\n"
+		"Sent: %d\r\n"
+		"Failed: %d\r\n",
+		job->num, job->bulk->id, job->bulk->read, job->bulk->invalid,
+		job->bulk->queued, job->bulk->sms, job->sent, job->failed);
+}
+
+/* Called with the span locked for each SMS_SEND_OK/FAILED event */
+static void gsm_bulk_result(int span, sms_info_u *sms_info, int ok)
+{
+	int i, tag = ALLOGSM_SMS_TAG_OF(sms_info->txt_info.flags);
+
+	if (!tag) {
+		return;
+	}
+
+	ast_mutex_lock(&bulk_lock);
+	for (i = 0; i < GSM_BULK_JOBS; i++) {
+		if (!bulk_jobs[i].num || (bulk_jobs[i].num & ALLOGSM_SMS_TAG_MASK) != tag) {
+			continue;
+		}
+		if (ok) {
+			bulk_jobs[i].sent++;
+		} else {
+			bulk_jobs[i].failed++;
+		}
+		time(&bulk_jobs[i].last_result);
+		manager_event(EVENT_FLAG_SYSTEM, "GSMBulkResult",
+			"Job: %d\r\n"
+			"ID: %s\r\n"
+			"Span: %d\r\n"
+			"Destination: %s\r\n"
+			"Status: %s\r\n",
+			bulk_jobs[i].num, sms_info->txt_info.id, span,
+			sms_info->txt_info.destination, ok ? "Sent" : "Failed");
+		break;
+	}
+	ast_mutex_unlock(&bulk_lock);
+}
+
+/* Called with the span locked, whether it sends what the job was made for */
+static int gsm_bulk_span_fits(const struct gsm_bulk_job *job, const struct allochan_gsm *gsm)
+{
+	if (gsm->send_sms.mode != job->send_sms.mode) {
+		return 0;
+	}
+	/* Text mode leaves the SMSC and the charset to each span */
+	if (job->send_sms.mode != SEND_SMS_MODE_PDU) {
+		return 1;
+	}
+	return !strcmp(gsm->send_sms.smsc, job->send_sms.smsc) &&
+		!strcasecmp(gsm->send_sms.coding, job->send_sms.coding);
+}
+
+static void *gsm_bulk_thread(void *data)
+{
+	struct gsm_bulk_job *job = data;
+	struct allogsm_bulk *bulk = job->bulk;
+	time_t now, last_progress = 0;
+	int i, room, reading;
+
+	while (!job->cancel) {
+		/* Only this thread changes eof */
+		reading = !bulk->eof;
+		if (reading) {
+			for (i = 0; i < NUM_SPANS; i++) {
+				if (!gsms[i].gsm || !gsms[i].dchan) {
+					continue;
+				}
+				allogsm_bulk_read(bulk);
+				ast_mutex_lock(&gsms[i].lock);
+				if (gsm_bulk_span_fits(job, &gsms[i]) && (allogsm_sms_load(gsms[i].dchan) >= 0)) {
+					room = GSM_BULK_BACKLOG - allogsm_sms_queue_depth(gsms[i].dchan);
+					if (room > 0) {
+						ast_mutex_lock(&bulk_lock);
+						allogsm_send_bulk(gsms[i].dchan, bulk, room);
+						ast_mutex_unlock(&bulk_lock);
+					}
+				}
+				ast_mutex_unlock(&gsms[i].lock);
+			}
+		}
+
+		time(&now);
+		ast_mutex_lock(&bulk_lock);
+		if (!reading && (job->sent + job->failed >= bulk->sms ||
+		    now - job->last_result > GSM_BULK_TIMEOUT)) {
+			ast_mutex_unlock(&bulk_lock);
+			break;
+		}
+		if (now - last_progress >= GSM_BULK_PROGRESS) {
+			gsm_bulk_event("GSMBulkProgress", job);
+			last_progress = now;
+		}
+		ast_mutex_unlock(&bulk_lock);
+
+		sleep(1);
+	}
+
+	ast_mutex_lock(&bulk_lock);
+	gsm_bulk_event("GSMBulkDone", job);
+	ast_verb(3, "Bulk SMS job %d done, %d sent %d failed %d invalid\n",
+		job->num, job->sent, job->failed, bulk->invalid);
+	allogsm_bulk_free(job->bulk);
+	job->bulk = NULL;
+	job->num = 0;
+	ast_mutex_unlock(&bulk_lock);
+
+	return NULL;
+}
+
+/* Start a bulk job, returns its number or -1 with the reason in err */
+static int gsm_bulk_start(const char *list, const char *message, const char *id, int prio, char *err, size_t errlen)
+{
+	struct gsm_bulk_job *job = NULL;
+	struct allogsm_bulk *bulk;
+	struct send_sms_cfg send_sms;
+	char job_id[512];
+	pthread_t threadid;
+	FILE *f;
+	int i, num, span = -1;
+
+	for (i = 0; i < NUM_SPANS; i++) {
+		if (gsms[i].gsm && gsms[i].dchan) {
+			span = i;
+			break;
+		}
+	}
+	if (span < 0) {
+		snprintf(err, errlen, "No dchannel running");
+		return -1;
+	}
+	ast_mutex_lock(&gsms[span].lock);
+	send_sms = gsms[span].send_sms;
+	ast_mutex_unlock(&gsms[span].lock);
+
+	ast_mutex_lock(&bulk_lock);
+	for (i = 0; i < GSM_BULK_JOBS; i++) {
+		if (!bulk_jobs[i].num) {
+			if (!job) {
+				job = &bulk_jobs[i];
+			}
+		} else if (!ast_strlen_zero(id) && !strcmp(bulk_jobs[i].bulk->id, id)) {
+			ast_mutex_unlock(&bulk_lock);
+			snprintf(err, errlen, "Job %d already uses ID %s", bulk_jobs[i].num, id);
+			return -1;
+		}
+	}
+	if (!job) {
+		ast_mutex_unlock(&bulk_lock);
+		snprintf(err, errlen, "Too many bulk jobs running");
+		return -1;
+	}
+	/* The tag of its SMS, never 0 */
+	if (!((num = bulk_next_num++) & ALLOGSM_SMS_TAG_MASK)) {
+		num = bulk_next_num++;
+	}
+
+	/* Counts and failed SMS are kept by id, so every job needs one */
+	if (ast_strlen_zero(id)) {
+		snprintf(job_id, sizeof(job_id), "bulk%d", num);
+	} else {
+		ast_copy_string(job_id, id, sizeof(job_id));
+	}
+
+	if (!(f = fopen(list, "r"))) {
+		ast_mutex_unlock(&bulk_lock);
+		snprintf(err, errlen, "Unable to open %s: %s", list, strerror(errno));
+		return -1;
+	}
+	bulk = allogsm_bulk_new(f, (const unsigned char*)message, job_id, prio | ALLOGSM_SMS_TAG(num),
+		send_sms.mode == SEND_SMS_MODE_PDU, send_sms.smsc, send_sms.coding);
+	if (!bulk) {
+		ast_mutex_unlock(&bulk_lock);
+		fclose(f);
+		snprintf(err, errlen, "Message is empty or too long, or bad SMSC");
+		return -1;
+	}
+
+	memset(job, 0, sizeof(*job));
+	job->bulk = bulk;
+	job->send_sms = send_sms;
+	job->num = num;
+	time(&job->start);
+	job->last_result = job->start;
+	if (ast_pthread_create_detached(&threadid, NULL, gsm_bulk_thread, job)) {
+		job->num = 0;
+		job->bulk = NULL;
+		ast_mutex_unlock(&bulk_lock);
+		allogsm_bulk_free(bulk);
+		snprintf(err, errlen, "Unable to start job thread");
+		return -1;
+	}
+	ast_mutex_unlock(&bulk_lock);
+
+	return num;
+}
+
+/* Stop every bulk job and wait for their threads, on unload */
+static void gsm_bulk_stop_all(void)
+{
+	int i, running;
+
+	do {
+		running = 0;
+		ast_mutex_lock(&bulk_lock);
+		for (i = 0; i < GSM_BULK_JOBS; i++) {
+			if (bulk_jobs[i].num) {
+				bulk_jobs[i].cancel = 1;
+				running = 1;
+			}
+		}
+		ast_mutex_unlock(&bulk_lock);
+		if (running) {
+			usleep(100000);
+		}
+	} while (running);
+}
+
 #if (ASTERISK_VERSION_NUM > 10444)
 static char *handle_gsm_unset_debug_file(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 #else  //(ASTERISK_VERSION_NUM > 10444)
@@ -9783,6 +10887,7 @@ static int handle_gsm_send_sms_file(int fd,int argc, char **argv)
 #endif //(ASTERISK_VERSION_NUM > 10444)
 {
 	int span;
+	int prio = ALLOGSM_SMS_PRIO_NORMAL;
 	char* id;
 	FILE *fptr;
 	char filename[50];
@@ -9802,7 +10907,9 @@ static int handle_gsm_send_sms_file(int fd,int argc, char **argv)
 		e->command = "allogsm send sms file";
 		e->usage =
 			"Usage: allogsm send sms file  <span> <destination> <message_file> [id]\n"
-			"       Send SMS on a given GSM span\n";
+			"       Send SMS on a given GSM span\n"
+			"       <span> may be auto to use the least loaded span, a single part\n"
+			"       SMS that fails there is sent again on another span\n";
 		return NULL;
 	case CLI_GENERATE:
 		return gsm_complete_span_5(a->line, a->word, a->pos, a->n);
@@ -9813,8 +10920,9 @@ static int handle_gsm_send_sms_file(int fd,int argc, char **argv)
 		return _SHOWUSAGE_;
 
 	id = argc >= 8 ? (char*)argv[7] : NULL;
-        span = atoi(argv[4]);
-        if (! is_dchan_span(span,fd) ) return _FAILURE_;
+        span = gsm_cli_sms_span(argv[4], fd);
+        if (!span) return _FAILURE_;
+        if (!strcasecmp(argv[4], "auto")) prio |= ALLOGSM_SMS_FAILOVER;
 
         int phone_num_len = strlen(argv[5]);
 /*************/
@@ -9873,131 +10981,39 @@ static int handle_gsm_send_sms_file(int fd,int argc, char **argv)
 
 	if(gsms[span-1].send_sms.mode == SEND_SMS_MODE_PDU) {
 		unsigned char pdu[1024];	
-/*************************************for PDU long ***********************/		
-		int total=0;
-		int msg_len;
+/*************************************for PDU long ***********************/
+		struct allogsm_sms_plan plan;
 		int part_num;
-		unsigned char* user_data;
-		char coding[64];
-		
-		user_data=msg;
-		msg_len=strlen((const char*)user_data);
-		
-		unsigned char lb;
-                int i;
-                int dest_size=0;
-                int lead=0;
-                int pdu_len_max;
-                i=0;
-
-		strcpy((char*)coding,"ASCII");//Assume is ASCII
-		pdu_len_max = PDU_LENGTH_7BIT;
-//		gsms[span-1].send_sms.mode = SEND_SMS_MODE_TXT;
-		unsigned char* p = (unsigned char*)msg;
-		while(*p != '\0') {
-			if( *p >= 128  || 	// It's not ASCII
-			    *p == 0x60 ){ 	// If character is `. Tilt is not allowed in gsm 7 bit encoding.
-				strcpy((char*)coding,"UTF-8");
-				pdu_len_max = PDU_LENGTH_UCS2;
-//				gsms[span-1].send_sms.mode = SEND_SMS_MODE_PDU;
-				break;
-			}
-			p++;
-		}
-		if (pdu_len_max==PDU_LENGTH_UCS2){
-			memset(long_pdu.message_split[0],'\0',sizeof(long_pdu.message_split[0]));
-			while((*user_data)!='\0'){
-				lead=0;
-				lb = *user_data;
-				if (( lb & 0x80 ) == 0 ){               // lead bit is zero, must be a single ascii
-					dest_size+= 2;
-				} else if (( lb & 0xE0 ) == 0xC0 ) {    // 110x xxxx
-					dest_size+= 2;
-				} else if (( lb & 0xF0 ) == 0xE0 ) {    // 1110 xxxx
-					dest_size+= 2;
-				} else if (( lb & 0xF8 ) == 0xF0 ) {    // 1111 0xxx
-					dest_size+= 2;
-				} else {
-					lead=1;  			// Unrecognized lead byte, thats why octect 1(Basically part of octect 2,3,4)
-				}
-				if ( lead || dest_size<=PDU_LENGTH_UCS2 ){
-					long_pdu.message_split[total][i] = lb;
-					++i;
-				}else{
-					long_pdu.message_split[total][i] = '\0';
-					++total;
-					i=0;
-					dest_size=2;
-					long_pdu.message_split[total][i] = lb;
-					++i;
-				}
-				user_data++;
-			}
-			long_pdu.message_split[total][i] = '\0';
-			long_pdu.total_parts=total+1;
-		}else{
-			memset(long_pdu.message_split[0],'\0',sizeof(long_pdu.message_split[0]));
-			while((*user_data)!='\0'){
-				lb = *user_data;
-				lead=0;
-		                switch(lb) {
-					case 0x0C: 	//  FORM FEED
-					case 0x5E: 	//CIRCUMFLEX ACCENT
-					case 0x7B: 	//LEFT CURLY BRACKET
-					case 0x7D: 	//RIGHT CURLY BRACKET
-					case 0x5C: 	//REVERSE SOLIDUS
-					case 0x5B: 	//LEFT SQUARE BRACKET
-					case 0x7E: 	//TILDE
-					case 0x5D: 	//RIGHT SQUARE BRACKET
-					case 0x7C: 	//VERTICAL LINE
-							dest_size+=2;
-							lead=1; // here lead is destination lead not source lead like in case of UCS2.
-							break;
-			                default: 	++dest_size;
-				}
-				if ( dest_size<=PDU_LENGTH_7BIT ){
-					long_pdu.message_split[total][i] = lb;
-					++i;
-				}else{
-					long_pdu.message_split[total][i] = '\0';
-					++total;
-					i=0;
-					if(lead)
-						dest_size=2;
-					else
-						dest_size=1;
-					long_pdu.message_split[total][i] = lb;
-					++i;
-				}
-				user_data++;
-			}
-			long_pdu.message_split[total][i] = '\0';
-			long_pdu.total_parts=total+1;
 
+		if (allogsm_sms_classify_coding(msg, gsms[span-1].send_sms.coding, &plan) || allogsm_sms_plan_split(msg, &plan, &long_pdu)) {
+			ast_cli(fd,"SMS message too long, %d SMS needed.\n", plan.segments);
+			goto sms_filure;
+			return _FAILURE_;
 		}
 
 		for(part_num=0;part_num<long_pdu.total_parts;part_num++){
 			long_pdu.part_num=part_num+1;
 
                         ast_cli(fd,"-------Preparing PDU for String: --------------------------------------- \n");
-                        ast_cli(fd,"coding :%s pdu_len_max %d  len %d\n", coding, pdu_len_max, strlen((const char*)long_pdu.message_split[part_num]));
+                        ast_cli(fd,"coding :%s units %d  len %d\n", plan.coding, plan.units, strlen((const char*)long_pdu.message_split[part_num]));
                         ast_cli(fd,">>%s<<\n", long_pdu.message_split[part_num]);
                         ast_cli(fd,"------------------------------------------------------------------------ \n");
 
 			//if(!allogsm_encode_pdu_ucs2(gsms[span-1].send_sms.smsc, (char*)argv[5], long_pdu.message_split[part_num], gsms[span-1].send_sms.coding, &long_pdu, pdu)) {
-			if(!allogsm_encode_pdu_ucs2(gsms[span-1].send_sms.smsc, (char*)argv[5], long_pdu.message_split[part_num], coding, &long_pdu, pdu)) {
+			if(!allogsm_encode_pdu_ucs2(gsms[span-1].send_sms.smsc, (char*)argv[5], long_pdu.message_split[part_num], plan.coding, &long_pdu, pdu)) {
 				ast_cli(fd,"Encode pdu error\n");
 				goto sms_filure;
 				return _FAILURE_;
 			}
 			ast_mutex_lock(&gsms[span-1].lock);
-			allogsm_send_pdu(gsms[span-1].gsm, (char*)pdu, long_pdu.message_split[part_num], id);
+			allogsm_send_pdu_prio(gsms[span-1].gsm, (char*)pdu, long_pdu.message_split[part_num], id,
+				(long_pdu.total_parts > 1) ? (prio & ~ALLOGSM_SMS_FAILOVER) : prio);
 			ast_mutex_unlock(&gsms[span-1].lock);
 		}
 	} else {
 		ast_mutex_lock(&gsms[span-1].lock);
 		//ast_verbose(LOG_ERROR,"Sending to number %d with text %s with id %d\n",argv[4],argv[5],id);
-		allogsm_send_text(gsms[span-1].gsm, (char*)argv[5], msg, id);
+		allogsm_send_text_prio(gsms[span-1].gsm, (char*)argv[5], msg, id, prio);
 		ast_mutex_unlock(&gsms[span-1].lock);
 	}
 	ast_mutex_unlock(&gsms[span-1].ussd_mutex);
@@ -10006,50 +11022,25 @@ static int handle_gsm_send_sms_file(int fd,int argc, char **argv)
 
 sms_filure:
 	if (id!=NULL){
+		char fail_filename[128];
+		FILE *f;
 
-		char filename[128]="/mnt/smsout_count/";
-	        char fail_filename[128]="/mnt/smsout_fail/";
-		int count = 0;
-		char name[64];
-		sprintf(name,"%s/%s", "fail", id);
-		strcat(filename, name);
-
-		FILE *f=fopen(filename, "a+");
+		ast_mutex_lock(&gsms[span-1].lock);
+		allogsm_count_add(gsms[span-1].gsm, id, 0, 1);
+		ast_mutex_unlock(&gsms[span-1].lock);
 
+		snprintf(fail_filename, sizeof(fail_filename), "/mnt/smsout_fail/%s", id);
+		f = fopen(fail_filename, "a+");
 		if (!f) {
-			printf("Error: Cannot open the file for count update (%s) error (%s)\n",filename, strerror(errno));
-	                return _FAILURE_;
-		}
-		if (fscanf(f, "%d", &count)){} /* Read count value here */
-
-		if (freopen(filename, "w+", f) == NULL)
-		{
-			printf("Error: Cannot open the file for count update (%s) error (%s)\n",filename, strerror(errno));
-	                return _FAILURE_;
-		}
-
-		fprintf(f, "%d", count+1); /* Write New count here */
-
-
-	        name[0]='\0';
-
-	        sprintf(name,"%s",id);
-	        strcat(fail_filename, name);
-
-	        f=freopen(fail_filename, "a+", f);
-
-	        if (!f) {
 			ast_cli(fd,"Error: Cannot save Failed sms at (%s)\n", fail_filename);
-	                return _FAILURE_;
-	        }
-	        fprintf(f, "\"%s\",\"%s\",\"%d\"\r\n",
-	                        (char*)argv[5],
-	                        msg,
-	                        span);
-	        fclose(f);
+			return _FAILURE_;
+		}
+		fprintf(f, "\"%s\",\"%s\",\"%d\"\r\n",
+				(char*)argv[5],
+				msg,
+				span);
+		fclose(f);
 		ast_cli(fd,"Error: SMS Sending Failed for (%s)\n",id);
-		if (system("/bin/sync")){}
-			
 	}
 	return _FAILURE_;
 }
@@ -10063,6 +11054,7 @@ static int handle_gsm_send_sms(int fd,int argc, char **argv)
 #endif //(ASTERISK_VERSION_NUM > 10444)
 {
 	int span;
+	int prio = ALLOGSM_SMS_PRIO_NORMAL;
 	char* id;
 #if (ASTERISK_VERSION_NUM > 10444)
 	int fd = a->fd;
@@ -10078,7 +11070,9 @@ static int handle_gsm_send_sms(int fd,int argc, char **argv)
 		e->command = "allogsm send sms";
 		e->usage =
 			"Usage: allogsm send sms <span> <destination> <message> [id]\n"
-			"       Send SMS on a given GSM span\n";
+			"       Send SMS on a given GSM span\n"
+			"       <span> may be auto to use the least loaded span, a single part\n"
+			"       SMS that fails there is sent again on another span\n";
 		return NULL;
 	case CLI_GENERATE:
 		return gsm_complete_span_4(a->line, a->word, a->pos, a->n);
@@ -10089,8 +11083,9 @@ static int handle_gsm_send_sms(int fd,int argc, char **argv)
 		return _SHOWUSAGE_;
 
 	id = argc >= 7 ? (char*)argv[6] : NULL;
-        span = atoi(argv[3]);
-        if (! is_dchan_span(span,fd) ) return _FAILURE_;
+        span = gsm_cli_sms_span(argv[3], fd);
+        if (!span) return _FAILURE_;
+        if (!strcasecmp(argv[3], "auto")) prio |= ALLOGSM_SMS_FAILOVER;
 
         int phone_num_len = strlen((const char*)argv[4]);
         int sms_len = strlen((const char*)argv[5]);
@@ -10113,104 +11108,319 @@ static int handle_gsm_send_sms(int fd,int argc, char **argv)
 
 
 	if(gsms[span-1].send_sms.mode == SEND_SMS_MODE_PDU) {
-		unsigned char pdu[1024];		
-		int total;
-		int msg_len;
+		unsigned char pdu[1024];
+		struct allogsm_sms_plan plan;
 		int part_num;
-		char coding[64];
-		unsigned char mesg[1024];
-		unsigned char* user_data;
-		
-		strcpy((char*)mesg,(char*)argv[5]);
-		user_data=mesg;
-		msg_len=strlen((const char*)user_data);
-#if 1
-		unsigned char lb;
-                int i;
-                int dest_size=0;
-                int lead=0;
-                int pdu_len_max;
-                total = 0;
-                i=0;
-
-		strcpy((char*)coding,"ASCII");//Assume is ASCII
-		pdu_len_max = PDU_LENGTH_7BIT;
-		unsigned char* p = (unsigned char*)mesg;
-		while(*p != '\0') {
-			if(*p >= 128) { //It's not ASCII
-				strcpy((char*)coding,"UTF-8");
-				pdu_len_max = PDU_LENGTH_UCS2;
-				break;
-			}
-			p++;
-		}
-
-		memset(long_pdu.message_split[0],'\0',sizeof(long_pdu.message_split[0]));
-                while((*user_data)!='\0'){
-                        lead=0;
-                        lb = *user_data;
-                        if (( lb & 0x80 ) == 0 ){               // lead bit is zero, must be a single ascii
-				dest_size+= 2;
-                        } else if (( lb & 0xE0 ) == 0xC0 ) {    // 110x xxxx
-				dest_size+= 2;
-                        } else if (( lb & 0xF0 ) == 0xE0 ) {    // 1110 xxxx
-				dest_size+= 2;
-                        } else if (( lb & 0xF8 ) == 0xF0 ) {    // 1111 0xxx
-				dest_size+= 2;
-                        } else {
-                                lead=1;  			// Unrecognized lead byte, thats why octect 1(Basically part of octect 2,3,4)
-                        }
-                        if ( lead || dest_size<=pdu_len_max){
-                                long_pdu.message_split[total][i] = lb;
-                                ++i;
-                        }else{
-                                long_pdu.message_split[total][i] = '\0';
-                                ++total;
-                                i=0;
-                                dest_size=2;
-                                long_pdu.message_split[total][i] = lb;
-                                ++i;
-                        }
-                        user_data++;
-                }
-		long_pdu.message_split[total][i] = '\0';
-#else	
-		for(total=0;msg_len>0;total++){
-			if(msg_len>=PDU_LENGTH_7BIT){
-				memset(long_pdu.message_split[total],'\0',sizeof(long_pdu.message_split[total]));
-				strncpy(long_pdu.message_split[total],user_data,PDU_LENGTH_7BIT);
-				}
-			else {
-				memset(long_pdu.message_split[total],'\0',sizeof(long_pdu.message_split[total]));
-				strcpy(long_pdu.message_split[total],user_data);
-				}
-                	msg_len-=PDU_LENGTH_7BIT;
-			user_data+=PDU_LENGTH_7BIT;
+
+		if (allogsm_sms_classify_coding((unsigned char*)argv[5], gsms[span-1].send_sms.coding, &plan) ||
+		    allogsm_sms_plan_split((unsigned char*)argv[5], &plan, &long_pdu)) {
+			ast_cli(fd,"SMS message to long, %d SMS needed.\n", plan.segments);
+			return _FAILURE_;
 		}
-#endif		
-		long_pdu.total_parts=total+1;
-		
-		for(part_num=0;part_num<=total;part_num++){
+
+		for(part_num=0;part_num<long_pdu.total_parts;part_num++){
 			long_pdu.part_num=part_num+1;
-			if(!allogsm_encode_pdu_ucs2(gsms[span-1].send_sms.smsc, (char*)argv[4],long_pdu.message_split[part_num], gsms[span-1].send_sms.coding, &long_pdu, pdu)) {
+			if(!allogsm_encode_pdu_ucs2(gsms[span-1].send_sms.smsc, (char*)argv[4],long_pdu.message_split[part_num], plan.coding, &long_pdu, pdu)) {
 				ast_cli(fd,"Encode pdu error\n");
 				return _FAILURE_;
 			}
 	
 			ast_mutex_lock(&gsms[span-1].lock);
-			allogsm_send_pdu(gsms[span-1].gsm, (char*)pdu, long_pdu.message_split[part_num], id);
+			allogsm_send_pdu_prio(gsms[span-1].gsm, (char*)pdu, long_pdu.message_split[part_num], id,
+				(long_pdu.total_parts > 1) ? (prio & ~ALLOGSM_SMS_FAILOVER) : prio);
 			ast_mutex_unlock(&gsms[span-1].lock);
 		}
 	} else {
 		ast_mutex_lock(&gsms[span-1].lock);
 		//ast_verbose(LOG_ERROR,"Sending to number %d with text %s with id %d\n",argv[4],argv[5],id);
-		allogsm_send_text(gsms[span-1].gsm, (char*)argv[4], (unsigned char*)argv[5], id);
+		allogsm_send_text_prio(gsms[span-1].gsm, (char*)argv[4], (unsigned char*)argv[5], id, prio);
 		ast_mutex_unlock(&gsms[span-1].lock);
 	}
 
 	return _SUCCESS_;
 }
 
+#if (ASTERISK_VERSION_NUM > 10444)
+static char *handle_gsm_send_bulk(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+#else  //(ASTERISK_VERSION_NUM > 10444)
+static int handle_gsm_send_bulk(int fd, int argc, char **argv)
+#endif //(ASTERISK_VERSION_NUM > 10444)
+{
+	int num;
+	int prio = ALLOGSM_SMS_PRIO_BULK;
+	char err[256];
+#if (ASTERISK_VERSION_NUM > 10444)
+	int fd = a->fd;
+	const int argc = a->argc;
+	const char * const *argv = a->argv;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "allogsm send bulk";
+		e->usage =
+			"Usage: allogsm send bulk <numbers_file> <message> [id] [priority]\n"
+			"       Send one SMS to every number of a file over all GSM spans that\n"
+			"       send SMS in the mode, SMSC and coding of the first running span.\n"
+			"       The file holds one number per line, or CSV lines starting with\n"
+			"       the number. [priority] is high, normal or bulk (default).\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+#endif //(ASTERISK_VERSION_NUM > 10444)
+
+	if (argc < 5)
+		return _SHOWUSAGE_;
+
+	if (argc >= 7 && (prio = allogsm_str2sms_prio(argv[6])) < 0) {
+		ast_cli(fd, "Unknown priority %s\n", argv[6]);
+		return _FAILURE_;
+	}
+
+	num = gsm_bulk_start(argv[3], argv[4], argc >= 6 ? argv[5] : NULL, prio, err, sizeof(err));
+	if (num < 0) {
+		ast_cli(fd, "%s\n", err);
+		return _FAILURE_;
+	}
+
+	ast_cli(fd, "Bulk job %d started\n", num);
+
+	return _SUCCESS_;
+}
+
+#if (ASTERISK_VERSION_NUM > 10444)
+static char *handle_gsm_show_bulk(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+#else  //(ASTERISK_VERSION_NUM > 10444)
+static int handle_gsm_show_bulk(int fd, int argc, char **argv)
+#endif //(ASTERISK_VERSION_NUM > 10444)
+{
+#define FORMAT_BULK "%-5d %-20.20s %8d %8d %8d %8d %8d %8d %8ld\n"
+#define FORMAT_BULK_TITLE "%-5s %-20.20s %8s %8s %8s %8s %8s %8s %8s\n"
+	struct gsm_bulk_job *job;
+	time_t now;
+	int i, count = 0;
+#if (ASTERISK_VERSION_NUM > 10444)
+	int fd = a->fd;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "allogsm show bulk";
+		e->usage =
+			"Usage: allogsm show bulk\n"
+			"       Show the progress of the running bulk SMS jobs\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+#endif //(ASTERISK_VERSION_NUM > 10444)
+
+	time(&now);
+	ast_cli(fd, FORMAT_BULK_TITLE, "Job", "ID", "Read", "Invalid", "Queued", "SMS", "Sent", "Failed", "Seconds");
+	ast_mutex_lock(&bulk_lock);
+	for (i = 0; i < GSM_BULK_JOBS; i++) {
+		job = &bulk_jobs[i];
+		if (!job->num) {
+			continue;
+		}
+		ast_cli(fd, FORMAT_BULK, job->num, job->bulk->id, job->bulk->read, job->bulk->invalid,
+			job->bulk->queued, job->bulk->sms, job->sent, job->failed, (long)(now - job->start));
+		count++;
+	}
+	ast_mutex_unlock(&bulk_lock);
+	ast_cli(fd, "%d bulk job%s running\n", count, count == 1 ? "" : "s");
+
+	return _SUCCESS_;
+#undef FORMAT_BULK
+#undef FORMAT_BULK_TITLE
+}
+
+static int gsm_show_journal_sms(const struct allogsm_journal_entry *entry, const char *record, void *data)
+{
+	int fd = *(int *)data;
+	time_t t = entry->time;
+	char date[64];
+
+	strftime(date, sizeof(date), "%F %T", localtime(&t));
+	ast_cli(fd, "Received: %s\n%s\n", date, record);
+
+	return 0;
+}
+
+#if (ASTERISK_VERSION_NUM > 10444)
+static char *handle_gsm_show_sms_journal(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+#else  //(ASTERISK_VERSION_NUM > 10444)
+static int handle_gsm_show_sms_journal(int fd, int argc, char **argv)
+#endif //(ASTERISK_VERSION_NUM > 10444)
+{
+	int span, minutes = 60, count;
+	const char *sender = NULL;
+#if (ASTERISK_VERSION_NUM > 10444)
+	int fd = a->fd;
+	const int argc = a->argc;
+	const char * const *argv = a->argv;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "allogsm show sms journal";
+		e->usage =
+			"Usage: allogsm show sms journal <span> [minutes] [sender]\n"
+			"       Show the SMS a GSM span received in the last minutes, 60 by default,\n"
+			"       0 for all of them, from sender only if given\n";
+		return NULL;
+	case CLI_GENERATE:
+		return gsm_complete_span_5(a->line, a->word, a->pos, a->n);
+	}
+#endif //(ASTERISK_VERSION_NUM > 10444)
+
+	if (argc < 5 || argc > 7)
+		return _SHOWUSAGE_;
+
+	span = atoi(argv[4]);
+	if ((span < 1) || (span > NUM_SPANS)) {
+		ast_cli(fd, "Invalid span '%s'.  Should be a number from %d to %d\n", argv[4], 1, NUM_SPANS);
+		return _FAILURE_;
+	}
+	if (argc > 5)
+		minutes = atoi(argv[5]);
+	if (argc > 6)
+		sender = argv[6];
+
+	count = allogsm_journal_query(SMSJOURNALDIR, span, minutes > 0 ? time(NULL) - minutes * 60 : 0, 0,
+		sender, gsm_show_journal_sms, &fd);
+	if (count < 0) {
+		ast_cli(fd, "No SMS journal for span %d in %s\n", span, SMSJOURNALDIR);
+		return _FAILURE_;
+	}
+	ast_cli(fd, "%d SMS\n", count);
+
+	return _SUCCESS_;
+}
+
+static int gsm_show_count_sms(const struct allogsm_sms_count *count, void *data)
+{
+	int fd = *(int *)data;
+	time_t t = count->updated;
+	char date[64];
+
+	strftime(date, sizeof(date), "%F %T", localtime(&t));
+	ast_cli(fd, "%-32.32s %10u %10u  %s\n", count->id, count->sent, count->failed, date);
+
+	return 0;
+}
+
+#if (ASTERISK_VERSION_NUM > 10444)
+static char *handle_gsm_show_sms_count(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+#else  //(ASTERISK_VERSION_NUM > 10444)
+static int handle_gsm_show_sms_count(int fd, int argc, char **argv)
+#endif //(ASTERISK_VERSION_NUM > 10444)
+{
+	struct allogsm_sms_count count;
+	int num;
+#if (ASTERISK_VERSION_NUM > 10444)
+	int fd = a->fd;
+	const int argc = a->argc;
+	const char * const *argv = a->argv;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "allogsm show sms count";
+		e->usage =
+			"Usage: allogsm show sms count [id]\n"
+			"       Show how many SMS were sent and failed for each id, or for id only\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+#endif //(ASTERISK_VERSION_NUM > 10444)
+
+	if (argc < 4 || argc > 5)
+		return _SHOWUSAGE_;
+
+	ast_cli(fd, "%-32.32s %10s %10s  %s\n", "ID", "Sent", "Failed", "Updated");
+	if (argc > 4) {
+		if (allogsm_count_get(argv[4], &count)) {
+			ast_cli(fd, "No SMS counted for '%s'\n", argv[4]);
+			return _FAILURE_;
+		}
+		gsm_show_count_sms(&count, &fd);
+		return _SUCCESS_;
+	}
+
+	num = allogsm_count_walk(gsm_show_count_sms, &fd);
+	ast_cli(fd, "%d id%s\n", num, (num == 1) ? "" : "s");
+
+	return _SUCCESS_;
+}
+
+/* AMI action AGSMSMSCount, the AMI side of allogsm show sms count */
+#if (ASTERISK_VERSION_NUM > 10444)
+static int action_gsm_sms_count(struct mansession *s, const struct message *m)
+#else  //(ASTERISK_VERSION_NUM > 10444)
+static int action_gsm_sms_count(struct mansession *s, struct message *m)
+#endif //(ASTERISK_VERSION_NUM > 10444)
+{
+	const char *id = astman_get_header(m, "ID");
+	const char *action_id = astman_get_header(m, "ActionID");
+	struct allogsm_sms_count count;
+
+	if (ast_strlen_zero(id)) {
+		astman_send_error(s, m, "ID is required");
+		return 0;
+	}
+	if (allogsm_count_get(id, &count)) {
+		astman_send_error(s, m, "No SMS counted for ID");
+		return 0;
+	}
+
+	astman_append(s, "Response: Success\r\n");
+	if (!ast_strlen_zero(action_id)) {
+		astman_append(s, "ActionID: %s\r\n", action_id);
+	}
+	astman_append(s, "ID: %s\r\nSent: %u\r\nFailed: %u\r\nUpdated: %lld\r\n\r\n",
+		count.id, count.sent, count.failed, count.updated);
+
+	return 0;
+}
+
+/* AMI action AGSMSendBulk, the AMI side of allogsm send bulk */
+#if (ASTERISK_VERSION_NUM > 10444)
+static int action_gsm_send_bulk(struct mansession *s, const struct message *m)
+#else  //(ASTERISK_VERSION_NUM > 10444)
+static int action_gsm_send_bulk(struct mansession *s, struct message *m)
+#endif //(ASTERISK_VERSION_NUM > 10444)
+{
+	const char *file = astman_get_header(m, "File");
+	const char *message = astman_get_header(m, "Message");
+	const char *id = astman_get_header(m, "ID");
+	const char *priority = astman_get_header(m, "Priority");
+	const char *action_id = astman_get_header(m, "ActionID");
+	int num, prio = ALLOGSM_SMS_PRIO_BULK;
+	char err[256];
+
+	if (ast_strlen_zero(file) || ast_strlen_zero(message)) {
+		astman_send_error(s, m, "File and Message are required");
+		return 0;
+	}
+	if (!ast_strlen_zero(priority) && (prio = allogsm_str2sms_prio(priority)) < 0) {
+		astman_send_error(s, m, "Unknown Priority");
+		return 0;
+	}
+
+	num = gsm_bulk_start(file, message, id, prio, err, sizeof(err));
+	if (num < 0) {
+		astman_send_error(s, m, err);
+		return 0;
+	}
+
+	astman_append(s, "Response: Success\r\n");
+	if (!ast_strlen_zero(action_id)) {
+		astman_append(s, "ActionID: %s\r\n", action_id);
+	}
+	astman_append(s, "Message: Bulk job started\r\nJob: %d\r\n\r\n", num);
+
+	return 0;
+}
+
 #if (ASTERISK_VERSION_NUM > 10444)
 static char * handle_gsm_send_pdu(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 #else  //(ASTERISK_VERSION_NUM > 10444)
@@ -11073,6 +12283,10 @@ static struct ast_cli_entry allochan_gsm_cli[] = {
 	AST_CLI_DEFINE(handle_gsm_unset_debug_file, "Ends GSM debug output to file"),
 	AST_CLI_DEFINE(handle_gsm_version, "Displays liballogsmat version"),
 	AST_CLI_DEFINE(handle_gsm_send_sms, "Send SMS on a given GSM span"),
+	AST_CLI_DEFINE(handle_gsm_send_bulk, "Send one SMS to a list of numbers"),
+	AST_CLI_DEFINE(handle_gsm_show_bulk, "Show running bulk SMS jobs"),
+	AST_CLI_DEFINE(handle_gsm_show_sms_journal, "Show received SMS from the journal"),
+	AST_CLI_DEFINE(handle_gsm_show_sms_count, "Show sent and failed SMS per id"),
 	AST_CLI_DEFINE(handle_gsm_send_sms_file, "Send SMS on a given GSM span having msg in file"),
 	AST_CLI_DEFINE(handle_gsm_send_sms_end, "Send SMS end character"),
 	AST_CLI_DEFINE(handle_gsm_send_ussd, "Send USSD on a given GSM span"),
@@ -11170,6 +12384,27 @@ static struct ast_cli_entry allochan_gsm_cli[] = {
 	"Usage: allogsm send sms end <span>\n"
 	"       Send SMS end character\n", gsm_complete_span_4},
 
+	{ { "allogsm", "send", "bulk", NULL },
+	handle_gsm_send_bulk, "Send one SMS to a list of numbers",
+	"Usage: allogsm send bulk <numbers_file> <message> [id] [priority]\n"
+	"       Send one SMS to every number of a file over all GSM spans\n", NULL},
+
+	{ { "allogsm", "show", "bulk", NULL },
+	handle_gsm_show_bulk, "Show running bulk SMS jobs",
+	"Usage: allogsm show bulk\n"
+	"       Show the progress of the running bulk SMS jobs\n", NULL},
+
+	{ { "allogsm", "show", "sms", "journal", NULL },
+	handle_gsm_show_sms_journal, "Show received SMS from the journal",
+	"Usage: allogsm show sms journal <span> [minutes] [sender]\n"
+	"       Show the SMS a GSM span received in the last minutes, 60 by default,\n"
+	"       0 for all of them, from sender only if given\n", gsm_complete_span_5},
+
+	{ { "allogsm", "show", "sms", "count", NULL },
+	handle_gsm_show_sms_count, "Show sent and failed SMS per id",
+	"Usage: allogsm show sms count [id]\n"
+	"       Show how many SMS were sent and failed for each id, or for id only\n", NULL},
+
 	{ { "allogsm", "send", "ussd", NULL },
 	handle_gsm_send_ussd, "Send USSD on a given GSM span",
 	"Usage: allogsm send ussd <span> <message> \n"
@@ -11348,6 +12583,8 @@ static int allochan_restart(void)
 			ast_debug(4, "Joined thread of span %d\n", i);
 		}
 	}
+	gsm_reactor_stop();
+	gsm_reactor_threads = 0;
 #endif
 
 	ast_mutex_lock(&ss_thread_lock);
@@ -11386,6 +12623,7 @@ static int allochan_restart(void)
 		ast_cond_init(&gsms[i].check_cond,NULL);
 #endif
 		ast_mutex_init(&gsms[i].ussd_mutex);
+		ast_mutex_init(&gsms[i].sms_result_lock);
 		ast_cond_init(&gsms[i].ussd_cond,NULL);
 		ast_cond_init(&gsms[i].operator_list_cond,NULL);
 		ast_cond_init(&gsms[i].safe_at_cond,NULL);
@@ -12166,6 +13404,10 @@ static int __unload_module(void)
 		
 #ifdef HAVE_ALLOGSMAT
 	int i;
+	ast_manager_unregister("AGSMSendBulk");
+	ast_manager_unregister("AGSMSMSCount");
+	gsm_bulk_stop_all();
+	gsm_reactor_stop();
 	for (i = 0; i < NUM_SPANS; i++) {
 		allogsm_test_atcommand(gsms[i].dchan, "AT+CFUN=0");
 #ifdef VIRTUAL_TTY
@@ -12177,6 +13419,8 @@ static int __unload_module(void)
 		if (gsms[i].master != AST_PTHREADT_NULL) 
 			pthread_cancel(gsms[i].master);
 	}
+	gsm_hook_stop();
+	allogsm_count_close();
 	ast_cli_unregister_multiple(allochan_gsm_cli, ARRAY_LEN(allochan_gsm_cli));
 #endif
 
@@ -12641,6 +13885,17 @@ static int process_extra(struct allochan_chan_conf *confp, const char *cat, stru
                                 confp->gsm.echocanval= atoi(v->value);
                         }else if (!strcasecmp(v->name, "smscodec")) {
                                 ast_copy_string(confp->gsm.send_sms.coding,v->value,sizeof(confp->gsm.send_sms.coding));
+			} else if (!strcasecmp(v->name, "dchanreactor")) {
+				/* no, yes for one thread or the number of threads, for all spans */
+				if (ast_true(v->value))
+					gsm_reactor_threads = 1;
+				else if (ast_false(v->value))
+					gsm_reactor_threads = 0;
+				else if ((atoi(v->value) >= 0) && (atoi(v->value) <= GSM_REACTOR_MAX))
+					gsm_reactor_threads = atoi(v->value);
+				else
+					ast_log(LOG_WARNING, "'%s' is not a valid dchanreactor, should be yes, no or 0 to %d threads at line %d.\n",
+						v->value, GSM_REACTOR_MAX, v->lineno);
 			} else if (!strcasecmp(v->name, "gsmresetinterval")) {
 				if (!strcasecmp(v->value, "never"))
 					confp->gsm.resetinterval = -1;
@@ -12963,6 +14218,8 @@ static int setup_allochan_int(int reload, struct allochan_chan_conf *base_conf,
 					ast_verb(2, "Starting D-Channel on span %d\n", x + 1);
 			}
 		}
+		if (gsm_reactor_start())
+			return -1;
 	}
 #endif
 
@@ -13219,7 +14476,8 @@ static int sendsms_exec(struct ast_channel *ast, const char * data)
 	char dest[512];
 	char mesg[1024];
 	char id[512];
-	char* cmd = "SendSMS(Span,Destination,Message,[ID])";
+	int prio = ALLOGSM_SMS_PRIO_NORMAL;
+	char* cmd = "SendSMS(Span,Destination,Message,[ID],[Priority])";
 
 // for Long PDU 
 	  gsm_sms_pdu long_pdu;
@@ -13245,7 +14503,15 @@ static int sendsms_exec(struct ast_channel *ast, const char * data)
 	strncpy(span,pdata,find-pdata);
 	span[find-pdata]='\0';
 	
-	span_num = atoi(span);
+	if (!strcasecmp(span, "auto")) {
+		span_num = gsm_sms_pick_span(0);
+		if (span_num < 0) {
+			ast_log(LOG_WARNING, "%s No span can send SMS now\n", cmd);
+			return -1;
+		}
+	} else {
+		span_num = atoi(span);
+	}
 	if ((span_num < 1) || (span_num > NUM_SPANS)) {
 		ast_log(LOG_WARNING, "%s Invalid span '%s'.  Should be a number from %d to %d\n", cmd,span, 1, NUM_SPANS);
 		return -1;
@@ -13287,102 +14553,59 @@ static int sendsms_exec(struct ast_channel *ast, const char * data)
 		strncpy(mesg,pdata,sizeof(mesg));
 		strcpy(id,"");
 	} else {
-		if(find-pdata > sizeof(dest)) {
-			ast_log(LOG_WARNING, "%s span overflow\n",cmd);
+		if(find-pdata >= sizeof(mesg)) {
+			ast_log(LOG_WARNING, "%s message overflow\n",cmd);
 			return -1;
 		}
-		strncpy(dest,pdata,find-pdata);
-		dest[find-pdata]='\0';
+		strncpy(mesg,pdata,find-pdata);
+		mesg[find-pdata]='\0';
 		
 		//Get ID
 		////////////////////////////////////////////////////////////////////////////////////
 		pdata = find+1;
-		if(strlen(pdata) > sizeof(dest)) {
-			ast_log(LOG_WARNING, "%s message overflow\n",cmd);
+		find = strchr(pdata,',');
+		if(NULL != find) {
+			//Get priority
+			prio = allogsm_str2sms_prio(find+1);
+		} else {
+			find = (char*)pdata + strlen(pdata);
+		}
+		if(find-pdata >= sizeof(id)) {
+			ast_log(LOG_WARNING, "%s id overflow\n",cmd);
 			return -1;
 		}
-		strncpy(id,pdata,sizeof(id));
+		strncpy(id,pdata,find-pdata);
+		id[find-pdata]='\0';
 		////////////////////////////////////////////////////////////////////////////////////
 	}
 	////////////////////////////////////////////////////////////////////////////////////
 		
 	if ( gsms[span_num-1].dchan ) {
 		unsigned char pdu[1024];
-		const char* char_coding = gsms[span_num-1].send_sms.coding;
 		const char* smsc = gsms[span_num-1].send_sms.smsc;
+		struct allogsm_sms_plan plan;
 		int total;
-		int msg_len;
 		int part_num;
-		char* user_data;
-		user_data=mesg;
-		msg_len=strlen(user_data);
-#if 1
-		unsigned char lb;
-                int i;
-                int octet;
-                total = 0;
-                i=0;
-
-		memset(long_pdu.message_split[0],'\0',sizeof(long_pdu.message_split[0]));
-                while((*user_data)!='\0'){
-                        octet=0;
-                        lb = *user_data;
-                        if (( lb & 0x80 ) == 0 ){               // lead bit is zero, must be a single ascii
-                                octet=1;
-                //              printf( "%x 1 octet\n",lb );
-                        } else if (( lb & 0xE0 ) == 0xC0 ) {    // 110x xxxx
-                                octet=2;
-                        //      printf( "%x 2 octets\n",lb );
-                        } else if (( lb & 0xF0 ) == 0xE0 ) {    // 1110 xxxx
-                                octet=3;
-                        //      printf( "%x 3 octets\n",lb );
-                        } else if (( lb & 0xF8 ) == 0xF0 ) {    // 1111 0xxx
-                                octet=4;
-                        //      printf( "%x 4 octets\n",lb );
-                        } else {
-                                octet=1;
-                                long_pdu.message_split[total][i] = lb;
-                        //      printf( "Unrecognized lead byte (%02x)\n", lb );
-                        }
-                        if ( octet && (i < (PDU_LENGTH_7BIT-(octet-1))) ){
-                                long_pdu.message_split[total][i] = lb;
-                                ++i;
-                        }else{
-                                ++total;
-                                i=0;
-				memset(long_pdu.message_split[total],'\0',sizeof(long_pdu.message_split[total]));
-                                long_pdu.message_split[total][i] = lb;
-				++i;
-                        }
-                        user_data++;
-                }
-#else	
-		for(total=0;msg_len>0;total++){
-			if(msg_len>=PDU_LENGTH_7BIT){
-				memset(long_pdu.message_split[total],'\0',sizeof(long_pdu.message_split[total]));
-				strncpy(long_pdu.message_split[total],user_data,PDU_LENGTH_7BIT);
-				}
-			else {
-				memset(long_pdu.message_split[total],'\0',sizeof(long_pdu.message_split[total]));
-				strcpy(long_pdu.message_split[total],user_data);
-				}
-                	msg_len-=PDU_LENGTH_7BIT;
-			user_data+=PDU_LENGTH_7BIT;
+
+		if (allogsm_sms_classify_coding((unsigned char*)mesg, gsms[span_num-1].send_sms.coding, &plan) ||
+		    allogsm_sms_plan_split((unsigned char*)mesg, &plan, &long_pdu)) {
+			ast_log(LOG_WARNING, "%s message needs %d SMS, more than %d\n", cmd, plan.segments, ALLOGSM_SMS_MAX_SEGMENTS);
+			return -1;
 		}
-#endif		
-		long_pdu.total_parts=total;
+		total = long_pdu.total_parts;
 		for(part_num=0;part_num<total;part_num++){
 			long_pdu.part_num=part_num+1;
 
 		//char_coding = pbx_builtin_getvar_helper(ast,"CHAR_CODING");
 		//smsc = pbx_builtin_getvar_helper(ast,"SMSC");
 
-		if(!allogsm_encode_pdu_ucs2(smsc,dest, long_pdu.message_split[part_num], char_coding, &long_pdu, pdu)) {
+		if(!allogsm_encode_pdu_ucs2(smsc,dest, long_pdu.message_split[part_num], plan.coding, &long_pdu, pdu)) {
 			ast_log(LOG_WARNING,"Encode pdu error\n");
 		}
 				
 		ast_mutex_lock(&gsms[span_num-1].lock);
-		allogsm_send_pdu(gsms[span_num-1].gsm, (char*)pdu,long_pdu.message_split[part_num],id);
+		allogsm_send_pdu_prio(gsms[span_num-1].gsm, (char*)pdu,long_pdu.message_split[part_num],id,
+			(!strcasecmp(span, "auto") && total <= 1) ? (prio | ALLOGSM_SMS_FAILOVER) : prio);
 		ast_mutex_unlock(&gsms[span_num-1].lock);
 		}
 	}
@@ -13582,6 +14805,7 @@ static int load_module(void)
 	memset(gsms, 0, sizeof(gsms));
 	for (z = 0; z < NUM_SPANS; z++) {
 		ast_mutex_init(&gsms[z].lock);
+		ast_mutex_init(&gsms[z].sms_result_lock);
 		gsms[z].offset = -1;
 		gsms[z].master = AST_PTHREADT_NULL;
 		gsms[z].fd = -1;
@@ -13591,12 +14815,21 @@ static int load_module(void)
 	}
 	allogsm_set_error(allochan_gsm_error);
 	allogsm_set_message(allochan_gsm_message);
+	if (gsm_hook_start())
+		return AST_MODULE_LOAD_DECLINE;
+	if (allogsm_count_open(SMSCOUNTDIR "/counters", SMSCOUNTDIR))
+		ast_log(LOG_WARNING, "Unable to map %s/counters, SMS counts are kept in memory only\n", SMSCOUNTDIR);
 #endif
 
 	res = setup_extra(0);
 	/* Make sure we can register our AGSM channel type */
-	if (res)
+	if (res) {
+#ifdef HAVE_ALLOGSMAT
+		gsm_hook_stop();
+		allogsm_count_close();
+#endif
 		return AST_MODULE_LOAD_DECLINE;
+	}
 	if (ast_channel_register(&allochan_tech)) {
 		ast_log(LOG_ERROR, "Unable to register channel class 'AGSM'\n");
 		__unload_module();
@@ -13604,6 +14837,8 @@ static int load_module(void)
 	}
 #ifdef HAVE_ALLOGSMAT
 	ast_cli_register_multiple(allochan_gsm_cli, ARRAY_LEN(allochan_gsm_cli));
+	ast_manager_register("AGSMSendBulk", EVENT_FLAG_SYSTEM | EVENT_FLAG_CALL, action_gsm_send_bulk, "Send one SMS to a list of numbers");
+	ast_manager_register("AGSMSMSCount", EVENT_FLAG_SYSTEM | EVENT_FLAG_CALL, action_gsm_sms_count, "Show sent and failed SMS for an id");
 #endif
 
 	ast_cli_register_multiple(allochan_cli, ARRAY_LEN(allochan_cli));
@@ -33,6 +33,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 //#define NO_WIND_BLOWING 1
 struct msgtype causes[] = {
 	{ ALLOGSM_CAUSE_UNALLOCATED,				"Unallocated (unassigned) number" },
@@ -214,15 +217,18 @@ static int __gsm_read(struct allogsm_modul *gsm, void *buf, int buflen)
  *		buflen: AT Command Length
  * return:
  *		The number of bytes sent; this may be less than buflen
+ *		0: the D-channel has no room now, the fd is non blocking
+ *		-1: write failed
  ******************************************************************************/
 static int __gsm_write(struct allogsm_modul *gsm, const void *buf, int buflen)
 {
 	int res = write(gsm->fd, buf, buflen);
 	if (res < 0) {
-		if (errno != EAGAIN) {
-			gsm_error(gsm, "Write to %d failed: %s\n", gsm->fd, strerror(errno));
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+			return 0;
 		}
-		return 0;
+		gsm_error(gsm, "Write to %d failed: %s\n", gsm->fd, strerror(errno));
+		return -1;
 	}
 
         if((gsm->debug_at_fd > 0) && (gsm->debug_at_flag)) {
@@ -478,16 +484,26 @@ char *callstate2str(int callstate)
 struct allogsm_modul *__gsm_new_tei(int fd, int nodetype, int switchtype, int span, allogsm_rio_cb rd, allogsm_wio_cb wr, void *userdata, int at_debug, int call_waiting_enabled, int auto_modem_reset)
 {
 	struct allogsm_modul *gsm;
-	/* malloc allogsm_modul */
-	if (!(gsm = calloc(1, sizeof(*gsm)))) {
+	/* malloc allogsm_modul, aligned for its cache line sized hot block */
+	if (posix_memalign((void **)&gsm, ALLOGSM_CACHELINE, sizeof(*gsm))) {
 		return NULL;
 	}
+	memset(gsm, 0, sizeof(*gsm));
 
 	gsm->fd			= fd;
+	/* Full driver buffers must not block the span, see allogsm_tx_flush() */
+	if (fd >= 0) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+	gsm->tx_wake_fd	= -1;
+#ifdef __linux__
+	gsm->tx_wake_fd	= eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
 	gsm->read_func	= rd;
 	gsm->write_func	= wr;
 	gsm->userdata	= userdata;
 	gsm->localtype	= nodetype;
+	gsm_schedule_init(gsm);
 	gsm->switchtype	= switchtype;
 	gsm->cref		= 1; /* Next call reference value */
 	gsm->callpool	= &gsm->localpool;
@@ -516,6 +532,7 @@ struct allogsm_modul *__gsm_new_tei(int fd, int nodetype, int switchtype, int sp
 	print_signal_level(gsm,-1);
 	
 	gsm->send_at = 0;
+	gsm->store_index = -1;
 
 #ifdef CONFIG_CHECK_PHONE
 	/*Makes modify 2012-04-10 17:03*/
@@ -560,6 +577,13 @@ void __gsm_free_tei(struct allogsm_modul *gsm)
 #ifdef QUEUE_SMS
 		QueueDestroy(gsm->sms_queue);
 #endif
+		allogsm_journal_close(gsm);
+		gsm_count_release(gsm);
+		gsm_at_queue_destroy(gsm);
+		gsm_schedule_destroy(gsm);
+		if (gsm->tx_wake_fd >= 0) {
+			close(gsm->tx_wake_fd);
+		}
 
                 __gsm_deinit_set_debugat(gsm);
 		gsm->debug_at_flag = 0;
@@ -659,8 +683,194 @@ void gsm_dump(struct allogsm_modul *gsm, const char *at, int len, int txrx)
 }
 
 
+/* txframe flag: wait tx_gap ms after writing this frame */
+#define GSM_TX_PACED	0x8000
+
+static void gsm_tx_resume(void *data)
+{
+	struct allogsm_modul *gsm = data;
+
+	gsm->tx_sched = 0;
+	allogsm_tx_flush(gsm);
+}
+
 /******************************************************************************
- * Transmit AT Command
+ * Write queued frames while the D-channel accepts them
+ * A frame the driver has no room for stays queued, the caller polls the
+ * D-channel for POLLOUT and calls this again.  A frame that fails to write
+ * for any other reason is dropped.  Paced SMS frames resume from the
+ * scheduler after tx_gap ms, nothing ever sleeps here.
+ * param:
+ *		gsm: gsm module
+ * return:
+ *		int: frames still queued
+ ******************************************************************************/
+int allogsm_tx_flush(struct allogsm_modul *gsm)
+{
+	char frame[ALLOGSM_TXBUF_SIZE + 2];
+	unsigned int first;
+	int paced;
+	int len;
+	int res;
+
+	if (gsm->tx_sched) {
+		return gsm->txframe_cnt;
+	}
+
+	while (gsm->txframe_cnt > gsm->tx_held) {
+		len = gsm->txframe[gsm->txframe_head] & ~GSM_TX_PACED;
+		paced = gsm->txframe[gsm->txframe_head] & GSM_TX_PACED;
+
+		first = ALLOGSM_TXBUF_SIZE - gsm->txhead;
+		if (first > len) {
+			first = len;
+		}
+		memcpy(frame, gsm->txbuf + gsm->txhead, first);
+		memcpy(frame + first, gsm->txbuf, len - first);
+		/* Two extra bytes for the FCS */
+		frame[len] = frame[len + 1] = '\0';
+
+		res = gsm->write_func ? gsm->write_func(gsm, frame, len + 2) : len + 2;
+		if (!res) {
+			/* Driver buffers are full, wait for POLLOUT */
+			break;
+		}
+		if (res < 0) {
+			gsm_error(gsm, "Span %d: dropping %d bytes of AT data\n", gsm->span, len);
+		} else if (res != (len + 2)) {
+			gsm_error(gsm, "Short write: %d/%d (%s)\n", res, len + 2, strerror(errno));
+		}
+
+		gsm->txhead = (gsm->txhead + len) & ALLOGSM_TXBUF_MASK;
+		gsm->txlen -= len;
+		gsm->txframe_head = (gsm->txframe_head + 1) % ALLOGSM_TXFRAMES;
+		gsm->txframe_cnt--;
+
+		/* Hold off whatever is queued next, now or later, for tx_gap ms;
+		   without room in the scheduler the rest goes unpaced rather than never */
+		if (paced && (gsm->tx_gap > 0)) {
+			res = gsm_schedule_event(gsm, gsm->tx_gap, gsm_tx_resume, gsm);
+			if (res > 0) {
+				gsm->tx_sched = res;
+				break;
+			}
+		}
+	}
+
+	if (!gsm->txframe_cnt) {
+		gsm->txhead = 0;
+	}
+
+	return gsm->txframe_cnt;
+}
+
+int allogsm_tx_pending(struct allogsm_modul *gsm)
+{
+	unsigned long long count;
+
+	/* The caller is about to poll for what this returns */
+	if (gsm->tx_wake_fd >= 0) {
+		if (read(gsm->tx_wake_fd, &count, sizeof(count)) < 0) {
+			/* EAGAIN: nothing queued since */
+		}
+	}
+
+	/* While a paced flush waits for its timer POLLOUT is of no use */
+	return gsm->tx_sched ? 0 : gsm->txframe_cnt - gsm->tx_held;
+}
+
+/******************************************************************************
+ * get the descriptor that wakes the D-channel poll up for queued frames
+ * AT data queued from another thread while the driver is full only goes out
+ * on POLLOUT, which the D-channel thread isn't polling for yet.  This becomes
+ * readable then, and allogsm_tx_pending() clears it.
+ * param:
+ *		gsm: struct allogsm_modul
+ * return:
+ *		int: descriptor to poll for POLLIN next to the D-channel
+ *		-1: none, the caller must wake the D-channel thread itself
+ ******************************************************************************/
+int allogsm_wake_fd(struct allogsm_modul *gsm)
+{
+	return gsm->tx_wake_fd;
+}
+
+/******************************************************************************
+ * Set the largest frame the D-channel driver takes in one write
+ * SMS body frames are AT_SMS_CHUNK_SIZE bytes of the module profile and
+ * never more than this, FCS bytes included.  DAHDI reports its buffer size
+ * (1024 by default), far more than the 32 byte signalling FIFO of the card,
+ * so this only catches a profile asking for more than the driver can take;
+ * matching the FIFO is up to AT_SMS_CHUNK_SIZE.
+ * param:
+ *		gsm: struct allogsm_modul
+ *		bytes: driver buffer size, 0 or less if unknown
+ * e.g.
+ *		if (!ioctl(fd, DAHDI_GET_BUFINFO, &bi))
+ *			allogsm_set_tx_fifo(gsm, bi.bufsize);
+ ******************************************************************************/
+void allogsm_set_tx_fifo(struct allogsm_modul *gsm, int bytes)
+{
+	/* A frame carries 2 FCS bytes on top of its payload */
+	gsm->tx_fifo = (bytes > 2) ? bytes - 2 : 0;
+}
+
+/******************************************************************************
+ * Queue one frame for the D-channel and write as much as it accepts now
+ * param:
+ *		gsm: gsm module
+ *		data: frame payload, the FCS bytes are added on write
+ *		len: payload length
+ *		paced: GSM_TX_PACED to keep tx_gap ms before the next frame, else 0
+ * return:
+ *	   	0: queued
+ *		-1: output buffer full
+ ******************************************************************************/
+static int gsm_tx_queue(struct allogsm_modul *gsm, const char *data, int len, int paced)
+{
+	unsigned int tail;
+	unsigned int first;
+
+	if (len <= 0) {
+		return 0;
+	}
+	if ((gsm->txlen + len > ALLOGSM_TXBUF_SIZE) || (gsm->txframe_cnt >= ALLOGSM_TXFRAMES)) {
+		gsm_error(gsm, "Span %d: output buffer full, dropping %d bytes\n", gsm->span, len);
+		return -1;
+	}
+
+	tail = (gsm->txhead + gsm->txlen) & ALLOGSM_TXBUF_MASK;
+	first = ALLOGSM_TXBUF_SIZE - tail;
+	if (first > len) {
+		first = len;
+	}
+	memcpy(gsm->txbuf + tail, data, first);
+	memcpy(gsm->txbuf, data + first, len - first);
+	gsm->txlen += len;
+
+	gsm->txframe[(gsm->txframe_head + gsm->txframe_cnt) % ALLOGSM_TXFRAMES] = len | paced;
+	gsm->txframe_cnt++;
+
+	/* Anything but the queued AT command in flight waits for its answer,
+	   see gsm_at_queue_complete() */
+	if (gsm->atq_head && gsm->atq_head->sent) {
+		gsm->tx_held++;
+	}
+
+	/* Left for POLLOUT, make sure the D-channel polls for it */
+	if (allogsm_tx_flush(gsm) > gsm->tx_held && !gsm->tx_sched && (gsm->tx_wake_fd >= 0)) {
+		unsigned long long one = 1;
+
+		if (write(gsm->tx_wake_fd, &one, sizeof(one)) < 0) {
+			/* Counter full, already readable */
+		}
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+ * Transmit AT Command, the AT command queue waits for its final result
  * param:
  *		gsm: gsm module
  *		at  : AT Command
@@ -668,9 +878,20 @@ void gsm_dump(struct allogsm_modul *gsm, const char *at, int len, int txrx)
  *	   	0: trasmit ok
  *		-1: error
  * e.g.
- *		gsm_transmit(gsm, "AT+CREG?\r\n");
+ *		gsm_send_at(gsm, "AT+CREG?");
  ******************************************************************************/
-int gsm_send_at(struct allogsm_modul *gsm, const char *at) 
+int gsm_send_at(struct allogsm_modul *gsm, const char *at)
+{
+	if (__gsm_send_at(gsm, at)) {
+		return -1;
+	}
+	gsm_at_raw_sent(gsm);
+
+	return 0;
+}
+
+/* Write at with CR LF, the AT command queue writes its own commands with it */
+int __gsm_send_at(struct allogsm_modul *gsm, const char *at)
 {
 	if ( NULL == gsm || NULL == at ) {
 		return -1;
@@ -694,7 +915,6 @@ int gsm_send_at(struct allogsm_modul *gsm, const char *at)
 	}
 
 	dbuf = (char*)malloc(len*sizeof(char)+2+1);
-	usleep (5000); //pawan
 	
 	/* Just send it raw */
 	/* Dump AT Message*/
@@ -707,11 +927,8 @@ int gsm_send_at(struct allogsm_modul *gsm, const char *at)
 	dbuf[len++]	= '\n';
 	dbuf[len] = '\0';
 
-		/* Write an extra two bytes for the FCS */
-	res = gsm->write_func ? gsm->write_func(gsm, dbuf, len + 2) : 0;
-	if (res != (len + 2)) {
-		gsm_error(gsm, "Short write: %d/%d (%s)\n", res, len + 2, strerror(errno));
-		
+	res = gsm_tx_queue(gsm, dbuf, len, 0);
+	if (res) {
 		free(dbuf);
 		return -1;
 	}
@@ -726,7 +943,8 @@ int gsm_send_at(struct allogsm_modul *gsm, const char *at)
 }
 
 /******************************************************************************
- * Transmit SMS in Packet of 10 bytes
+ * Transmit SMS in packets of AT_SMS_CHUNK_SIZE bytes (capped to the driver
+ * buffer), AT_SMS_CHUNK_GAP ms apart when the module profile asks for it
  * param:
  *		gsm	: gsm module
  *		msg  	: sms
@@ -743,10 +961,25 @@ int gsm_transmit_sms(struct allogsm_modul *gsm, const char *msg)
 	}
 	
 	int res, len, count, rem;
+	int chunk, paced;
 	int j=0;
 
 	/* get AT Command length */
 	len = strlen(msg);
+
+	/* A bad chunk size falls back to the 10 bytes SMS bodies were always sent in */
+	chunk = atoi(get_at(gsm->switchtype, AT_SMS_CHUNK_SIZE));
+	if ((chunk <= 0) || (chunk > ALLOGSM_TXBUF_SIZE)) {
+		chunk = 10;
+	}
+	if ((gsm->tx_fifo > 0) && (chunk > gsm->tx_fifo)) {
+		chunk = gsm->tx_fifo;
+	}
+	gsm->tx_gap = atoi(get_at(gsm->switchtype, AT_SMS_CHUNK_GAP));
+	if (gsm->tx_gap < 0) {
+		gsm->tx_gap = 0;
+	}
+	paced = (gsm->tx_gap > 0) ? GSM_TX_PACED : 0;
 #if 0 
 	printf("Transmitted msg is >>%s<< len: %d\n",msg, len);
 #endif
@@ -765,21 +998,18 @@ int gsm_transmit_sms(struct allogsm_modul *gsm, const char *msg)
 		gsm_dump(gsm, msg, len, 1);
 	}
 
-#define SMS_SHORT_LEN	10
-        count = len/SMS_SHORT_LEN;
-        rem = len%SMS_SHORT_LEN;
+        count = len/chunk;
+        rem = len%chunk;
+	/* One frame per chunk, the driver and the scheduler pace them */
         for (j=0; j<count; ++j){
-		res = gsm->write_func ? gsm->write_func(gsm, &msg[j*SMS_SHORT_LEN], SMS_SHORT_LEN + 2) : 0;
-		if (res != (SMS_SHORT_LEN + 2)) {
-			gsm_error(gsm, "Short write: %d/%d (%s)\n", res,  SMS_SHORT_LEN + 2, strerror(errno));
+		res = gsm_tx_queue(gsm, &msg[j*chunk], chunk, paced);
+		if (res) {
 			return -1;
 		}
-		usleep(3000);
 	}
 	if(rem){
-		res = gsm->write_func ? gsm->write_func(gsm, &msg[j*SMS_SHORT_LEN], rem + 2) : 0;
-		if (res != (rem + 2)) {
-			gsm_error(gsm, "Short write: %d/%d (%s)\n", res,  rem + 2, strerror(errno));
+		res = gsm_tx_queue(gsm, &msg[j*chunk], rem, paced);
+		if (res) {
 			return -1;
 		}
 	}	
@@ -851,12 +1081,11 @@ int gsm_transmit(struct allogsm_modul *gsm, const char *at)
 		gsm_dump(gsm, at, len, 1);
 	}
 	
-	/* Write an extra two bytes for the FCS */
-	res = gsm->write_func ? gsm->write_func(gsm, at, len + 2) : 0;
-	if (res != (len + 2)) {
-		gsm_error(gsm, "Short write: %d/%d (%s)\n", res, len + 2, strerror(errno));
+	res = gsm_tx_queue(gsm, at, len, 0);
+	if (res) {
 		return -1;
 	}
+	gsm_at_raw_sent(gsm);
 
 	/* Last sent command to dchan */
 	strncpy(gsm->at_last_sent, at, sizeof(gsm->at_last_sent));
@@ -887,10 +1116,8 @@ int gsm_transmit_data(struct allogsm_modul *gsm, const char *data, int len)
 		gsm_dump(gsm, data, len, 1);
 	}
 
-	/* Write an extra two bytes for the FCS */
-	res = gsm->write_func ? gsm->write_func(gsm, data, len + 2) : 0;
-	if (res != (len + 2)) {
-		gsm_error(gsm, "Short write: %d/%d (%s)\n", res, len + 2, strerror(errno));
+	res = gsm_tx_queue(gsm, data, len, 0);
+	if (res) {
 		return -1;
 	}
 	
@@ -990,10 +1217,8 @@ int allogsm_test_atcommand(struct allogsm_modul *gsm, char *at)
 	dbuf[len++]	= '\n';		
 	dbuf[len] = '\0';
 						
-	/* Write an extra two bytes for the FCS */
-	res = gsm->write_func ? gsm->write_func(gsm, dbuf, len + 2) : 0;
-	if (res != (len + 2)) {
-		gsm_error(gsm, "Short write: %d/%d (%s)\n", res, len + 2, strerror(errno));
+	res = gsm_tx_queue(gsm, dbuf, len, 0);
+	if (res) {
 		free(dbuf);
 		return -2;
 	}
@@ -1259,6 +1484,7 @@ void gsm_get_operator(struct allogsm_modul *gsm, char *buf)
 int gsm_switch_state(struct allogsm_modul *gsm, int state, const char *next_command)
 {
     gsm->state = state;
+    gsm->at_pending = next_command ? 1 : 0;
     if (next_command) {
 		//Freedom Modify 2011-10-10 15:58
 		//gsm_transmit(gsm, next_command);
@@ -1281,6 +1507,9 @@ int gsm_switch_state(struct allogsm_modul *gsm, int state, const char *next_comm
 	gsm_switch_state(gsm, ALLOGSM_STATE_INIT, get_at(gsm->switchtype,AT_GENERAL_INDICATION));
     }
 /************************************/
+    if (ALLOGSM_STATE_READY == gsm->state && !next_command) {
+	gsm_at_queue_kick(gsm);
+    }
     return 0;
 }
 
@@ -1288,6 +1517,7 @@ int gsm_switch_sim_state(struct allogsm_modul *gsm, int state, char *next_comman
 {
     gsm->sim_state = state;
     if (next_command) {
+		gsm->at_pending = 1;
         //Freedom Modify 2011-10-10 15:58
 		//gsm_transmit(gsm, next_command);
 		gsm_send_at(gsm,next_command);
@@ -2078,9 +2308,7 @@ void allogsm_module_start(struct allogsm_modul *gsm)
 static allogsm_event *gsm_set_switchtype(struct allogsm_modul *gsm, char *data, int len)
 {
 	struct alloat_call *call;
-	char buf[1024];
-	char receivebuf[1024];
-	char *p;
+	char *buf;
 	int i;
 	allogsm_event* res_event=NULL;
 	/* get ast_call */
@@ -2090,11 +2318,9 @@ static allogsm_event *gsm_set_switchtype(struct allogsm_modul *gsm, char *data,
 		return NULL;
 	}
 
-	strncpy(receivebuf, data, sizeof(receivebuf));
-	p = receivebuf;
 	i = 0;
 	while (1) {	
-		len = gsm_san(gsm, p, buf, len);
+		len = gsm_san_line(gsm, data, len, &buf);
 		if (!len) {
 			return NULL;
 		}
@@ -2112,7 +2338,6 @@ static allogsm_event *gsm_set_switchtype(struct allogsm_modul *gsm, char *data,
                                 gsm_message(gsm,"             %-40.40s\n", buf+ii);
 #undef FORMAT
 		}
-		strncpy(p, gsm->sanbuf, sizeof(receivebuf));
 		/*{
 			char tmp[1024];
 			gsm_trim(gsm->at_last_sent, tmp, strlen(gsm->at_last_sent));
@@ -2492,12 +2717,8 @@ static allogsm_event *gsm_set_switchtype(struct allogsm_modul *gsm, char *data,
 			return NULL;
 		}
 		
-		len = gsm->sanidx;
-#if 0
-		gsm->sanidx = 0;
-#else
-		gsm->sanidx = 0;
-#endif
+		/* Remaining lines are still queued in sanbuf */
+		len = 0;
 		
 		if (gsm->state == ALLOGSM_STATE_MANUFACTURER_REQ) {
 			break;
@@ -2525,17 +2746,10 @@ allogsm_event *allogsm_check_event(struct allogsm_modul *gsm)
 	allogsm_event *e;
 	char *p=NULL;
 	e = NULL;
-	int j;
         if (gsm->debug & ALLOGSM_DEBUG_AT_DUMP){
 //	if (gsm->span==2)	{
 		gsm_message(gsm, "--------after(%d)-->\n", gsm->sanidx);
-		for (j = 0; j < gsm->sanidx ; j++) {
-		if ( (gsm->sanbuf[j]<20)||(gsm->sanbuf[j]>127) )
-			gsm_message(gsm, "0x%x", gsm->sanbuf[j]);
-		else
-			gsm_message(gsm, "%c", gsm->sanbuf[j]);
-		}
-		gsm_message(gsm, "\n<----\n");
+		gsm_san_dump(gsm);
 	}
 
 	if (gsm->sanidx>0){
@@ -2643,6 +2857,10 @@ allogsm_event *allogsm_check_event(struct allogsm_modul *gsm)
 			memset(gsm->at_last_recv,0,sizeof(gsm->at_last_recv));
 		}
 	}
+
+	/* The state machine may have gone idle on these lines */
+	gsm_at_queue_kick(gsm);
+
 	return e;
 }
 
@@ -2655,16 +2873,9 @@ allogsm_event *allogsm_check_event_buffered(struct allogsm_modul *gsm)
 	allogsm_event *e;
 	char *p=NULL;
 	e = NULL;
-	int j;
 	if (gsm->debug & ALLOGSM_DEBUG_AT_DUMP){
 	gsm_message(gsm, "--------after(%d)-->\n", gsm->sanidx);
-		for (j = 0; j < gsm->sanidx ; j++) {
-		if ( (gsm->sanbuf[j]<20)||(gsm->sanbuf[j]>127) )
-			gsm_message(gsm, "0x%x", gsm->sanbuf[j]);
-		else
-			gsm_message(gsm, "%c", gsm->sanbuf[j]);
-		}
-		gsm_message(gsm, "\n<----\n");
+		gsm_san_dump(gsm);
 	}
 	/* Read from GSM D-channel */
 	if (gsm->sanidx>0){
@@ -2680,6 +2891,48 @@ allogsm_event *allogsm_check_event_buffered(struct allogsm_modul *gsm)
 	}
 	return e;
 }
+
+/******************************************************************************
+ * Handle every AT line available from one D-channel read
+ * param:
+ *		gsm: struct allogsm_modul
+ *		events: array receiving the events, in line order
+ *		max: size of events
+ * return:
+ *		int: number of events stored in events
+ *		Lines left over once events is full stay queued in sanbuf
+ * e.g.
+ *		n = allogsm_check_event_batch(gsm, evs, sizeof(evs) / sizeof(evs[0]));
+ ******************************************************************************/
+int allogsm_check_event_batch(struct allogsm_modul *gsm, allogsm_event *events, int max)
+{
+	allogsm_event *e;
+	int n = 0;
+	int before;
+
+	if (max <= 0) {
+		return 0;
+	}
+
+	/* Read (or take the queued lines) once */
+	if ((e = allogsm_check_event(gsm))) {
+		events[n++] = *e;
+	}
+
+	/* Then split out the rest of the lines without going back to poll() */
+	while ((n < max) && (gsm->sanidx > 0)) {
+		before = gsm->sanidx;
+		if ((e = allogsm_check_event(gsm))) {
+			events[n++] = *e;
+		} else if (gsm->sanidx == before) {
+			/* Only an incomplete line is left */
+			break;
+		}
+	}
+
+	return n;
+}
+
 int allogsm_acknowledge(struct allogsm_modul *gsm, struct alloat_call *c, int channel, int info)
 {
 	if (!gsm || !c) {
@@ -3115,6 +3368,21 @@ char *allogsm_dump_info_str(struct allogsm_modul *gsm)
 //	len += sprintf(buf + len, (gsm->switchtype == ALLOGSM_SWITCH_EM200) ? "Card GSN: %s\n" : "Card IMEI: %s\n", gsm->imei);
 	len += sprintf(buf + len, "SIM IMSI: %s\n", gsm->imsi == NULL ? "UNKNOWN": gsm->imsi);
 	len += sprintf(buf + len, "SIM SMS Center Number: %s\n",gsm->sim_smsc == NULL ? "UNKNOWN": gsm->sim_smsc);
+	len += sprintf(buf + len, "SMS Storage: %d of %d used, %d read waiting for deletion\n", gsm->store_used, gsm->store_total, gsm->store_read);
+#ifdef QUEUE_SMS
+	{
+		struct allogsm_sms_lane_stats st;
+		int prio;
+
+		for (prio = 0; prio < ALLOGSM_SMS_PRIO_SUM; prio++) {
+			if (allogsm_sms_queue_stats(gsm, prio, &st)) {
+				break;
+			}
+			len += sprintf(buf + len, "SMS Queue %s: %d waiting, oldest %u ms, sent %u, wait avg %u ms max %u ms\n",
+					allogsm_sms_prio2str(prio), st.depth, st.wait_oldest, st.sent, st.wait_avg, st.wait_max);
+		}
+	}
+#endif
 
 	return strdup(buf);
 }
@@ -3192,45 +3460,87 @@ static int __gsm_send_text(struct allogsm_modul *gsm, char *destination, char *m
 }
 #ifdef QUEUE_SMS 
 
-static void gsm_dequeue_sms_txt(void *gsm_ptr)
+static int __gsm_send_pdu(struct allogsm_modul *gsm, char *message);
+
+static void gsm_dequeue_sms(void *gsm_ptr)
 {
 	struct allogsm_modul *gsm	= gsm_ptr;
-	char *destination;
-	char *message;
+	sms_info_u *sms_info;
+	int pdu;
 
 	if ((ALLOGSM_STATE_READY != gsm->state) ||
 	    (gsm->dial_initiated == 1) ||
 	    ((gsm->creg_state!=CREG_1_REGISTERED_HOME) &&
 	    (gsm->creg_state!=CREG_5_REGISTERED_ROAMING))) {
-		gsm_message(gsm, "here after dequeue %s %d\n",__func__, __LINE__ ); //pawan print
-		int resendsmsidx = gsm_schedule_event(gsm, 1000, gsm_dequeue_sms_txt, gsm_ptr);
-		gsm->sms_queue->front->sms_info.txt_info.resendsmsidx = resendsmsidx;
-		//Freedom Add 2011-10-27 16:41 Release memory
-		if (resendsmsidx < 0 && &(gsm->sms_queue->front->sms_info)) {
+		if (gsm_schedule_event(gsm, 1000, gsm_dequeue_sms, gsm_ptr) < 0) {
+			gsm_error(gsm, "Can't schedule sending sms!\n");
+		}
+		return;
+	}
+
+	sms_info = QueueDelete(gsm, &pdu);
+	if (!sms_info) {
+		return;
+	}
+
+	/* The message sent before is done with, hand its slot back */
+	QueueRelease(gsm, gsm->sms_info);
+	gsm->sms_info = sms_info;
+
+	if (!QueueIsEmpty(gsm->sms_queue)) {
+		if (gsm_schedule_event(gsm, 1000, gsm_dequeue_sms, (void *)gsm) < 0) {
 			gsm_error(gsm, "Can't schedule sending sms!\n");
-			free (&(gsm->sms_queue->front->sms_info));
-//			sms_info = NULL;
 		}
+	}
+
+	if (pdu) {
+		__gsm_send_pdu(gsm, sms_info->pdu_info.message);
 	} else {
-		gsm->sms_info=&(gsm->last_sms);
-		if (QueueDelete(gsm) == 1){
-			gsm_message(gsm, "here after dequeue %s %d\n",__func__, __LINE__ ); //pawan print
-			int resendsmsidx = gsm_schedule_event(gsm, 1000, gsm_dequeue_sms_txt, (void *)gsm);
-			gsm->sms_queue->front->sms_info.txt_info.resendsmsidx = resendsmsidx;
-			//Freedom Add 2011-10-27 16:41 Release memory
-			if (resendsmsidx < 0 && &(gsm->sms_queue->front->sms_info)) {
+		__gsm_send_text(gsm, sms_info->txt_info.destination, sms_info->txt_info.message);
+	}
+}
+
+/******************************************************************************
+ * Send a filled slot now if the span is idle, else queue it in its lane
+ * param:
+ *		gsm: gsm module
+ *		sms_info: slot from QueueAlloc(), released here on failure
+ *		prio: enum allogsm_sms_prio
+ *		pdu: 1 if sms_info holds pdu_info, 0 for txt_info
+ * return:
+ *		0: sent or queued
+ *		-1: can not schedule sending
+ ******************************************************************************/
+static int gsm_queue_sms(struct allogsm_modul *gsm, sms_info_u *sms_info, int prio, int pdu)
+{
+	if ((ALLOGSM_STATE_READY != gsm->state) ||
+	    (gsm->dial_initiated == 1) ||
+	    ((gsm->creg_state!=CREG_1_REGISTERED_HOME) &&
+	    (gsm->creg_state!=CREG_5_REGISTERED_ROAMING))) {
+
+		if (QueueIsEmpty(gsm->sms_queue)) {	
+			/* First one waiting, start polling for the span to be ready */
+			if (gsm_schedule_check(gsm) < 0 ||
+			    gsm_schedule_event(gsm, 1000, gsm_dequeue_sms, (void *)gsm) < 0) {
 				gsm_error(gsm, "Can't schedule sending sms!\n");
-				free (&(gsm->sms_queue->front->sms_info));
-			//			sms_info = NULL;
+				QueueRelease(gsm, sms_info);
+				return -1;
 			}
 		}
-
-		destination = gsm->sms_info->txt_info.destination;
-		message	= gsm->sms_info->txt_info.message;
-//		gsm->sms_info = sms_info;
-		gsm_message(gsm, "here after dequeue %s %d\n",__func__, __LINE__ ); //pawan print
-		__gsm_send_text(gsm, destination, message);
+		QueueEnter(gsm, sms_info, prio, pdu);
+	}  else if (QueueIsEmpty(gsm->sms_queue)) {	
+		QueueRelease(gsm, gsm->sms_info);
+		gsm->sms_info = sms_info;
+		if (pdu) {
+			__gsm_send_pdu(gsm, sms_info->pdu_info.message);
+		} else {
+			__gsm_send_text(gsm, sms_info->txt_info.destination, sms_info->txt_info.message);
+		}
+	} else { //put in queue
+		QueueEnter(gsm, sms_info, prio, pdu);
 	}
+
+	return 0;
 }
 
 #else
@@ -3379,17 +3689,36 @@ int allogsm_send_text_csv(struct allogsm_modul *gsm, char *destination, char *me
 #ifdef QUEUE_SMS
 int allogsm_send_text(struct allogsm_modul *gsm, char *destination, unsigned char *message, char *id)
 {
-	int res = -1;
+	return allogsm_send_text_prio(gsm, destination, message, id, ALLOGSM_SMS_PRIO_NORMAL);
+}
+
+/******************************************************************************
+ * send sms in a priority lane
+ * param:
+ *		gsm: gsm module
+ *		destination: called number
+ *		message: sms body
+ *		id: identification of this sms, may be NULL
+ *		prio: enum allogsm_sms_prio, may be or'ed with ALLOGSM_SMS_FAILOVER
+ * return:
+ *		0: sms sent or queued
+ *		-1: can not send sms, the queue may be full
+ * e.g.
+ *		allogsm_send_text_prio(gsm, "1000", "Code 4711", NULL, ALLOGSM_SMS_PRIO_HIGH)
+ ******************************************************************************/
+int allogsm_send_text_prio(struct allogsm_modul *gsm, char *destination, unsigned char *message, char *id, int prio)
+{
 	sms_info_u *sms_info = NULL;	
 	
 	if (!gsm) {
-		return res;
+		return -1;
 	}
 	
-	sms_info = malloc(sizeof(sms_txt_info_t));
+	/* Filled in place and handed to the queue by pointer */
+	sms_info = QueueAlloc(gsm);
 	if (!sms_info) {
-		gsm_error(gsm, "unable to malloc!\n");
-		return res;
+		gsm_error(gsm, "SMS queue full on span %d, %d messages waiting\n", gsm->span, allogsm_sms_queue_depth(gsm));
+		return -1;
 	}
 
 	//id
@@ -3402,44 +3731,10 @@ int allogsm_send_text(struct allogsm_modul *gsm, char *destination, unsigned cha
 	sms_info->txt_info.gsm = gsm;
 	strncpy(sms_info->txt_info.destination, destination, sizeof(sms_info->txt_info.destination));
 	strncpy(sms_info->txt_info.message, message, sizeof(sms_info->txt_info.message));		
+	sms_info->txt_info.prio = prio & ALLOGSM_SMS_PRIO_MASK;
+	sms_info->txt_info.flags = prio & ~ALLOGSM_SMS_PRIO_MASK;
 	
-	if ((ALLOGSM_STATE_READY != gsm->state) ||
-	    (gsm->dial_initiated == 1) ||
-	    ((gsm->creg_state!=CREG_1_REGISTERED_HOME) &&
-	    (gsm->creg_state!=CREG_5_REGISTERED_ROAMING))) {
-
-		if (QueueIsEmpty(gsm->sms_queue)) {	
-			/*sched here*/
-		gsm_message(gsm, "here at enqueue %d..\n",__LINE__); //pawan print
-			QueueEnter(gsm, *sms_info);
-			if (gsm_schedule_check(gsm) < 0) {
-				gsm_error(gsm, "No enough space for sending sms!\n");
-				return -1;
-			}
-			int resendsmsidx = gsm_schedule_event(gsm, 1000, gsm_dequeue_sms_txt, (void *)gsm);
-			sms_info->txt_info.resendsmsidx = resendsmsidx;
-			if (resendsmsidx < 0 && sms_info) {
-				gsm_error(gsm, "Can't schedule sending sms!\n");
-				free(sms_info);
-				sms_info = NULL;
-				return -1;
-			}
-			res = 0;
-		}else{
-		gsm_message(gsm, "here at enqueue %d..\n",__LINE__); //pawan print
-			QueueEnter(gsm, *sms_info);
-		}
-	}  else if (QueueIsEmpty(gsm->sms_queue)) {	
-		gsm_message(gsm, "here at enqueue %d..\n",__LINE__); //pawan print
-		gsm->sms_info = sms_info;
-		__gsm_send_text(gsm, sms_info->txt_info.destination, sms_info->txt_info.message);
-		res = 0;
-	} else { //put in queue
-		gsm_message(gsm, "here at enqueue %d..\n",__LINE__); //pawan print
-		QueueEnter(gsm, *sms_info);
-	}
-
-	return res;
+	return gsm_queue_sms(gsm, sms_info, sms_info->txt_info.prio, 0);
 }
 #else
 int allogsm_send_text(struct allogsm_modul *gsm, char *destination, char *message, char *id) 
@@ -3494,6 +3789,12 @@ int allogsm_send_text(struct allogsm_modul *gsm, char *destination, char *messag
 
 	return res;
 }
+
+/* Without QUEUE_SMS every message is sent as soon as the span is ready, prio and flags are ignored */
+int allogsm_send_text_prio(struct allogsm_modul *gsm, char *destination, unsigned char *message, char *id, int prio)
+{
+	return allogsm_send_text(gsm, destination, message, id);
+}
 #endif
 
 static int __gsm_send_pdu(struct allogsm_modul *gsm, char *message)
@@ -3501,6 +3802,7 @@ static int __gsm_send_pdu(struct allogsm_modul *gsm, char *message)
 	return module_send_pdu(gsm, message);
 }
 
+#ifndef QUEUE_SMS
 static void gsm_resend_sms_pdu(void *info)
 {
 	sms_info_u *sms_info = info;
@@ -3523,6 +3825,7 @@ static void gsm_resend_sms_pdu(void *info)
 		__gsm_send_pdu(gsm, sms_info->pdu_info.message);
 	}
 }
+#endif
 
 /******************************************************************************
  * send pdu
@@ -3536,6 +3839,24 @@ static void gsm_resend_sms_pdu(void *info)
  *		allogsm_send_pdu(gsm, "0891683110808805F0040BA13140432789F300F1010112316435230BE8F71D14969741F9771D")
  ******************************************************************************/
 int allogsm_send_pdu(struct allogsm_modul *gsm,  char *message, unsigned char *text, char *id) 
+{
+	return allogsm_send_pdu_prio(gsm, message, text, id, ALLOGSM_SMS_PRIO_NORMAL);
+}
+
+/******************************************************************************
+ * send pdu in a priority lane
+ * param:
+ *		gsm: gsm module
+ *		message: pdu body
+ *		text: sms body for reporting, may be NULL
+ *		id: identification of this sms, may be NULL
+ *		prio: enum allogsm_sms_prio, may be or'ed with ALLOGSM_SMS_FAILOVER,
+ *			the lane is ignored without QUEUE_SMS
+ * return:
+ *		0: pdu sent or queued
+ *		-1: can not send pdu, the queue may be full
+ ******************************************************************************/
+int allogsm_send_pdu_prio(struct allogsm_modul *gsm, char *message, unsigned char *text, char *id, int prio)
 {
 	int res = -1;
 	sms_info_u *sms_info = NULL;	
@@ -3546,11 +3867,19 @@ int allogsm_send_pdu(struct allogsm_modul *gsm,  char *message, unsigned char *t
 		return res;
 	}	
 	
+#ifdef QUEUE_SMS
+	sms_info = QueueAlloc(gsm);
+	if (!sms_info) {
+		gsm_error(gsm, "SMS queue full on span %d, %d messages waiting\n", gsm->span, allogsm_sms_queue_depth(gsm));
+		return res;
+	}
+#else
 	sms_info = malloc(sizeof(sms_pdu_info_t));
 	if (!sms_info) {
 		gsm_error(gsm, "unable to malloc!\n");
 		return res;
 	}
+#endif
 
 	//id
 	if(id) {
@@ -3582,8 +3911,13 @@ int allogsm_send_pdu(struct allogsm_modul *gsm,  char *message, unsigned char *t
 	smsc_len = gsm_hex2int(smsc, 2);
 	len = (len / 2) - 1 - smsc_len;
 	sms_info->pdu_info.len = len;
+	sms_info->pdu_info.prio = prio & ALLOGSM_SMS_PRIO_MASK;
+	sms_info->pdu_info.flags = prio & ~ALLOGSM_SMS_PRIO_MASK;
 	if (gsm->dial_initiated)
 		gsm_message(gsm, "---------------here %d dial_initiated %d\n", __LINE__,gsm->dial_initiated);
+#ifdef QUEUE_SMS
+	res = gsm_queue_sms(gsm, sms_info, sms_info->pdu_info.prio, 1);
+#else
 	if ((ALLOGSM_STATE_READY != gsm->state) ||
 	    (gsm->dial_initiated == 1) ||
 	    ((gsm->creg_state!=CREG_1_REGISTERED_HOME) &&
@@ -3607,11 +3941,68 @@ int allogsm_send_pdu(struct allogsm_modul *gsm,  char *message, unsigned char *t
 		__gsm_send_pdu(gsm, sms_info->pdu_info.message);
 		res = 0;
 	}
+#endif
 
 	return res;
 }
 
 
+/******************************************************************************
+ * Rate a span for one more outgoing SMS
+ * param:
+ *		gsm: gsm module
+ * return:
+ *		>= 0: lower is better, SMS segments ahead of it first then signal quality
+ *		-1: span can't send now, not ready, not registered, dialing or no signal
+ * e.g.
+ *		pick the span with the lowest allogsm_sms_load() that isn't -1
+ ******************************************************************************/
+int allogsm_sms_load(struct allogsm_modul *gsm)
+{
+	int ahead;
+
+	if (!gsm || gsm->state < ALLOGSM_STATE_READY) {
+		return -1;
+	}
+	if ((gsm->creg_state != CREG_1_REGISTERED_HOME) &&
+	    (gsm->creg_state != CREG_5_REGISTERED_ROAMING)) {
+		return -1;
+	}
+	if (gsm->dial_initiated || gsm->coverage <= 0 || gsm->coverage > 31) {
+		return -1;
+	}
+
+	/* Anything but idle means a message or a call is on the air */
+	ahead = (gsm->state != ALLOGSM_STATE_READY);
+#ifdef QUEUE_SMS
+	ahead += allogsm_sms_queue_segments(gsm);
+#endif
+
+	return ahead * 32 + (31 - gsm->coverage);
+}
+
+/******************************************************************************
+ * Give back the message reported by ALLOGSM_EVENT_SMS_SEND_OK or
+ * ALLOGSM_EVENT_SMS_SEND_FAILED once the event is handled
+ * param:
+ *		gsm: gsm module
+ * return:
+ *		void
+ ******************************************************************************/
+void allogsm_sms_release(struct allogsm_modul *gsm)
+{
+	if (!gsm || !gsm->sms_info) {
+		return;
+	}
+
+#ifdef QUEUE_SMS
+	QueueRelease(gsm, gsm->sms_info);
+#else
+	free(gsm->sms_info);
+#endif
+	gsm->sms_info = NULL;
+}
+
 /******************************************************************************
  * send pin
  * param:
@@ -3631,122 +4022,185 @@ int allogsm_send_pin(struct allogsm_modul *gsm, char *pin)
 	return module_send_pin(gsm, pin);
 }
 
-int gsm_san(struct allogsm_modul *gsm, char *in, char *out, int len) 
+/* Byte k of the unread data in the sanbuf ring */
+#define SANBYTE(gsm, k)	((gsm)->sanbuf[((gsm)->sanhead + (k)) & ALLOGSM_SANBUF_MASK])
+
+/******************************************************************************
+ * Dump the unread bytes of the AT ring buffer
+ * param:
+ *		gsm: struct allogsm_modul
+ * return:
+ *		void
+ ******************************************************************************/
+void gsm_san_dump(struct allogsm_modul *gsm)
 {
-	int i=0;
+	int j;
+
+	for (j = 0; j < gsm->sanidx; j++) {
+		if ((SANBYTE(gsm, j) < 20) || (SANBYTE(gsm, j) > 127))
+			gsm_message(gsm, "0x%x", SANBYTE(gsm, j));
+		else
+			gsm_message(gsm, "%c", SANBYTE(gsm, j));
+	}
+	gsm_message(gsm, "\n<----\n");
+}
+
+/* Drop n bytes from the head of the ring */
+static void gsm_san_consume(struct allogsm_modul *gsm, int n)
+{
+	gsm->sanidx -= n;
+	if (gsm->sanidx <= 0) {
+		/* Empty, restart at offset 0 so following lines stay contiguous */
+		gsm->sanidx = 0;
+		gsm->sanhead = 0;
+	} else {
+		gsm->sanhead = (gsm->sanhead + n) & ALLOGSM_SANBUF_MASK;
+	}
+}
+
+/*
+ * Point at n unread bytes starting at off.  The line is terminated in place
+ * over its consumed '\r' when it doesn't wrap, otherwise it is copied out.
+ */
+static char *gsm_san_view(struct allogsm_modul *gsm, int off, int n, int inplace)
+{
+	unsigned int start = (gsm->sanhead + off) & ALLOGSM_SANBUF_MASK;
+	int first;
+
+	if (inplace && (start + n < ALLOGSM_SANBUF_SIZE)) {
+		/* Contiguous, terminate in place over the '\r' */
+		gsm->sanbuf[start + n] = '\0';
+		return gsm->sanbuf + start;
+	}
+
+	if (n > (int)sizeof(gsm->sanline) - 1) {
+		n = sizeof(gsm->sanline) - 1;
+	}
+	first = ALLOGSM_SANBUF_SIZE - start;
+	if (first > n) {
+		first = n;
+	}
+	memcpy(gsm->sanline, gsm->sanbuf + start, first);
+	memcpy(gsm->sanline + first, gsm->sanbuf, n - first);
+	gsm->sanline[n] = '\0';
+
+	return gsm->sanline;
+}
+
+/******************************************************************************
+ * Get the next AT line from the receive ring buffer
+ * param:
+ *		gsm: struct allogsm_modul
+ *		in: received data to append first (may be NULL if len is 0)
+ *		len: length of in
+ *		line: set to the NUL terminated line, valid until the next append
+ * return:
+ *		>0: length of the line
+ *		0: nothing left
+ *		-1: incomplete line, *line holds what we have so far
+ *		-3: blank line right after a +CMT text header
+ ******************************************************************************/
+int gsm_san_line(struct allogsm_modul *gsm, const char *in, int len, char **line)
+{
+	int i;
 	int skip=0;
-	char *tmp = NULL;
 	int skipEnd=0;
+	unsigned int tail;
+	int first;
+	char *tmp = NULL;
+
+	*line = gsm->sanline;
+	gsm->sanline[0] = '\0';
 
 	if ((len <= 0) && (gsm->sanidx <= 0)){
 		return 0;
 	}
 
-	int j;
 	if (gsm->debug & ALLOGSM_DEBUG_AT_DUMP){
-//	if (gsm->span==2){
-	gsm_message(gsm, "--------SAN BUF b4 (gsm->sanidx: %d) (len: %d)-->\n", gsm->sanidx, len); //pawan san
-		for (j = 0; j < gsm->sanidx ; j++) {
-		if ( (gsm->sanbuf[j]<20)||(gsm->sanbuf[j]>127) )
-			gsm_message(gsm, "0x%x", gsm->sanbuf[j]);
-		else
-			gsm_message(gsm, "%c", gsm->sanbuf[j]);
-		}
-		gsm_message(gsm, "\n<----\n");
+		gsm_message(gsm, "--------SAN BUF b4 (gsm->sanidx: %d) (len: %d)-->\n", gsm->sanidx, len); //pawan san
+		gsm_san_dump(gsm);
 	}
 
-	if ((len > 0) && ((gsm->sanidx + len < sizeof(gsm->sanbuf)))) {
-		memcpy(gsm->sanbuf + gsm->sanidx, in, len);
+	/* Keep one byte free so a line ending at the tail can be terminated */
+	if ((len > 0) && ((gsm->sanidx + len < ALLOGSM_SANBUF_SIZE))) {
+		tail = (gsm->sanhead + gsm->sanidx) & ALLOGSM_SANBUF_MASK;
+		first = ALLOGSM_SANBUF_SIZE - tail;
+		if (first > len) {
+			first = len;
+		}
+		memcpy(gsm->sanbuf + tail, in, first);
+		memcpy(gsm->sanbuf, in + first, len - first);
 		gsm->sanidx += len;
-		gsm->sanbuf[gsm->sanidx] = '\0';
-
-	if (gsm->debug & ALLOGSM_DEBUG_AT_DUMP)
-	//if (gsm->span==2)
-		gsm_message(gsm, "--------herer %d (%d) (%d)-->\n", __LINE__ , gsm->sanidx, len); //pawan san 
 	}
 
-	while ((gsm->sanbuf[i] == '\r') || (gsm->sanbuf[i] == '\n')) {
-		i++;
+	while ((skip < gsm->sanidx) && ((SANBYTE(gsm, skip) == '\r') || (SANBYTE(gsm, skip) == '\n'))) {
+		skip++;
 	}
-	skip = i;
 	gsm->sanskip = skip;
-	tmp = (char *)memchr(gsm->sanbuf + skip, '\r', gsm->sanidx - skip);
 
-	if (gsm->debug & ALLOGSM_DEBUG_AT_DUMP){
-	//if (gsm->span==2){
-	gsm_message(gsm, "--------SAN BUF(%d)-->\n", gsm->sanidx);
-		for (j = 0; j < gsm->sanidx ; j++) {
-		if ( (gsm->sanbuf[j]<20)||(gsm->sanbuf[j]>127) )
-			gsm_message(gsm, "0x%x", gsm->sanbuf[j]);
-		else
-			gsm_message(gsm, "%c", gsm->sanbuf[j]);
+	/* Look for the line end, the unread data is at most two segments */
+	for (i = skip; i < gsm->sanidx; i += first) {
+		unsigned int start = (gsm->sanhead + i) & ALLOGSM_SANBUF_MASK;
+		first = ALLOGSM_SANBUF_SIZE - start;
+		if (first > gsm->sanidx - i) {
+			first = gsm->sanidx - i;
+		}
+		if ((tmp = (char *)memchr(gsm->sanbuf + start, '\r', first))) {
+			i += tmp - (gsm->sanbuf + start);
+			break;
 		}
-		gsm_message(gsm, "\n<----\n");
 	}
-	if (tmp){
-		i = tmp - (gsm->sanbuf + skip);
-		memcpy(out, (gsm->sanbuf + skip), i);
-		out[i] = 0x0;
 
-		if ((gsm->sanidx >= skip + i + 2 ) && (gsm->sanbuf[skip+i] == '\r') && (gsm->sanbuf[skip+i+1] == '\n'))
+	if (gsm->debug & ALLOGSM_DEBUG_AT_DUMP){
+		gsm_message(gsm, "--------SAN BUF(%d)-->\n", gsm->sanidx);
+		gsm_san_dump(gsm);
+	}
+
+	if (tmp){
+		i -= skip;
+		if ((gsm->sanidx >= skip + i + 2 ) && (SANBYTE(gsm, skip + i + 1) == '\n'))
 			skipEnd = 2;
 
-		memmove(&gsm->sanbuf[0], &gsm->sanbuf[skip+i+skipEnd], sizeof(gsm->sanbuf) - i - skip - skipEnd);
-		gsm->sanidx = gsm->sanidx - (i + skip + skipEnd);
-/*
-		if (gsm->span==2){
-		gsm_message(gsm, "--------SAN BUF left(%d)-->\n", gsm->sanidx);
-			for (j = 0; j < gsm->sanidx ; j++) {
-			if ( (gsm->sanbuf[j]<20)||(gsm->sanbuf[j]>127) )
-				gsm_message(gsm, "0x%x", gsm->sanbuf[j]);
-			else
-				gsm_message(gsm, "%c", gsm->sanbuf[j]);
-			}
-			gsm_message(gsm, "\n<----\n");
-		}
-*/
+		/* A lone '\r' stays queued and is skipped next time, so don't clobber it */
+		*line = gsm_san_view(gsm, skip, i, skipEnd);
+		gsm_san_consume(gsm, skip + i + skipEnd);
+
 		return i;
 	} else {
-		if ((gsm->sanidx - skip == 2) && (gsm->sanbuf[gsm->sanidx - 2] == '>') && (gsm->sanbuf[gsm->sanidx - 1] == ' ')) {
+		if ((gsm->sanidx - skip == 2) && (SANBYTE(gsm, gsm->sanidx - 2) == '>') && (SANBYTE(gsm, gsm->sanidx - 1) == ' ')) {
 			/* for sim340dz and m20 */
-			out[0] = '>';
-			out[1] = ' ';
-			out[2] = 0x0;
-			gsm->sanidx = 0;
+			strcpy(gsm->sanline, "> ");
+			gsm_san_consume(gsm, gsm->sanidx);
 			return 2;
-		} else if ((gsm->sanidx - skip == 3) && (gsm->sanbuf[gsm->sanidx - 3] == '>') && (gsm->sanbuf[gsm->sanidx - 2] == ' ') && (gsm->sanbuf[gsm->sanidx - 1] == ' ')) {
+		} else if ((gsm->sanidx - skip == 3) && (SANBYTE(gsm, gsm->sanidx - 3) == '>') && (SANBYTE(gsm, gsm->sanidx - 2) == ' ') && (SANBYTE(gsm, gsm->sanidx - 1) == ' ')) {
 			/* for Sierra wireless HL modem on S500 board */
-			out[0] = '>';
-			out[1] = ' ';
-			out[2] = ' ';
-			out[3] = 0x0;
-			gsm->sanidx = 0;
+			strcpy(gsm->sanline, ">  ");
+			gsm_san_consume(gsm, gsm->sanidx);
 			return 3;
-		} else if ((gsm->sanidx - skip == 1) && (gsm->sanbuf[gsm->sanidx - 1] == '>')) {
+		} else if ((gsm->sanidx - skip == 1) && (SANBYTE(gsm, gsm->sanidx - 1) == '>')) {
 			/* for em200 */
-			out[0] = '>';
-			out[1] = 0x0;
-			gsm->sanidx = 0;
+			strcpy(gsm->sanline, ">");
+			gsm_san_consume(gsm, gsm->sanidx);
 			return 1;
-		} else if (0x0 == gsm->sanbuf[skip]) {
+		} else if (skip == gsm->sanidx) {
 			/* gsm->sanbuf = "\r\n" */
 			if (gsm->sanskip == 4 && gsm_compare(gsm->at_last_recv, "+CMT: \""))
 			{
-				out[0] = '\0';
 				return -3;
 			}
-			if (gsm->sanskip == gsm->sanidx)
-				gsm->sanidx=0;
-			gsm->sanskip = 0;
-			return 0;
-		} else if (gsm->sanskip == gsm->sanidx) {
-			gsm->sanidx = 0;
+			gsm_san_consume(gsm, gsm->sanidx);
 			gsm->sanskip = 0;
 			return 0;
 		} else {
+			/* Partial line stays queued, hand out a copy */
 			i = gsm->sanidx - skip;
-			memcpy(out, (gsm->sanbuf + skip), i);
-			out[i] = 0x0;
+			if (i > (int)sizeof(gsm->sanline) - 1) {
+				i = sizeof(gsm->sanline) - 1;
+			}
+			for (first = 0; first < i; first++) {
+				gsm->sanline[first] = SANBYTE(gsm, skip + first);
+			}
+			gsm->sanline[i] = '\0';
 			return -1;
 		}
 	}
@@ -3754,6 +4208,28 @@ int gsm_san(struct allogsm_modul *gsm, char *in, char *out, int len)
 	return 0;
 }
 
+/******************************************************************************
+ * Copying variant of gsm_san_line()
+ * param:
+ *		gsm: struct allogsm_modul
+ *		in: received data to append first
+ *		out: buffer receiving the line (1024 bytes)
+ *		len: length of in
+ * return:
+ *		same as gsm_san_line()
+ ******************************************************************************/
+int gsm_san(struct allogsm_modul *gsm, char *in, char *out, int len) 
+{
+	char *line;
+	int res;
+
+	res = gsm_san_line(gsm, in, len, &line);
+	strncpy(out, line, 1023);
+	out[1023] = '\0';
+
+	return res;
+}
+
 /*Makes Add 2012-4-9 14:01*/
 
 #ifdef CONFIG_CHECK_PHONE
@@ -4046,4 +4522,38 @@ char *allogsm_state2str(int state)
 	return "ALLOGSM STATE UNKNOW";
 }
 
+char *allogsm_sms_prio2str(int prio)
+{
+	switch(prio) {
+		case ALLOGSM_SMS_PRIO_HIGH:
+			return "high";
+		case ALLOGSM_SMS_PRIO_NORMAL:
+			return "normal";
+		case ALLOGSM_SMS_PRIO_BULK:
+			return "bulk";
+	}
+	return "unknown";
+}
+
+/******************************************************************************
+ * Parse an SMS priority name
+ * param:
+ *		str: "high" or "otp", "normal", "bulk" or "low", case ignored
+ * return:
+ *		enum allogsm_sms_prio, ALLOGSM_SMS_PRIO_NORMAL if str is empty or unknown
+ ******************************************************************************/
+int allogsm_str2sms_prio(const char *str)
+{
+	if (!str) {
+		return ALLOGSM_SMS_PRIO_NORMAL;
+	}
+	if (!strcasecmp(str, "high") || !strcasecmp(str, "otp")) {
+		return ALLOGSM_SMS_PRIO_HIGH;
+	}
+	if (!strcasecmp(str, "bulk") || !strcasecmp(str, "low")) {
+		return ALLOGSM_SMS_PRIO_BULK;
+	}
+	return ALLOGSM_SMS_PRIO_NORMAL;
+}
+
 
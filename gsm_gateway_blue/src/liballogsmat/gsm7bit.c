@@ -0,0 +1,477 @@
+/*
+ * liballogsmat: An implementation of ALLO GSM cards
+ *
+ * GSM 7 bit default alphabet, packing and unpacking of septets
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "liballogsmat.h"
+#include "gsm_internal.h"
+
+/*
+ * Characters are mapped with the tables below and the septets are packed
+ * eight at a time: eight septets are exactly seven octets, so each group is
+ * built in one 64 bit word and stored without carrying bits between groups.
+ * Nothing is allocated; the septets of one message are staged on the stack.
+ *
+ * allogsm_sms_classify() reads a UTF-8 text once and keeps the GSM 7 bit and
+ * the UCS2 segmentation side by side, so by the end it knows the charset,
+ * the size and where every segment starts without a second pass.
+ * allogsm_sms_classify_coding() does the same for a configured coding: GSM7,
+ * ASCII and UCS2 force that cut, other charsets are cut by iconv.
+ */
+
+/* Room of one segment, the encoder always adds the 6 octet concatenation UDH */
+#define GSM_SMS_SEGMENT_SEPTETS	153
+#define GSM_SMS_SEGMENT_OCTETS	134
+
+/* UTF-8 bytes one row of gsm_sms_pdu.message_split holds */
+#define GSM_SMS_SEGMENT_BYTES	255
+
+/* Septet of each byte, bytes outside the alphabet are sent as '?' */
+static const unsigned char gsm7_from_byte[256] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F,
+	0x20, 0x21, 0x22, 0x23, 0x02, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F,
+	0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
+	0x00, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
+	0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x5B, 0x5C, 0x5D, 0x5E, 0x11,
+	0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x6B, 0x6C, 0x6D, 0x6E, 0x6F,
+	0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x7B, 0x7C, 0x7D, 0x7E, 0x7F,
+	0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F,
+	0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F,
+	0x3F, 0x40, 0x3F, 0x01, 0x24, 0x03, 0x3F, 0x5F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F,
+	0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x60,
+	0x3F, 0x3F, 0x3F, 0x3F, 0x5B, 0x0E, 0x1C, 0x09, 0x3F, 0x1F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F, 0x3F,
+	0x3F, 0x5D, 0x3F, 0x3F, 0x3F, 0x3F, 0x5C, 0x3F, 0x0B, 0x3F, 0x3F, 0x3F, 0x5E, 0x3F, 0x3F, 0x1E,
+	0x7F, 0x3F, 0x3F, 0x3F, 0x7B, 0x0F, 0x1D, 0x3F, 0x04, 0x05, 0x3F, 0x3F, 0x07, 0x3F, 0x3F, 0x3F,
+	0x3F, 0x7D, 0x08, 0x3F, 0x3F, 0x3F, 0x7C, 0x3F, 0x0C, 0x06, 0x3F, 0x3F, 0x7E, 0x3F, 0x3F, 0x3F,
+};
+
+/* Escape table code of the bytes sent as ESC + code, 0 for the others */
+static const unsigned char gsm7_ext_from_byte[256] = {
+	['\f'] = 0x0A,
+	['^'] = 0x14,
+	['{'] = 0x28,
+	['}'] = 0x29,
+	['\\'] = 0x2F,
+	['['] = 0x3C,
+	['~'] = 0x3D,
+	[']'] = 0x3E,
+	['|'] = 0x40,
+};
+
+/* Byte of each septet, 0xFF where the alphabet has no byte */
+static const unsigned char gsm7_to_byte[128] = {
+	0x40, 0xA3, 0x24, 0xA5, 0xE8, 0xE9, 0xF9, 0xEC, 0xF2, 0xC7, 0x0A, 0xD8, 0xF8, 0x0D, 0xC5, 0xE5,
+	0xFF, 0x5F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xC6, 0xE6, 0xDF, 0xC9,
+	0x20, 0x21, 0x22, 0x23, 0xA4, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F,
+	0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
+	0xA1, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
+	0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0xC4, 0xD6, 0xD1, 0xDC, 0xA7,
+	0xBF, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x6B, 0x6C, 0x6D, 0x6E, 0x6F,
+	0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0xE4, 0xF6, 0xF1, 0xFC, 0xE0,
+};
+
+/* Byte of each escape table code, 0 for codes that are not used */
+static const unsigned char gsm7_ext_to_byte[128] = {
+	[0x0A] = '\f',
+	[0x14] = '^',
+	[0x28] = '{',
+	[0x29] = '}',
+	[0x2F] = '\\',
+	[0x3C] = '[',
+	[0x3D] = '~',
+	[0x3E] = ']',
+	[0x40] = '|',
+};
+
+/* Pack n septets into (7 * n + 7) / 8 octets, returns the octets written */
+static int gsm7_pack(const unsigned char *septet, int n, unsigned char *dst)
+{
+	uint64_t w;
+	int i, k, len = 0;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		w = (uint64_t)septet[i] |
+		    (uint64_t)septet[i + 1] << 7 |
+		    (uint64_t)septet[i + 2] << 14 |
+		    (uint64_t)septet[i + 3] << 21 |
+		    (uint64_t)septet[i + 4] << 28 |
+		    (uint64_t)septet[i + 5] << 35 |
+		    (uint64_t)septet[i + 6] << 42 |
+		    (uint64_t)septet[i + 7] << 49;
+		dst[len] = w;
+		dst[len + 1] = w >> 8;
+		dst[len + 2] = w >> 16;
+		dst[len + 3] = w >> 24;
+		dst[len + 4] = w >> 32;
+		dst[len + 5] = w >> 40;
+		dst[len + 6] = w >> 48;
+		len += 7;
+	}
+
+	if (i < n) {
+		w = 0;
+		for (k = 0; i + k < n; k++) {
+			w |= (uint64_t)septet[i + k] << (7 * k);
+		}
+		for (k = 0; k < (7 * (n - i) + 7) / 8; k++) {
+			dst[len++] = w >> (8 * k);
+		}
+	}
+
+	return len;
+}
+
+/* Unpack n septets from (7 * n + 7) / 8 octets */
+static void gsm7_unpack(const unsigned char *src, int n, unsigned char *septet)
+{
+	uint64_t w;
+	int i, k;
+
+	for (i = 0; i + 8 <= n; i += 8, src += 7) {
+		w = (uint64_t)src[0] |
+		    (uint64_t)src[1] << 8 |
+		    (uint64_t)src[2] << 16 |
+		    (uint64_t)src[3] << 24 |
+		    (uint64_t)src[4] << 32 |
+		    (uint64_t)src[5] << 40 |
+		    (uint64_t)src[6] << 48;
+		septet[i] = w & 0x7F;
+		septet[i + 1] = (w >> 7) & 0x7F;
+		septet[i + 2] = (w >> 14) & 0x7F;
+		septet[i + 3] = (w >> 21) & 0x7F;
+		septet[i + 4] = (w >> 28) & 0x7F;
+		septet[i + 5] = (w >> 35) & 0x7F;
+		septet[i + 6] = (w >> 42) & 0x7F;
+		septet[i + 7] = (w >> 49) & 0x7F;
+	}
+
+	if (i < n) {
+		w = 0;
+		for (k = 0; k < (7 * (n - i) + 7) / 8; k++) {
+			w |= (uint64_t)src[k] << (8 * k);
+		}
+		for (k = 0; i + k < n; k++) {
+			septet[i + k] = (w >> (7 * k)) & 0x7F;
+		}
+	}
+}
+
+/**
+ * \fn        int gsmEncode7bit(const char* pSrc, unsigned char* pDst, int nSrcLength, unsigned char* pUDLen)
+ * \brief     encode text as the user data of a concatenated SMS, the first
+ *            septet takes the 7 bits left after the 6 octet UDH
+ * \param  const char* pSrc
+ *             unsigned char* pDst
+ *                 int nSrcLength
+ *                 int *pUDLen   Set User Data len,7bit User Data
+ *                 length not equal to pDst length
+ * \return  the length of the pDst.
+ */
+int gsmEncode7bit(const char* pSrc, unsigned char* pDst, int nSrcLength, unsigned char* pUDLen)
+{
+	const unsigned char *src = (const unsigned char *)pSrc;
+	unsigned char septet[GSM_7BIT_MAX_SEPTETS];
+	unsigned char ext;
+	int i, n = 0;
+
+	for (i = 0; i < nSrcLength; i++) {
+		ext = gsm7_ext_from_byte[src[i]];
+		if (ext) {
+			if (n + 2 > GSM_7BIT_MAX_SEPTETS) {
+				break;
+			}
+			septet[n++] = 0x1B;
+			septet[n++] = ext;
+		} else {
+			if (n + 1 > GSM_7BIT_MAX_SEPTETS) {
+				break;
+			}
+			septet[n++] = gsm7_from_byte[src[i]];
+		}
+	}
+
+	*pUDLen = n; //Setting User Data length
+
+	if (n == 0) {
+		pDst[0] = 0;
+		return 1;
+	}
+
+	pDst[0] = septet[0] << 1;
+
+	return 1 + gsm7_pack(&septet[1], n - 1, &pDst[1]);
+}
+
+/**
+ * \fn        void gsm_to8Bit(unsigned char in[], unsigned char out[], int len, int flag)
+ * \brief     decode len septets of 7 bit user data, out is not terminated
+ * \param  unsigned char in[]   packed user data
+ *             unsigned char out[]  decoded text, escapes take one byte
+ *             int len              septets to decode
+ *             int flag             1 if the first septet follows one fill bit
+ */
+void gsm_to8Bit(unsigned char in[], unsigned char out[], int len, int flag)
+{
+	unsigned char septet[GSM_7BIT_MAX_SEPTETS];
+	unsigned char ext;
+	int j, k;
+
+	if (len <= 0) {
+		return;
+	}
+	if (len > GSM_7BIT_MAX_SEPTETS) {
+		len = GSM_7BIT_MAX_SEPTETS;
+	}
+
+	if (flag == 1) {
+		septet[0] = in[0] >> 1;
+		gsm7_unpack(&in[1], len - 1, &septet[1]);
+	} else {
+		gsm7_unpack(in, len, septet);
+	}
+
+	for (j = 0, k = 0; j < len; j++, k++) {
+		//Special character, two bytes mean one character.
+		if (septet[j] == 0x1B && j + 1 < len && (ext = gsm7_ext_to_byte[septet[j + 1]])) {
+			out[k] = ext;
+			j++;
+		} else {
+			out[k] = gsm7_to_byte[septet[j]];
+		}
+	}
+}
+
+/* Septets code point cp takes in GSM 7 bit, 0 if the alphabet lacks it */
+static int gsm7_width(unsigned int cp)
+{
+	if (cp > 0xFF) {
+		return 0;
+	}
+	if (gsm7_ext_from_byte[cp]) {
+		return 2;
+	}
+
+	/* Bytes without a septet map to '?', and a few ASCII codes to a septet of another character */
+	return gsm7_to_byte[gsm7_from_byte[cp]] == cp;
+}
+
+/* One segmentation of the text being classified */
+struct gsm_sms_cut {
+	int size;					/* Units of the current segment */
+	int bytes;					/* UTF-8 bytes of the current segment */
+	int units;
+	int segments;
+	int offset[ALLOGSM_SMS_MAX_SEGMENTS + 1];
+};
+
+/* Add a character of width units and len bytes found at byte pos */
+static void gsm_sms_cut_add(struct gsm_sms_cut *cut, int width, int len, int pos, int room)
+{
+	if (cut->size + width > room || cut->bytes + len > GSM_SMS_SEGMENT_BYTES) {
+		if (cut->segments <= ALLOGSM_SMS_MAX_SEGMENTS) {
+			cut->offset[cut->segments] = pos;
+		}
+		cut->segments++;
+		cut->size = 0;
+		cut->bytes = 0;
+	}
+	cut->size += width;
+	cut->bytes += len;
+	cut->units += width;
+}
+
+/* How a UTF-8 text is cut */
+enum gsm_sms_cut_mode {
+	GSM_SMS_CUT_AUTO,			/* GSM 7 bit if every character fits, else UCS2 */
+	GSM_SMS_CUT_GSM7,			/* GSM 7 bit, characters outside the alphabet as '?' */
+	GSM_SMS_CUT_BYTES,			/* GSM 7 bit, a septet for each byte past ASCII */
+	GSM_SMS_CUT_UCS2,
+};
+
+static int gsm_sms_plan_utf8(const unsigned char *text, struct allogsm_sms_plan *plan, int mode)
+{
+	struct gsm_sms_cut cut7, cut16;
+	struct gsm_sms_cut *cut;
+	unsigned int cp;
+	int i = 0, len, width, gsm7 = (mode != GSM_SMS_CUT_UCS2);
+
+	memset(&cut7, 0, sizeof(cut7));
+	memset(&cut16, 0, sizeof(cut16));
+	cut7.segments = cut16.segments = 1;
+
+	while (text[i]) {
+		/* A NUL ends any sequence, so no more than the text is read */
+		cp = gsm_utf8_next(&text[i], 4, &len);
+		gsm_sms_cut_add(&cut16, cp >= 0x10000 ? 4 : 2, len, i, GSM_SMS_SEGMENT_OCTETS);
+		if (gsm7) {
+			width = gsm7_width(cp);
+			if (mode == GSM_SMS_CUT_BYTES && cp >= 0x80) {
+				width = len;
+			} else if (!width && mode != GSM_SMS_CUT_AUTO) {
+				width = 1;
+			}
+			if (width) {
+				gsm_sms_cut_add(&cut7, width, len, i, GSM_SMS_SEGMENT_SEPTETS);
+			} else {
+				gsm7 = 0;
+			}
+		}
+		i += len;
+	}
+
+	cut = gsm7 ? &cut7 : &cut16;
+	if (cut->segments <= ALLOGSM_SMS_MAX_SEGMENTS) {
+		cut->offset[cut->segments] = i;
+	}
+
+	plan->coding = gsm7 ? "GSM7" : "UCS2";
+	plan->ucs2 = !gsm7;
+	plan->units = cut->units;
+	plan->segments = cut->segments;
+	memcpy(plan->offset, cut->offset, sizeof(plan->offset));
+
+	return cut->segments > ALLOGSM_SMS_MAX_SEGMENTS ? -1 : 0;
+}
+
+/* Text in another charset goes out as UCS2; iconv finds how much fits each segment */
+static int gsm_sms_plan_iconv(const unsigned char *text, const char *coding, struct allogsm_sms_plan *plan)
+{
+	int i = 0, len = strlen((const char *)text);
+	int n, room, used;
+
+	memset(plan, 0, sizeof(*plan));
+	plan->coding = coding;
+	plan->ucs2 = 1;
+
+	while (i < len) {
+		room = (len - i < GSM_SMS_SEGMENT_BYTES) ? len - i : GSM_SMS_SEGMENT_BYTES;
+		n = gsm_code_fit(coding, "UTF-16BE", (const char *)&text[i], room, GSM_SMS_SEGMENT_OCTETS, &used);
+		if (n <= 0) {
+			/* Unknown charset or not a text in it */
+			plan->segments = 0;
+			return -1;
+		}
+		if (plan->segments <= ALLOGSM_SMS_MAX_SEGMENTS) {
+			plan->offset[plan->segments] = i;
+		}
+		plan->segments++;
+		plan->units += used;
+		i += n;
+	}
+
+	if (!plan->segments) {
+		plan->segments = 1;
+	}
+	if (plan->segments <= ALLOGSM_SMS_MAX_SEGMENTS) {
+		plan->offset[plan->segments] = i;
+	}
+
+	return plan->segments > ALLOGSM_SMS_MAX_SEGMENTS ? -1 : 0;
+}
+
+/******************************************************************************
+ * Find how a text goes out: charset, size and segments
+ * param:
+ *		text: UTF-8, NUL terminated
+ *		plan: filled in; GSM 7 bit when every character is in the default
+ *			alphabet or its extension table, UCS2 otherwise
+ * return:
+ *		0: ok
+ *		-1: more than ALLOGSM_SMS_MAX_SEGMENTS segments, plan->segments holds
+ *			how many and plan->offset the first ALLOGSM_SMS_MAX_SEGMENTS
+ * e.g.
+ *		allogsm_sms_classify("Caf\xC3\xA9 {ok}", &plan) --> GSM7, 11 septets, 1 segment
+ ******************************************************************************/
+int allogsm_sms_classify(const unsigned char *text, struct allogsm_sms_plan *plan)
+{
+	return gsm_sms_plan_utf8(text, plan, GSM_SMS_CUT_AUTO);
+}
+
+/******************************************************************************
+ * Find how a text goes out in the coding a span is configured with
+ * param:
+ *		text: NUL terminated, in coding
+ *		coding: as for allogsm_encode_pdu_ucs2(); NULL, "" or "auto" to let
+ *			allogsm_sms_classify() choose, as it does for UTF-8 too
+ *		plan: filled in; plan->coding is what to encode the parts with, GSM7,
+ *			UCS2 or coding itself for ASCII and other charsets
+ * return:
+ *		0: ok
+ *		-1: more than ALLOGSM_SMS_MAX_SEGMENTS segments, or a charset iconv
+ *			doesn't know or the text isn't in (plan->segments 0)
+ * e.g.
+ *		allogsm_sms_classify_coding(msg, "GB2312", &plan) --> UCS2, cut between characters
+ ******************************************************************************/
+int allogsm_sms_classify_coding(const unsigned char *text, const char *coding, struct allogsm_sms_plan *plan)
+{
+	char name[64];
+	int i;
+
+	if (!coding || !coding[0] || !strcasecmp(coding, "auto")) {
+		return gsm_sms_plan_utf8(text, plan, GSM_SMS_CUT_AUTO);
+	}
+
+	/* Same names the encoder tells apart */
+	for (i = 0; coding[i] && i < (int)sizeof(name) - 1; i++) {
+		name[i] = toupper((unsigned char)coding[i]);
+	}
+	name[i] = '\0';
+
+	if (!strcmp(name, "GSM7")) {
+		return gsm_sms_plan_utf8(text, plan, GSM_SMS_CUT_GSM7);
+	} else if (!strcmp(name, "UCS2")) {
+		return gsm_sms_plan_utf8(text, plan, GSM_SMS_CUT_UCS2);
+	} else if (strstr(name, "UTF-8") || !strcmp(name, "UTF8")) {
+		return gsm_sms_plan_utf8(text, plan, GSM_SMS_CUT_AUTO);
+	} else if (strstr(name, "ASCII")) {
+		i = gsm_sms_plan_utf8(text, plan, GSM_SMS_CUT_BYTES);
+		plan->coding = coding;
+		return i;
+	}
+
+	return gsm_sms_plan_iconv(text, coding, plan);
+}
+
+/******************************************************************************
+ * Split a text into the parts of a long SMS as planned
+ * param:
+ *		text: the text given to allogsm_sms_classify()
+ *		plan: from allogsm_sms_classify() or allogsm_sms_classify_coding()
+ *		long_pdu: parts filled in, part_num is left alone
+ * return:
+ *		0: ok
+ *		-1: the plan has too many segments
+ * e.g.
+ *		if (!allogsm_sms_classify(msg, &plan) && !allogsm_sms_plan_split(msg, &plan, &long_pdu))
+ *			allogsm_encode_pdu_ucs2(smsc, dest, long_pdu.message_split[0], plan.coding, &long_pdu, pdu);
+ ******************************************************************************/
+int allogsm_sms_plan_split(const unsigned char *text, const struct allogsm_sms_plan *plan, gsm_sms_pdu *long_pdu)
+{
+	int part, len;
+
+	if (plan->segments < 1 || plan->segments > ALLOGSM_SMS_MAX_SEGMENTS) {
+		return -1;
+	}
+
+	for (part = 0; part < plan->segments; part++) {
+		len = plan->offset[part + 1] - plan->offset[part];
+		memcpy(long_pdu->message_split[part], &text[plan->offset[part]], len);
+		long_pdu->message_split[part][len] = '\0';
+	}
+	long_pdu->total_parts = plan->segments;
+
+	return 0;
+}
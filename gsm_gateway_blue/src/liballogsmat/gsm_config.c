@@ -1,4 +1,6 @@
 #include "gsm_config.h"
+#include "liballogsmat.h"
+#include "gsm_internal.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +12,9 @@
 static struct cfg_info* cfg_head = NULL;
 static int cfg_len = 0;
 
+struct expect_list list[100];
+unsigned int MAX_EXPECTLIST_SIZE;
+
 struct at_cmd_t {
 	int id;
 	const char* name;
@@ -111,6 +116,11 @@ struct at_cmd_t at_cmds[] = {
 	{AT_SIM_SELECT_3,	     "AT_SIM_SELECT_3",            "AT+WIOM=4"},
 	{AT_SET_GAIN_INDEX,	     "AT_SET_GAIN_INDEX",          "AT+WBHV=8,0"},
 	{AT_DEL_MSG,                 "AT_DEL_MSG",                 "AT+CMGD=1,4"},	
+	{AT_LIST_UNREAD_MSG,         "AT_LIST_UNREAD_MSG",         "AT+CMGL=0"},
+	{AT_DEL_READ_MSG,            "AT_DEL_READ_MSG",            "AT+CMGD=1,1"},
+	{AT_GET_MSG_STORE,           "AT_GET_MSG_STORE",           "AT+CPMS?"},
+	{AT_SMS_CHUNK_SIZE,          "AT_SMS_CHUNK_SIZE",          "32"},
+	{AT_SMS_CHUNK_GAP,           "AT_SMS_CHUNK_GAP",           "3"},
 	{AT_SEND_USSD,               "AT_SEND_USSD",               "AT+CUSD=1,\"$USSD_CODE\""},
 	{AT_CHECK_USSD,              "AT_CHECK_USSD",              "+CUSD:"},	
 	{AT_CHECK_BAUD,              "AT_CHECK_BAUD",              "AT+IPR/"},	
@@ -369,14 +379,9 @@ const char* get_at(int module_id, int cmds_id)
  *              expectlist_compare("abc")               => 1
  ******************************************************************************/
 int expectlist_compare (char *buf){
-        int i=0, ret=1;
-        for (i=0;i<MAX_EXPECTLIST_SIZE;++i){
- //               printf("i=%d val= %s \n", i, list[i].value);
-                ret = NULL==strstr(buf, list[i].value) ? 1 : 0;
-                if(!ret)
-                        return ret;
-        }
-       // printf("+++++++++++expectlist buf= %s \n",buf);
+        /* One pass over buf through the automaton built by gsm_token_init() */
+        if (gsm_match_line(buf, GSM_MATCH_EXPECT) & GSM_MATCH_EXPECT)
+                return 0;
         return 1;
 }
 #endif
@@ -661,7 +666,7 @@ int alloinit_cfg_file(void)
         if ( file != NULL ){
                 char line[25];
                 int j=0;
-                while ( fgets(line, 25, file) != NULL ) /* read all records */
+                while ( j < sizeof(list) / sizeof(list[0]) && fgets(line, 25, file) != NULL ) /* read all records */
                 {
                         line[strlen(line) - 1]='\0';
                         strcpy(list[j].value, line);
@@ -669,12 +674,14 @@ int alloinit_cfg_file(void)
                 }
                 MAX_EXPECTLIST_SIZE=j;
                 fclose(file);
+                gsm_token_init();
                 return 0;
         }else{
                 printf("Can not Open expectinglist.conf\n");
         }
 
 #endif
+	gsm_token_init();
 	return 1;
 }
 
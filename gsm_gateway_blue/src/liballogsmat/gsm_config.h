@@ -94,6 +94,12 @@ enum AT_CMDS {
 	AT_CREG_DISABLE,
 	AT_SET_GAIN_INDEX,
 	AT_DEL_MSG,
+	AT_LIST_UNREAD_MSG,		/* List the unread stored messages, marking them read */
+	AT_DEL_READ_MSG,		/* Delete every read stored message */
+	AT_GET_MSG_STORE,		/* Used and total of the message storage */
+/*** SMS body transmission ********/
+	AT_SMS_CHUNK_SIZE,		/* Bytes per D-channel frame */
+	AT_SMS_CHUNK_GAP,		/* ms between frames, 3 as always by default, 0 to write as fast as the driver takes them */
 /*** SIM Selection****************/
 	AT_SIM_SELECT_1,
 	AT_SIM_SELECT_2,
@@ -113,11 +119,13 @@ struct cfg_info {
 
 struct expect_list{
         char value[25];
-}list[100];
-unsigned int MAX_EXPECTLIST_SIZE;
+};
+extern struct expect_list list[100];
+extern unsigned int MAX_EXPECTLIST_SIZE;
 
 int alloinit_cfg_file(void);
 int allodestroy_cfg_file(void);
+int gsm_token_init(void);
 
 int expectlist_compare (char *buf);
 const char* get_at(int module_id, int cfg_id);
@@ -289,13 +289,21 @@ struct msgtype {
  */
  
 extern int gsm_schedule_check(struct allogsm_modul *gsm);
+
+extern int gsm_schedule_room(struct allogsm_modul *gsm, int n);
  
 extern int gsm_schedule_event(struct allogsm_modul *gsm, int ms, void (*function)(void *data), void *data);
 
+extern int gsm_schedule_event_lTime(struct allogsm_modul *gsm, long int ms, void (*function)(void *data), void *data);
+
 extern allogsm_event *allogsm_schedule_run(struct allogsm_modul *gsm);
 
 extern void gsm_schedule_del(struct allogsm_modul *gsm, int ev);
 
+extern void gsm_schedule_init(struct allogsm_modul *gsm);
+
+extern void gsm_schedule_destroy(struct allogsm_modul *gsm);
+
 /*
  * from gsm.c
  */
@@ -312,6 +320,7 @@ extern void gsm_dump(struct allogsm_modul *gsm, const char *h, int len, int txrx
 
 //Freedom Add 2010-10-10 16:03
 extern int gsm_send_at(struct allogsm_modul *gsm, const char *at);
+extern int __gsm_send_at(struct allogsm_modul *gsm, const char *at);
 extern int gsm_transmit(struct allogsm_modul *gsm, const char *at);
 
 extern int gsm_transmit_data(struct allogsm_modul *gsm, const char *data, int len);
@@ -350,8 +359,6 @@ extern int gsm_switch_state(struct allogsm_modul *gsm, int state, const char *ne
 	
 extern int gsm_switch_sim_state(struct allogsm_modul *gsm, int state, char *next_command);
 
-extern unsigned long gsm_hex2int(const char *hex, int len);
-
 extern int gsm_pdu2sm_event(struct allogsm_modul *gsm, char *pdu);
 
 extern int gsm_ussd_event(struct allogsm_modul *gsm, char *ussd) ;
@@ -361,6 +368,42 @@ extern int sms_get_str(struct allogsm_modul *gsm,char *in, size_t inlen, char *o
 
 extern int sms_set_str(char *in, char *out);
 
+/*
+ * from gsm7bit.c
+ */
+/* Septets one PDU can carry after the UDH, also the decoding limit */
+#define GSM_7BIT_MAX_SEPTETS	280
+
+extern int gsmEncode7bit(const char* pSrc, unsigned char* pDst, int nSrcLength, unsigned char* pUDLen);
+
+extern void gsm_to8Bit(unsigned char in[], unsigned char out[], int len, int flag);
+
+/*
+ * from gsmhex.c
+ */
+extern int gsm_hex_encode(const unsigned char *src, int len, char *dst);
+
+extern int gsm_hex_decode(const char *src, int len, unsigned char *dst);
+
+extern unsigned long gsm_hex2int(const char *hex, int len);
+
+extern const char *gsm_hex_impl(void);
+
+/*
+ * from gsmucs2.c
+ */
+extern int gsm_ucs2_to_utf8(const unsigned char *in, int inlen, char *out, int outlen);
+
+extern unsigned int gsm_utf8_next(const unsigned char *in, int inlen, int *len);
+
+extern int gsm_utf8_to_ucs2(const unsigned char *in, int inlen, unsigned char *out, int outlen);
+
+extern int gsm_utf8_to_latin1(const unsigned char *in, int inlen, char *out, int outlen);
+
+extern int gsm_code_convert(const char *from_charset, const char *to_charset, char *inbuf, size_t inlen, char *outbuf, size_t outlen);
+
+extern int gsm_code_fit(const char *from_charset, const char *to_charset, const char *inbuf, size_t inlen, size_t outlen, int *used);
+
 extern int gsm_text2sm_event(struct allogsm_modul *gsm, char *sms_info);
 extern int gsm_text2sm_event2(struct allogsm_modul *gsm, char *sms_info, char *sms_body);
 
@@ -372,6 +415,153 @@ extern enum sms_mode gsm_check_sms_mode(struct allogsm_modul *gsm, char *sms_inf
 
 extern int gsm_san(struct allogsm_modul *gsm, char *in, char *out, int len);
 
+extern int gsm_san_line(struct allogsm_modul *gsm, const char *in, int len, char **line);
+
+extern void gsm_san_dump(struct allogsm_modul *gsm);
+
+/*
+ * from gsm_token.c
+ */
+
+/* Line classes reported by gsm_classify_line(), at most 32 (token masks) */
+enum gsm_token {
+	GSM_TOKEN_NONE = 0,
+	GSM_TOKEN_OK,
+	GSM_TOKEN_ERROR,
+	GSM_TOKEN_CME_ERROR,
+	GSM_TOKEN_CMS_ERROR,
+	GSM_TOKEN_CREG,
+	GSM_TOKEN_CMT,
+	GSM_TOKEN_CMGS,
+	GSM_TOKEN_CLIP,
+	GSM_TOKEN_RING,
+	GSM_TOKEN_CUSD,
+	GSM_TOKEN_CSQ,
+	GSM_TOKEN_CSQN,
+	GSM_TOKEN_COPS,
+	GSM_TOKEN_NO_CARRIER,
+	GSM_TOKEN_NO_ANSWER,
+	GSM_TOKEN_NO_DIALTONE,
+	GSM_TOKEN_BUSY,
+	GSM_TOKEN_MO_CONNECTED,
+	GSM_TOKEN_CPIN,
+	GSM_TOKEN_WIND,
+	GSM_TOKEN_WBCI,
+	GSM_TOKEN_CCWA,
+	GSM_TOKEN_PSCSC,
+	GSM_TOKEN_PROMPT,
+	GSM_TOKEN_CMTI,
+	GSM_TOKEN_CMGL,
+	GSM_TOKEN_CPMS,
+	GSM_TOKEN_SUM
+};
+
+#define GSM_TOKEN_MASK(t)	(1 << (t))
+
+/* Line module_receive is handling contains response t, like gsm_compare() */
+#define gsm_line_is(gsm, t)	((gsm)->line_found & GSM_TOKEN_MASK(t))
+
+extern int gsm_classify_line(const char *line, unsigned int *tokens);
+
+extern unsigned int gsm_search_line(const char *line);
+
+/* Pattern sets reported by gsm_match_line() */
+#define GSM_MATCH_EXPECT	(1 << 0)	/* Line contains an expectlist.conf entry */
+#define GSM_MATCH_JUNK		(1 << 1)	/* Unsolicited line module_receive ignores */
+
+extern unsigned int gsm_match_line(const char *line, unsigned int stop);
+
+#ifdef QUEUE_SMS
+/*
+ * from gsmqueue.c
+ */
+
+extern queueADT QueueCreate(void);
+
+extern void QueueDestroy(queueADT queue);
+
+extern int QueueIsEmpty(queueADT queue);
+
+extern sms_info_u *QueueAlloc(struct allogsm_modul *gsm);
+
+extern void QueueRelease(struct allogsm_modul *gsm, sms_info_u *sms_info);
+
+extern int QueueEnter(struct allogsm_modul *gsm, sms_info_u *sms_info, int prio, int pdu);
+
+extern sms_info_u *QueueDelete(struct allogsm_modul *gsm, int *pdu);
+
+extern sms_info_u *QueueFront(queueADT queue);
+#endif
+
+/*
+ * from gsmatqueue.c
+ */
+
+#define GSM_AT_QUEUE_MAX	32		/* Commands waiting per span */
+#define GSM_AT_TIMEOUT		5000	/* Default deadline for a final result, ms */
+#define GSM_AT_RAW_TIMEOUT	30000	/* ms the queue waits for a command written around it */
+
+/* Final results that complete a command unless the caller asks otherwise */
+#define GSM_AT_FINALS	(GSM_TOKEN_MASK(GSM_TOKEN_OK) | GSM_TOKEN_MASK(GSM_TOKEN_ERROR) | \
+						 GSM_TOKEN_MASK(GSM_TOKEN_CME_ERROR) | GSM_TOKEN_MASK(GSM_TOKEN_CMS_ERROR) | \
+						 GSM_TOKEN_MASK(GSM_TOKEN_NO_CARRIER))
+
+struct gsm_at_cmd {
+	struct gsm_at_cmd *next;
+	char at[256];			/* Command without CR LF */
+	unsigned int finals;	/* GSM_TOKEN_MASK of lines that complete the command */
+	unsigned int infos;		/* GSM_TOKEN_MASK of lines passed to info before that */
+	int timeout;			/* ms to wait for a final result after each write */
+	int retries;			/* Writes left after a timeout */
+	int sent;				/* Written and waiting for its final result */
+	/* Intermediate line, e.g. +CSQ: 20,0 */
+	void (*info)(struct allogsm_modul *gsm, struct gsm_at_cmd *cmd, const char *line);
+	/* Final result, token GSM_TOKEN_NONE and line NULL on timeout */
+	void (*done)(struct allogsm_modul *gsm, struct gsm_at_cmd *cmd, int token, const char *line);
+	void *data;
+};
+
+extern struct gsm_at_cmd *gsm_at_cmd_new(struct allogsm_modul *gsm, const char *at);
+
+extern int gsm_at_queue(struct allogsm_modul *gsm, struct gsm_at_cmd *cmd);
+
+extern void gsm_at_queue_kick(struct allogsm_modul *gsm);
+
+extern int gsm_at_queue_response(struct allogsm_modul *gsm, const char *line);
+
+extern void gsm_at_raw_sent(struct allogsm_modul *gsm);
+
+extern void gsm_at_queue_destroy(struct allogsm_modul *gsm);
+
+
+/*
+ * from gsmcount.c
+ */
+extern void gsm_count_release(struct allogsm_modul *gsm);
+
+/*
+ * from gsmstore.c
+ */
+extern void gsm_store_check(struct allogsm_modul *gsm);
+
+extern allogsm_event *gsm_store_indication(struct allogsm_modul *gsm, struct alloat_call *call, char *buf, int i);
+
+/*
+ * from gsmjournal.c
+ */
+struct gsm_journal {
+	char dir[256];				/* <dir>/<span> */
+	int span;
+	int seg_fd;					/* Newest segment, appended to */
+	int index_fd;
+	unsigned int segment;		/* Number of the newest segment */
+	unsigned int first;			/* Number of the oldest segment kept */
+	off_t seg_size;
+	off_t max_size;				/* Bytes of a segment before the next is started */
+	unsigned int max_segments;	/* Segments kept */
+	int pending;				/* Records written since the last sync */
+	int sync_sched;				/* Timer of the next sync, 0 if none */
+};
 
 //Freedom Add 2012-01-29 15:48
 extern char* pdu_get_send_number(const char* pdu, char* number, int len);
@@ -362,34 +362,6 @@ char *remove_all_chars(char* str, char c) {
 }
 
 #if 1
-static void allogsm_update_count(struct allogsm_modul *gsm, int status)
-{
-        char filename[128]="/mnt/smsout_count/";
-	int count = 0;
-        char name[64];
-        sprintf(name,"%s/%s", status == SENT_SUCCESS ? "success": "fail", gsm->sms_info->pdu_info.id);
-        strcat(filename, name);
-
-        FILE *f=fopen(filename, "a+");
-
-        if (!f) {
-                printf("Error: Cannot open the file for count update (%s) error (%s)\n",filename, strerror(errno));
-                return;
-        }
-        fscanf(f, "%d", &count); /* Read count value here */
-
-        if (freopen(filename, "w+", f) == NULL)
-        {
-                printf("Error: Cannot open the file for count update (%s) error (%s)\n",filename, strerror(errno));
-                return;
-        }
-
-        fprintf(f, "%d", count+1); /* Write New count here */
-
-        fclose(f);
-	// system("/bin/sync");
-	sync();
-}
 static void allogsm_save_sms(struct allogsm_modul *gsm, int status)
 {
         char filename[128]="/mnt/";
@@ -419,8 +391,6 @@ static void allogsm_save_sms(struct allogsm_modul *gsm, int status)
 	}else
 		printf("Unknown msg type %s %d", __func__, __LINE__);
         fclose(f);
-//	system("/bin/sync");
-	sync();
 }
 #endif
 static int parse_callforward(struct allogsm_modul *gsm,const char* response)
@@ -531,7 +501,7 @@ static int parse_ussd_code(struct allogsm_modul *gsm,const char* ussd_code)
 	return response_type;
 }
 
-static allogsm_event *module_check_safe_at(struct allogsm_modul *gsm, char *buf, int i){
+static allogsm_event *module_check_safe_at(struct allogsm_modul *gsm, struct alloat_call *call, char *buf, int i){
 	int response_type;
 	if(gsm->state != ALLOGSM_STATE_SAFE_AT)
 		return NULL;
@@ -574,7 +544,7 @@ static allogsm_event *module_check_safe_at(struct allogsm_modul *gsm, char *buf,
 		return NULL;
 }
 
-static allogsm_event *module_check_operator_list_query(struct allogsm_modul *gsm, char *buf, int i)
+static allogsm_event *module_check_operator_list_query(struct allogsm_modul *gsm, struct alloat_call *call, char *buf, int i)
 {
 	int response_type;
 	if(gsm->state != ALLOGSM_STATE_OPERATOR_QUERY)
@@ -612,7 +582,7 @@ static allogsm_event *module_check_operator_list_query(struct allogsm_modul *gsm
 	return NULL;
 }
 
-static allogsm_event *module_check_ussd(struct allogsm_modul *gsm, char *buf, int i)
+static allogsm_event *module_check_ussd(struct allogsm_modul *gsm, struct alloat_call *call, char *buf, int i)
 {
 	int response_type;
 
@@ -722,19 +692,24 @@ int updateSmsStatus( struct allogsm_modul *gsm, int status){
 		allogsm_save_sms(gsm);
 	}
 #else
-	allogsm_update_count(gsm, status);
+	/* Counted in memory, written back by gsmcount.c.  A failed ALLOGSM_SMS_FAILOVER
+	   SMS is counted by the sender, which knows whether it is retried */
+	if (status == SENT_SUCCESS || !(gsm->sms_info->pdu_info.flags & ALLOGSM_SMS_FAILOVER)) {
+		allogsm_count_add(gsm, gsm->sms_info->pdu_info.id, status == SENT_SUCCESS, status != SENT_SUCCESS);
+	}
 
 	allogsm_save_sms(gsm, status);
 #endif
 	return 0;
 }
-static allogsm_event *module_check_sms(struct allogsm_modul *gsm, char *buf, int i)
+static allogsm_event *module_check_sms(struct allogsm_modul *gsm, struct alloat_call *call, char *buf, int i)
 {
 	int res;
 	int compare1;
 	int compare2;
 	char sms_buf[1024],fun[256];
 	char cmt_buf[1024];
+	char *sms_line;
 	int len;	
 	char sms_end[5];
 	sprintf(sms_end, "%c", 0x1A);
@@ -746,8 +721,9 @@ static allogsm_event *module_check_sms(struct allogsm_modul *gsm, char *buf, int
 		strcpy(cmt_buf, buf);
 		gsm_message(gsm,"cmt_buf %s\n",cmt_buf);
 		strcat(cmt_buf, "\r\n");
-		len = gsm_san(gsm, gsm->at_last_recv, buf, 0);
-		strcat(cmt_buf, buf);
+		/* The PDU/text body is the next queued line */
+		len = gsm_san_line(gsm, NULL, 0, &sms_line);
+		strncat(cmt_buf, sms_line, sizeof(cmt_buf) - strlen(cmt_buf) - 3);
 		strcat(cmt_buf, "\r\n");
 		gsm_message(gsm,"cmt_buf %s\n",cmt_buf);
 		gsm_message(gsm,"gsm->sanidx %d at_last_recv_idx:%d smslen:%d \n",gsm->sanidx,gsm->at_last_recv_idx, strlen(cmt_buf));
@@ -1121,7 +1097,7 @@ static allogsm_event * module_check_network(struct allogsm_modul *gsm, struct al
 		return NULL;
 	}
 
-	if (gsm_compare(buf, get_at(gsm->switchtype,AT_CHECK_SIGNAL1))){
+	if (gsm_line_is(gsm, GSM_TOKEN_CSQ)){
 		module_get_coverage(gsm, buf);
                 if (gsm->coverage < 1) {
                         gsm->ev.gen.e = ALLOGSM_EVENT_NO_SIGNAL;
@@ -1131,7 +1107,7 @@ static allogsm_event * module_check_network(struct allogsm_modul *gsm, struct al
                         gsm_switch_state(gsm, ALLOGSM_STATE_READY, NULL);
                 }
                 return &gsm->ev;
-	} else if (gsm_compare(buf, get_at(gsm->switchtype,AT_CREG))) {
+	} else if (gsm_line_is(gsm, GSM_TOKEN_CREG)) {
 		/*
 			0 not registered, ME is not currently searching a new operator to register to
 			1 registered, home network
@@ -1193,7 +1169,7 @@ static allogsm_event * module_check_network(struct allogsm_modul *gsm, struct al
     		gsm->net_name[0]	= 0x0;
 */
 		}
-	} else if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+	} else if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 		if (((2 == i) && (gsm_compare(gsm->at_last_recv, get_at(gsm->switchtype,AT_CHECK_SIGNAL1))))
 			  || ((1 == i) && (gsm_compare(gsm->at_pre_recv, get_at(gsm->switchtype,AT_CHECK_SIGNAL1))))) {
 			/*	
@@ -1220,7 +1196,7 @@ static allogsm_event * module_check_network(struct allogsm_modul *gsm, struct al
 				return &gsm->ev;	
 			}*/
 		}
-	} else if (gsm_compare(buf, get_at(gsm->switchtype,AT_CHECK_SIGNAL2))) {
+	} else if (gsm_line_is(gsm, GSM_TOKEN_CSQN)) {
 		module_get_coverage(gsm, buf);
 //		gsm_transmit(gsm, "AT+CREG?\r\n"); /* Req Net Status */
 		if (gsm->coverage < 1) {
@@ -1262,15 +1238,40 @@ int module_mux_end(struct allogsm_modul *gsm, int restart_at_flow)
 }
 #endif //VIRTUAL_TTY
 
+/*
+ * Lines the state switch in module_receive did not consume are offered to
+ * these handlers in order.  A handler only runs when the span is in state
+ * (-1 for any state) and the line contains one of tokens (0 for any line).
+ */
+struct module_line_handler {
+	int state;
+	unsigned int tokens;
+	allogsm_event *(*handler)(struct allogsm_modul *gsm, struct alloat_call *call, char *buf, int i);
+};
+
+static const struct module_line_handler module_line_handlers[] = {
+	{ -1,								0,	module_check_sms },
+	{ -1,		GSM_TOKEN_MASK(GSM_TOKEN_CMTI),	gsm_store_indication },
+	{ ALLOGSM_STATE_READY,				0,	module_check_network },
+	{ ALLOGSM_STATE_NET_REQ,			0,	module_check_network },
+	{ ALLOGSM_STATE_NET_NAME_REQ,		0,	module_check_network },
+	{ ALLOGSM_STATE_USSD_SENDING,
+		GSM_TOKEN_MASK(GSM_TOKEN_CUSD) | GSM_TOKEN_MASK(GSM_TOKEN_CMS_ERROR) |
+		GSM_TOKEN_MASK(GSM_TOKEN_NO_CARRIER) | GSM_TOKEN_MASK(GSM_TOKEN_CME_ERROR),
+											module_check_ussd },
+	{ ALLOGSM_STATE_OPERATOR_QUERY,		0,	module_check_operator_list_query },
+	{ ALLOGSM_STATE_SAFE_AT,			0,	module_check_safe_at },
+};
+
 allogsm_event *module_receive(struct allogsm_modul *gsm, char *data, int len)
 {
 	struct alloat_call *call;
-	char buf[1024];
-	char receivebuf[1024];
-	char *p;
+	char *buf;
+	char clip_buf[64];
 	allogsm_event* res_event=NULL;
 	int i;
 	int j;
+	int h;
 	//Freedom Add 2012-02-07 15:24
 	/////////////////////////////////////////////////////////
 #if SIMCOM900D_NO_ANSWER_BUG
@@ -1286,13 +1287,11 @@ allogsm_event *module_receive(struct allogsm_modul *gsm, char *data, int len)
 		return NULL;
 	}
 
-	strncpy(receivebuf, data, sizeof(receivebuf));
-	p = receivebuf;
 	i = 0;
 
 	while (1) {
 received_junk_parse_next:	
-		len = gsm_san(gsm, p, buf, len);
+		len = gsm_san_line(gsm, data, len, &buf);
 		if (0 == len || -1 == len) {
 			return NULL;
 		}
@@ -1314,26 +1313,33 @@ received_junk_parse_next:
 
 		}
 	
-		strncpy(p, gsm->sanbuf, sizeof(receivebuf));
-		len = (-3 == len) ? 0: gsm->sanidx;
-//		gsm->sanidx = 0;
+		/* Remaining lines are still queued in sanbuf */
 		len=0;
+		gsm->line_token = gsm_classify_line(buf, &gsm->line_tokens);
+		gsm->line_found = gsm_search_line(buf);
 /*********** Ignore few responces.. Mostly unsolicited 
 		Make it proper.. right now ignoring in begning***************/
-		if (gsm_compare(buf,"+WBCI")) {
+		if (gsm_match_line(buf, GSM_MATCH_JUNK) & GSM_MATCH_JUNK) {
 			goto received_junk_parse_next;
 		}
 /*******************************************/
-		if(gsm_compare(buf, "+CME ERROR: 515")) {
+		if(gsm_line_is(gsm, GSM_TOKEN_CME_ERROR) && gsm_compare(buf, "+CME ERROR: 515")) {
 			gsm->CME_515_count++;
 		}
+		if (gsm_at_queue_response(gsm, buf)) {
+			if (gsm->at_event) {
+				gsm->at_event = 0;
+				return &gsm->ev;
+			}
+			goto received_junk_parse_next;
+		}
 #ifdef WAVECOM
 		res_event = module_check_wind(gsm, call ,buf, i);
 		if (res_event) {
 			return res_event;
 		}
 /*
-		if (gsm_compare(buf, "+CREG: ")) {
+		if (gsm_line_is(gsm, GSM_TOKEN_CREG)) {
 			int creg_state;
 			if (!strcmp(buf,get_at(gsm->switchtype,AT_CREG0))){ creg_state = CREG_0_NOT_REG_NOT_SERARCHING;
 			} else if (!strcmp(buf,get_at(gsm->switchtype,AT_CREG1))) { creg_state =CREG_1_REGISTERED_HOME;
@@ -1357,15 +1363,15 @@ received_junk_parse_next:
 			case ALLOGSM_STATE_MANUFACTURER_REQ:
 				/* Request manufacturer identification */
 				if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_GET_MANUFACTURER))) {
-					if (gsm_compare(buf,get_at(gsm->switchtype,AT_OK))&&strlen(gsm->manufacturer)) {
+					if (gsm_line_is(gsm, GSM_TOKEN_OK)&&strlen(gsm->manufacturer)) {
 						memset(gsm->revision, 0, sizeof(gsm->revision));
 						gsm_switch_state(gsm, ALLOGSM_STATE_VERSION_REQ, get_at(gsm->switchtype,AT_GET_VERSION));
 #ifdef WAVECOM_JUNK
-					} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ")) {
+					} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_GET_MANUFACTURER));
 #endif
-					} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ")) {
-					} else if (!gsm_compare(buf, get_at(gsm->switchtype,AT_CME_ERROR))) {
+					} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND)) {
+					} else if (!gsm_line_is(gsm, GSM_TOKEN_CME_ERROR)) {
 						gsm_get_manufacturer(gsm, buf);
 					} else {
 						//Freedom del 2012-06-05 15:50
@@ -1379,15 +1385,15 @@ received_junk_parse_next:
 		
 			case ALLOGSM_STATE_VERSION_REQ:
 				if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_GET_VERSION))) {
-					if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))&&strlen(gsm->revision)) {
+					if (gsm_line_is(gsm, GSM_TOKEN_OK)&&strlen(gsm->revision)) {
 						//gsm_switch_state(gsm, ALLOGSM_STATE_IMEI_REQ, get_at(gsm->switchtype,AT_GET_IMEI)); /*Now selecting sim 1 here*/
 						gsm_switch_state(gsm, ALLOGSM_STATE_SET_SIM_SELECT_1, get_at(gsm->switchtype,AT_SIM_SELECT_1)); /*Now selecting sim 1 here*/
 #ifdef WAVECOM_JUNK
-					} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ")) {
+					} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_GET_VERSION));
 #endif
-					} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ")) {
-					} else if (!gsm_compare(buf, get_at(gsm->switchtype,AT_CME_ERROR))) {
+					} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND)) {
+					} else if (!gsm_line_is(gsm, GSM_TOKEN_CME_ERROR)) {
 						gsm_get_model_version(gsm, buf+9);
 					} else {
 						//Freedom del 2012-06-05 15:50
@@ -1400,10 +1406,10 @@ received_junk_parse_next:
 				break;
 			case ALLOGSM_STATE_SET_SIM_SELECT_1:
 				if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_SIM_SELECT_1))) {
-					if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+					if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 						gsm_switch_state(gsm, ALLOGSM_STATE_SET_SIM_SELECT_2, get_at(gsm->switchtype,AT_SIM_SELECT_2));
 #ifdef WAVECOM_JUNK
-					} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ")) {
+					} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_SIM_SELECT_1));
 #endif
 					} else {
@@ -1417,10 +1423,10 @@ received_junk_parse_next:
 				break;
 			case ALLOGSM_STATE_SET_SIM_SELECT_2:
 				if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_SIM_SELECT_2))) {
-					if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+					if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 						gsm_switch_state(gsm, ALLOGSM_STATE_SET_SIM_SELECT_3, get_at(gsm->switchtype,AT_SIM_SELECT_3));
 #ifdef WAVECOM_JUNK
-					} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ")) {
+					} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_SIM_SELECT_2));
 #endif
 					} else {
@@ -1434,11 +1440,11 @@ received_junk_parse_next:
 				break;
 			case ALLOGSM_STATE_SET_SIM_SELECT_3:
 				if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_SIM_SELECT_3))) {
-					if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+					if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 						memset(gsm->imei, 0, sizeof(gsm->imei));
 						gsm_switch_state(gsm, ALLOGSM_STATE_IMEI_REQ, get_at(gsm->switchtype,AT_GET_IMEI)); 
 #ifdef WAVECOM_JUNK
-					} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ")) {
+					} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_SIM_SELECT_3));
 #endif
 					} else {
@@ -1453,15 +1459,15 @@ received_junk_parse_next:
 			case ALLOGSM_STATE_IMEI_REQ:
 				/* IMEI (International Mobile Equipment Identification). */
 				if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_GET_IMEI))) {
-					if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))&&strlen(gsm->imei)) {
+					if (gsm_line_is(gsm, GSM_TOKEN_OK)&&strlen(gsm->imei)) {
 						memset(gsm->imsi, 0, sizeof(gsm->imsi));
 						gsm_switch_state(gsm, ALLOGSM_STATE_SIM_READY_REQ, get_at(gsm->switchtype,AT_ASK_PIN));
 #ifdef WAVECOM_JUNK
-					} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ")) {
+					} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_GET_IMEI));
 #endif
-					} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ")) {
-					} else if (!gsm_compare(buf, get_at(gsm->switchtype,AT_CME_ERROR))) {
+					} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND)) {
+					} else if (!gsm_line_is(gsm, GSM_TOKEN_CME_ERROR)) {
 						gsm_get_imei(gsm, buf);
 					} else {
 						//Freedom del 2012-06-05 15:50
@@ -1481,7 +1487,7 @@ received_junk_parse_next:
 					gsm_switch_state(gsm, ALLOGSM_STATE_SIM_PIN_REQ, NULL);
 					gsm->ev.e = ALLOGSM_EVENT_PIN_REQUIRED;
 					return &gsm->ev;
-				} else if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 					switch(gsm->sim_state) {
 						case ALLOGSM_STATE_SIM_READY:
 								gsm_switch_state(gsm, ALLOGSM_STATE_INIT_4, NULL);
@@ -1496,7 +1502,7 @@ received_junk_parse_next:
                 			gsm->sched_state = ALLOGSM_STATE_SIM_READY_REQ;
 					strcpy(gsm->sched_command, get_at(gsm->switchtype,AT_ASK_PIN));
 					gsm_schedule_event(gsm, 2000, gsm_cmd_sched, call);
-				}  else if(gsm_compare(buf, get_at(gsm->switchtype,AT_CME_ERROR))) {
+				}  else if(gsm_line_is(gsm, GSM_TOKEN_CME_ERROR)) {
 					/* Todo: other code support */
 					//Freedom del 2012-06-05 15:50
 					//gsm_error(gsm, DEBUGFMT "!%s!,last at tx:[%s]\n", DEBUGARGS, buf,gsm->at_last_sent);
@@ -1504,7 +1510,7 @@ received_junk_parse_next:
 					gsm->ev.e = ALLOGSM_EVENT_SIM_FAILED;
 					return &gsm->ev;
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 					if (!strcmp(buf,"+WIND: 0")) { 
 						/*SIM not present*/
 						gsm->ev.e = ALLOGSM_EVENT_SIM_FAILED;
@@ -1518,7 +1524,7 @@ received_junk_parse_next:
 				}
 				break;
 			case ALLOGSM_STATE_SIM_PIN_REQ:
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) { /* \r\n+CPIN: SIM PIN\r\n\r\nOK\r\n */
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) { /* \r\n+CPIN: SIM PIN\r\n\r\nOK\r\n */
 					/* gsm_message(gsm, "LAST>%s<\n",gsm->lastcmd); */
 					gsm_switch_state(gsm, ALLOGSM_STATE_INIT_4, NULL);
 				} else 
@@ -1535,14 +1541,14 @@ received_junk_parse_next:
 					//////////////////////////////////////////////////////////
 					gsm->ev.e = ALLOGSM_EVENT_SIM_FAILED;
 					return &gsm->ev;
-				} else if(gsm_compare(buf, get_at(gsm->switchtype,AT_CME_ERROR))){
+				} else if(gsm_line_is(gsm, GSM_TOKEN_CME_ERROR)){
 					//Freedom del 2012-06-05 15:50
 					//gsm_error(gsm, DEBUGFMT "!%s!,last at tx:[%s]\n", DEBUGARGS, buf,gsm->at_last_sent);
 					gsm->retries=-1;
 					gsm->ev.e = ALLOGSM_EVENT_PIN_ERROR;
 					return &gsm->ev;
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 					gsm_switch_state(gsm, ALLOGSM_STATE_SIM_READY_REQ, get_at(gsm->switchtype,AT_ASK_PIN));
 #endif
 				} else {
@@ -1560,7 +1566,7 @@ received_junk_parse_next:
 			case ALLOGSM_STATE_IMSI_REQ:
 				/* IMSI (International Mobile Subscriber Identity number). */
 				if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_IMSI))) {
-					if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))&&strlen(gsm->imsi)) {
+					if (gsm_line_is(gsm, GSM_TOKEN_OK)&&strlen(gsm->imsi)) {
 						if(get_at(gsm->switchtype,AT_MOC_ENABLED))
 						{
 							gsm_switch_state(gsm, ALLOGSM_STATE_MOC_STATE_ENABLED, get_at(gsm->switchtype,AT_MOC_ENABLED));
@@ -1575,8 +1581,8 @@ received_junk_parse_next:
 						}
 					} else if (gsm_compare(buf, "+CME ERROR: 14") ){
 						gsm_schedule_event(gsm, 1000, gsm_sim_waiting_sched, call);
-					} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ")) {
-					} else if (!gsm_compare(buf, get_at(gsm->switchtype,AT_CME_ERROR))) {
+					} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND)) {
+					} else if (!gsm_line_is(gsm, GSM_TOKEN_CME_ERROR)) {
 						gsm_get_imsi(gsm, buf);
 					} else {
 						//Freedom del 2012-06-05 15:50
@@ -1591,7 +1597,7 @@ received_junk_parse_next:
 #ifdef TESTING
 				if(1){
 #else
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 #endif
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_MOC_ENABLED))) {
 						if(get_at(gsm->switchtype,AT_SET_SIDE_TONE))
@@ -1604,7 +1610,7 @@ received_junk_parse_next:
 						}
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 					gsm_send_at(gsm, get_at(gsm->switchtype,AT_MOC_ENABLED));
 #endif
 				} else {
@@ -1615,12 +1621,12 @@ received_junk_parse_next:
 
 			case ALLOGSM_STATE_SET_SPEAKER:
 
-				if (gsm_compare(buf,get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_SPEAKER))) {
 						gsm_switch_state(gsm, ALLOGSM_STATE_SET_GAIN_INDEX,  get_at(gsm->switchtype,AT_SET_GAIN_INDEX));
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 					gsm_send_at(gsm, get_at(gsm->switchtype, AT_SPEAKER));
 #endif
 				} else {
@@ -1631,7 +1637,7 @@ received_junk_parse_next:
 
 			case ALLOGSM_STATE_SET_GAIN_INDEX:
 
-				if (gsm_compare(buf,get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_SET_GAIN_INDEX))) {
 						gsm_switch_state(gsm, ALLOGSM_STATE_SET_SIDE_TONE, get_at(gsm->switchtype,AT_SET_SIDE_TONE));
 					}
@@ -1643,13 +1649,13 @@ received_junk_parse_next:
 #ifdef TESTING
 				if(1){
 #else
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 #endif
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_SET_SIDE_TONE))) {
 						gsm_switch_state(gsm, ALLOGSM_STATE_SET_NOISE_CANCEL, get_at(gsm->switchtype,AT_NOISE_CANCEL));
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 					gsm_send_at(gsm, get_at(gsm->switchtype,AT_SET_SIDE_TONE));
 #endif
 				} else {
@@ -1662,13 +1668,13 @@ received_junk_parse_next:
 #ifdef TESTING
 				if(1){
 #else
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 #endif
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_NOISE_CANCEL))) {
 						gsm_switch_state(gsm, ALLOGSM_STATE_DEL_SIM_MSG, get_at(gsm->switchtype,AT_DEL_MSG));
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 					gsm_send_at(gsm, get_at(gsm->switchtype,AT_NOISE_CANCEL));
 #endif
 				} else {
@@ -1681,17 +1687,19 @@ received_junk_parse_next:
 #ifdef TESTING
 				if(1){
 #else
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 #endif
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_DEL_MSG))) {
+						/* Sized once the module is ready, the storage is empty now */
+						gsm_store_check(gsm);
 						gsm_switch_state(gsm, ALLOGSM_STATE_SET_SPEEK_VOL, NULL);
 						module_set_gain(gsm,gsm->vol);
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 					gsm_send_at(gsm, get_at(gsm->switchtype,AT_DEL_MSG));
 #endif
-				} else if (gsm_compare(buf, get_at(gsm->switchtype,AT_CMS_ERROR))){
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CMS_ERROR)){
                 			gsm->sched_state = ALLOGSM_STATE_DEL_SIM_MSG;
 					strcpy(gsm->sched_command, get_at(gsm->switchtype,AT_DEL_MSG));
 					gsm_schedule_event(gsm, 2000, gsm_cmd_sched, call);
@@ -1705,15 +1713,15 @@ received_junk_parse_next:
 #ifdef TESTING
 				if(1){
 #else
-				if (gsm_compare(buf,get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 #endif
 					gsm_switch_state(gsm, ALLOGSM_STATE_SET_MIC_VOL, NULL);
 					module_set_gain(gsm,gsm->mic);
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 					module_set_gain(gsm,gsm->vol);
 #endif
-				} else if (gsm_compare(buf, get_at(gsm->switchtype,AT_CME_ERROR))) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CME_ERROR)) {
 					gsm_send_at(gsm, get_at(gsm->switchtype, AT_CHECK));
 				} else {
 					//Freedom del 2012-06-05 15:50
@@ -1724,15 +1732,15 @@ received_junk_parse_next:
 #ifdef TESTING
 				if(1){
 #else
-				if (gsm_compare(buf,get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 #endif
 					gsm_switch_state(gsm, ALLOGSM_STATE_SET_ECHOCANSUP, NULL);
 					module_set_echocansup(gsm,gsm->echocanval);
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 					module_set_gain(gsm,gsm->mic);
 #endif
-				} else if (gsm_compare(buf, get_at(gsm->switchtype,AT_CME_ERROR))) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CME_ERROR)) {
 					gsm_send_at(gsm, get_at(gsm->switchtype, AT_CHECK));
 				} else {
 					//Freedom del 2012-06-05 15:50
@@ -1742,13 +1750,13 @@ received_junk_parse_next:
 
 			case ALLOGSM_STATE_SET_ECHOCANSUP:
 
-				if (gsm_compare(buf,get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 					gsm_switch_state(gsm, ALLOGSM_STATE_SET_CALL_NOTIFICATION, get_at(gsm->switchtype,AT_CALL_NOTIFICATION));
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 					module_set_echocansup(gsm,gsm->echocanval);
 #endif
-				} else if (gsm_compare(buf, get_at(gsm->switchtype,AT_CME_ERROR))) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CME_ERROR)) {
 					gsm_send_at(gsm, get_at(gsm->switchtype, AT_CHECK));
 				} else {
 					//Freedom del 2012-06-05 15:50
@@ -1758,12 +1766,12 @@ received_junk_parse_next:
 
 			case ALLOGSM_STATE_SET_CALL_NOTIFICATION:
 
-				if (gsm_compare(buf,get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_CALL_NOTIFICATION))) {
 						gsm_switch_state(gsm, ALLOGSM_STATE_SET_DTMF_DETECTION, get_at(gsm->switchtype,AT_DTMF_DETECTION));
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 					gsm_send_at(gsm, get_at(gsm->switchtype, AT_CALL_NOTIFICATION));
 #endif
 				} else {
@@ -1774,12 +1782,12 @@ received_junk_parse_next:
 
 			case ALLOGSM_STATE_SET_DTMF_DETECTION:
 
-				if (gsm_compare(buf,get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_DTMF_DETECTION))) {
 						gsm_switch_state(gsm, ALLOGSM_STATE_CLIP_ENABLED, get_at(gsm->switchtype,AT_CLIP_ENABLED));
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 					gsm_send_at(gsm, get_at(gsm->switchtype, AT_DTMF_DETECTION));
 #endif
 				} else {
@@ -1792,13 +1800,13 @@ received_junk_parse_next:
 #ifdef TESTING
 				if(1){
 #else
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 #endif
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_CLIP_ENABLED))) {
 						gsm_switch_state(gsm, ALLOGSM_STATE_RSSI_ENABLED, get_at(gsm->switchtype,AT_RSSI_ENABLED));
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 					gsm_send_at(gsm, get_at(gsm->switchtype, AT_CLIP_ENABLED));
 #endif
 				} else {
@@ -1810,13 +1818,13 @@ received_junk_parse_next:
 #ifdef TESTING
 				if(1){
 #else
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 #endif
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_RSSI_ENABLED))) {
 						gsm_switch_state(gsm, ALLOGSM_STATE_SMS_MODE, get_at(gsm->switchtype,AT_SEND_SMS_PDU_MODE));
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_RSSI_ENABLED));
 #endif
 				} else {
@@ -1827,12 +1835,12 @@ received_junk_parse_next:
 
 			case ALLOGSM_STATE_SMS_MODE:
 
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_SEND_SMS_PDU_MODE))) {
 						gsm_switch_state(gsm, ALLOGSM_STATE_SET_NET_URC, get_at(gsm->switchtype,AT_SET_NET_URC));
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_SEND_SMS_PDU_MODE));
 #endif
 				} else {
@@ -1844,13 +1852,13 @@ received_junk_parse_next:
 #ifdef TESTING
 				if(1){
 #else
-				if (gsm_compare(buf,  get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 #endif
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_SET_NET_URC))) {
 						gsm_switch_state(gsm, ALLOGSM_STATE_NET_REQ, get_at(gsm->switchtype,AT_ASK_NET));
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_SET_NET_URC));
 #endif
 				} else {
@@ -1861,7 +1869,7 @@ received_junk_parse_next:
 			case ALLOGSM_STATE_NET_REQ:
 				if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_ASK_NET))) {
 					trim_CRLF(buf);
-					if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {						
+					if (gsm_line_is(gsm, GSM_TOKEN_OK)) {						
 						if ((GSM_NET_HOME == gsm->network) || (GSM_NET_ROAMING == gsm->network)) {
 							gsm_switch_state(gsm, ALLOGSM_STATE_NET_OK, get_at(gsm->switchtype,AT_NET_OK));
 						} else {
@@ -1889,9 +1897,9 @@ received_junk_parse_next:
 						gsm_message(gsm,"ALLO GSM: Span: %d  REGISTERED TO ROAMING NETWORK\n", gsm->span);
 						gsm->network = GSM_NET_ROAMING;
 #ifdef WAVECOM_JUNK
-					} else if (gsm_compare(buf, "+CREG: ")) {
+					} else if (gsm_line_is(gsm, GSM_TOKEN_CREG)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_ASK_NET));
-					} else if (gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+					} else if (gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_ASK_NET));
 #endif
 					} else {
@@ -1900,7 +1908,7 @@ received_junk_parse_next:
 						gsm->net_name[0]	= 0x0;
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_ASK_NET));
 #endif
 				} else {
@@ -1916,13 +1924,13 @@ received_junk_parse_next:
 				}
 				break;
 			case ALLOGSM_STATE_NET_OK:
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_NET_OK))) { /* set only <format> (for read command +COPS?) ¨C not shown in Read command response */
 						memset(gsm->sim_smsc, 0, sizeof(gsm->sim_smsc));
 						gsm_switch_state(gsm, ALLOGSM_STATE_GET_SMSC_REQ, get_at(gsm->switchtype,AT_GET_SMSC));
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_NET_OK));
 #endif
 				}
@@ -1932,12 +1940,12 @@ received_junk_parse_next:
 				/* Request smsc */
 				if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_GET_SMSC))) {
 						
-					if (gsm_compare(buf,get_at(gsm->switchtype,AT_OK))&&strlen(gsm->sim_smsc)) {
+					if (gsm_line_is(gsm, GSM_TOKEN_OK)&&strlen(gsm->sim_smsc)) {
 						gsm_switch_state(gsm, ALLOGSM_STATE_SMS_SET_CHARSET, get_at(gsm->switchtype,AT_SMS_SET_CHARSET));
-					} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ")) {
+					} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND)) {
 					} else if (gsm_compare(buf, "+CMS ERROR: 301") ){
 						gsm_schedule_event(gsm, 1000, gsm_sms_service_waiting, call);
-					} else if (!gsm_compare(buf, get_at(gsm->switchtype,AT_CME_ERROR))) {
+					} else if (!gsm_line_is(gsm, GSM_TOKEN_CME_ERROR)) {
 						if (gsm_compare(buf, "+CSCA: "))
 							gsm_get_smsc(gsm, buf);
 					} else {
@@ -1945,7 +1953,7 @@ received_junk_parse_next:
 						//gsm_error(gsm, DEBUGFMT "!%s!,last at tx:[%s]\n", DEBUGARGS, buf,gsm->at_last_sent);
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_GET_SMSC));
 #endif
 				} else {
@@ -1958,7 +1966,7 @@ received_junk_parse_next:
 #ifdef TESTING
 				if(1){
 #else
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 #endif
 					if(get_at(gsm->switchtype,AT_MODE)){
 						gsm_switch_state(gsm, ALLOGSM_AT_MODE, get_at(gsm->switchtype,AT_MODE));
@@ -1966,7 +1974,7 @@ received_junk_parse_next:
 						gsm_switch_state(gsm, ALLOGSM_STATE_SMS_SET_INDICATION, get_at(gsm->switchtype,AT_GSM));
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_SMS_SET_CHARSET));
 #endif
 				} else {
@@ -1979,13 +1987,13 @@ received_junk_parse_next:
 #ifdef TESTING
 				if(1){
 #else
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 #endif
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_MODE))) { /*add by makes 2012-4-10 15:54*/
 						gsm_switch_state(gsm, ALLOGSM_STATE_SMS_SET_INDICATION, get_at(gsm->switchtype,AT_GSM));
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_MODE));
 #endif
 				}
@@ -1995,7 +2003,7 @@ received_junk_parse_next:
 #ifdef TESTING
 				if(1){
 #else
-				if (gsm_compare(buf,get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 #endif
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_GSM))) {
 						gsm->sms_mod_flag = SMS_TEXT;
@@ -2004,7 +2012,7 @@ received_junk_parse_next:
 						gsm_switch_state(gsm, ALLOGSM_STATE_NET_NAME_REQ, get_at(gsm->switchtype,AT_ASK_NET_NAME));
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_GSM));
 #endif
 				} else {
@@ -2013,7 +2021,7 @@ received_junk_parse_next:
 				}
 				break;
 			case ALLOGSM_STATE_NET_NAME_REQ:
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_CHECK_NET))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_COPS)) {
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_ASK_NET_NAME))) {
 						gsm_get_operator(gsm, buf);
 						UPDATE_OURCALLSTATE(gsm, call, AT_CALL_STATE_NULL);
@@ -2053,7 +2061,7 @@ received_junk_parse_next:
 						return &gsm->ev;
 					}
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ") || expectlist_compare(buf)) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND) || expectlist_compare(buf)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_ASK_NET_NAME));
 #endif
 				} else {
@@ -2069,11 +2077,11 @@ received_junk_parse_next:
 #endif //VIRTUAL_TTY
 			case ALLOGSM_STATE_READY:
 				/* Request operators */
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_CHECK_NET))) { /* AT+COPS? */
+				if (gsm_line_is(gsm, GSM_TOKEN_COPS)) { /* AT+COPS? */
 					//printf("cops buf: >>%s<<\n", buf);
 						gsm_get_operator(gsm, buf);
 						//strncpy(gsm->net_name, buf, sizeof(gsm->net_name));
-			//	} else if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+			//	} else if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 					//Freedom notice must to rewrite this code 2011-10-12 15:13
 			//		gsm_message(gsm, "%s\n", data);
 				} else if (gsm_compare(buf, get_at(gsm->switchtype,AT_RING))) { /* RING  */
@@ -2089,12 +2097,15 @@ received_junk_parse_next:
                                                 call->ring_count=call->ring_count+1;
                                                 if (call->ring_count>1){
 							/* lets build CLIP RESPONSE */
-							memset(buf, 0x0, sizeof(buf));
+							buf = clip_buf;
 							sprintf(buf, "+CLIP: \"UNKNOWN\",129,1,,\"UNKNOWN\"");
+							gsm->line_token = GSM_TOKEN_CLIP;
+							gsm->line_tokens = GSM_TOKEN_MASK(GSM_TOKEN_CLIP);
+							gsm->line_found = GSM_TOKEN_MASK(GSM_TOKEN_CLIP);
                                                         goto call_without_callerid;
 						}
                                         }
-				} else if (gsm_compare(buf, get_at(gsm->switchtype,AT_INCOMING_CALL))) { /* Incoming call */
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CLIP)) { /* Incoming call */
 call_without_callerid:
 					/*If getting a CLIP event for first time, then only go inside this condition otherwise break*/
 					if (!call->newcall) {
@@ -2140,7 +2151,7 @@ call_without_callerid:
 					return &gsm->ev;
 #ifdef WAVECOM
 /*  Should not call AT+CSQ(AT_NET_NAME) here..
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: 4") || gsm_compare(buf, "+WIND: 7")) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_compare(buf, "+WIND: 4") || gsm_compare(buf, "+WIND: 7")) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_NET_NAME));
 */
 #endif
@@ -2168,11 +2179,11 @@ call_without_callerid:
 			////////////////////////////////////////////////////
 			case ALLOGSM_STATE_RINGING:
 #ifdef WAVECOM
-				if( gsm_compare(buf, get_at(gsm->switchtype,AT_NO_CARRIER)) ||
-					gsm_compare(buf, get_at(gsm->switchtype,AT_NO_ANSWER)) || gsm_compare(buf, "+WIND: 6,") ) {
+				if( gsm_line_is(gsm, GSM_TOKEN_NO_CARRIER) ||
+					gsm_line_is(gsm, GSM_TOKEN_NO_ANSWER) || gsm_compare(buf, "+WIND: 6,") ) {
 #else				
-				if( gsm_compare(buf, get_at(gsm->switchtype,AT_NO_CARRIER)) ||
-					gsm_compare(buf, get_at(gsm->switchtype,AT_NO_ANSWER)) ) {
+				if( gsm_line_is(gsm, GSM_TOKEN_NO_CARRIER) ||
+					gsm_line_is(gsm, GSM_TOKEN_NO_ANSWER) ) {
 #endif					
 					gsm->state = ALLOGSM_STATE_READY;
 					UPDATE_OURCALLSTATE(gsm, call, AT_CALL_STATE_NULL);
@@ -2191,7 +2202,7 @@ call_without_callerid:
 			////////////////////////////////////////////////////
 			case ALLOGSM_STATE_PRE_ANSWER:
 				/* Answer the remote calling */
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_ANSWER))) {
 						UPDATE_OURCALLSTATE(gsm, call, AT_CALL_STATE_ACTIVE);
 						call->peercallstate = AT_CALL_STATE_ACTIVE;
@@ -2216,12 +2227,12 @@ call_without_callerid:
 			case ALLOGSM_STATE_CALL_ACTIVE:
 				/* Remote end of active all. Waiting ...*/
 #ifdef WAVECOM
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_NO_CARRIER)) || 
-					gsm_compare(buf, get_at(gsm->switchtype,AT_NO_ANSWER)) ||  gsm_compare(buf,"+WIND: 6,") 
-					||  gsm_compare(buf,"BUSY") || gsm_compare(buf,"+CREG: ")) {
+				if (gsm_line_is(gsm, GSM_TOKEN_NO_CARRIER) || 
+					gsm_line_is(gsm, GSM_TOKEN_NO_ANSWER) ||  gsm_compare(buf,"+WIND: 6,") 
+					||  gsm_compare(buf,"BUSY") || gsm_line_is(gsm, GSM_TOKEN_CREG)) {
 #else
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_NO_CARRIER)) || 
-					gsm_compare(buf, get_at(gsm->switchtype,AT_NO_ANSWER))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_NO_CARRIER) || 
+					gsm_line_is(gsm, GSM_TOKEN_NO_ANSWER)) {
 #endif
 					gsm_switch_state(gsm, ALLOGSM_STATE_READY, get_at(gsm->switchtype,AT_NET_NAME));
 					UPDATE_OURCALLSTATE(gsm, call, AT_CALL_STATE_NULL);
@@ -2379,11 +2390,11 @@ call_without_callerid:
 				}
 
 				/* Remote end of active call. Waiting ...*/
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_NO_CARRIER)) || 
-				    gsm_compare(buf, get_at(gsm->switchtype,AT_NO_ANSWER)) ||  
+				if (gsm_line_is(gsm, GSM_TOKEN_NO_CARRIER) || 
+				    gsm_line_is(gsm, GSM_TOKEN_NO_ANSWER) ||  
 				    gsm_compare(buf, held_wind) ||
 				    gsm_compare(buf,"BUSY") || 
-				    gsm_compare(buf,"+CREG: ")) {
+				    gsm_line_is(gsm, GSM_TOKEN_CREG)) {
 		
 					gsm_switch_state(gsm, ALLOGSM_STATE_READY, get_at(gsm->switchtype,AT_NET_NAME));
 					UPDATE_OURCALLSTATE(gsm, call, AT_CALL_STATE_NULL);
@@ -2429,7 +2440,7 @@ call_without_callerid:
 				break;
 			case ALLOGSM_STATE_HANGUP_REQ:
 				/* Hangup the active call */
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 junk_received_for_ATH:
 					if ((gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_HANGUP))) 
 					   ||(gsm_compare(gsm->at_last_sent, "AT+CHLD=1"))) {
@@ -2450,13 +2461,13 @@ junk_received_for_ATH:
 #endif
 						return &gsm->ev;
 					}
-                                } else if (gsm_compare(buf, get_at(gsm->switchtype,AT_NO_CARRIER)) ||
-                                        gsm_compare(buf, get_at(gsm->switchtype,AT_NO_ANSWER)) ||  gsm_compare(buf,"+WIND: 6,1")
-                                        ||  gsm_compare(buf,"BUSY") || gsm_compare(buf,"+CREG: ")) {
+                                } else if (gsm_line_is(gsm, GSM_TOKEN_NO_CARRIER) ||
+                                        gsm_line_is(gsm, GSM_TOKEN_NO_ANSWER) ||  gsm_compare(buf,"+WIND: 6,1")
+                                        ||  gsm_compare(buf,"BUSY") || gsm_line_is(gsm, GSM_TOKEN_CREG)) {
                                         return NULL;
 #ifdef WAVECOM
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ")) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_HANGUP));
 #endif
 				} else if (expectlist_compare(buf)) {
@@ -2466,7 +2477,7 @@ junk_received_for_ATH:
 				break;
 			case ALLOGSM_STATE_HANGUP_REQ_CALL_WAITING:
 				/* Hangup the active call */
-				if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+				if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 					if ((gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_HANGUP))) 
 					   ||(gsm_compare(gsm->at_last_sent, "AT+CHLD=1"))) {
 
@@ -2490,7 +2501,7 @@ junk_received_for_ATH:
 					}
 #ifdef WAVECOM
 #ifdef WAVECOM_JUNK
-				} else if (gsm_compare(buf, "+CREG: ") || gsm_compare(buf, "+WIND: ")) {
+				} else if (gsm_line_is(gsm, GSM_TOKEN_CREG) || gsm_line_is(gsm, GSM_TOKEN_WIND)) {
 						gsm_send_at(gsm, get_at(gsm->switchtype,AT_HANGUP));
 #endif
 				} else if (expectlist_compare(buf)) {
@@ -2531,7 +2542,7 @@ junk_received_for_ATH:
                                 if (gsm_compare(buf, "*PSCSC: 1, 0,")) {
 					/* 0 MO call SETUP (if no control by SIM) */
 					
-                                } else if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+                                } else if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 					/* OK for ATD */
 
                                 } else if (gsm_compare(buf, "*PSCSC: 1, 3,")) {
@@ -2553,7 +2564,7 @@ junk_received_for_ATH:
                                         }
                                 }
 #else
-//                              if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+//                              if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
                                                 gsm_send_at(gsm, get_at(gsm->switchtype,AT_CALL_INIT));
                                                 gsm->state = ALLOGSM_STATE_CALL_MADE;
 //                              }
@@ -2562,7 +2573,7 @@ junk_received_for_ATH:
 			case ALLOGSM_STATE_CALL_MADE:
 #ifdef WAVECOM
 #else
-			//	if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+			//	if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 					if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_CALL_INIT))) {
 						call->channelno = 1;
 						//gsm_switch_state(gsm, ALLOGSM_STATE_CALL_PROCEEDING, get_at(gsm->switchtype,AT_CALL_PROCEEDING));
@@ -2611,7 +2622,7 @@ junk_received_for_ATH:
                                         }
                                 }
 #else
-				//if (gsm_compare(buf, get_at(gsm->switchtype,AT_OK))) {
+				//if (gsm_line_is(gsm, GSM_TOKEN_OK)) {
 				//	if (gsm_compare(gsm->at_last_sent, get_at(gsm->switchtype,AT_CALL_PROCEEDING))) {
 						
 						//Freedom Add 2012-02-07 15:24
@@ -2673,8 +2684,8 @@ auto_answer_without_progress:
                                                 gsm->ev.answer.cref = call->cr;
                                                 gsm->ev.answer.call = call;
                                                 return &gsm->ev;
-                                        } else if( gsm_compare(buf, get_at(gsm->switchtype,AT_NO_CARRIER)) ||
-                                        gsm_compare(buf, get_at(gsm->switchtype,AT_NO_ANSWER)) || gsm_compare(buf, "*PSCSC: 1, 20") ) {
+                                        } else if( gsm_line_is(gsm, GSM_TOKEN_NO_CARRIER) ||
+                                        gsm_line_is(gsm, GSM_TOKEN_NO_ANSWER) || gsm_compare(buf, "*PSCSC: 1, 20") ) {
                                                 gsm->state = ALLOGSM_STATE_READY; 
                                                 UPDATE_OURCALLSTATE(gsm, call, AT_CALL_STATE_NULL);
                                                 call->peercallstate = AT_CALL_STATE_NULL;
@@ -2689,7 +2700,7 @@ auto_answer_without_progress:
                                                 return &gsm->ev;
                                         }
 #else
-//	     				if (gsm_compare(buf, get_at(gsm->switchtype,AT_MO_CONNECTED))) {
+//	     				if (gsm_line_is(gsm, GSM_TOKEN_MO_CONNECTED)) {
 						call->alive = 1;
 				//		gsm->state = ALLOGSM_STATE_CALL_ACTIVE;
 						gsm->state = ALLOGSM_STATE_PRE_ANSWER; // If AT_MO_CONNECTED is not proper, comment if case and use this state
@@ -2723,7 +2734,7 @@ auto_answer_without_progress:
 						gsm->phone_stat=PHONE_BUSY;
 						return &gsm->ev;
 					}
-					else if(gsm_compare(buf, get_at(gsm->switchtype,AT_MO_CONNECTED))){
+					else if(gsm_line_is(gsm, GSM_TOKEN_MO_CONNECTED)){
 						gsm->hangupTimeoutSched = gsm_schedule_event(gsm, 2000, gsm_hangup_timeout, gsm);
 						gsm_switch_state(gsm, ALLOGSM_STATE_HANGUP_REQ, get_at(gsm->switchtype,AT_HANGUP));
 						gsm->ev.gen.e = ALLOGSM_EVENT_CHECK_PHONE;
@@ -2731,7 +2742,7 @@ auto_answer_without_progress:
 						gsm->phone_stat=PHONE_CONNECT;
 						return &gsm->ev;
 					}
-					else if(gsm_compare(buf, get_at(gsm->switchtype,AT_NO_CARRIER))){
+					else if(gsm_line_is(gsm, GSM_TOKEN_NO_CARRIER)){
 						gsm->hangupTimeoutSched = gsm_schedule_event(gsm, 2000, gsm_hangup_timeout, gsm);
 						gsm_switch_state(gsm, ALLOGSM_STATE_HANGUP_REQ, get_at(gsm->switchtype,AT_HANGUP));
 						gsm->ev.gen.e = ALLOGSM_EVENT_CHECK_PHONE;
@@ -2739,7 +2750,7 @@ auto_answer_without_progress:
 						gsm->phone_stat=PHONE_NOT_CARRIER;
 						return &gsm->ev;
 					}
-					else if(gsm_compare(buf, get_at(gsm->switchtype,AT_NO_ANSWER))){
+					else if(gsm_line_is(gsm, GSM_TOKEN_NO_ANSWER)){
 						gsm->hangupTimeoutSched = gsm_schedule_event(gsm, 2000, gsm_hangup_timeout, gsm);
 						gsm_switch_state(gsm, ALLOGSM_STATE_HANGUP_REQ, get_at(gsm->switchtype,AT_HANGUP));
 						gsm->ev.gen.e = ALLOGSM_EVENT_CHECK_PHONE;
@@ -2747,7 +2758,7 @@ auto_answer_without_progress:
 						gsm->phone_stat=PHONE_NOT_ANSWER;
 						return &gsm->ev;
 					}
-					else if(gsm_compare(buf, get_at(gsm->switchtype,AT_NO_DIALTONE))){
+					else if(gsm_line_is(gsm, GSM_TOKEN_NO_DIALTONE)){
 						gsm->hangupTimeoutSched = gsm_schedule_event(gsm, 2000, gsm_hangup_timeout, gsm);
 						gsm_switch_state(gsm, ALLOGSM_STATE_HANGUP_REQ, get_at(gsm->switchtype,AT_HANGUP));
 						gsm->ev.gen.e = ALLOGSM_EVENT_CHECK_PHONE;
@@ -2786,7 +2797,7 @@ auto_answer_without_progress:
 							gsm->phone_stat=PHONE_BUSY;
 							return &gsm->ev;
 						}
-						else if(gsm_compare(buf, get_at(gsm->switchtype,AT_MO_CONNECTED))){
+						else if(gsm_line_is(gsm, GSM_TOKEN_MO_CONNECTED)){
 							gsm->hangupTimeoutSched = gsm_schedule_event(gsm, 2000, gsm_hangup_timeout, gsm);
 							gsm_switch_state(gsm, ALLOGSM_STATE_HANGUP_REQ, get_at(gsm->switchtype,AT_HANGUP));
 							gsm->ev.gen.e = ALLOGSM_EVENT_CHECK_PHONE;
@@ -2794,7 +2805,7 @@ auto_answer_without_progress:
 							gsm->phone_stat=PHONE_CONNECT;
 							return &gsm->ev;
 						}
-						else if(gsm_compare(buf, get_at(gsm->switchtype,AT_NO_CARRIER))){
+						else if(gsm_line_is(gsm, GSM_TOKEN_NO_CARRIER)){
 							gsm->hangupTimeoutSched = gsm_schedule_event(gsm, 2000, gsm_hangup_timeout, gsm);
 							gsm_switch_state(gsm, ALLOGSM_STATE_HANGUP_REQ, get_at(gsm->switchtype,AT_HANGUP));
 							gsm->ev.gen.e = ALLOGSM_EVENT_CHECK_PHONE;
@@ -2802,7 +2813,7 @@ auto_answer_without_progress:
 							gsm->phone_stat=PHONE_NOT_CARRIER;
 							return &gsm->ev;
 						}
-						else if(gsm_compare(buf, get_at(gsm->switchtype,AT_NO_ANSWER))){
+						else if(gsm_line_is(gsm, GSM_TOKEN_NO_ANSWER)){
 							gsm->hangupTimeoutSched = gsm_schedule_event(gsm, 2000, gsm_hangup_timeout, gsm);
 							gsm_switch_state(gsm, ALLOGSM_STATE_HANGUP_REQ, get_at(gsm->switchtype,AT_HANGUP));
 							gsm->ev.gen.e = ALLOGSM_EVENT_CHECK_PHONE;
@@ -2810,7 +2821,7 @@ auto_answer_without_progress:
 							gsm->phone_stat=PHONE_NOT_ANSWER;
 							return &gsm->ev;
 						}
-						else if(gsm_compare(buf, get_at(gsm->switchtype,AT_NO_DIALTONE))){
+						else if(gsm_line_is(gsm, GSM_TOKEN_NO_DIALTONE)){
 							gsm->hangupTimeoutSched = gsm_schedule_event(gsm, 2000, gsm_hangup_timeout, gsm);
 							gsm_switch_state(gsm, ALLOGSM_STATE_HANGUP_REQ, get_at(gsm->switchtype,AT_HANGUP));
 							gsm->ev.gen.e = ALLOGSM_EVENT_CHECK_PHONE;
@@ -2841,11 +2852,11 @@ auto_answer_without_progress:
 				
 		if(gsm->state >= ALLOGSM_STATE_READY) {
 #ifdef WAVECOM
-			if(gsm_compare(buf, get_at(gsm->switchtype,AT_NO_CARRIER)) ||
-				gsm_compare(buf, get_at(gsm->switchtype,AT_NO_ANSWER)) || gsm_compare(buf, "*PSCSC: 1, 20")) {
+			if(gsm_line_is(gsm, GSM_TOKEN_NO_CARRIER) ||
+				gsm_line_is(gsm, GSM_TOKEN_NO_ANSWER) || gsm_compare(buf, "*PSCSC: 1, 20")) {
 #else
-			if(gsm_compare(buf, get_at(gsm->switchtype,AT_NO_CARRIER)) ||
-				gsm_compare(buf, get_at(gsm->switchtype,AT_NO_ANSWER))) {
+			if(gsm_line_is(gsm, GSM_TOKEN_NO_CARRIER) ||
+				gsm_line_is(gsm, GSM_TOKEN_NO_ANSWER)) {
 #endif
 				gsm->state = ALLOGSM_STATE_READY;
 				UPDATE_OURCALLSTATE(gsm, call, AT_CALL_STATE_NULL);
@@ -2859,7 +2870,7 @@ auto_answer_without_progress:
 				call->sendhangupack = 0;
 				allogsm_destroycall(gsm, call);
 				return &gsm->ev;
-			} else if (gsm_compare(buf, get_at(gsm->switchtype,AT_NO_DIALTONE))) {
+			} else if (gsm_line_is(gsm, GSM_TOKEN_NO_DIALTONE)) {
 				gsm->state = ALLOGSM_STATE_READY;
 				UPDATE_OURCALLSTATE(gsm, call, AT_CALL_STATE_NULL);
 				call->peercallstate = AT_CALL_STATE_NULL;
@@ -2892,30 +2903,19 @@ auto_answer_without_progress:
 			return res_event;
 		}
 #endif		
-		res_event = module_check_sms(gsm, buf, i);
-		if (res_event) {
-			return res_event;
-		}
-
-		res_event = module_check_network(gsm, call ,buf, i);
-		if (res_event) {
-			return res_event;
-		}
-
-		res_event = module_check_ussd(gsm, buf, i);
-		if (res_event) {
-			return res_event;
+		for (h = 0; h < sizeof(module_line_handlers) / sizeof(module_line_handlers[0]); h++) {
+			if (module_line_handlers[h].state >= 0 && module_line_handlers[h].state != gsm->state) {
+				continue;
+			}
+			if (module_line_handlers[h].tokens && !(module_line_handlers[h].tokens & gsm->line_found)) {
+				continue;
+			}
+			res_event = module_line_handlers[h].handler(gsm, call, buf, i);
+			if (res_event) {
+				return res_event;
+			}
 		}
 
-		res_event = module_check_operator_list_query(gsm, buf, i);
-                if (res_event) {
-                        return res_event;
-                }
-		res_event = module_check_safe_at(gsm, buf, i);
-                if (res_event) {
-                        return res_event;
-                }
-
 	}
 
 	return res_event;
@@ -22,32 +22,10 @@
 #include <ctype.h>
 //#include <iconv.h> FIXME: Any how add this library for uClib
 //#include "/opt/libiconv/include/iconv.h"
-#include <iconv.h>
 #include "liballogsmat.h"
 #include "gsm_internal.h"
 
 
-static int code_convert(const char *from_charset,const char *to_charset,char *inbuf,size_t inlen,char *outbuf,size_t outlen);
-
-unsigned long gsm_hex2int(const char *hex, int len)
-{
-	int i,j;
-	unsigned long res = 0;
-
-	for (i=0; i<len; i++) {
-		j = 0;
-		if ((hex[i] >= 48) && (hex[i] <=57)) { /* '0' - '9' */
-			j = hex[i] - 48;
-		} else if ((hex[i] >= 65) && (hex[i] <=70)) { /* 'A' - 'F' */
-			j = hex[i] - 55;
-		} else if ((hex[i] >= 97) && (hex[i] <=102)) { /* 'a' - 'f' */
-			j = hex[i] - 87;
-		}
-		/* j = [0-9,A-F,a-f] */
-		res += j * (unsigned long)pow(16, len - i - 1);
-	}
-	return res;
-}
 
 static void gsm_dso2string(char *res, char *dso)
 {
@@ -71,15 +49,10 @@ static void gsm_dso2string(char *res, char *dso)
 
 static void gsm_string2byte(unsigned char *res, char *in, int len)
 {
-	int i;
-
-	for (i = 0; i < len ; i++) {
-		res[i] = (unsigned char)gsm_hex2int(&in[i*2], 2);
-	}
-	res[len * 2] = '\0';
+	gsm_hex_decode(in, len, res);
+	res[len] = '\0';
 }
 
-static void gsm_to8Bit(unsigned char in[], unsigned char out[], int len, int flag);
 static void gsm_convertNumber(struct allogsm_modul *gsm,char *res, char *dso, int toa, char len)
 {
 	if (toa == 0x91) {
@@ -126,112 +99,6 @@ static char *gsm_get_dot_string(char *in, char *out, char flag)
 	return NULL;
 }
 
-#if 0
-static void gsm_to8Bit(unsigned char in[], unsigned char out[], int len, int flag)
-{
-	int i = 0;
-	int inputOffset = 0;
-	int outputOffset = 0;
-
-	while (inputOffset < len ) {
-	out[outputOffset] = (in[inputOffset] & (unsigned char)(pow(2, 7-i)-1));
-	if (i == 8) {
-		out[outputOffset] = in[inputOffset-1] & 127;
-		i = 1;
-	} else {
-		out[outputOffset] = out[outputOffset] << i;
-		out[outputOffset] |= in[inputOffset-1] >> (8-i);
-		inputOffset++;
-		i++;
-	}
-		outputOffset++;
-	}
-
-	out[len] = '\0';
-}
-#endif
-
-static void gsm_to8Bit(unsigned char in[], unsigned char out[], int len, int flag)
-{
-        int i = 0;
-        int inputOffset = 0;
-        int outputOffset = 0;
-        unsigned char* tmp;
-        tmp = (unsigned char*)malloc(320);
-        memset(tmp,0,320);
-	
-	if(flag == 1){
-        tmp[outputOffset] = in[inputOffset] >>1;
-        outputOffset++;
-	inputOffset++;
-	}
-
-        while (inputOffset < len ) {
-                tmp[outputOffset] = (in[inputOffset] & (unsigned char)(pow(2, 7-i)-1));
-
-                if (i == 8) {
-                        tmp[outputOffset] = in[inputOffset-1] & 127;
-                        i = 1;
-                } else {
-                        tmp[outputOffset] = tmp[outputOffset] << i;
-                        tmp[outputOffset] |= in[inputOffset-1] >> (8-i);
-                        inputOffset++;
-                        i++;
-                }
-                outputOffset++;
-
-                if(outputOffset>=320) {
-                        printf("Warnning: Function %s overflow in %s,%d\n",__func__,__FILE__,__LINE__);
-                }
-        }
-
-        // This is the transition table from 7-bit to ASCII
-        const int UK = -1;
-        const unsigned char EQ7BIT2ASCII[128] =
-                {  64, 163,  36, 165, 232, 223, 249, 236, 242, 199,
-                   10, 216, 248,  13, 197, 229,  UK,  95,  UK,  UK,
-                   UK,  UK,  UK,  UK,  UK,  UK,  UK,  UK, 198, 230,
-                  223, 201,  32,  33,  34,  35, 164,  37,  38,  39,
-                   40,  41,  42,  43,  44,  45,  46,  47,  48,  49,
-                   50,  51,  52,  53,  54,  55,  56,  57,  58,  59,
-                   60,  61,  62,  63, 161,  65,  66,  67,  68,  69,
-                   70,  71,  72,  73,  74,  75,  76,  77,  78,  79,
-                   80,  81,  82,  83,  84,  85,  86,  87,  88,  89,
-                   90, 196, 204, 209, 220, 167, 191,  97,  98,  99,
-                  100, 101, 102, 103, 104, 105, 106, 107, 108, 109,
-                  110, 111, 112, 113, 114, 115, 116, 117, 118, 119,
-                  120, 121, 122, 228, 246, 241, 252, 224
-                };
-
-        int j,k;
-
-        for(j=0,k=0; j < len; j++,k++) {
-                if(tmp[j] < 128) {
-                        if(tmp[j] == 0x1b && j+1 < len) {  //Special character, two bytes mean one character.
-                                switch(tmp[j+1]) {
-                                case 0x0A: out[k] = 0x000C; j++; break;  //     FORM FEED
-                                case 0x14: out[k] = 0x005E; j++; break;   //CIRCUMFLEX ACCENT
-                                case 0x28: out[k] = 0x007B; j++; break;   //LEFT CURLY BRACKET
-                                case 0x29: out[k] = 0x007D; j++; break;   //RIGHT CURLY BRACKET
-                                case 0x2F: out[k] = 0x005C; j++; break;   //REVERSE SOLIDUS
-                                case 0x3C: out[k] = 0x005B; j++; break;   //LEFT SQUARE BRACKET
-                                case 0x3D: out[k] = 0x007E; j++; break;   //TILDE
-                                case 0x3E: out[k] = 0x005D; j++; break;   //RIGHT SQUARE BRACKET
-                                case 0x40: out[k] = 0x007C; j++; break;   //VERTICAL LINE
-                                // case 0x65: out[k] = 0x20AC; j++; break;   //EURO SIGN
-                                default: out[k] = EQ7BIT2ASCII[tmp[j]]; break;
-                                }
-                        } else {
-                                out[k] = EQ7BIT2ASCII[tmp[j]];
-                        }
-                } else {
-                        out[k] = tmp[j];
-                }
-        }
-
-        free(tmp);
-}
-
 static inline char *pdu_get_smsc_len(char *body, char *smsc_len)
 {
 	char *pBegin, *pEnd;
@@ -796,42 +663,15 @@ iconv_close (iconv_t cd)
 }
 
 #endif //iconv library implementation
-static int code_convert(const char *from_charset,const char *to_charset,char *inbuf,size_t inlen,char *outbuf,size_t outlen)
-{
-	iconv_t cd;
-	char **pin = &inbuf;
-	char **pout = &outbuf;
-
-printf("to_charset >>%s<< from_charset >>%s<< inlen %d outlen %d\n", to_charset, from_charset, inlen, outlen);
-
-	cd = iconv_open(to_charset,from_charset);
-	if ( (iconv_t)-1 == cd ) {
-		printf("file:%s,line:%d,iconv_open error!\n",__FILE__,__LINE__);
-		return -1;
-	}
-
-printf ("==================================\n");
-	memset(outbuf,0,outlen);
-
-	if (iconv(cd,pin,&inlen,pout,&outlen) == -1) {
-		printf("file:%s,line:%d,iconv error!\n",__FILE__,__LINE__);
-		return -1;
-	}
-        printf ("output: >>%s<<\n", outbuf);
-
-	iconv_close(cd);
-
-	return outlen;
-}
 #if 0
 static int unicode_2_gb18030(char *inbuf,size_t inlen,char *outbuf,size_t outlen)
 {
-	return code_convert("UCS-2","GB18030",inbuf,inlen,outbuf,outlen);
+	return gsm_code_convert("UCS-2","GB18030",inbuf,inlen,outbuf,outlen);
 }
 
 static int gb18030_2_unicode(char *inbuf,size_t inlen,char *outbuf,size_t outlen)
 {
-	return code_convert("GB18030","UCS-2",inbuf,inlen,outbuf,outlen);
+	return gsm_code_convert("GB18030","UCS-2",inbuf,inlen,outbuf,outlen);
 }
 
 static int sms_decode_gb18030(char *in, size_t inlen, char *out)
@@ -960,20 +800,17 @@ static int sms_encode(char *sms_coding,char *in, size_t inlen, char *out, size_t
 {
         int outleft;
         char coding[256];
-        char tmp[512];
-        int j;
-
-        //Add BOM header
-        tmp[0] = 0xFE;
-        tmp[1] = 0xFF;
-        memcpy(&tmp[2],in,inlen);
-        j = 2 + inlen;
 
-        memset(coding,0,sizeof(coding));
-        memcpy(coding,sms_coding,strlen(sms_coding));
+        strncpy(coding,sms_coding,sizeof(coding) - 1);
+        coding[sizeof(coding) - 1] = '\0';
         to_upper_string(coding);
-        //outleft = code_convert("UCS-2BE",coding,tmp,j,out,outlen);
-        outleft = code_convert("UTF-16",coding,tmp,j,out,outlen);
+
+        //UTF-8 needs no iconv
+        if(!strcmp(coding,"UTF-8") || !strcmp(coding,"UTF8")) {
+                return gsm_ucs2_to_utf8((unsigned char*)in,inlen,out,outlen);
+        }
+
+        outleft = gsm_code_convert("UTF-16BE",coding,in,inlen,out,outlen);
         if (outleft <= 0) {
                 return -1;
         }
@@ -1317,16 +1154,7 @@ static int gsmInvertNumbers(const char* pSrc, char* pDst,int nSrcLength)
  */
 static int gsmBytes2String(const unsigned char* pSrc, char* pDst, int nSrcLength)
 {
-	const char tab[]="0123456789ABCDEF";
-	int i;
-	for(i=0; i<nSrcLength; i++) {
-		*pDst++ = tab[*pSrc >> 4];
-		*pDst++ = tab[*pSrc & 0x0f];
-		pSrc++;
-	}
-
-	*pDst = '\0';
-	return nSrcLength * 2;
+	return gsm_hex_encode(pSrc, nSrcLength, pDst);
 }
 
 /**
@@ -1342,182 +1170,6 @@ static int gsmBytes2String_pdu(const unsigned char* pSrc, unsigned char* pDst, i
 	return nSrcLength;
 }
 
-/**
- * \fn     int myUTF8_to_UNICODE(Uint16* unicode, unsigned char* utf8, int len)
- * \brief  
- * \param  none
- * \return none
- */
-static int myUTF8_to_UNICODE(unsigned char* unicode, unsigned char* utf8, int len)
-{
-	int length=0;
-	unsigned int code_int;
-	int i;
-	 
-	for(i = 0; i<len;i++) {
-		if(utf8[i]<=0x7f) {
-			unicode[length]=0x00;
-			length++;
-			unicode[length]=utf8[i];
-			length++;	 
-		} else if(utf8[i]<=0xdf) {
-			code_int = (((unsigned char) utf8[i] & 0x1f)  << 6) + ((unsigned char) utf8[i+1] & 0x3f) ;
-			unicode[length] = (unsigned char) (code_int >> 8);
-			i += 1;
-			unicode[length+1] = (unsigned char) code_int;
-			unicode[length] = (unsigned char) (code_int >> 8);				
-			length += 2;
-		} else {
-			code_int = ((int) ((unsigned char) utf8[i] & 0x0f) << 12)+(((unsigned char) utf8[i+1] & 0x3f) << 6)+((unsigned char) utf8[i+2] & 0x3f);
-			i += 2;
-			unicode[length+1] = (unsigned char) code_int;
-			unicode[length] = (unsigned char) (code_int >> 8);				
-			length += 2;
-		}	 	
-	}
-
-	return (length);
-}
-#if 0
-/**
- * \fn        int gsmEncode7bit(const char* pSrc, unsigned char* pDst, int nSrcLength)
- * \brief  
- * \param  const char* pSrc
- *             unsigned char* pDst
- *             int nSrcLength
- * \return  the length of the pDst.
- */
-static int gsmEncode7bit(const char* pSrc, unsigned char* pDst, int nSrcLength)
-{
-	int nSrc;
-	int nDst; 
-	int nChar;
-	unsigned char nLeft; 
-	 
-	nSrc = 0;
-	nDst = 0; 
- 
-	while (nSrc < nSrcLength) {
-		nChar = nSrc & 7; 
-		if(nChar == 0) {
-			nLeft = *pSrc;
-		} else {
-			*pDst = (*pSrc << (8-nChar)) | nLeft;  
-			nLeft = *pSrc >> nChar;	
-			pDst++;
-			nDst++;
-		}
-		pSrc++;
-		nSrc++;
-	} 
-	return nDst;
-}
-#else
-
-/**
- * \fn        int gsmEncode7bit(const char* pSrc, unsigned char* pDst, int nSrcLength)
- * \brief  
- * \param  const char* pSrc
- *             unsigned char* pDst
- *                 int nSrcLength
- *                 int *pUDLen   Set User Data len,7bit User Data
- *                 length not equal to pDst length
- * \return  the length of the pDst.
- */
-static int gsmEncode7bit(const char* pSrc, unsigned char* pDst, int nSrcLength, unsigned char* pUDLen)
-{
-        int nSrc;
-        int nDst;
-        int nChar;
-        unsigned char nLeft;
-        int len;
-
-        unsigned char* tmp;
-        tmp = (unsigned char*)malloc(320);
-        memset(tmp,0,320);
-
-        // This is the transition table from 7-bit to ASCII
-   int UK = -1;
-   const unsigned char EQ7BIT2ASCII[128] =
-                {  64, 163,  36, 165, 232, 223, 249, 236, 242, 199,
-                   10, 216, 248,  13, 197, 229,  UK,  95,  UK,  UK,
-                   UK,  UK,  UK,  UK,  UK,  UK,  UK,  UK, 198, 230,
-                  223, 201,  32,  33,  34,  35, 164,  37,  38,  39,
-                   40,  41,  42,  43,  44,  45,  46,  47,  48,  49,
-                   50,  51,  52,  53,  54,  55,  56,  57,  58,  59,
-                   60,  61,  62,  63, 161,  65,  66,  67,  68,  69,
-                   70,  71,  72,  73,  74,  75,  76,  77,  78,  79,
-                   80,  81,  82,  83,  84,  85,  86,  87,  88,  89,
-                   90, 196, 204, 209, 220, 167, 191,  97,  98,  99,
-                  100, 101, 102, 103, 104, 105, 106, 107, 108, 109,
-                  110, 111, 112, 113, 114, 115, 116, 117, 118, 119,
-                  120, 121, 122, 228, 246, 241, 252, 224
-                };
-
-        int i,j,k;
-
-        len = nSrcLength;
-        for(i=0,j=0; i<nSrcLength; i++,j++) {
-                switch(pSrc[i]) {
-                case 0x000C: tmp[j] = 0x1B; tmp[++j] = 0x0A; len++; break;  //  FORM FEED
-                case 0x005E: tmp[j] = 0x1B; tmp[++j] = 0x14; len++; break;   //CIRCUMFLEX ACCENT
-                case 0x007B: tmp[j] = 0x1B; tmp[++j] = 0x28; len++; break;   //LEFT CURLY BRACKET
-                case 0x007D: tmp[j] = 0x1B; tmp[++j] = 0x29; len++; break;   //RIGHT CURLY BRACKET
-                case 0x005C: tmp[j] = 0x1B; tmp[++j] = 0x2F; len++; break;   //REVERSE SOLIDUS
-                case 0x005B: tmp[j] = 0x1B; tmp[++j] = 0x3C; len++; break;   //LEFT SQUARE BRACKET
-                case 0x007E: tmp[j] = 0x1B; tmp[++j] = 0x3D; len++; break;   //TILDE
-                case 0x005D: tmp[j] = 0x1B; tmp[++j] = 0x3E; len++; break;   //RIGHT SQUARE BRACKET
-                case 0x007C: tmp[j] = 0x1B; tmp[++j] = 0x40; len++; break;   //VERTICAL LINE
-                default: tmp[j] = pSrc[i];
-                //case 0x20AC; tmp[j] = 0x1B; tmp[++j] = 0x65; break; //EURO SIGN
-                }
-
-                for(k=0; k<128; k++) {
-                        if(pSrc[i] == EQ7BIT2ASCII[k] ) {
-                                tmp[j] = k;
-                                break;
-                        }
-                }
-		if(j<5 || j>150)
-		printf(" ++ j %d tmp[j] %X\n", j, tmp[j]);
-        }
-
-		printf(" ++ len %d \n", len);
-        nSrc = 0;
-        nDst = 0;
-
-        unsigned char* p;
-        p = tmp;
-	*pDst = (*p << 1);
-	pDst++;
-	p++;
-	nDst++;
-
-        while (nSrc < len) {
-                nChar = nSrc & 7;
-                if(nChar == 0) {
-                        nLeft = *p;
-                } else {
-                        *pDst = (*p << (8-nChar)) | nLeft;
-                        nLeft = *p >> nChar;
-                        pDst++;
-                        nDst++;
-                }
-                p++;
-                nSrc++;
-        }
-
-        free(tmp);
-
-        *pUDLen = len; //Setting User Data length
-	printf("-----------TP UDL %d nDst %d\n", len, nDst);
-        //*pUDLen = len; //Setting User Data length
-
-        return nDst;
-}
-
-
-#endif
 /**
  * \fn       int gsmEncode8bit(const char* pSrc,unsigned char* pDst,int nSrcLength)
  * \brief  
@@ -1553,29 +1205,29 @@ static int gsm_is_valid_number(const char* number)
 
 	return 1;
 }
-#ifdef PDU_LONG
-static int gsm_encode_pdu(const char* SCA, const char* TPA, char TP_PID, char TP_DCS, const char* TP_UD, gsm_sms_pdu* long_pdu, char* pDst){
-#else
-static int gsm_encode_pdu(const char* SCA, const char* TPA, char TP_PID, char TP_DCS, const char* TP_UD, char* pDst){
-#endif
+/* Hex of the longest SMS center field, an address of 20 digits, and the NUL */
+#define GSM_PDU_SCA_SIZE	(4 + 20 + 1)
 
-	int nLength; 
-	int nDstLength; 	
-	unsigned char buf[256];
-	char udh_total[16];
-	char udh_part_num[16];
-
-	if(!gsm_is_valid_number(TPA)) {
-		return 0;
-	}
+/**
+ * \fn        int gsm_encode_pdu_sca(const char* SCA, char* pDst, size_t size)
+ * \brief     SMS center field, "" for the one set in the SIM
+ * \return  the length of the pDst, 0 if SCA is not a number or its field needs more than size bytes.
+ */
+static int gsm_encode_pdu_sca(const char* SCA, char* pDst, size_t size)
+{
+	int nLength;
+	int nDstLength;
+	unsigned char buf[2];
 
-	//SMS Center
-	/////////////////////////////////////////////////////////////////////////
 	nLength = strlen(SCA); 
 	if(nLength) {
 		if(!gsm_is_valid_number(SCA)) {
 			return 0;
 		}
+		/* Length and type octets, the digits padded to a whole octet, the NUL */
+		if((size_t)(4 + ((nLength + 1) & ~1) + 1) > size) {
+			return 0;
+		}
 		buf[0] = ((char)((nLength & 1) == 0 ? nLength : nLength + 1))/2 + 1;
 		buf[1] = 0x91;
 		nDstLength = gsmBytes2String(buf, pDst, 2); 
@@ -1584,16 +1236,28 @@ static int gsm_encode_pdu(const char* SCA, const char* TPA, char TP_PID, char TP
 		nDstLength = gsmBytes2String(buf, pDst, 1);
 	}
 	nDstLength += gsmInvertNumbers(SCA, &pDst[nDstLength], nLength); 
-	/////////////////////////////////////////////////////////////////////////
 
-	/////////////////////////////////////////////////////////////////////////
+	return nDstLength;
+}
+
+/**
+ * \fn        int gsm_encode_pdu_da(const char* TPA, char* pDst)
+ * \brief     first octet, TP-MR and TP-DA, the only recipient dependent part of a PDU
+ * \return  the length of the pDst.
+ */
+static int gsm_encode_pdu_da(const char* TPA, char* pDst)
+{
+	int nLength;
+	int nDstLength;
+	unsigned char buf[4];
+
 	if(TPA[0] == '+' ) {
 		nLength = strlen(&(TPA[1])); 
 		buf[0] = 0x71;	 
 		buf[1] = 0;  
 		buf[2] = (char)nLength; 	
 		buf[3] = 0x91;	
-		nDstLength += gsmBytes2String(buf, &pDst[nDstLength], 4);
+		nDstLength = gsmBytes2String(buf, pDst, 4);
 		nDstLength += gsmInvertNumbers(&(TPA[1]), &pDst[nDstLength], nLength);
 	} else {
 		nLength = strlen(TPA); 
@@ -1601,11 +1265,23 @@ static int gsm_encode_pdu(const char* SCA, const char* TPA, char TP_PID, char TP
 		buf[1] = 0;
 		buf[2] = (char)nLength;
 		buf[3] = 0x81;	
-		nDstLength += gsmBytes2String(buf, &pDst[nDstLength], 4);
+		nDstLength = gsmBytes2String(buf, pDst, 4);
 		nDstLength += gsmInvertNumbers(TPA, &pDst[nDstLength], nLength);
 	}
-	////////////////////////////////////////////////////////////////////////////
-	
+
+	return nDstLength;
+}
+
+/**
+ * \fn        int gsm_encode_pdu_ud(char TP_PID, char TP_DCS, const char* TP_UD, gsm_sms_pdu* long_pdu, char* pDst)
+ * \brief     TP-PID, TP-DCS, TP-VP, TP-UDL, concatenation UDH and TP-UD
+ * \return  the length of the pDst.
+ */
+static int gsm_encode_pdu_ud(char TP_PID, char TP_DCS, const char* TP_UD, gsm_sms_pdu* long_pdu, char* pDst)
+{
+	int nLength; 
+	unsigned char buf[256];
+
 	nLength = strlen(TP_UD);
 	buf[0] = TP_PID;
 	buf[1] = TP_DCS;
@@ -1622,13 +1298,14 @@ static int gsm_encode_pdu(const char* SCA, const char* TPA, char TP_PID, char TP
                 buf[9] = (char)long_pdu->part_num;
 /******************************************************************************/
 		nLength = nLength + 10;
-                nDstLength += gsmBytes2String(buf, &pDst[nDstLength], nLength);
+                return gsmBytes2String(buf, pDst, nLength);
 
 	} else if(TP_DCS == GSM_UCS2) {
-		int leng_ucs = 254;
+		int leng_ucs;
 		unsigned char out[255];
 
-		leng_ucs=myUTF8_to_UNICODE(out, (unsigned char*)TP_UD,strlen(TP_UD));
+		//Room left in buf after the UDH and the NUL of gsmBytes2String_pdu
+		leng_ucs=gsm_utf8_to_ucs2((const unsigned char*)TP_UD,strlen(TP_UD),out,sizeof(buf) - 11);
 /*********************** UDH*************/
 		buf[3] =gsmBytes2String_pdu(out, &buf[10],leng_ucs);
                 buf[3] = (char)(buf[3]+6);
@@ -1643,14 +1320,38 @@ static int gsm_encode_pdu(const char* SCA, const char* TPA, char TP_PID, char TP
 		buf[3] =gsmBytes2String_pdu(out, &buf[4],leng_ucs);
 */
 		nLength = buf[3]+4;
-		nDstLength += gsmBytes2String(buf, &pDst[nDstLength],nLength);
+		return gsmBytes2String(buf, pDst,nLength);
 	} else {
 		buf[3] = gsmEncode8bit(TP_UD, &buf[4], nLength);
 		nLength = buf[3] + 4; 
-		nDstLength += gsmBytes2String(buf, &pDst[nDstLength], nLength); 
+		return gsmBytes2String(buf, pDst, nLength); 
 	}
+}
+
+#ifdef PDU_LONG
+static int gsm_encode_pdu(const char* SCA, const char* TPA, char TP_PID, char TP_DCS, const char* TP_UD, gsm_sms_pdu* long_pdu, char* pDst){
+#else
+static int gsm_encode_pdu(const char* SCA, const char* TPA, char TP_PID, char TP_DCS, const char* TP_UD, char* pDst){
+#endif
+
+	int nLength; 
+	int nDstLength; 	
+
+	if(!gsm_is_valid_number(TPA)) {
+		return 0;
+	}
+
+	//SMS Center
+	nDstLength = gsm_encode_pdu_sca(SCA, pDst, GSM_PDU_SCA_SIZE);
+	if(!nDstLength) {
+		return 0;
+	}
+
+	nDstLength += gsm_encode_pdu_da(TPA, &pDst[nDstLength]);
+
+	nLength = gsm_encode_pdu_ud(TP_PID, TP_DCS, TP_UD, long_pdu, &pDst[nDstLength]);
 	
-	return nDstLength;
+	return nDstLength + nLength;
 }
 #if 0
 int allogsm_encode_pdu_ucs2(const char* SCA, const char* TPA, char* TP_UD, const char* coding,char* pDst)
@@ -1658,9 +1359,9 @@ int allogsm_encode_pdu_ucs2(const char* SCA, const char* TPA, char* TP_UD, const
 	char mesg[1024];
 	
 	if(coding == NULL || strlen(coding) == 0)
-		code_convert("ASCII","UTF-8",TP_UD,strlen(TP_UD),mesg,1024);
+		gsm_code_convert("ASCII","UTF-8",TP_UD,strlen(TP_UD),mesg,1024);
 	else
-		code_convert(coding,"UTF-8",TP_UD,strlen(TP_UD),mesg,1024);
+		gsm_code_convert(coding,"UTF-8",TP_UD,strlen(TP_UD),mesg,1024);
 	
 	if(SCA == NULL)
 		return gsm_encode_pdu("", TPA, 0, GSM_UCS2, mesg, pDst);
@@ -1668,12 +1369,14 @@ int allogsm_encode_pdu_ucs2(const char* SCA, const char* TPA, char* TP_UD, const
 	return gsm_encode_pdu(SCA, TPA, 0, GSM_UCS2, mesg, pDst);
 }
 #else
-#ifdef PDU_LONG
-int allogsm_encode_pdu_ucs2(const char* smsc, const char* dest, unsigned char* sms_data, const char* coding, gsm_sms_pdu* long_pdu, unsigned char* pdu){
-#else
-int allogsm_encode_pdu_ucs2(const char* smsc, const char* dest, char* sms_data, const char* coding, char* pdu){
-#endif
-        char mesg[1024];
+/**
+ * \fn        int gsm_pdu_dcs(const char* sms_data, const char* coding, char* mesg)
+ * \brief     convert sms_data in mesg to what the encoder takes, Latin-1 for
+ *            GSM_7BIT and UTF-8 for GSM_UCS2, and choose the TP-DCS to send it with
+ * \return  GSM_7BIT or GSM_UCS2.
+ */
+static char gsm_pdu_dcs(const char* sms_data, const char* coding, char* mesg)
+{
         char text_coding[256];
         char TP_DCS;  //UCS2,7BIT or 8BIT
         if(coding == NULL || strlen(coding) == 0) {  //Use default ASCII
@@ -1683,28 +1386,115 @@ int allogsm_encode_pdu_ucs2(const char* smsc, const char* dest, char* sms_data,
                 to_upper_string(text_coding);
         }
 
-        if(strstr(text_coding,"UTF-8")) {
+        if(!strcmp(text_coding,"GSM7")) { //UTF-8 that allogsm_sms_classify() found fits GSM 7 bit
+                gsm_utf8_to_latin1((const unsigned char*)sms_data,strlen(sms_data),mesg,1024);
+                TP_DCS = GSM_7BIT;
+        } else if(!strcmp(text_coding,"UCS2")) { //UTF-8 that allogsm_sms_classify() found does not
                 strncpy(mesg,sms_data,1024);
-                TP_DCS = GSM_7BIT; //Assume is ASCII
-                unsigned char* p = (unsigned char*)mesg;
-                while(*p != '\0') {
-                        if(*p >= 128) { //It's not ASCII
-                                TP_DCS = GSM_UCS2;
-                                break;
-                        }
-                        p++;
+                TP_DCS = GSM_UCS2;
+        } else if(strstr(text_coding,"UTF-8")) {
+                struct allogsm_sms_plan plan;
+
+                allogsm_sms_classify((const unsigned char*)sms_data, &plan);
+                if(plan.ucs2) {
+                        strncpy(mesg,sms_data,1024);
+                        TP_DCS = GSM_UCS2;
+                } else {
+                        gsm_utf8_to_latin1((const unsigned char*)sms_data,strlen(sms_data),mesg,1024);
+                        TP_DCS = GSM_7BIT;
                 }
         } else if(strstr(text_coding,"ASCII")) { //ASCII same to UTF-8
                 strncpy(mesg,sms_data,1024);
                 TP_DCS = GSM_7BIT;
         } else {
-                code_convert(text_coding,"UTF-8",sms_data,strlen(sms_data),mesg,1024);
+                gsm_code_convert(text_coding,"UTF-8",(char*)sms_data,strlen(sms_data),mesg,1024);
                 TP_DCS = GSM_UCS2;
         }
 
+        return TP_DCS;
+}
+
+#ifdef PDU_LONG
+int allogsm_encode_pdu_ucs2(const char* smsc, const char* dest, unsigned char* sms_data, const char* coding, gsm_sms_pdu* long_pdu, unsigned char* pdu){
+#else
+int allogsm_encode_pdu_ucs2(const char* smsc, const char* dest, char* sms_data, const char* coding, char* pdu){
+#endif
+        char mesg[1024];
+        char TP_DCS;  //UCS2,7BIT or 8BIT
+
+        TP_DCS = gsm_pdu_dcs((const char*)sms_data, coding, mesg);
+
         return gsm_encode_pdu(smsc == NULL ? "" : smsc , dest, 0, TP_DCS, mesg, long_pdu, pdu);
 }
 
+/******************************************************************************
+ * Encode every part of a message once, for sending it to many numbers
+ * param:
+ *		tpl: template to fill in
+ *		smsc: SMS center, NULL or "" for the one of the SIM
+ *		long_pdu: message already split into parts
+ *		coding: charset of the parts, as for allogsm_encode_pdu_ucs2()
+ * return:
+ *		0: ok
+ *		-1: smsc is not a number or has more than 20 digits
+ * e.g.
+ *		allogsm_pdu_template_init(&tpl, NULL, &long_pdu, "UTF-8");
+ *		for (part = 0; part < tpl.total_parts; part++)
+ *			allogsm_pdu_template_fill(&tpl, part, "+8613678038107", pdu);
+ ******************************************************************************/
+int allogsm_pdu_template_init(struct allogsm_pdu_template *tpl, const char *smsc, gsm_sms_pdu *long_pdu, const char *coding)
+{
+	char mesg[1024];
+	char TP_DCS;
+	int part;
+
+	if (!tpl || !long_pdu || long_pdu->total_parts < 1 || long_pdu->total_parts > ALLOGSM_PDU_TEMPLATE_PARTS) {
+		return -1;
+	}
+
+	tpl->sca_len = gsm_encode_pdu_sca(smsc ? smsc : "", tpl->sca, sizeof(tpl->sca));
+	if (!tpl->sca_len) {
+		return -1;
+	}
+
+	tpl->total_parts = long_pdu->total_parts;
+	for (part = 0; part < tpl->total_parts; part++) {
+		long_pdu->part_num = part + 1;
+		TP_DCS = gsm_pdu_dcs((const char*)long_pdu->message_split[part], coding, mesg);
+		tpl->ud_len[part] = gsm_encode_pdu_ud(0, TP_DCS, mesg, long_pdu, tpl->ud[part]);
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+ * Make the PDU of one part of a template for one number
+ * param:
+ *		tpl: template from allogsm_pdu_template_init()
+ *		part: 0 to tpl->total_parts - 1
+ *		dest: destination number, an optional + then digits
+ *		pdu: filled with the PDU hex string, 1024 bytes are enough
+ * return:
+ *		length of pdu, the same as allogsm_encode_pdu_ucs2() gives
+ *		0: bad part or dest is not a number
+ ******************************************************************************/
+int allogsm_pdu_template_fill(const struct allogsm_pdu_template *tpl, int part, const char *dest, unsigned char *pdu)
+{
+	char *p = (char *)pdu;
+	int len;
+
+	if (!tpl || part < 0 || part >= tpl->total_parts || !dest || !gsm_is_valid_number(dest)) {
+		return 0;
+	}
+
+	memcpy(p, tpl->sca, tpl->sca_len);
+	len = tpl->sca_len;
+	len += gsm_encode_pdu_da(dest, &p[len]);
+	memcpy(&p[len], tpl->ud[part], tpl->ud_len[part] + 1);
+
+	return len + tpl->ud_len[part];
+}
+
 #endif
 int allogsm_forward_pdu(const char* src_pdu,const char* TPA,const char* SCA, char* pDst)
 {
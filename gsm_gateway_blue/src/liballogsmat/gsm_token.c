@@ -0,0 +1,487 @@
+/*
+ * liballogsmat: An implementation of ALLO GSM cards
+ *
+ * Line classifier for AT responses and unsolicited result codes
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "liballogsmat.h"
+#include "gsm_internal.h"
+#include "gsm_config.h"
+
+/*
+ * Every received line is classified once by walking a prefix trie built from
+ * the configured response strings, which gives the AT queue the response the
+ * line starts with.  The same strings are also compiled into a substring
+ * matcher, so module_receive can test a token mask with the strstr()
+ * semantics the state machine was written for, without running strstr() for
+ * each candidate response.
+ */
+
+#define GSM_TRIE_MAX_NODES	512
+
+struct gsm_trie_node {
+	char c;				/* Character leading to this node */
+	short token;		/* Token of the first pattern ending here, GSM_TOKEN_NONE if none */
+	unsigned int tokens;	/* GSM_TOKEN_MASK of every pattern ending here */
+	short child;		/* First child, 0 if none */
+	short sibling;		/* Next sibling, 0 if none */
+};
+
+struct gsm_token_pattern {
+	int token;
+	int cmds_id;			/* Response from the module config, -1 to use value */
+	const char *value;
+};
+
+static const struct gsm_token_pattern gsm_token_patterns[] = {
+	{ GSM_TOKEN_OK,				AT_OK,					NULL },
+	{ GSM_TOKEN_ERROR,			AT_ERROR,				NULL },
+	{ GSM_TOKEN_CME_ERROR,		AT_CME_ERROR,			NULL },
+	{ GSM_TOKEN_CMS_ERROR,		AT_CMS_ERROR,			NULL },
+	{ GSM_TOKEN_CREG,			AT_CREG,				NULL },
+	{ GSM_TOKEN_CMT,			AT_CHECK_SMS,			NULL },
+	{ GSM_TOKEN_CMGS,			AT_SEND_SMS_SUCCESS,	NULL },
+	{ GSM_TOKEN_CLIP,			AT_INCOMING_CALL,		NULL },
+	{ GSM_TOKEN_RING,			AT_RING,				NULL },
+	{ GSM_TOKEN_CUSD,			AT_CHECK_USSD,			NULL },
+	{ GSM_TOKEN_CSQ,			AT_CHECK_SIGNAL1,		NULL },
+	{ GSM_TOKEN_CSQN,			AT_CHECK_SIGNAL2,		NULL },
+	{ GSM_TOKEN_COPS,			AT_CHECK_NET,			NULL },
+	{ GSM_TOKEN_NO_CARRIER,		AT_NO_CARRIER,			NULL },
+	{ GSM_TOKEN_NO_ANSWER,		AT_NO_ANSWER,			NULL },
+	{ GSM_TOKEN_NO_DIALTONE,	AT_NO_DIALTONE,			NULL },
+	{ GSM_TOKEN_BUSY,			AT_BUSY,				NULL },
+	{ GSM_TOKEN_MO_CONNECTED,	AT_MO_CONNECTED,		NULL },
+	{ GSM_TOKEN_CPIN,			-1,						"+CPIN:" },
+	{ GSM_TOKEN_WIND,			-1,						"+WIND:" },
+	{ GSM_TOKEN_WBCI,			-1,						"+WBCI" },
+	{ GSM_TOKEN_CCWA,			-1,						"+CCWA:" },
+	{ GSM_TOKEN_PSCSC,			-1,						"*PSCSC:" },
+	{ GSM_TOKEN_PROMPT,			-1,						">" },
+	{ GSM_TOKEN_CMTI,			-1,						"+CMTI:" },
+	{ GSM_TOKEN_CMGL,			-1,						"+CMGL:" },
+	{ GSM_TOKEN_CPMS,			-1,						"+CPMS:" },
+};
+
+/*
+ * Substring matcher for expectlist.conf and the unsolicited lines that
+ * module_receive drops.  All patterns are compiled into one Aho-Corasick
+ * automaton with the failure links folded into a dense transition table, so
+ * a line is scanned exactly once no matter how many patterns are loaded.
+ * Bytes that appear in no pattern share class 0 to keep the table small.
+ */
+struct gsm_matcher {
+	int nstates;
+	int nclasses;
+	unsigned char cls[256];		/* Byte to column in delta */
+	unsigned short *delta;		/* nstates * nclasses next states */
+	unsigned int *out;			/* GSM_MATCH_* of every pattern ending in a state */
+};
+
+struct gsm_match_pattern {
+	unsigned int flag;
+	const char *value;
+};
+
+/* Unsolicited result codes module_receive ignores wherever they appear */
+static const struct gsm_match_pattern gsm_junk_patterns[] = {
+	{ GSM_MATCH_JUNK,	"+WBCI" },
+};
+
+/*
+ * Two banks so a config reload builds the new trie and matchers while span
+ * threads may still be walking the current ones.  Readers hold gsm_token_lock
+ * for the whole walk, the reload only takes it to switch gsm_trie_bank, so
+ * the spare bank is never rebuilt under a reader.  Node 0 is the root.
+ */
+static struct gsm_trie_node gsm_trie[2][GSM_TRIE_MAX_NODES];
+static struct gsm_matcher gsm_matcher[2];
+static struct gsm_matcher gsm_token_matcher[2];
+static int gsm_trie_bank = -1;
+static pthread_rwlock_t gsm_token_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t gsm_token_build_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t gsm_token_once = PTHREAD_ONCE_INIT;
+
+/* Add one pattern to the trie in bank, return -1 when it is full */
+static int gsm_trie_add(struct gsm_trie_node *trie, int *used, const char *pattern, int token)
+{
+	int node = 0;
+	int next;
+
+	if (!pattern || !*pattern) {
+		return 0;
+	}
+
+	for (; *pattern; pattern++) {
+		for (next = trie[node].child; next; next = trie[next].sibling) {
+			if (trie[next].c == *pattern) {
+				break;
+			}
+		}
+		if (!next) {
+			if (*used >= GSM_TRIE_MAX_NODES) {
+				return -1;
+			}
+			next = (*used)++;
+			trie[next].c = *pattern;
+			trie[next].token = GSM_TOKEN_NONE;
+			trie[next].tokens = 0;
+			trie[next].child = 0;
+			trie[next].sibling = trie[node].child;
+			trie[node].child = next;
+		}
+		node = next;
+	}
+
+	/* Responses configured identically (AT_MO_CONNECTED is OK on most modules)
+	   all match, the first one is the token of the line */
+	if (GSM_TOKEN_NONE == trie[node].token) {
+		trie[node].token = token;
+	}
+	trie[node].tokens |= GSM_TOKEN_MASK(token);
+
+	return 0;
+}
+
+static void gsm_matcher_free(struct gsm_matcher *m)
+{
+	free(m->delta);
+	free(m->out);
+	memset(m, 0, sizeof(*m));
+}
+
+/* Compile patterns into m, return -1 when out of memory */
+static int gsm_matcher_build(struct gsm_matcher *m, const struct gsm_match_pattern *patterns, int n)
+{
+	unsigned short *fail = NULL;
+	unsigned short *queue = NULL;
+	const unsigned char *p;
+	int max_states = 1;
+	int head, tail;
+	int state, next;
+	int i, c;
+
+	gsm_matcher_free(m);
+
+	m->nclasses = 1;
+	for (i = 0; i < n; i++) {
+		for (p = (const unsigned char *)patterns[i].value; *p; p++) {
+			if (!m->cls[*p]) {
+				m->cls[*p] = m->nclasses++;
+			}
+			max_states++;
+		}
+	}
+	if (max_states > 0xffff) {
+		return -1;
+	}
+
+	m->delta = malloc(sizeof(*m->delta) * max_states * m->nclasses);
+	m->out = calloc(max_states, sizeof(*m->out));
+	fail = malloc(sizeof(*fail) * max_states);
+	queue = malloc(sizeof(*queue) * max_states);
+	if (!m->delta || !m->out || !fail || !queue) {
+		free(fail);
+		free(queue);
+		gsm_matcher_free(m);
+		return -1;
+	}
+	memset(m->delta, 0xff, sizeof(*m->delta) * max_states * m->nclasses);
+
+	/* Goto function: a plain trie, 0xffff marks a missing edge */
+	m->nstates = 1;
+	for (i = 0; i < n; i++) {
+		state = 0;
+		for (p = (const unsigned char *)patterns[i].value; *p; p++) {
+			next = m->delta[state * m->nclasses + m->cls[*p]];
+			if (0xffff == next) {
+				next = m->nstates++;
+				m->delta[state * m->nclasses + m->cls[*p]] = next;
+			}
+			state = next;
+		}
+		m->out[state] |= patterns[i].flag;
+	}
+
+	/* Breadth first: fill missing edges from the failure state and merge outputs */
+	head = tail = 0;
+	for (c = 0; c < m->nclasses; c++) {
+		next = m->delta[c];
+		if (0xffff == next) {
+			m->delta[c] = 0;
+		} else {
+			fail[next] = 0;
+			queue[tail++] = next;
+		}
+	}
+	while (head < tail) {
+		state = queue[head++];
+		m->out[state] |= m->out[fail[state]];
+		for (c = 0; c < m->nclasses; c++) {
+			next = m->delta[state * m->nclasses + c];
+			if (0xffff == next) {
+				m->delta[state * m->nclasses + c] = m->delta[fail[state] * m->nclasses + c];
+			} else {
+				fail[next] = m->delta[fail[state] * m->nclasses + c];
+				queue[tail++] = next;
+			}
+		}
+	}
+
+	free(fail);
+	free(queue);
+
+	return 0;
+}
+
+/* Compile expectlist.conf and the junk filter into the matcher in bank */
+static int gsm_matcher_init(int bank)
+{
+	struct gsm_match_pattern *patterns;
+	int njunk = sizeof(gsm_junk_patterns) / sizeof(gsm_junk_patterns[0]);
+	int n = 0;
+	int res;
+	int i;
+
+	patterns = malloc(sizeof(*patterns) * (MAX_EXPECTLIST_SIZE + njunk));
+	if (!patterns) {
+		return -1;
+	}
+	for (i = 0; i < (int)MAX_EXPECTLIST_SIZE; i++) {
+		patterns[n].flag = GSM_MATCH_EXPECT;
+		patterns[n].value = list[i].value;
+		n++;
+	}
+	for (i = 0; i < njunk; i++) {
+		patterns[n++] = gsm_junk_patterns[i];
+	}
+
+	res = gsm_matcher_build(&gsm_matcher[bank], patterns, n);
+	free(patterns);
+
+	return res;
+}
+
+/* Compile every configured response into the token matcher in bank */
+static int gsm_token_matcher_init(int bank)
+{
+	struct gsm_match_pattern patterns[sizeof(gsm_token_patterns) / sizeof(gsm_token_patterns[0])];
+	const char *pattern;
+	int ntokens = sizeof(gsm_token_patterns) / sizeof(gsm_token_patterns[0]);
+	int n = 0;
+	int i;
+
+	for (i = 0; i < ntokens; i++) {
+		if (gsm_token_patterns[i].cmds_id >= 0) {
+			pattern = get_at(0, gsm_token_patterns[i].cmds_id);
+		} else {
+			pattern = gsm_token_patterns[i].value;
+		}
+		/* An empty response would be found in every line */
+		if (!pattern || !*pattern) {
+			continue;
+		}
+		patterns[n].flag = GSM_TOKEN_MASK(gsm_token_patterns[i].token);
+		patterns[n].value = pattern;
+		n++;
+	}
+
+	return gsm_matcher_build(&gsm_token_matcher[bank], patterns, n);
+}
+
+/* Build the first bank unless a config load already did */
+static void gsm_token_first(void)
+{
+	if (gsm_trie_bank < 0) {
+		gsm_token_init();
+	}
+}
+
+/* Read lock the current bank, building it on first use; unlock with gsm_token_unlock() */
+static int gsm_token_rdlock(void)
+{
+	pthread_once(&gsm_token_once, gsm_token_first);
+	pthread_rwlock_rdlock(&gsm_token_lock);
+
+	return gsm_trie_bank;
+}
+
+static void gsm_token_unlock(void)
+{
+	pthread_rwlock_unlock(&gsm_token_lock);
+}
+
+/* Run line through m, stop once any bit of stop is found */
+static unsigned int gsm_matcher_scan(const struct gsm_matcher *m, const char *line, unsigned int stop)
+{
+	const unsigned char *p;
+	unsigned int found;
+	int state = 0;
+
+	if (!m->delta) {
+		return 0;
+	}
+
+	found = m->out[0];
+	for (p = (const unsigned char *)line; *p && !(found & stop); p++) {
+		state = m->delta[state * m->nclasses + m->cls[*p]];
+		found |= m->out[state];
+	}
+
+	return found;
+}
+
+/******************************************************************************
+ * Build the line classifier and response matcher from the loaded module
+ * config and expectlist.conf
+ * param:
+ *		void
+ * return:
+ *		0: ok
+ *		-1: some patterns did not fit
+ ******************************************************************************/
+int gsm_token_init(void)
+{
+	struct gsm_trie_node *trie;
+	const char *pattern;
+	int ntokens = sizeof(gsm_token_patterns) / sizeof(gsm_token_patterns[0]);
+	int bank;
+	int used = 1;
+	int res = 0;
+	int i;
+
+	/* Only the spare bank is written, one reload at a time */
+	pthread_mutex_lock(&gsm_token_build_lock);
+
+	bank = (gsm_trie_bank == 0) ? 1 : 0;
+	trie = gsm_trie[bank];
+	memset(&trie[0], 0, sizeof(trie[0]));
+
+	for (i = 0; i < ntokens; i++) {
+		if (gsm_token_patterns[i].cmds_id >= 0) {
+			pattern = get_at(0, gsm_token_patterns[i].cmds_id);
+		} else {
+			pattern = gsm_token_patterns[i].value;
+		}
+		if (gsm_trie_add(trie, &used, pattern, gsm_token_patterns[i].token) < 0) {
+			printf("Too many response patterns, %s not classified\n", pattern);
+			res = -1;
+		}
+	}
+
+	if (gsm_matcher_init(bank) < 0 || gsm_token_matcher_init(bank) < 0) {
+		printf("Can not build the response matcher\n");
+		res = -1;
+	}
+
+	pthread_rwlock_wrlock(&gsm_token_lock);
+	gsm_trie_bank = bank;
+	pthread_rwlock_unlock(&gsm_token_lock);
+
+	pthread_mutex_unlock(&gsm_token_build_lock);
+
+	return res;
+}
+
+/******************************************************************************
+ * Classify a received line
+ * param:
+ *		line: NUL terminated AT line
+ *		tokens: if not NULL, set to the GSM_TOKEN_MASK of every response
+ *				configured as that longest one
+ * return:
+ *		int: GSM_TOKEN_* of the longest configured response the line starts with
+ *		GSM_TOKEN_NONE: no known response
+ * e.g.
+ *		gsm_classify_line("+CREG: 1,5", NULL)	=> GSM_TOKEN_CREG
+ *		gsm_classify_line("OK", &tokens)		=> GSM_TOKEN_OK, tokens has
+ *												   GSM_TOKEN_MO_CONNECTED too
+ ******************************************************************************/
+int gsm_classify_line(const char *line, unsigned int *tokens)
+{
+	const struct gsm_trie_node *trie;
+	int token = GSM_TOKEN_NONE;
+	unsigned int mask = 0;
+	int node = 0;
+	int next;
+
+	trie = gsm_trie[gsm_token_rdlock()];
+
+	for (; *line; line++) {
+		for (next = trie[node].child; next; next = trie[next].sibling) {
+			if (trie[next].c == *line) {
+				break;
+			}
+		}
+		if (!next) {
+			break;
+		}
+		node = next;
+		if (GSM_TOKEN_NONE != trie[node].token) {
+			token = trie[node].token;
+			mask = trie[node].tokens;
+		}
+	}
+
+	gsm_token_unlock();
+
+	if (tokens) {
+		*tokens = mask;
+	}
+	return token;
+}
+
+/******************************************************************************
+ * Find which pattern sets occur anywhere in a received line
+ * param:
+ *		line: NUL terminated AT line
+ *		stop: return as soon as any of these GSM_MATCH_* bits is found
+ * return:
+ *		unsigned int: GSM_MATCH_* bits of every pattern set found
+ * e.g.
+ *		expectlist.conf contains "+CREG"
+ *		gsm_match_line("+CREG: 1", GSM_MATCH_EXPECT)	=> GSM_MATCH_EXPECT
+ *		gsm_match_line("+WBCI: 2", 0)				=> GSM_MATCH_JUNK
+ *		gsm_match_line("abc", 0)					=> 0
+ ******************************************************************************/
+unsigned int gsm_match_line(const char *line, unsigned int stop)
+{
+	unsigned int found;
+
+	found = gsm_matcher_scan(&gsm_matcher[gsm_token_rdlock()], line, stop);
+	gsm_token_unlock();
+
+	return found;
+}
+
+/******************************************************************************
+ * Find which configured responses occur anywhere in a received line, as
+ * gsm_compare() would
+ * param:
+ *		line: NUL terminated AT line
+ * return:
+ *		unsigned int: GSM_TOKEN_MASK of every response found
+ * e.g.
+ *		gsm_search_line("+CME ERROR: 10")	=> GSM_TOKEN_CME_ERROR and GSM_TOKEN_ERROR
+ *		gsm_search_line("abc")				=> 0
+ ******************************************************************************/
+unsigned int gsm_search_line(const char *line)
+{
+	unsigned int found;
+
+	found = gsm_matcher_scan(&gsm_token_matcher[gsm_token_rdlock()], line, 0);
+	gsm_token_unlock();
+
+	return found;
+}
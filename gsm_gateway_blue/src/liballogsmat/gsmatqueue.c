@@ -0,0 +1,307 @@
+/*
+ * liballogsmat: An implementation of ALLO GSM cards
+ *
+ * Per span AT command queue
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "liballogsmat.h"
+#include "gsm_internal.h"
+
+/*
+ * Commands queued here are written one at a time while the span is in
+ * ALLOGSM_STATE_READY and no command of the state machine is outstanding
+ * (gsm->at_pending).  The head command owns the lines that come back until
+ * one of its final results arrives or its deadline fires, then the next one
+ * is written straight away.  Lines the head command did not ask for are left
+ * to the state machine in module_receive.
+ *
+ * Whatever the state machine writes while a queued command is in flight (a
+ * dial, an answer, an SMS) is held in the TX ring, see gsm->tx_held, and goes
+ * out once that command is answered, so final results are never routed to
+ * the wrong command.  Any command written around the queue, by the state
+ * machine or raw with allogsm_transmit(), sets at_pending the same way, so
+ * the queue waits for its final result, or GSM_AT_RAW_TIMEOUT ms if none
+ * comes.
+ */
+
+static void gsm_at_queue_send(struct allogsm_modul *gsm);
+static void gsm_at_raw_pending(struct allogsm_modul *gsm);
+
+static void gsm_at_cmd_release(struct allogsm_modul *gsm, struct gsm_at_cmd *cmd)
+{
+	cmd->next = gsm->atq_free;
+	gsm->atq_free = cmd;
+}
+
+/* Unlink the head command and report token to its owner */
+static void gsm_at_queue_complete(struct allogsm_modul *gsm, int token, const char *line)
+{
+	struct gsm_at_cmd *cmd = gsm->atq_head;
+
+	gsm_schedule_del(gsm, gsm->atq_sched);
+	gsm->atq_sched = 0;
+
+	gsm->atq_head = cmd->next;
+	if (!gsm->atq_head) {
+		gsm->atq_tail = NULL;
+	}
+	gsm->atq_len--;
+
+	/* Let out what the state machine wrote meanwhile, the queue waits for its answer */
+	if (gsm->tx_held) {
+		gsm->tx_held = 0;
+		gsm_at_raw_pending(gsm);
+		allogsm_tx_flush(gsm);
+	}
+
+	if (cmd->done) {
+		cmd->done(gsm, cmd, token, line);
+	}
+	gsm_at_cmd_release(gsm, cmd);
+}
+
+static void gsm_at_queue_timeout(void *data)
+{
+	struct allogsm_modul *gsm = data;
+	struct gsm_at_cmd *cmd = gsm->atq_head;
+
+	gsm->atq_sched = 0;
+	if (!cmd || !cmd->sent) {
+		return;
+	}
+
+	/* Not resent behind held frames, those wait for this command */
+	if ((cmd->retries > 0) && !gsm->tx_held) {
+		cmd->retries--;
+		gsm_error(gsm, "Span %d: no answer to %s, retrying\n", gsm->span, cmd->at);
+		gsm_at_queue_send(gsm);
+		return;
+	}
+
+	gsm_error(gsm, "Span %d: no answer to %s\n", gsm->span, cmd->at);
+	gsm_at_queue_complete(gsm, GSM_TOKEN_NONE, NULL);
+	gsm_at_queue_kick(gsm);
+}
+
+static void gsm_at_queue_send(struct allogsm_modul *gsm)
+{
+	struct gsm_at_cmd *cmd = gsm->atq_head;
+
+	/* Marked sent once written, so gsm_tx_queue() doesn't hold it back */
+	cmd->sent = 0;
+	if (__gsm_send_at(gsm, cmd->at)) {
+		gsm_error(gsm, "Span %d: unable to send %s\n", gsm->span, cmd->at);
+	}
+	cmd->sent = 1;
+	/* A failed write is retried through the deadline like a lost answer */
+	gsm->atq_sched = gsm_schedule_event(gsm, cmd->timeout, gsm_at_queue_timeout, gsm);
+}
+
+/* No final result came for the command written around the queue, stop waiting */
+static void gsm_at_raw_timeout(void *data)
+{
+	struct allogsm_modul *gsm = data;
+
+	gsm->at_raw_sched = 0;
+	if (gsm->atq_head && gsm->atq_head->sent) {
+		return;
+	}
+	gsm->at_pending = 0;
+	gsm_at_queue_kick(gsm);
+}
+
+/* Hold the queue until the command written around it is answered */
+static void gsm_at_raw_pending(struct allogsm_modul *gsm)
+{
+	gsm->at_pending = 1;
+	gsm_schedule_del(gsm, gsm->at_raw_sched);
+	gsm->at_raw_sched = gsm_schedule_event(gsm, GSM_AT_RAW_TIMEOUT, gsm_at_raw_timeout, gsm);
+	if (gsm->at_raw_sched < 0) {
+		gsm->at_raw_sched = 0;
+	}
+}
+
+/******************************************************************************
+ * Note a command written with gsm_send_at() or gsm_transmit(), the queue
+ * waits for its final result
+ * param:
+ *		gsm: gsm module
+ * return:
+ *		void
+ ******************************************************************************/
+void gsm_at_raw_sent(struct allogsm_modul *gsm)
+{
+	/* Held behind the queued command in flight, gsm_at_queue_complete() marks it */
+	if (gsm->atq_head && gsm->atq_head->sent) {
+		return;
+	}
+	gsm_at_raw_pending(gsm);
+}
+
+/******************************************************************************
+ * Get a command to fill in for gsm_at_queue()
+ * param:
+ *		gsm: gsm module
+ *		at: AT command, without the trailing CR LF
+ * return:
+ *		struct gsm_at_cmd*: command waiting for OK, ERROR, +CME ERROR,
+ *			+CMS ERROR or NO CARRIER within GSM_AT_TIMEOUT ms, no retry
+ *		NULL: queue is full or no memory
+ ******************************************************************************/
+struct gsm_at_cmd *gsm_at_cmd_new(struct allogsm_modul *gsm, const char *at)
+{
+	struct gsm_at_cmd *cmd;
+
+	if (!gsm || !at || gsm->atq_len >= GSM_AT_QUEUE_MAX) {
+		return NULL;
+	}
+
+	if (gsm->atq_free) {
+		cmd = gsm->atq_free;
+		gsm->atq_free = cmd->next;
+	} else {
+		cmd = malloc(sizeof(*cmd));
+		if (!cmd) {
+			gsm_error(gsm, "Insufficient memory for AT command.\n");
+			return NULL;
+		}
+	}
+
+	memset(cmd, 0, sizeof(*cmd));
+	strncpy(cmd->at, at, sizeof(cmd->at) - 1);
+	cmd->finals = GSM_AT_FINALS;
+	cmd->timeout = GSM_AT_TIMEOUT;
+
+	return cmd;
+}
+
+/******************************************************************************
+ * Queue a command from gsm_at_cmd_new()
+ * param:
+ *		gsm: gsm module
+ *		cmd: command, owned by the queue from now on
+ * return:
+ *		0: queued
+ *		-1: queue is full
+ * e.g.
+ *		cmd = gsm_at_cmd_new(gsm, "AT+CSQ");
+ *		cmd->infos = GSM_TOKEN_MASK(GSM_TOKEN_CSQ);
+ *		cmd->info = csq_received;
+ *		cmd->done = csq_done;
+ *		gsm_at_queue(gsm, cmd);
+ ******************************************************************************/
+int gsm_at_queue(struct allogsm_modul *gsm, struct gsm_at_cmd *cmd)
+{
+	if (gsm->atq_len >= GSM_AT_QUEUE_MAX) {
+		gsm_at_cmd_release(gsm, cmd);
+		return -1;
+	}
+
+	cmd->next = NULL;
+	cmd->sent = 0;
+	if (gsm->atq_tail) {
+		gsm->atq_tail->next = cmd;
+	} else {
+		gsm->atq_head = cmd;
+	}
+	gsm->atq_tail = cmd;
+	gsm->atq_len++;
+
+	gsm_at_queue_kick(gsm);
+
+	return 0;
+}
+
+/******************************************************************************
+ * Write the head command if the span is idle, called again whenever the
+ * state machine may have gone idle
+ * param:
+ *		gsm: gsm module
+ * return:
+ *		void
+ ******************************************************************************/
+void gsm_at_queue_kick(struct allogsm_modul *gsm)
+{
+	if (!gsm->atq_head || gsm->atq_head->sent) {
+		return;
+	}
+	if (ALLOGSM_STATE_READY != gsm->state || gsm->at_pending) {
+		return;
+	}
+
+	gsm_at_queue_send(gsm);
+}
+
+/******************************************************************************
+ * Offer a received line to the command in flight
+ * param:
+ *		gsm: gsm module, gsm->line_token already classified
+ *		line: received line
+ * return:
+ *		1: line belonged to the command in flight
+ *		0: line is for the state machine
+ ******************************************************************************/
+int gsm_at_queue_response(struct allogsm_modul *gsm, const char *line)
+{
+	struct gsm_at_cmd *cmd = gsm->atq_head;
+	unsigned int mask = gsm->line_tokens;
+
+	if (!cmd || !cmd->sent) {
+		/* Answer to a command of the state machine */
+		if (mask & GSM_AT_FINALS) {
+			gsm->at_pending = 0;
+			gsm_schedule_del(gsm, gsm->at_raw_sched);
+			gsm->at_raw_sched = 0;
+		}
+		return 0;
+	}
+
+	if (mask & cmd->finals) {
+		gsm_at_queue_complete(gsm, gsm->line_token, line);
+		gsm_at_queue_kick(gsm);
+		return 1;
+	}
+
+	if (mask & cmd->infos) {
+		if (cmd->info) {
+			cmd->info(gsm, cmd, line);
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+ * Drop every queued command, the owners see a GSM_TOKEN_NONE completion
+ * param:
+ *		gsm: gsm module
+ * return:
+ *		void
+ ******************************************************************************/
+void gsm_at_queue_destroy(struct allogsm_modul *gsm)
+{
+	struct gsm_at_cmd *cmd;
+
+	while (gsm->atq_head) {
+		gsm_at_queue_complete(gsm, GSM_TOKEN_NONE, NULL);
+	}
+	gsm_schedule_del(gsm, gsm->at_raw_sched);
+	gsm->at_raw_sched = 0;
+
+	while (gsm->atq_free) {
+		cmd = gsm->atq_free;
+		gsm->atq_free = cmd->next;
+		free(cmd);
+	}
+}
@@ -0,0 +1,181 @@
+/*
+ * liballogsmat: An implementation of ALLO GSM cards
+ *
+ * Microbenchmarks of the SMS codecs, run with "make bench"
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "liballogsmat.h"
+#include "gsm_internal.h"
+
+#define BENCH_ROUNDS	200000
+
+/* 153 characters, the longest part of a concatenated 7 bit SMS, with escapes */
+static const char bench_text[] =
+	"Your code is 4711. Valid for 10 min [do not share] {ref: A-93}. "
+	"Questions? Call +1 555 0100 ~ 24/7 | Reply STOP to opt out ^_^ "
+	"Thank you for choosing us!";
+
+static unsigned char bench_sink;
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_report(const char *name, double start, int bytes)
+{
+	double secs = bench_now() - start;
+
+	printf("%-24s %8.1f ns/op %8.1f MB/s\n", name,
+		secs * 1e9 / BENCH_ROUNDS, (double)bytes * BENCH_ROUNDS / secs / 1e6);
+}
+
+static void bench_7bit(void)
+{
+	unsigned char packed[256];
+	unsigned char text[GSM_7BIT_MAX_SEPTETS];
+	unsigned char udl = 0;
+	int len = strlen(bench_text);
+	int i, packed_len = 0;
+	double start;
+
+	start = bench_now();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		packed_len = gsmEncode7bit(bench_text, packed, len, &udl);
+		bench_sink ^= packed[i % packed_len];
+	}
+	bench_report("gsmEncode7bit", start, len);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		gsm_to8Bit(packed, text, udl, 1);
+		bench_sink ^= text[i % len];
+	}
+	bench_report("gsm_to8Bit", start, udl);
+
+	gsm_to8Bit(packed, text, udl, 1);
+	if (memcmp(text, bench_text, len)) {
+		printf("gsm_to8Bit: round trip mismatch\n");
+		exit(1);
+	}
+}
+
+static void bench_hex(void)
+{
+	unsigned char bytes[ALLOGSM_MAX_PDU_LENGTH / 2];
+	unsigned char back[ALLOGSM_MAX_PDU_LENGTH / 2];
+	char hex[ALLOGSM_MAX_PDU_LENGTH + 1];
+	int len = sizeof(bytes);
+	int i;
+	double start;
+
+	for (i = 0; i < len; i++) {
+		bytes[i] = rand();
+	}
+
+	printf("hex codec: %s\n", gsm_hex_impl());
+
+	start = bench_now();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		gsm_hex_encode(bytes, len, hex);
+		bench_sink ^= hex[i % len];
+	}
+	bench_report("gsm_hex_encode", start, len);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		gsm_hex_decode(hex, len, back);
+		bench_sink ^= back[i % len];
+	}
+	bench_report("gsm_hex_decode", start, len * 2);
+
+	if (memcmp(bytes, back, len)) {
+		printf("gsm_hex_decode: round trip mismatch\n");
+		exit(1);
+	}
+}
+
+static void bench_ucs2(void)
+{
+	/* 51 characters, one a surrogate pair, 104 bytes of UCS2 */
+	static const char text[] =
+		"\xE4\xBD\xA0\xE5\xA5\xBD! Your order #4711 ships today \xF0\x9F\x9A\x9A "
+		"\xD0\xA1\xD0\xBF\xD0\xB0\xD1\x81\xD0\xB8\xD0\xB1\xD0\xBE "
+		"caf\xC3\xA9 \xE2\x82\xAC" "12";
+	unsigned char ucs2[256];
+	char utf8[256];
+	int len = strlen(text);
+	int i, ucs2_len = 0;
+	double start;
+
+	start = bench_now();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		ucs2_len = gsm_utf8_to_ucs2((const unsigned char *)text, len, ucs2, sizeof(ucs2));
+		bench_sink ^= ucs2[i % ucs2_len];
+	}
+	bench_report("gsm_utf8_to_ucs2", start, len);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		gsm_ucs2_to_utf8(ucs2, ucs2_len, utf8, sizeof(utf8));
+		bench_sink ^= utf8[i % len];
+	}
+	bench_report("gsm_ucs2_to_utf8", start, ucs2_len);
+
+	if (strcmp(utf8, text)) {
+		printf("gsm_ucs2_to_utf8: round trip mismatch\n");
+		exit(1);
+	}
+
+	start = bench_now();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		gsm_code_convert("UTF-16BE", "UTF-8", (char *)ucs2, ucs2_len, utf8, sizeof(utf8));
+		bench_sink ^= utf8[i % len];
+	}
+	bench_report("gsm_code_convert", start, ucs2_len);
+}
+
+static void bench_classify(void)
+{
+	struct allogsm_sms_plan plan;
+	int len = strlen(bench_text);
+	int i;
+	double start;
+
+	start = bench_now();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		allogsm_sms_classify((const unsigned char *)bench_text, &plan);
+		bench_sink ^= plan.units;
+	}
+	bench_report("allogsm_sms_classify", start, len);
+
+	if (plan.ucs2 || plan.segments != 2) {
+		printf("allogsm_sms_classify: %s in %d segments, expected GSM7 in 2\n", plan.coding, plan.segments);
+		exit(1);
+	}
+}
+
+int main(void)
+{
+	printf("%d rounds, %d character message\n", BENCH_ROUNDS, (int)strlen(bench_text));
+	bench_7bit();
+	bench_hex();
+	bench_ucs2();
+	bench_classify();
+
+	return bench_sink == 0xFFFF;
+}
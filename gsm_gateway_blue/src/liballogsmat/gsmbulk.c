@@ -0,0 +1,289 @@
+/*
+ * liballogsmat: An implementation of ALLO GSM cards
+ *
+ * Bulk SMS, one message to a list of numbers
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "liballogsmat.h"
+#include "gsm_internal.h"
+
+/*
+ * A bulk job reads its recipient list ALLOGSM_BULK_AHEAD numbers at a time,
+ * so a list of any length costs that much memory.  The message is checked,
+ * split and encoded into a PDU template once when the job is made;
+ * allogsm_send_bulk() then only has to splice a destination into each part.
+ * The caller spreads a job over its spans by calling allogsm_bulk_read(),
+ * with no span locked as it reads the file, then allogsm_send_bulk() for
+ * each of them as their queues drain.
+ */
+
+/* Whether the span can take n more SMS now */
+static int bulk_room(struct allogsm_modul *gsm, int n)
+{
+#ifdef QUEUE_SMS
+	return !gsm->sms_queue || gsm->sms_queue->max_depth - gsm->sms_queue->used >= n;
+#else
+	/* A message waits for the span in a schedule slot */
+	return !gsm_schedule_room(gsm, n);
+#endif
+}
+
+/* Same rule as the PDU encoder: an optional + then digits only */
+static int bulk_valid_number(const char *number)
+{
+	const char *p = number;
+
+	if (*p == '+') {
+		p++;
+	}
+	if (*p == '\0') {
+		return 0;
+	}
+	for (; *p; p++) {
+		if (*p < '0' || *p > '9') {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Next usable number of the list into number, 0 at the end of the list */
+static int bulk_next(struct allogsm_bulk *bulk, char *number)
+{
+	char line[512];
+	char *p, *end;
+
+	while (fgets(line, sizeof(line), bulk->list)) {
+		bulk->ahead_read++;
+
+		/* First CSV field, quotes and blanks around it ignored */
+		p = line;
+		while (isspace((unsigned char)*p) || *p == '"') {
+			p++;
+		}
+		if (*p == '\0' || *p == '#') {
+			continue;
+		}
+		end = p;
+		while (*end && *end != ',' && *end != '"' && !isspace((unsigned char)*end)) {
+			end++;
+		}
+		*end = '\0';
+
+		if ((end - p) > ALLOGSM_MAX_PHONE_NUMBER || !bulk_valid_number(p)) {
+			bulk->ahead_invalid++;
+			continue;
+		}
+
+		strcpy(number, p);
+		return 1;
+	}
+
+	bulk->list_eof = 1;
+	return 0;
+}
+
+/******************************************************************************
+ * Make a bulk job
+ * param:
+ *		list: recipients, one per line, a number or a CSV line starting with
+ *			the number, empty lines and lines starting with # are skipped;
+ *			owned by the job from now on
+ *		message: sms body, UTF-8 unless coding says otherwise
+ *		id: identification of every sms of the job, may be NULL
+ *		prio: enum allogsm_sms_prio, ALLOGSM_SMS_PRIO_BULK for campaigns
+ *		pdu: 1 to send in PDU mode, 0 in text mode
+ *		smsc: SMS center for PDU mode, may be NULL
+ *		coding: coding for PDU mode, as for allogsm_sms_classify_coding()
+ * return:
+ *		struct allogsm_bulk*: job, free with allogsm_bulk_free()
+ *		NULL: bad message, more than ALLOGSM_SMS_MAX_SEGMENTS parts, bad smsc
+ *			or no memory
+ * e.g.
+ *		bulk = allogsm_bulk_new(fopen("/tmp/numbers.csv", "r"), msg, "promo", ALLOGSM_SMS_PRIO_BULK, 1, NULL, NULL);
+ ******************************************************************************/
+struct allogsm_bulk *allogsm_bulk_new(FILE *list, const unsigned char *message, const char *id, int prio, int pdu, const char *smsc, const char *coding)
+{
+	struct allogsm_bulk *bulk;
+	size_t len;
+
+	if (!list || !message) {
+		return NULL;
+	}
+
+	len = strlen((const char *)message);
+	if (len == 0 || len >= sizeof(bulk->message)) {
+		return NULL;
+	}
+
+	bulk = calloc(1, sizeof(*bulk));
+	if (!bulk) {
+		return NULL;
+	}
+
+	bulk->list = list;
+	memcpy(bulk->message, message, len + 1);
+	if (id) {
+		strncpy(bulk->id, id, sizeof(bulk->id) - 1);
+	}
+	bulk->prio = prio;
+	bulk->pdu = pdu;
+	if (smsc) {
+		strncpy(bulk->smsc, smsc, sizeof(bulk->smsc) - 1);
+	}
+
+	if (pdu) {
+		struct allogsm_sms_plan plan;
+
+		if (allogsm_sms_classify_coding(bulk->message, coding, &plan) ||
+		    allogsm_sms_plan_split(bulk->message, &plan, &bulk->parts)) {
+			free(bulk);
+			return NULL;
+		}
+		strncpy(bulk->coding, plan.coding, sizeof(bulk->coding) - 1);
+		if (allogsm_pdu_template_init(&bulk->tpl, bulk->smsc, &bulk->parts, bulk->coding)) {
+			free(bulk);
+			return NULL;
+		}
+	}
+
+	return bulk;
+}
+
+/******************************************************************************
+ * Read the next recipients of a bulk job from its list
+ * param:
+ *		bulk: job from allogsm_bulk_new()
+ * return:
+ *		recipients read and not queued yet, up to ALLOGSM_BULK_AHEAD
+ * e.g.
+ *		allogsm_bulk_read(bulk);
+ *		allogsm_send_bulk(gsm, bulk, 16);
+ ******************************************************************************/
+int allogsm_bulk_read(struct allogsm_bulk *bulk)
+{
+	if (!bulk) {
+		return 0;
+	}
+
+	if (bulk->ahead_next) {
+		bulk->ahead_len -= bulk->ahead_next;
+		memmove(bulk->ahead[0], bulk->ahead[bulk->ahead_next], bulk->ahead_len * sizeof(bulk->ahead[0]));
+		bulk->ahead_next = 0;
+	}
+	while (bulk->ahead_len < ALLOGSM_BULK_AHEAD && !bulk->list_eof && bulk_next(bulk, bulk->ahead[bulk->ahead_len])) {
+		bulk->ahead_len++;
+	}
+
+	return bulk->ahead_len;
+}
+
+/******************************************************************************
+ * Queue the next recipients of a bulk job on a span
+ * param:
+ *		gsm: gsm module
+ *		bulk: job from allogsm_bulk_new()
+ *		max: most recipients to queue now
+ * return:
+ *		>= 0: recipients queued, fewer than max when the span queue is full,
+ *			allogsm_bulk_read() has none left or the list is done (bulk->eof)
+ *		-1: bad arguments
+ ******************************************************************************/
+int allogsm_send_bulk(struct allogsm_modul *gsm, struct allogsm_bulk *bulk, int max)
+{
+	gsm_sms_pdu *parts;
+	unsigned char pdu[1024];
+	char *number;
+	int n = 0, part;
+
+	if (!gsm || !bulk) {
+		return -1;
+	}
+	parts = &bulk->parts;
+
+	bulk->read += bulk->ahead_read;
+	bulk->invalid += bulk->ahead_invalid;
+	bulk->ahead_read = bulk->ahead_invalid = 0;
+
+	while (n < max) {
+		if (bulk->ahead_next == bulk->ahead_len) {
+			bulk->eof = bulk->list_eof;
+			break;
+		}
+		number = bulk->ahead[bulk->ahead_next];
+
+		/* A destination the template can't take is dropped before any part is sent */
+		if (bulk->pdu) {
+			for (part = 0; part < parts->total_parts; part++) {
+				if (!allogsm_pdu_template_fill(&bulk->tpl, part, number, pdu)) {
+					break;
+				}
+			}
+			if (part < parts->total_parts) {
+				gsm_error(gsm, "Bulk SMS to %s can't be encoded on span %d\n", number, gsm->span);
+				bulk->invalid++;
+				bulk->ahead_next++;
+				continue;
+			}
+		}
+
+		/* Every part of a message goes in or none does */
+		if (!bulk_room(gsm, bulk->pdu ? parts->total_parts : 1)) {
+			break;
+		}
+
+		if (bulk->pdu) {
+			for (part = 0; part < parts->total_parts; part++) {
+				allogsm_pdu_template_fill(&bulk->tpl, part, number, pdu);
+				if (allogsm_send_pdu_prio(gsm, (char *)pdu, parts->message_split[part], bulk->id, bulk->prio)) {
+					break;
+				}
+			}
+			/* Out of memory past the room check, nothing left to do but report it */
+			if (part < parts->total_parts) {
+				if (!part) {
+					break;
+				}
+				gsm_error(gsm, "Bulk SMS to %s on span %d cut after %d of %d parts\n",
+					number, gsm->span, part, parts->total_parts);
+				bulk->invalid++;
+				bulk->ahead_next++;
+				continue;
+			}
+		} else if (allogsm_send_text_prio(gsm, number, bulk->message, bulk->id, bulk->prio)) {
+			break;
+		}
+
+		bulk->ahead_next++;
+		bulk->queued++;
+		bulk->sms += bulk->pdu ? parts->total_parts : 1;
+		n++;
+	}
+
+	return n;
+}
+
+/* Close the list and free the job */
+void allogsm_bulk_free(struct allogsm_bulk *bulk)
+{
+	if (!bulk) {
+		return;
+	}
+
+	if (bulk->list) {
+		fclose(bulk->list);
+	}
+	free(bulk);
+}
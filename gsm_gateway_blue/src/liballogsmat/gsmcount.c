@@ -0,0 +1,460 @@
+/*
+ * liballogsmat: An implementation of ALLO GSM cards
+ *
+ * Sent and failed SMS counters of each campaign id
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "liballogsmat.h"
+#include "gsm_internal.h"
+
+/*
+ * Counters live in a table of ALLOGSM_COUNT_RECORDS fixed size records,
+ * hashed by id with linear probing, mapped from a file so counting an SMS
+ * is an increment in memory.  The pages are written back with msync() at
+ * most GSM_COUNT_FLUSH_MS after a change and on close; the kernel may write
+ * them earlier.  An id that finds neither itself nor a free record within
+ * GSM_COUNT_PROBE records takes over the one there updated longest ago.
+ *
+ * The table is shared by all spans.  If the file can't be mapped it is kept
+ * in anonymous memory for the life of the process.
+ *
+ * Flushing also writes the counts that changed to
+ * <export>/success/<id> and <export>/fail/<id>, one number per file, for
+ * readers of the per id files this table replaces.  Those counts are
+ * cumulative, so a record new to the table starts from what its files hold.
+ */
+
+#define GSM_COUNT_MAGIC		0x43534741	/* "AGSC" */
+#define GSM_COUNT_VERSION	1
+#define GSM_COUNT_PROBE		32
+#define GSM_COUNT_FLUSH_MS	5000
+
+#define GSM_COUNT_DIRTY_SENT	(1 << 0)
+#define GSM_COUNT_DIRTY_FAILED	(1 << 1)
+
+/* Start of the file, the records follow at ALLOGSM_COUNT_RECORD_SIZE */
+struct gsm_count_head {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int records;
+	unsigned int record_size;
+	char reserved[ALLOGSM_COUNT_RECORD_SIZE - 16];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	void *map;
+	size_t size;
+	int file;						/* map is backed by a file */
+	struct allogsm_sms_count *rec;
+	char export[PATH_MAX];			/* "" to write no per id files */
+	struct allogsm_modul *flush_gsm;	/* Span whose scheduler runs the next flush */
+	int flush_sched;
+} gsm_count = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static unsigned int gsm_count_hash(const char *id)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *id; id++) {
+		h = (h ^ (unsigned char)*id) * 16777619u;
+	}
+	return h;
+}
+
+/* Map the table, from path if it can be used, lock held */
+static int gsm_count_map(const char *path)
+{
+	struct gsm_count_head *head;
+	size_t size = (size_t)(ALLOGSM_COUNT_RECORDS + 1) * ALLOGSM_COUNT_RECORD_SIZE;
+	struct stat st;
+	int fd = -1;
+	int res = -1;
+
+	if (path && (fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) >= 0) {
+		if (fstat(fd, &st) || (st.st_size != (off_t)size && ftruncate(fd, size))) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	if (fd >= 0) {
+		gsm_count.map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (MAP_FAILED != gsm_count.map) {
+			gsm_count.file = 1;
+			res = 0;
+		}
+	}
+	if (res) {
+		gsm_count.map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == gsm_count.map) {
+			gsm_count.map = NULL;
+			return -1;
+		}
+		gsm_count.file = 0;
+	}
+	gsm_count.size = size;
+
+	head = gsm_count.map;
+	if (head->magic != GSM_COUNT_MAGIC || head->version != GSM_COUNT_VERSION ||
+		head->records != ALLOGSM_COUNT_RECORDS || head->record_size != ALLOGSM_COUNT_RECORD_SIZE) {
+		/* New file, or one laid out differently: start from zero */
+		memset(gsm_count.map, 0, size);
+		head->magic = GSM_COUNT_MAGIC;
+		head->version = GSM_COUNT_VERSION;
+		head->records = ALLOGSM_COUNT_RECORDS;
+		head->record_size = ALLOGSM_COUNT_RECORD_SIZE;
+	}
+	gsm_count.rec = (struct allogsm_sms_count *)((char *)gsm_count.map + ALLOGSM_COUNT_RECORD_SIZE);
+
+	return res;
+}
+
+/* Count last written to <export>/<kind>/<id>, 0 if there is none */
+static unsigned int gsm_count_import(const char *kind, const char *id)
+{
+	char path[PATH_MAX];
+	unsigned int count = 0;
+	FILE *f;
+
+	if (!gsm_count.export[0] || strchr(id, '/')) {
+		return 0;
+	}
+	if (snprintf(path, sizeof(path), "%s/%s/%s", gsm_count.export, kind, id) >= (int)sizeof(path)) {
+		return 0;
+	}
+	if (!(f = fopen(path, "r"))) {
+		return 0;
+	}
+	if (1 != fscanf(f, "%u", &count)) {
+		count = 0;
+	}
+	fclose(f);
+
+	return count;
+}
+
+/* Record of id, claimed if new, lock held */
+static struct allogsm_sms_count *gsm_count_find(const char *id, int create)
+{
+	struct allogsm_sms_count *rec, *oldest = NULL;
+	unsigned int hash = gsm_count_hash(id);
+	unsigned int i;
+
+	for (i = 0; i < GSM_COUNT_PROBE; i++) {
+		rec = &gsm_count.rec[(hash + i) % ALLOGSM_COUNT_RECORDS];
+		if (!rec->id[0]) {
+			break;
+		}
+		if (rec->hash == hash && !strcmp(rec->id, id)) {
+			return rec;
+		}
+		if (!oldest || rec->updated < oldest->updated) {
+			oldest = rec;
+		}
+		rec = NULL;
+	}
+
+	if (!create) {
+		return NULL;
+	}
+	if (!rec) {
+		rec = oldest;
+	}
+
+	memset(rec, 0, sizeof(*rec));
+	strncpy(rec->id, id, sizeof(rec->id) - 1);
+	rec->hash = hash;
+
+	/* The exported files are cumulative, carry on from them */
+	rec->sent = gsm_count_import("success", rec->id);
+	rec->failed = gsm_count_import("fail", rec->id);
+	return rec;
+}
+
+/* Write one count to <export>/<kind>/<id> */
+static void gsm_count_export(const char *kind, const char *id, unsigned int count)
+{
+	char path[PATH_MAX];
+	char num[16];
+	int fd;
+	int len;
+
+	if (snprintf(path, sizeof(path), "%s/%s/%s", gsm_count.export, kind, id) >= (int)sizeof(path)) {
+		return;
+	}
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return;
+	}
+	len = snprintf(num, sizeof(num), "%u", count);
+	/* Best effort, the table holds the count anyway */
+	if (write(fd, num, len) != len) {
+	}
+	close(fd);
+}
+
+/* data is the span that scheduled it, gsm_count.flush_gsm */
+static void gsm_count_flush_sched(void *data)
+{
+	(void)data;
+
+	pthread_mutex_lock(&gsm_count.lock);
+	gsm_count.flush_gsm = NULL;
+	gsm_count.flush_sched = 0;
+	pthread_mutex_unlock(&gsm_count.lock);
+
+	allogsm_count_flush();
+}
+
+/******************************************************************************
+ * Map the SMS counter table
+ * param:
+ *		path: file of the table, created if missing, NULL to keep it in memory
+ *		export: directory to also write <export>/{success,fail}/<id> in, or NULL
+ * return:
+ *		0: ok
+ *		-1: path can't be used, counting goes on in memory only
+ * e.g.
+ *		allogsm_count_open("/mnt/smsout_count/counters", "/mnt/smsout_count");
+ ******************************************************************************/
+int allogsm_count_open(const char *path, const char *export)
+{
+	int res;
+
+	allogsm_count_close();
+
+	pthread_mutex_lock(&gsm_count.lock);
+	res = gsm_count_map(path);
+	if (export) {
+		snprintf(gsm_count.export, sizeof(gsm_count.export), "%s", export);
+	} else {
+		gsm_count.export[0] = '\0';
+	}
+	pthread_mutex_unlock(&gsm_count.lock);
+
+	return res;
+}
+
+/******************************************************************************
+ * Count SMS of a campaign as sent or failed
+ * param:
+ *		gsm: span reporting it, its scheduler runs the next flush, may be NULL
+ *		id: campaign id, only its first ALLOGSM_COUNT_ID_LEN - 1 bytes are kept
+ *		sent: SMS to add to sent
+ *		failed: SMS to add to failed
+ * return:
+ *		0: counted
+ *		-1: no id or no table
+ ******************************************************************************/
+int allogsm_count_add(struct allogsm_modul *gsm, const char *id, int sent, int failed)
+{
+	struct allogsm_sms_count *rec;
+	char key[ALLOGSM_COUNT_ID_LEN];
+
+	if (!id || !id[0]) {
+		return -1;
+	}
+	snprintf(key, sizeof(key), "%s", id);
+
+	pthread_mutex_lock(&gsm_count.lock);
+	/* Never opened, count in memory */
+	if (!gsm_count.map) {
+		gsm_count_map(NULL);
+	}
+	if (!gsm_count.map) {
+		pthread_mutex_unlock(&gsm_count.lock);
+		return -1;
+	}
+
+	rec = gsm_count_find(key, 1);
+	rec->sent += sent;
+	rec->failed += failed;
+	rec->updated = time(NULL);
+	rec->dirty |= (sent ? GSM_COUNT_DIRTY_SENT : 0) | (failed ? GSM_COUNT_DIRTY_FAILED : 0);
+
+	if (gsm && !gsm_count.flush_sched) {
+		gsm_count.flush_sched = gsm_schedule_event(gsm, GSM_COUNT_FLUSH_MS, gsm_count_flush_sched, NULL);
+		if (gsm_count.flush_sched > 0) {
+			gsm_count.flush_gsm = gsm;
+		} else {
+			gsm_count.flush_sched = 0;
+		}
+	}
+	pthread_mutex_unlock(&gsm_count.lock);
+
+	return 0;
+}
+
+/******************************************************************************
+ * Get the counters of a campaign
+ * param:
+ *		id: campaign id
+ *		count: filled in
+ * return:
+ *		0: ok
+ *		-1: nothing counted for id
+ ******************************************************************************/
+int allogsm_count_get(const char *id, struct allogsm_sms_count *count)
+{
+	struct allogsm_sms_count *rec = NULL;
+	char key[ALLOGSM_COUNT_ID_LEN];
+
+	if (!id || !count) {
+		return -1;
+	}
+	snprintf(key, sizeof(key), "%s", id);
+
+	pthread_mutex_lock(&gsm_count.lock);
+	if (gsm_count.map && (rec = gsm_count_find(key, 0))) {
+		*count = *rec;
+	}
+	pthread_mutex_unlock(&gsm_count.lock);
+
+	return rec ? 0 : -1;
+}
+
+/******************************************************************************
+ * Call cb for a copy of every campaign counted, in table order
+ * param:
+ *		cb: return non zero to stop
+ *		data: passed to cb
+ * return:
+ *		int: campaigns passed to cb
+ ******************************************************************************/
+int allogsm_count_walk(allogsm_count_cb cb, void *data)
+{
+	struct allogsm_sms_count rec;
+	int i;
+	int n = 0;
+	int found;
+
+	for (i = 0; i < ALLOGSM_COUNT_RECORDS; i++) {
+		pthread_mutex_lock(&gsm_count.lock);
+		found = gsm_count.map && gsm_count.rec[i].id[0];
+		if (found) {
+			rec = gsm_count.rec[i];
+		}
+		pthread_mutex_unlock(&gsm_count.lock);
+
+		if (found) {
+			n++;
+			if (cb(&rec, data)) {
+				break;
+			}
+		}
+	}
+
+	return n;
+}
+
+/******************************************************************************
+ * Write the counters that changed to the per id files and start writing the
+ * table back to its file
+ * param:
+ *		void
+ * return:
+ *		void
+ ******************************************************************************/
+void allogsm_count_flush(void)
+{
+	struct allogsm_sms_count rec;
+	int i;
+
+	for (i = 0; i < ALLOGSM_COUNT_RECORDS; i++) {
+		pthread_mutex_lock(&gsm_count.lock);
+		if (!gsm_count.map || !gsm_count.rec[i].dirty) {
+			pthread_mutex_unlock(&gsm_count.lock);
+			continue;
+		}
+		rec = gsm_count.rec[i];
+		gsm_count.rec[i].dirty = 0;
+		pthread_mutex_unlock(&gsm_count.lock);
+
+		/* An id is a file name there, never a path */
+		if (!gsm_count.export[0] || strchr(rec.id, '/')) {
+			continue;
+		}
+		if (rec.dirty & GSM_COUNT_DIRTY_SENT) {
+			gsm_count_export("success", rec.id, rec.sent);
+		}
+		if (rec.dirty & GSM_COUNT_DIRTY_FAILED) {
+			gsm_count_export("fail", rec.id, rec.failed);
+		}
+	}
+
+	pthread_mutex_lock(&gsm_count.lock);
+	if (gsm_count.map && gsm_count.file) {
+		msync(gsm_count.map, gsm_count.size, MS_ASYNC);
+	}
+	pthread_mutex_unlock(&gsm_count.lock);
+}
+
+/******************************************************************************
+ * Flush now if gsm's scheduler was to do it, gsm is going away
+ * param:
+ *		gsm: gsm module being freed
+ * return:
+ *		void
+ ******************************************************************************/
+void gsm_count_release(struct allogsm_modul *gsm)
+{
+	int mine;
+
+	pthread_mutex_lock(&gsm_count.lock);
+	mine = (gsm_count.flush_gsm == gsm);
+	if (mine) {
+		gsm_schedule_del(gsm, gsm_count.flush_sched);
+		gsm_count.flush_gsm = NULL;
+		gsm_count.flush_sched = 0;
+	}
+	pthread_mutex_unlock(&gsm_count.lock);
+
+	if (mine) {
+		allogsm_count_flush();
+	}
+}
+
+/******************************************************************************
+ * Flush the SMS counter table to its file and unmap it
+ * param:
+ *		void
+ * return:
+ *		void
+ ******************************************************************************/
+void allogsm_count_close(void)
+{
+	allogsm_count_flush();
+
+	pthread_mutex_lock(&gsm_count.lock);
+	if (gsm_count.map) {
+		if (gsm_count.file) {
+			msync(gsm_count.map, gsm_count.size, MS_SYNC);
+		}
+		munmap(gsm_count.map, gsm_count.size);
+		gsm_count.map = NULL;
+		gsm_count.rec = NULL;
+	}
+	pthread_mutex_unlock(&gsm_count.lock);
+}
@@ -0,0 +1,309 @@
+/*
+ * liballogsmat: An implementation of ALLO GSM cards
+ *
+ * Hex codec of PDU strings
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ *
+ */
+
+#include <string.h>
+
+#include "liballogsmat.h"
+#include "gsm_internal.h"
+
+/*
+ * PDUs go to and come from the module as hex strings.  Both directions use a
+ * 256 entry table per byte, and a 16 byte SIMD kernel for the bulk of longer
+ * strings when the CPU has one: SSE2 on x86, checked at run time so i386
+ * builds still run on CPUs without it, and NEON on AArch64 where it is always
+ * present.  Encoding writes upper case; decoding takes either case and reads
+ * any other character as 0, as gsm_hex2int() always did.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GSM_HEX_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define GSM_HEX_NEON
+#include <arm_neon.h>
+#endif
+
+/* Two hex digits of each byte */
+static const char gsm_hex_pair[256][2] = {
+	"00", "01", "02", "03", "04", "05", "06", "07",
+	"08", "09", "0A", "0B", "0C", "0D", "0E", "0F",
+	"10", "11", "12", "13", "14", "15", "16", "17",
+	"18", "19", "1A", "1B", "1C", "1D", "1E", "1F",
+	"20", "21", "22", "23", "24", "25", "26", "27",
+	"28", "29", "2A", "2B", "2C", "2D", "2E", "2F",
+	"30", "31", "32", "33", "34", "35", "36", "37",
+	"38", "39", "3A", "3B", "3C", "3D", "3E", "3F",
+	"40", "41", "42", "43", "44", "45", "46", "47",
+	"48", "49", "4A", "4B", "4C", "4D", "4E", "4F",
+	"50", "51", "52", "53", "54", "55", "56", "57",
+	"58", "59", "5A", "5B", "5C", "5D", "5E", "5F",
+	"60", "61", "62", "63", "64", "65", "66", "67",
+	"68", "69", "6A", "6B", "6C", "6D", "6E", "6F",
+	"70", "71", "72", "73", "74", "75", "76", "77",
+	"78", "79", "7A", "7B", "7C", "7D", "7E", "7F",
+	"80", "81", "82", "83", "84", "85", "86", "87",
+	"88", "89", "8A", "8B", "8C", "8D", "8E", "8F",
+	"90", "91", "92", "93", "94", "95", "96", "97",
+	"98", "99", "9A", "9B", "9C", "9D", "9E", "9F",
+	"A0", "A1", "A2", "A3", "A4", "A5", "A6", "A7",
+	"A8", "A9", "AA", "AB", "AC", "AD", "AE", "AF",
+	"B0", "B1", "B2", "B3", "B4", "B5", "B6", "B7",
+	"B8", "B9", "BA", "BB", "BC", "BD", "BE", "BF",
+	"C0", "C1", "C2", "C3", "C4", "C5", "C6", "C7",
+	"C8", "C9", "CA", "CB", "CC", "CD", "CE", "CF",
+	"D0", "D1", "D2", "D3", "D4", "D5", "D6", "D7",
+	"D8", "D9", "DA", "DB", "DC", "DD", "DE", "DF",
+	"E0", "E1", "E2", "E3", "E4", "E5", "E6", "E7",
+	"E8", "E9", "EA", "EB", "EC", "ED", "EE", "EF",
+	"F0", "F1", "F2", "F3", "F4", "F5", "F6", "F7",
+	"F8", "F9", "FA", "FB", "FC", "FD", "FE", "FF",
+};
+
+/* Value of each hex digit, 0 for anything else */
+static const unsigned char gsm_hex_nibble[256] = {
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  0,  0,  0,  0,  0,  0,
+	 0, 10, 11, 12, 13, 14, 15,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0, 10, 11, 12, 13, 14, 15,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+};
+
+/* SIMD kernels do whole 16 byte blocks and return the bytes done */
+typedef int (*gsm_hex_encode_fn)(const unsigned char *src, int len, char *dst);
+typedef int (*gsm_hex_decode_fn)(const char *src, int len, unsigned char *dst);
+
+static gsm_hex_encode_fn hex_encode_simd;
+static gsm_hex_decode_fn hex_decode_simd;
+static const char *hex_impl = "scalar";
+static volatile int hex_selected;
+
+#ifdef GSM_HEX_SSE2
+__attribute__((target("sse2")))
+static int hex_encode_sse2(const unsigned char *src, int len, char *dst)
+{
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i alpha = _mm_set1_epi8('A' - '0' - 10);
+	__m128i v, hi, lo, a, b;
+	int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)&src[i]);
+		hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+		lo = _mm_and_si128(v, mask);
+		a = _mm_unpacklo_epi8(hi, lo);
+		b = _mm_unpackhi_epi8(hi, lo);
+		a = _mm_add_epi8(_mm_add_epi8(a, zero), _mm_and_si128(_mm_cmpgt_epi8(a, nine), alpha));
+		b = _mm_add_epi8(_mm_add_epi8(b, zero), _mm_and_si128(_mm_cmpgt_epi8(b, nine), alpha));
+		_mm_storeu_si128((__m128i *)&dst[i * 2], a);
+		_mm_storeu_si128((__m128i *)&dst[i * 2 + 16], b);
+	}
+
+	return i;
+}
+
+/* Value of 16 hex digits, one per byte, 0 for anything else */
+__attribute__((target("sse2")))
+static __m128i hex_nibbles_sse2(__m128i c)
+{
+	__m128i dig, up, lo;
+
+	/* Signed compares, so bytes from 0x80 up are out of every range */
+	dig = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+	up = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('F' + 1)));
+	lo = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('f' + 1)));
+
+	return _mm_or_si128(_mm_or_si128(
+		_mm_and_si128(dig, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+		_mm_and_si128(up, _mm_sub_epi8(c, _mm_set1_epi8('A' - 10)))),
+		_mm_and_si128(lo, _mm_sub_epi8(c, _mm_set1_epi8('a' - 10))));
+}
+
+__attribute__((target("sse2")))
+static int hex_decode_sse2(const char *src, int len, unsigned char *dst)
+{
+	const __m128i low = _mm_set1_epi16(0x00FF);
+	__m128i a, b;
+	int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		a = hex_nibbles_sse2(_mm_loadu_si128((const __m128i *)&src[i * 2]));
+		b = hex_nibbles_sse2(_mm_loadu_si128((const __m128i *)&src[i * 2 + 16]));
+		/* Each 16 bit lane holds the high digit in its low byte */
+		a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, low), 4), _mm_srli_epi16(a, 8));
+		b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, low), 4), _mm_srli_epi16(b, 8));
+		_mm_storeu_si128((__m128i *)&dst[i], _mm_packus_epi16(a, b));
+	}
+
+	return i;
+}
+#endif /* GSM_HEX_SSE2 */
+
+#ifdef GSM_HEX_NEON
+static int hex_encode_neon(const unsigned char *src, int len, char *dst)
+{
+	const uint8x16_t digits = vld1q_u8((const uint8_t *)"0123456789ABCDEF");
+	const uint8x16_t mask = vdupq_n_u8(0x0F);
+	uint8x16_t v, hi, lo;
+	int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = vld1q_u8(&src[i]);
+		hi = vqtbl1q_u8(digits, vshrq_n_u8(v, 4));
+		lo = vqtbl1q_u8(digits, vandq_u8(v, mask));
+		vst1q_u8((uint8_t *)&dst[i * 2], vzip1q_u8(hi, lo));
+		vst1q_u8((uint8_t *)&dst[i * 2 + 16], vzip2q_u8(hi, lo));
+	}
+
+	return i;
+}
+
+/* Value of 16 hex digits, one per byte, 0 for anything else */
+static uint8x16_t hex_nibbles_neon(uint8x16_t c)
+{
+	uint8x16_t dig, up, lo;
+
+	dig = vandq_u8(vcgeq_u8(c, vdupq_n_u8('0')), vcleq_u8(c, vdupq_n_u8('9')));
+	up = vandq_u8(vcgeq_u8(c, vdupq_n_u8('A')), vcleq_u8(c, vdupq_n_u8('F')));
+	lo = vandq_u8(vcgeq_u8(c, vdupq_n_u8('a')), vcleq_u8(c, vdupq_n_u8('f')));
+
+	return vorrq_u8(vorrq_u8(
+		vandq_u8(dig, vsubq_u8(c, vdupq_n_u8('0'))),
+		vandq_u8(up, vsubq_u8(c, vdupq_n_u8('A' - 10)))),
+		vandq_u8(lo, vsubq_u8(c, vdupq_n_u8('a' - 10))));
+}
+
+static int hex_decode_neon(const char *src, int len, unsigned char *dst)
+{
+	uint8x16_t a, b;
+	int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		a = hex_nibbles_neon(vld1q_u8((const uint8_t *)&src[i * 2]));
+		b = hex_nibbles_neon(vld1q_u8((const uint8_t *)&src[i * 2 + 16]));
+		vst1q_u8(&dst[i], vorrq_u8(vshlq_n_u8(vuzp1q_u8(a, b), 4), vuzp2q_u8(a, b)));
+	}
+
+	return i;
+}
+#endif /* GSM_HEX_NEON */
+
+/* Pick the kernels once, a race only picks the same ones twice */
+static void gsm_hex_select(void)
+{
+#ifdef GSM_HEX_SSE2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		hex_encode_simd = hex_encode_sse2;
+		hex_decode_simd = hex_decode_sse2;
+		hex_impl = "sse2";
+	}
+#elif defined(GSM_HEX_NEON)
+	hex_encode_simd = hex_encode_neon;
+	hex_decode_simd = hex_decode_neon;
+	hex_impl = "neon";
+#endif
+	hex_selected = 1;
+}
+
+/******************************************************************************
+ * Bytes to an upper case hex string
+ * param:
+ *		src: bytes
+ *		len: number of bytes
+ *		dst: 2 * len + 1 chars, NUL terminated
+ * return:
+ *		2 * len, the length of dst
+ * e.g.
+ *		{0xC8, 0x32, 0x9B} --> "C8329B"
+ ******************************************************************************/
+int gsm_hex_encode(const unsigned char *src, int len, char *dst)
+{
+	int i = 0;
+
+	if (!hex_selected) {
+		gsm_hex_select();
+	}
+	if (hex_encode_simd && len >= 16) {
+		i = hex_encode_simd(src, len, dst);
+	}
+	for (; i < len; i++) {
+		memcpy(&dst[i * 2], gsm_hex_pair[src[i]], 2);
+	}
+	dst[len * 2] = '\0';
+
+	return len * 2;
+}
+
+/******************************************************************************
+ * Hex string to bytes
+ * param:
+ *		src: 2 * len hex digits, either case
+ *		len: number of bytes
+ *		dst: len bytes, not terminated
+ * return:
+ *		len
+ * e.g.
+ *		"c8329B" --> {0xC8, 0x32, 0x9B}
+ ******************************************************************************/
+int gsm_hex_decode(const char *src, int len, unsigned char *dst)
+{
+	const unsigned char *s = (const unsigned char *)src;
+	int i = 0;
+
+	if (!hex_selected) {
+		gsm_hex_select();
+	}
+	if (hex_decode_simd && len >= 16) {
+		i = hex_decode_simd(src, len, dst);
+	}
+	for (; i < len; i++) {
+		dst[i] = gsm_hex_nibble[s[i * 2]] << 4 | gsm_hex_nibble[s[i * 2 + 1]];
+	}
+
+	return len;
+}
+
+/* Value of len hex digits, e.g. gsm_hex2int("1F", 2) is 31 */
+unsigned long gsm_hex2int(const char *hex, int len)
+{
+	const unsigned char *s = (const unsigned char *)hex;
+	unsigned long res = 0;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		res = res << 4 | gsm_hex_nibble[s[i]];
+	}
+
+	return res;
+}
+
+/* Kernel in use, "sse2", "neon" or "scalar" */
+const char *gsm_hex_impl(void)
+{
+	if (!hex_selected) {
+		gsm_hex_select();
+	}
+
+	return hex_impl;
+}
@@ -0,0 +1,603 @@
+/*
+ * liballogsmat: An implementation of ALLO GSM cards
+ *
+ * Journal of received SMS, one append-only log per span
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "liballogsmat.h"
+#include "gsm_internal.h"
+
+/*
+ * Every SMS a span receives is appended to <dir>/<span>/<segment>.jnl as one
+ * length prefixed record, so storing a message costs a write() instead of a
+ * file creation.  Segments are started once they reach their size and the
+ * oldest are removed past a count.  Data is synced once GSM_JOURNAL_SYNC_RECORDS
+ * records are pending or GSM_JOURNAL_SYNC_MS after the first of them,
+ * whichever comes first.
+ *
+ * <dir>/<span>/index holds one struct allogsm_journal_entry per record in the
+ * order received.  Readers mmap it to find messages by time or sender and
+ * read only the records they want, see allogsm_journal_query().  The times
+ * are wall clock, so they are not sorted once the clock is stepped back.  Entries of
+ * removed segments are dropped from it when the journal is opened and whenever
+ * rotation removes a segment, so it never outgrows the segments kept.
+ */
+
+#define GSM_JOURNAL_MAGIC			0x4A534741	/* "AGSJ" */
+#define GSM_JOURNAL_SYNC_RECORDS	16
+#define GSM_JOURNAL_SYNC_MS			2000
+
+/* Largest record body, the text and PDU of one SMS with their labels */
+#define GSM_JOURNAL_RECORD_MAX		8192
+
+/* What precedes the body of each record in a segment */
+struct gsm_journal_head {
+	unsigned int magic;
+	unsigned int len;			/* Bytes of the body */
+	unsigned int sum;			/* FNV-1a of the body, a torn write fails it */
+	unsigned int usec;
+	long long time;
+};
+
+static unsigned int gsm_journal_sum(const char *p, int len)
+{
+	unsigned int h = 2166136261u;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)p[i]) * 16777619u;
+	}
+
+	return h;
+}
+
+static void gsm_journal_path(const struct gsm_journal *jnl, unsigned int segment, char *path, int len)
+{
+	snprintf(path, len, "%s/%08u.jnl", jnl->dir, segment);
+}
+
+/* Copy the value of "label: " in body to out, "" when missing */
+static void gsm_journal_field(const char *body, const char *label, char *out, int len)
+{
+	const char *p = strstr(body, label);
+	int n = 0;
+
+	if (p) {
+		for (p += strlen(label); *p && *p != '\n' && n < len - 1; p++) {
+			out[n++] = *p;
+		}
+	}
+	out[n] = '\0';
+}
+
+static void gsm_journal_entry(struct allogsm_journal_entry *entry, const struct gsm_journal_head *head,
+	const char *body, int span, unsigned int segment, unsigned int offset)
+{
+	memset(entry, 0, sizeof(*entry));
+	entry->time = head->time;
+	entry->usec = head->usec;
+	entry->segment = segment;
+	entry->offset = offset;
+	entry->len = sizeof(*head) + head->len;
+	entry->span = span;
+	gsm_journal_field(body, "Sender: ", entry->sender, sizeof(entry->sender));
+	entry->sender_hash = gsm_journal_sum(entry->sender, strlen(entry->sender));
+}
+
+/* Write all of buf, 0 on success */
+static int gsm_journal_write(int fd, const void *buf, int len)
+{
+	const char *p = buf;
+	int res;
+
+	while (len > 0) {
+		res = write(fd, p, len);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += res;
+		len -= res;
+	}
+
+	return 0;
+}
+
+/* Oldest and newest segment numbers in the directory, 0 if it has none */
+static int gsm_journal_segments(const char *dir, unsigned int *first, unsigned int *last)
+{
+	DIR *d;
+	struct dirent *de;
+	unsigned int n;
+	char tail[8];
+	int count = 0;
+
+	*first = *last = 0;
+	d = opendir(dir);
+	if (!d) {
+		return 0;
+	}
+	while ((de = readdir(d))) {
+		if (sscanf(de->d_name, "%8u.%3s", &n, tail) != 2 || strcmp(tail, "jnl")) {
+			continue;
+		}
+		if (!count || n < *first) {
+			*first = n;
+		}
+		if (!count || n > *last) {
+			*last = n;
+		}
+		count++;
+	}
+	closedir(d);
+
+	return count;
+}
+
+/*
+ * Bring the index in line with the newest segment after a crash: drop a
+ * partial entry, index the records written after the last entry and cut the
+ * segment at the first record that is not whole.
+ */
+static int gsm_journal_recover(struct gsm_journal *jnl)
+{
+	struct allogsm_journal_entry entry;
+	struct gsm_journal_head head;
+	char *body;
+	off_t size, end = 0, pos;
+
+	size = lseek(jnl->index_fd, 0, SEEK_END);
+	if (size % sizeof(entry)) {
+		size -= size % sizeof(entry);
+		if (ftruncate(jnl->index_fd, size)) {
+			return -1;
+		}
+	}
+	if (size >= (off_t)sizeof(entry) &&
+	    pread(jnl->index_fd, &entry, sizeof(entry), size - sizeof(entry)) == sizeof(entry) &&
+	    entry.segment == jnl->segment) {
+		end = entry.offset + entry.len;
+	}
+
+	body = malloc(GSM_JOURNAL_RECORD_MAX + 1);
+	if (!body) {
+		return -1;
+	}
+
+	pos = end;
+	while (pread(jnl->seg_fd, &head, sizeof(head), pos) == sizeof(head)) {
+		if (head.magic != GSM_JOURNAL_MAGIC || head.len > GSM_JOURNAL_RECORD_MAX ||
+		    pread(jnl->seg_fd, body, head.len, pos + sizeof(head)) != head.len ||
+		    gsm_journal_sum(body, head.len) != head.sum) {
+			break;
+		}
+		body[head.len] = '\0';
+		gsm_journal_entry(&entry, &head, body, jnl->span, jnl->segment, pos);
+		if (gsm_journal_write(jnl->index_fd, &entry, sizeof(entry))) {
+			free(body);
+			return -1;
+		}
+		pos += sizeof(head) + head.len;
+	}
+	free(body);
+
+	if (pos < lseek(jnl->seg_fd, 0, SEEK_END) && ftruncate(jnl->seg_fd, pos)) {
+		return -1;
+	}
+	jnl->seg_size = pos;
+
+	return 0;
+}
+
+/* Rewrite the index without the entries of segments rotation removed */
+static int gsm_journal_prune(struct gsm_journal *jnl, const char *path)
+{
+	struct allogsm_journal_entry entry;
+	char tmp[PATH_MAX];
+	off_t pos = 0;
+	int fd;
+
+	if (pread(jnl->index_fd, &entry, sizeof(entry), 0) != sizeof(entry) || entry.segment >= jnl->first) {
+		return 0;
+	}
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	while (pread(jnl->index_fd, &entry, sizeof(entry), pos) == sizeof(entry)) {
+		pos += sizeof(entry);
+		if (entry.segment >= jnl->first && gsm_journal_write(fd, &entry, sizeof(entry))) {
+			break;
+		}
+	}
+	if (fsync(fd) || rename(tmp, path)) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+
+	close(jnl->index_fd);
+	jnl->index_fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+
+	return jnl->index_fd < 0 ? -1 : 0;
+}
+
+static int gsm_journal_open_segment(struct gsm_journal *jnl, unsigned int segment)
+{
+	char path[PATH_MAX];
+
+	gsm_journal_path(jnl, segment, path, sizeof(path));
+	jnl->seg_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (jnl->seg_fd < 0) {
+		return -1;
+	}
+	jnl->segment = segment;
+	jnl->seg_size = lseek(jnl->seg_fd, 0, SEEK_END);
+
+	return 0;
+}
+
+static void gsm_journal_sync(struct gsm_journal *jnl)
+{
+	if (!jnl->pending) {
+		return;
+	}
+	fdatasync(jnl->seg_fd);
+	fdatasync(jnl->index_fd);
+	jnl->pending = 0;
+}
+
+static void gsm_journal_flush(void *data)
+{
+	struct allogsm_modul *gsm = data;
+
+	gsm->journal->sync_sched = 0;
+	gsm_journal_sync(gsm->journal);
+}
+
+/* Close the newest segment, start the next one and remove the oldest past the limit */
+static int gsm_journal_rotate(struct gsm_journal *jnl)
+{
+	char path[PATH_MAX];
+	unsigned int first = jnl->first;
+
+	gsm_journal_sync(jnl);
+	close(jnl->seg_fd);
+	if (gsm_journal_open_segment(jnl, jnl->segment + 1)) {
+		return -1;
+	}
+
+	while (jnl->segment - jnl->first >= jnl->max_segments) {
+		gsm_journal_path(jnl, jnl->first, path, sizeof(path));
+		unlink(path);
+		jnl->first++;
+	}
+
+	if (jnl->first == first) {
+		return 0;
+	}
+	/* Left as it is if it can't be rewritten, the next open prunes it */
+	snprintf(path, sizeof(path), "%s/index", jnl->dir);
+	if (gsm_journal_prune(jnl, path) && jnl->index_fd < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+ * Start journaling the SMS a span receives
+ * param:
+ *		gsm: gsm module
+ *		dir: directory of the journals, <dir>/<span> is made if missing
+ *		segment_size: bytes of a segment before the next is started, 0 for
+ *			ALLOGSM_JOURNAL_SEGMENT_SIZE
+ *		segments: segments kept, the oldest are removed, 0 for
+ *			ALLOGSM_JOURNAL_SEGMENTS
+ * return:
+ *		0: ok
+ *		-1: the journal can't be opened, see errno
+ * e.g.
+ *		allogsm_journal_open(gsm, "/mnt/sms_bak", 0, 0);
+ ******************************************************************************/
+int allogsm_journal_open(struct allogsm_modul *gsm, const char *dir, int segment_size, int segments)
+{
+	struct gsm_journal *jnl;
+	char path[PATH_MAX];
+	unsigned int first, last;
+
+	if (!gsm || !dir) {
+		errno = EINVAL;
+		return -1;
+	}
+	allogsm_journal_close(gsm);
+
+	jnl = calloc(1, sizeof(*jnl));
+	if (!jnl) {
+		return -1;
+	}
+	jnl->span = gsm->span;
+	jnl->max_size = segment_size > 0 ? segment_size : ALLOGSM_JOURNAL_SEGMENT_SIZE;
+	jnl->max_segments = segments > 0 ? segments : ALLOGSM_JOURNAL_SEGMENTS;
+	jnl->seg_fd = jnl->index_fd = -1;
+
+	mkdir(dir, 0755);
+	snprintf(jnl->dir, sizeof(jnl->dir), "%s/%d", dir, gsm->span);
+	if (mkdir(jnl->dir, 0755) && errno != EEXIST) {
+		goto e_free;
+	}
+
+	snprintf(path, sizeof(path), "%s/index", jnl->dir);
+	jnl->index_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (jnl->index_fd < 0) {
+		goto e_free;
+	}
+
+	gsm_journal_segments(jnl->dir, &first, &last);
+	jnl->first = first;
+	if (gsm_journal_prune(jnl, path) || gsm_journal_open_segment(jnl, last) || gsm_journal_recover(jnl)) {
+		goto e_free;
+	}
+
+	gsm->journal = jnl;
+
+	return 0;
+
+e_free:
+	gsm_error(gsm, "Can't open SMS journal %s on span %d: %s\n", jnl->dir, gsm->span, strerror(errno));
+	if (jnl->seg_fd > -1) {
+		close(jnl->seg_fd);
+	}
+	if (jnl->index_fd > -1) {
+		close(jnl->index_fd);
+	}
+	free(jnl);
+	return -1;
+}
+
+/******************************************************************************
+ * Append a received SMS to the journal of its span
+ * param:
+ *		gsm: gsm module with a journal from allogsm_journal_open()
+ *		sms: the message as reported by ALLOGSM_EVENT_SMS_RECEIVED
+ *		date: time received, as shown to users
+ * return:
+ *		0: ok, on disk within GSM_JOURNAL_SYNC_MS
+ *		-1: no journal or write error
+ ******************************************************************************/
+int allogsm_journal_append(struct allogsm_modul *gsm, const gsm_event_sms_received *sms, const char *date)
+{
+	struct gsm_journal *jnl;
+	struct allogsm_journal_entry entry;
+	struct gsm_journal_head head;
+	struct timeval tv;
+	struct iovec iov[2];
+	char *body;
+	int len;
+
+	if (!gsm || !gsm->journal || !sms) {
+		return -1;
+	}
+	jnl = gsm->journal;
+
+	body = malloc(GSM_JOURNAL_RECORD_MAX + 1);
+	if (!body) {
+		return -1;
+	}
+
+	/* Same fields as the one file per SMS this replaces */
+	len = snprintf(body, GSM_JOURNAL_RECORD_MAX + 1,
+		"Span: %d\nSender: %s\nDate: %s\nSMSC: %s\nMode: %s\nPDU: %s\nText: %s\n",
+		gsm->span, sms->sender, date ? date : "", sms->smsc,
+		(sms->mode == SMS_PDU) ? "PDU" : "TEXT", sms->pdu, sms->text);
+	if (len > GSM_JOURNAL_RECORD_MAX) {
+		len = GSM_JOURNAL_RECORD_MAX;
+	}
+
+	gettimeofday(&tv, NULL);
+	head.magic = GSM_JOURNAL_MAGIC;
+	head.len = len;
+	head.sum = gsm_journal_sum(body, len);
+	head.usec = tv.tv_usec;
+	head.time = tv.tv_sec;
+
+	if (jnl->seg_size && jnl->seg_size + (off_t)(sizeof(head) + len) > jnl->max_size && gsm_journal_rotate(jnl)) {
+		gsm_error(gsm, "Can't start SMS journal segment on span %d: %s\n", gsm->span, strerror(errno));
+		free(body);
+		return -1;
+	}
+
+	iov[0].iov_base = &head;
+	iov[0].iov_len = sizeof(head);
+	iov[1].iov_base = body;
+	iov[1].iov_len = len;
+	if (writev(jnl->seg_fd, iov, 2) != (ssize_t)(sizeof(head) + len)) {
+		gsm_error(gsm, "Can't journal SMS from %s on span %d: %s\n", sms->sender, gsm->span, strerror(errno));
+		/* Cut what made it so the next record starts on a boundary */
+		if (ftruncate(jnl->seg_fd, jnl->seg_size)) {}
+		free(body);
+		return -1;
+	}
+
+	gsm_journal_entry(&entry, &head, body, gsm->span, jnl->segment, jnl->seg_size);
+	free(body);
+	jnl->seg_size += entry.len;
+	if (gsm_journal_write(jnl->index_fd, &entry, sizeof(entry))) {
+		gsm_error(gsm, "Can't index SMS from %s on span %d: %s\n", sms->sender, gsm->span, strerror(errno));
+	}
+
+	if (++jnl->pending >= GSM_JOURNAL_SYNC_RECORDS) {
+		gsm_schedule_del(gsm, jnl->sync_sched);
+		jnl->sync_sched = 0;
+		gsm_journal_sync(jnl);
+	} else if (!jnl->sync_sched) {
+		jnl->sync_sched = gsm_schedule_event(gsm, GSM_JOURNAL_SYNC_MS, gsm_journal_flush, gsm);
+		if (jnl->sync_sched < 0) {
+			jnl->sync_sched = 0;
+			gsm_journal_sync(jnl);
+		}
+	}
+
+	return 0;
+}
+
+/* Sync and close the journal of a span, if it has one */
+void allogsm_journal_close(struct allogsm_modul *gsm)
+{
+	struct gsm_journal *jnl;
+
+	if (!gsm || !gsm->journal) {
+		return;
+	}
+	jnl = gsm->journal;
+
+	gsm_schedule_del(gsm, jnl->sync_sched);
+	gsm_journal_sync(jnl);
+	close(jnl->seg_fd);
+	close(jnl->index_fd);
+	free(jnl);
+	gsm->journal = NULL;
+}
+
+/******************************************************************************
+ * Find journaled SMS of a span, needs no gsm module
+ * param:
+ *		dir: directory given to allogsm_journal_open()
+ *		span: span number
+ *		from, to: received in [from, to], seconds since the epoch, 0 for no
+ *			bound
+ *		sender: only from this number, NULL for any
+ *		cb: called for each match in the order received, with the record text
+ *			("Span: ...\nSender: ...\n...Text: ...\n"); non zero stops
+ *		data: passed to cb
+ * return:
+ *		>= 0: messages passed to cb
+ *		-1: no journal for the span
+ * e.g.
+ *		allogsm_journal_query("/mnt/sms_bak", 1, time(NULL) - 3600, 0, NULL, print_sms, NULL);
+ ******************************************************************************/
+int allogsm_journal_query(const char *dir, int span, time_t from, time_t to, const char *sender,
+	allogsm_journal_cb cb, void *data)
+{
+	const struct allogsm_journal_entry *index, *entry;
+	struct gsm_journal jnl;
+	struct gsm_journal_head head;
+	struct stat st;
+	char path[PATH_MAX];
+	char *body = NULL;
+	char from_sender[256];
+	unsigned int hash = 0, segment = 0;
+	int fd, seg_fd = -1, count = 0;
+	size_t n, stored = 0;
+
+	snprintf(jnl.dir, sizeof(jnl.dir), "%s/%d", dir, span);
+	snprintf(path, sizeof(path), "%s/index", jnl.dir);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*index)) {
+		close(fd);
+		return 0;
+	}
+	n = st.st_size / sizeof(*index);
+	index = mmap(NULL, n * sizeof(*index), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (index == MAP_FAILED) {
+		return -1;
+	}
+
+	body = malloc(GSM_JOURNAL_RECORD_MAX + 1);
+	if (!body) {
+		munmap((void *)index, n * sizeof(*index));
+		return -1;
+	}
+
+	/* The index holds the first sizeof(sender) - 1 characters of the sender */
+	if (sender) {
+		stored = strlen(sender);
+		if (stored > sizeof(index->sender) - 1) {
+			stored = sizeof(index->sender) - 1;
+		}
+		hash = gsm_journal_sum(sender, stored);
+	}
+
+	/* Entries are in the order received, but their wall clock times go back
+	   whenever the clock is stepped, so every entry is checked */
+	for (entry = index; entry < &index[n]; entry++) {
+		if ((from && entry->time < from) || (to && entry->time > to)) {
+			continue;
+		}
+		if (sender && (entry->sender_hash != hash || strncmp(entry->sender, sender, sizeof(entry->sender) - 1))) {
+			continue;
+		}
+
+		if (seg_fd < 0 || entry->segment != segment) {
+			if (seg_fd > -1) {
+				close(seg_fd);
+			}
+			segment = entry->segment;
+			gsm_journal_path(&jnl, segment, path, sizeof(path));
+			/* Removed by rotation */
+			seg_fd = open(path, O_RDONLY | O_CLOEXEC);
+			if (seg_fd < 0) {
+				continue;
+			}
+		}
+
+		if (pread(seg_fd, &head, sizeof(head), entry->offset) != sizeof(head) ||
+		    head.magic != GSM_JOURNAL_MAGIC || head.len > GSM_JOURNAL_RECORD_MAX ||
+		    pread(seg_fd, body, head.len, entry->offset + sizeof(head)) != head.len) {
+			continue;
+		}
+		body[head.len] = '\0';
+
+		/* Longer than the index holds, match it in full against the record */
+		if (sender && stored == sizeof(entry->sender) - 1) {
+			gsm_journal_field(body, "Sender: ", from_sender, sizeof(from_sender));
+			if (strcmp(from_sender, sender)) {
+				continue;
+			}
+		}
+
+		count++;
+		if (cb(entry, body, data)) {
+			break;
+		}
+	}
+
+	if (seg_fd > -1) {
+		close(seg_fd);
+	}
+	free(body);
+	munmap((void *)index, n * sizeof(*index));
+
+	return count;
+}
@@ -14,145 +14,320 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 
 #include "liballogsmat.h"
 #include "gsm_internal.h"
 
-queueADT QueueCreate(void);
+#ifdef QUEUE_SMS
+
+/*
+ * Outgoing SMS are kept in slots carved from slabs of QUEUE_SLAB_SLOTS,
+ * allocated the first time they are needed and reused until the queue is
+ * destroyed.  Callers fill a slot in place with QueueAlloc(), link it with
+ * QueueEnter() and get the same pointer back from QueueDelete(), so a message
+ * is never copied.  No more than max_depth slots are in use at once.
+ *
+ * Each enum allogsm_sms_prio has its own FIFO lane.  QueueDelete() takes the
+ * head of the highest lane, except that every aging_ms a message waits counts
+ * as one lane up, so bulk traffic is delayed by a busy high lane but never
+ * starved by it.
+ *
+ * A text message costs the segments allogsm_sms_classify() finds for it, a
+ * PDU is one segment already; the queue keeps the sum for load balancing.
+ */
+#define QUEUE_SLAB_SLOTS	16
+
+struct queueSlabTag {
+	struct queueSlabTag *next;
+	queueNodeT slot[QUEUE_SLAB_SLOTS];
+};
+
+static queueNodeT *QueueSlot(queueADT queue, sms_info_u *sms_info)
+{
+	struct queueSlabTag *slab;
+	queueNodeT *node = (queueNodeT *)sms_info;
+
+	for (slab = queue->slabs; slab; slab = slab->next) {
+		if ((node >= slab->slot) && (node < slab->slot + QUEUE_SLAB_SLOTS)) {
+			return node;
+		}
+	}
+
+	return NULL;
+}
+
+static long long QueueNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Lane whose head goes next, -1 if every lane is empty */
+static int QueuePick(queueADT queue, long long now)
+{
+	long long rank, best_rank = 0;
+	int prio, best = -1;
+
+	for (prio = 0; prio < ALLOGSM_SMS_PRIO_SUM; prio++) {
+		if (!queue->lane[prio].front) {
+			continue;
+		}
+		/* Position of the head once promoted for its wait, in ms */
+		rank = (long long)prio * queue->aging_ms;
+		if (queue->aging_ms) {
+			rank -= now - queue->lane[prio].front->enter_ms;
+		}
+		if (best < 0 || rank < best_rank) {
+			best = prio;
+			best_rank = rank;
+		}
+	}
+
+	return best;
+}
 
 int QueueIsEmpty(queueADT queue){
 
-        if(queue->front)
+        if(queue->depth)
                 return 0; /* Queue is not empty*/
         else
                 return 1; /* Queue is empty*/
 
 }
-int QueueEnter(struct allogsm_modul *gsm, sms_info_u sms_info)
+
+/******************************************************************************
+ * Take a free slot for a message to be queued or sent
+ * param:
+ *		gsm: gsm module
+ * return:
+ *		sms_info_u*: slot to fill in, owned by the caller until QueueEnter()
+ *			or QueueRelease()
+ *		NULL: max_depth messages are already waiting
+ ******************************************************************************/
+sms_info_u *QueueAlloc(struct allogsm_modul *gsm)
 {
 	queueADT queue = gsm->sms_queue;
-        queueNodeT *newNodeP;
+	struct queueSlabTag *slab;
+	queueNodeT *node;
+	int i;
 
-        /* Allocate space for a node in the linked list. */
+	if (queue == NULL || queue->used >= queue->max_depth) {
+		return NULL;
+	}
 
-        newNodeP = (queueNodeT *)malloc(sizeof(queueNodeT));
+	if (queue->free == NULL) {
+		slab = malloc(sizeof(*slab));
+		if (slab == NULL) {
+			gsm_error(gsm, "Insufficient memory for new queue sms_info.\n");
+			return NULL;
+		}
+		slab->next = queue->slabs;
+		queue->slabs = slab;
+		for (i = QUEUE_SLAB_SLOTS - 1; i >= 0; i--) {
+			slab->slot[i].next = queue->free;
+			queue->free = &slab->slot[i];
+		}
+	}
 
-        if (newNodeP == NULL) {
-                gsm_error(gsm, "Insufficient memory for new queue sms_info.\n");
-                return -1;
-        }
+	node = queue->free;
+	queue->free = node->next;
+	node->next = NULL;
+	queue->used++;
 
-        /* Place information in the node */
+	return &node->sms_info;
+}
 
-        newNodeP->sms_info = sms_info;
-        newNodeP->next = NULL;
-	gsm_message(gsm, "here at enqueue %d.. dest: %s, msg:%s\n",__LINE__ ,newNodeP->sms_info.txt_info.destination, newNodeP->sms_info.txt_info.message);
-	
-        /*Check Queue is present or not.. if not create it*/
-        if (queue == NULL){
-                gsm_message(gsm, "queue is empty\n");
-//              queue = QueueCreate();
-                return -2;
-        }
-        if (queue == NULL)
-                gsm_message(gsm, "queue is still empty.. how\n");
-        /*
-        ** Link the sms_info into the right place in
-        ** the linked list.
-        **/
-
-        if (queue->front == NULL) {  /* Queue is empty */
-                queue->front = queue->rear = newNodeP;
-		gsm_message(gsm, "here at enqueue %d..\n",__LINE__); //pawan print
-		/*pawan sched here*/
-        } else {
-		gsm_message(gsm, "here at enqueue %d..\n",__LINE__); //pawan print
-                queue->rear->next = newNodeP;
-                queue->rear = newNodeP;
-        }
-        return 0;
+/******************************************************************************
+ * Give a slot back to the pool
+ * param:
+ *		gsm: gsm module
+ *		sms_info: slot from QueueAlloc() or QueueDelete(), anything else is
+ *			ignored so a malloc'd sms_info may be passed safely
+ * return:
+ *		void
+ ******************************************************************************/
+void QueueRelease(struct allogsm_modul *gsm, sms_info_u *sms_info)
+{
+	queueADT queue = gsm->sms_queue;
+	queueNodeT *node;
+
+	if (queue == NULL || sms_info == NULL) {
+		return;
+	}
+
+	node = QueueSlot(queue, sms_info);
+	if (node == NULL) {
+		return;
+	}
+
+	node->next = queue->free;
+	queue->free = node;
+	queue->used--;
 }
 
-/* This is a queue and it is FIFO, so we will always remove the first element */
-//struct my_list* QueueDelete( struct my_list* s )
-int QueueDelete(struct allogsm_modul *gsm)
+/******************************************************************************
+ * Append a filled slot to the lane of its priority
+ * param:
+ *		gsm: gsm module
+ *		sms_info: slot from QueueAlloc()
+ *		prio: enum allogsm_sms_prio, out of range is ALLOGSM_SMS_PRIO_NORMAL
+ *		pdu: 1 if sms_info holds pdu_info, 0 for txt_info
+ * return:
+ *		0: queued
+ *		-1: no queue
+ ******************************************************************************/
+int QueueEnter(struct allogsm_modul *gsm, sms_info_u *sms_info, int prio, int pdu)
 {
 	queueADT queue = gsm->sms_queue;
-        queueNodeT *newNodeF, *newNodeP;
-        newNodeF = NULL;
-        newNodeP = NULL;
-//	gsm->sms_info=&(gsm->last_sms);
-        memset(gsm->sms_info, 0, sizeof (sms_info_u));
-
-        if( NULL == queue ){
-                gsm_message(gsm, "List is empty\n");
-                return -1;
-        } else if ( NULL == queue->front && NULL == queue->rear ){
-                gsm_message(gsm, "Well, List is empty\n");
-                return -1;
-        } else if ( NULL == queue->front || NULL == queue->rear ){
-                gsm_message(gsm, "There is something seriously wrong with your list\n");
-                gsm_message(gsm, "One of the front/rear is empty while other is not \n");
-                return -1;
-        }
-//gsm->sms_info = sms_info;
-
-	gsm_message(gsm, "here after dequeue %d.. dest: %s, msg:%s\n",__LINE__ ,queue->front->sms_info.txt_info.destination, queue->front->sms_info.txt_info.message);
-        newNodeF = queue->front ;
-        newNodeP = newNodeF->next;
-        memcpy(gsm->sms_info,&(queue->front->sms_info), sizeof(sms_info_u));
-        free(newNodeF);
-	gsm_message(gsm, "here after dequeue %d.. dest: %s, msg:%s\n",__LINE__ ,gsm->sms_info->txt_info.destination, gsm->sms_info->txt_info.message);
-        queue->front = newNodeP;
-        if( NULL == queue->front )  queue->rear = queue->front ;   /* The element rear was pointing to is free(), so we need an update */
-        if (queue->front== NULL){
-		/**/
-                gsm_message(gsm, "after deletion queue front is null.. \n");
-	}else{
-		/*pawan sched here*/
-                return 1;
-	}
-        return 0;
+	queueNodeT *node = (queueNodeT *)sms_info;
+	queueLaneT *lane;
+
+	if (queue == NULL) {
+		return -1;
+	}
+
+	if (prio < 0 || prio >= ALLOGSM_SMS_PRIO_SUM) {
+		prio = ALLOGSM_SMS_PRIO_NORMAL;
+	}
+	lane = &queue->lane[prio];
+
+	node->next = NULL;
+	node->prio = prio;
+	node->pdu = pdu;
+	node->enter_ms = QueueNow();
+	if (pdu) {
+		node->segments = 1;
+	} else {
+		struct allogsm_sms_plan plan;
+
+		allogsm_sms_classify((const unsigned char *)sms_info->txt_info.message, &plan);
+		node->segments = plan.segments;
+	}
+	if (lane->front == NULL) {  /* Lane is empty */
+		lane->front = lane->rear = node;
+	} else {
+		lane->rear->next = node;
+		lane->rear = node;
+	}
+	lane->depth++;
+	queue->depth++;
+	queue->segments += node->segments;
+
+	return 0;
+}
+
+/******************************************************************************
+ * Unlink the message to send next
+ * param:
+ *		gsm: gsm module
+ *		pdu: set to 1 if the message holds pdu_info, 0 for txt_info, may be NULL
+ * return:
+ *		sms_info_u*: the slot, owned by the caller until QueueRelease()
+ *		NULL: queue is empty
+ ******************************************************************************/
+sms_info_u *QueueDelete(struct allogsm_modul *gsm, int *pdu)
+{
+	queueADT queue = gsm->sms_queue;
+	queueNodeT *node;
+	queueLaneT *lane;
+	long long now = QueueNow();
+	unsigned int wait;
+	int prio;
+
+	if (queue == NULL) {
+		return NULL;
+	}
+
+	prio = QueuePick(queue, now);
+	if (prio < 0) {
+		return NULL;
+	}
+	lane = &queue->lane[prio];
+
+	node = lane->front;
+	lane->front = node->next;
+	if (lane->front == NULL) {
+		lane->rear = NULL;	/* The element rear was pointing to is gone, so we need an update */
+	}
+	node->next = NULL;
+	lane->depth--;
+	queue->depth--;
+	queue->segments -= node->segments;
+
+	wait = (unsigned int)(now - node->enter_ms);
+	lane->sent++;
+	lane->wait_sum += wait;
+	if (wait > lane->wait_max) {
+		lane->wait_max = wait;
+	}
+
+	if (pdu) {
+		*pdu = node->pdu;
+	}
+
+	return &node->sms_info;
+}
+
+/* Message QueueDelete() would return, without unlinking it, NULL if the queue is empty */
+sms_info_u *QueueFront(queueADT queue)
+{
+	int prio;
+
+	if (queue == NULL) {
+		return NULL;
+	}
+
+	prio = QueuePick(queue, QueueNow());
+	if (prio < 0) {
+		return NULL;
+	}
+
+	return &queue->lane[prio].front->sms_info;
 }
 
 queueADT QueueCreate(void)
 {
   queueADT queue;
 
-  queue = (queueADT)malloc(sizeof(queueCDT));
+  queue = (queueADT)calloc(1, sizeof(queueCDT));
 
   if (queue == NULL) {
 	fprintf(stderr, "Insufficient memory for new queue.\n");
+	return NULL;
   }
 
-  queue->front = queue->rear = NULL;
+  queue->max_depth = ALLOGSM_SMS_QUEUE_DEPTH;
+  queue->aging_ms = ALLOGSM_SMS_AGING_MS;
 
   return queue;
 }
 
 void QueueDestroy(queueADT queue)
 {
-  /*
- * * First remove each sms_info from the queue (each
- * * sms_info is in a dynamically-allocated node.)
- * */
+	struct queueSlabTag *slab;
+
         if (queue == NULL){
                 fprintf(stderr, "Queue Doesnot exist, Cant Destroy\n");
                 return;
         }
 
-  //while ( queue->front )
-  while (!QueueIsEmpty(queue)){
-        fprintf(stderr, "In destroy, Deleting sms\n");
-    QueueDelete(queue);
-        }
+	/* Every slot lives in a slab, queued or not */
+	while (queue->slabs) {
+		slab = queue->slabs;
+		queue->slabs = slab->next;
+		free(slab);
+	}
 
   /*
  * * Reset the front and rear just in case someone
  * * tries to use them after the CDT is freed.
  * */
-  queue->front = queue->rear = NULL;
+  memset(queue->lane, 0, sizeof(queue->lane));
+  queue->free = NULL;
 
   /*
  * * Now free the structure that holds information
@@ -161,4 +336,95 @@ void QueueDestroy(queueADT queue)
   free(queue);
 }
 
+/******************************************************************************
+ * Limit how many outgoing SMS may wait on a span
+ * param:
+ *		gsm: gsm module
+ *		depth: messages queued or in flight, at least 1
+ * return:
+ *		0: ok
+ *		-1: no queue or bad depth
+ ******************************************************************************/
+int allogsm_set_sms_queue_depth(struct allogsm_modul *gsm, int depth)
+{
+	if (!gsm || !gsm->sms_queue || depth < 1) {
+		return -1;
+	}
+
+	gsm->sms_queue->max_depth = depth;
+
+	return 0;
+}
+
+/* Messages waiting to be sent on a span */
+int allogsm_sms_queue_depth(struct allogsm_modul *gsm)
+{
+	if (!gsm || !gsm->sms_queue) {
+		return 0;
+	}
+
+	return gsm->sms_queue->depth;
+}
+
+/* SMS segments the messages waiting on a span go out as */
+int allogsm_sms_queue_segments(struct allogsm_modul *gsm)
+{
+	if (!gsm || !gsm->sms_queue) {
+		return 0;
+	}
+
+	return gsm->sms_queue->segments;
+}
+
+/******************************************************************************
+ * Set how long a queued SMS waits before it counts as one lane higher
+ * param:
+ *		gsm: gsm module
+ *		ms: wait worth one lane, 0 to always send strictly by lane
+ * return:
+ *		0: ok
+ *		-1: no queue or bad value
+ ******************************************************************************/
+int allogsm_set_sms_aging(struct allogsm_modul *gsm, int ms)
+{
+	if (!gsm || !gsm->sms_queue || ms < 0) {
+		return -1;
+	}
+
+	gsm->sms_queue->aging_ms = ms;
+
+	return 0;
+}
+
+/******************************************************************************
+ * Get depth and wait times of one lane of the outgoing SMS queue
+ * param:
+ *		gsm: gsm module
+ *		prio: enum allogsm_sms_prio
+ *		stats: filled in
+ * return:
+ *		0: ok
+ *		-1: no queue or bad lane
+ * e.g.
+ *		struct allogsm_sms_lane_stats st;
+ *		allogsm_sms_queue_stats(gsm, ALLOGSM_SMS_PRIO_HIGH, &st);
+ ******************************************************************************/
+int allogsm_sms_queue_stats(struct allogsm_modul *gsm, int prio, struct allogsm_sms_lane_stats *stats)
+{
+	queueLaneT *lane;
+
+	if (!gsm || !gsm->sms_queue || !stats || prio < 0 || prio >= ALLOGSM_SMS_PRIO_SUM) {
+		return -1;
+	}
+
+	lane = &gsm->sms_queue->lane[prio];
+	stats->depth = lane->depth;
+	stats->sent = lane->sent;
+	stats->wait_avg = lane->sent ? (unsigned int)(lane->wait_sum / lane->sent) : 0;
+	stats->wait_max = lane->wait_max;
+	stats->wait_oldest = lane->front ? (unsigned int)(QueueNow() - lane->front->enter_ms) : 0;
+
+	return 0;
+}
 
+#endif /* QUEUE_SMS */
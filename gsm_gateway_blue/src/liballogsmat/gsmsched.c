@@ -16,39 +16,261 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
 
 #include "liballogsmat.h"
 #include "gsm_internal.h"
 
-static int maxsched = 0;
-
 /* Scheduler routines */
 
+/*
+ * Pending events are kept in a binary min-heap (gsm->sched_heap) of sched ids
+ * ordered by deadline, so insert/delete are O(log n) and the next deadline is
+ * always sched_heap[0].  Released ids are chained on a free list and reused
+ * before new ones are handed out; ids start at 1 since 0 means "no timer".
+ */
+
+static int sched_before(const struct timeval *a, const struct timeval *b)
+{
+	return (a->tv_sec < b->tv_sec) || ((a->tv_sec == b->tv_sec) && (a->tv_usec < b->tv_usec));
+}
+
+/* Deadlines use CLOCK_MONOTONIC so wall clock steps (NTP, date) don't move them */
+static void sched_now(struct timeval *tv)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+/* Arm sched_timer_fd for the earliest deadline, disarm it when nothing is queued */
+static void sched_arm(struct allogsm_modul *gsm)
+{
+#ifdef __linux__
+	struct itimerspec its;
+	struct timeval *next;
+
+	if (gsm->sched_timer_fd < 0) {
+		return;
+	}
+
+	next = allogsm_schedule_next(gsm);
+	if (next) {
+		if ((next->tv_sec == gsm->sched_armed.tv_sec) && (next->tv_usec == gsm->sched_armed.tv_usec)) {
+			return;
+		}
+		gsm->sched_armed = *next;
+	} else {
+		if (!gsm->sched_armed.tv_sec && !gsm->sched_armed.tv_usec) {
+			return;
+		}
+		memset(&gsm->sched_armed, 0, sizeof(gsm->sched_armed));
+	}
+
+	/* A zero it_value disarms the timer */
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = gsm->sched_armed.tv_sec;
+	its.it_value.tv_nsec = gsm->sched_armed.tv_usec * 1000;
+	if (timerfd_settime(gsm->sched_timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		gsm_error(gsm, "Unable to arm scheduler timer\n");
+	}
+#endif
+}
+
+/* Clear the readable state of sched_timer_fd */
+static void sched_ack(struct allogsm_modul *gsm)
+{
+#ifdef __linux__
+	unsigned long long expirations;
+
+	if (gsm->sched_timer_fd >= 0) {
+		if (read(gsm->sched_timer_fd, &expirations, sizeof(expirations)) < 0) {
+			/* EAGAIN: not expired yet */
+		}
+		/* A fired timerfd is disarmed, make sched_arm() set it again */
+		memset(&gsm->sched_armed, 0, sizeof(gsm->sched_armed));
+	}
+#endif
+}
+
+static void sched_heap_set(struct allogsm_modul *gsm, int pos, int id)
+{
+	gsm->sched_heap[pos] = id;
+	gsm->gsm_sched[id].heap = pos + 1;
+}
+
+static void sched_heap_up(struct allogsm_modul *gsm, int pos)
+{
+	int id = gsm->sched_heap[pos];
+	int parent;
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (!sched_before(&gsm->gsm_sched[id].when, &gsm->gsm_sched[gsm->sched_heap[parent]].when)) {
+			break;
+		}
+		sched_heap_set(gsm, pos, gsm->sched_heap[parent]);
+		pos = parent;
+	}
+	sched_heap_set(gsm, pos, id);
+}
+
+static void sched_heap_down(struct allogsm_modul *gsm, int pos)
+{
+	int id = gsm->sched_heap[pos];
+	int child;
+
+	while ((child = 2 * pos + 1) < gsm->sched_heap_len) {
+		if ((child + 1 < gsm->sched_heap_len) &&
+			sched_before(&gsm->gsm_sched[gsm->sched_heap[child + 1]].when, &gsm->gsm_sched[gsm->sched_heap[child]].when)) {
+			child++;
+		}
+		if (!sched_before(&gsm->gsm_sched[gsm->sched_heap[child]].when, &gsm->gsm_sched[id].when)) {
+			break;
+		}
+		sched_heap_set(gsm, pos, gsm->sched_heap[child]);
+		pos = child;
+	}
+	sched_heap_set(gsm, pos, id);
+}
+
+/* Double the scheduler pool, up to ALLO_MAX_SCHED entries */
+static int sched_grow(struct allogsm_modul *gsm)
+{
+	struct gsm_sched *sched;
+	int *heap;
+	int size;
+
+	size = gsm->sched_size ? gsm->sched_size * 2 : ALLO_MIN_SCHED;
+	if (size > ALLO_MAX_SCHED) {
+		size = ALLO_MAX_SCHED;
+	}
+	if (size <= gsm->sched_size) {
+		return -1;
+	}
+
+	if (!(sched = realloc(gsm->gsm_sched, size * sizeof(*sched)))) {
+		return -1;
+	}
+	gsm->gsm_sched = sched;
+	memset(sched + gsm->sched_size, 0, (size - gsm->sched_size) * sizeof(*sched));
+
+	if (!(heap = realloc(gsm->sched_heap, size * sizeof(*heap)))) {
+		return -1;
+	}
+	gsm->sched_heap = heap;
+	gsm->sched_size = size;
+
+	return 0;
+}
+
+/* Unlink sched id x from the heap and put it back on the free list */
+static void sched_release(struct allogsm_modul *gsm, int x)
+{
+	int pos = gsm->gsm_sched[x].heap - 1;
+	int last;
+
+	gsm->sched_heap_len--;
+	if (pos != gsm->sched_heap_len) {
+		last = gsm->sched_heap[gsm->sched_heap_len];
+		sched_heap_set(gsm, pos, last);
+		if ((pos > 0) && sched_before(&gsm->gsm_sched[last].when, &gsm->gsm_sched[gsm->sched_heap[(pos - 1) / 2]].when)) {
+			sched_heap_up(gsm, pos);
+		} else {
+			sched_heap_down(gsm, pos);
+		}
+	}
+
+	gsm->gsm_sched[x].heap = 0;
+	gsm->gsm_sched[x].callback = NULL;
+	gsm->gsm_sched[x].data = NULL;
+	gsm->gsm_sched[x].next_free = gsm->sched_free;
+	gsm->sched_free = x;
+}
+
 /******************************************************************************
- * set schedule
+ * create the scheduler timer descriptor
  * param:
  *		gsm: struct allogsm_modul
- *		ms: delay (ms)
- *		function: set callback function 
- *		data: user data
  * return:
- *		int: schedule id (0 < id < ALLO_MAX_SCHED)
+ *		void
+ ******************************************************************************/
+void gsm_schedule_init(struct allogsm_modul *gsm)
+{
+	/* Start with a small pool, it grows when more timers are pending */
+	if (sched_grow(gsm) < 0) {
+		gsm_error(gsm, "Unable to allocate scheduler\n");
+	}
+
+	gsm->sched_timer_fd = -1;
+	memset(&gsm->sched_armed, 0, sizeof(gsm->sched_armed));
+#ifdef __linux__
+	gsm->sched_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (gsm->sched_timer_fd < 0) {
+		gsm_error(gsm, "Unable to create scheduler timer, falling back to polling\n");
+	}
+#endif
+}
+
+/******************************************************************************
+ * release the scheduler timer descriptor
+ * param:
+ *		gsm: struct allogsm_modul
+ * return:
+ *		void
+ ******************************************************************************/
+void gsm_schedule_destroy(struct allogsm_modul *gsm)
+{
+	if (gsm->sched_timer_fd >= 0) {
+		close(gsm->sched_timer_fd);
+		gsm->sched_timer_fd = -1;
+	}
+
+	free(gsm->gsm_sched);
+	free(gsm->sched_heap);
+	gsm->gsm_sched = NULL;
+	gsm->sched_heap = NULL;
+	gsm->sched_size = 0;
+	gsm->sched_heap_len = 0;
+	gsm->sched_top = 0;
+	gsm->sched_free = 0;
+}
+
+/******************************************************************************
+ * get the scheduler timer descriptor
+ * param:
+ *		gsm: struct allogsm_modul
+ * return:
+ *		int: descriptor readable (POLLIN) once a schedule is due
+ *		-1: no timer descriptor, poll with allogsm_schedule_next_ms()
  * e.g.
- *		gsm->restart_timer = gsm_schedule_event(gsm, 10000, em200_error_hard, gsm);
+ *		fds[1].fd = allogsm_timer_fd(gsm);
  ******************************************************************************/
+int allogsm_timer_fd(struct allogsm_modul *gsm)
+{
+	return gsm->sched_timer_fd;
+}
 
+/******************************************************************************
+ * check for a free schedule slot
+ * param:
+ *		gsm: struct allogsm_modul
+ * return:
+ *		0: a slot is available
+ *		-1: scheduler is full
+ ******************************************************************************/
 int gsm_schedule_check(struct allogsm_modul *gsm)
 {
 	int res = 0;
-	int x;
 
-	for (x=1;x<ALLO_MAX_SCHED;x++) { /* [1, 127] */
-		if (!gsm->gsm_sched[x].callback) {
-			break;
-		}
-	}
-	
-	if (x == ALLO_MAX_SCHED) {
+	if (!gsm->sched_free && (gsm->sched_top + 1 >= ALLO_MAX_SCHED)) {
 		gsm_error(gsm, "No more room in scheduler\n");
 		res = -1;
 	}
@@ -56,73 +278,51 @@ int gsm_schedule_check(struct allogsm_modul *gsm)
 	return res;
 }
 
-int gsm_schedule_event_lTime(struct allogsm_modul *gsm, long int ms, void (*function)(void *data), void *data)
+/******************************************************************************
+ * check for n free schedule slots
+ * param:
+ *		gsm: struct allogsm_modul
+ *		n: slots wanted
+ * return:
+ *		0: n slots are available
+ *		-1: fewer than n are
+ ******************************************************************************/
+int gsm_schedule_room(struct allogsm_modul *gsm, int n)
 {
 	int x;
-	struct timeval tv;
-	
-	for (x=1;x<ALLO_MAX_SCHED;x++) { /* [1, 127] */
-		if (!gsm->gsm_sched[x].callback) {
-			break;
-		}
-	}
-	
-	if (x == ALLO_MAX_SCHED) {
-		gsm_error(gsm, "No more room in scheduler\n");
-		return -1;
-	}
 
-	if (x > maxsched) {
-		maxsched = x; /* [1, 127] */
+	/* Ids never handed out yet, then the recycled ones */
+	n -= ALLO_MAX_SCHED - 1 - gsm->sched_top;
+	for (x = gsm->sched_free; n > 0 && x; x = gsm->gsm_sched[x].next_free) {
+		n--;
 	}
 
-	/* Get current time */
-	gettimeofday(&tv, NULL);
-
-	/* Get the schedule end time */
-	tv.tv_sec += ms / 1000;
-	tv.tv_usec += (ms % 1000) * 1000;
-	if (tv.tv_usec > 1000000) {
-		tv.tv_usec -= 1000000;
-		tv.tv_sec += 1;
-	}
-
-	/* Set schedule */
-	gsm->gsm_sched[x].when = tv;			/* end time */
-	gsm->gsm_sched[x].callback = function;	/* callback function */
-	gsm->gsm_sched[x].data = data;			/* data */
-
-	/* return schedule id */
-	return x;
+	return n > 0 ? -1 : 0;
 }
 
-int gsm_schedule_event(struct allogsm_modul *gsm, int ms, void (*function)(void *data), void *data)
+static int __gsm_schedule_event(struct allogsm_modul *gsm, long int ms, void (*function)(void *data), void *data)
 {
 	int x;
 	struct timeval tv;
-	
-	for (x=1;x<ALLO_MAX_SCHED;x++) { /* [1, 127] */
-		if (!gsm->gsm_sched[x].callback) {
-			break;
-		}
-	}
-	
-	if (x == ALLO_MAX_SCHED) {
+
+	/* Take a recycled id first, otherwise hand out a new one */
+	if (gsm->sched_free) {
+		x = gsm->sched_free;
+		gsm->sched_free = gsm->gsm_sched[x].next_free;
+	} else if ((gsm->sched_top + 1 < gsm->sched_size) || (sched_grow(gsm) == 0)) {
+		x = ++gsm->sched_top;
+	} else {
 		gsm_error(gsm, "No more room in scheduler\n");
 		return -1;
 	}
 
-	if (x > maxsched) {
-		maxsched = x; /* [1, 127] */
-	}
-
 	/* Get current time */
-	gettimeofday(&tv, NULL);
+	sched_now(&tv);
 
 	/* Get the schedule end time */
 	tv.tv_sec += ms / 1000;
 	tv.tv_usec += (ms % 1000) * 1000;
-	if (tv.tv_usec > 1000000) {
+	if (tv.tv_usec >= 1000000) {
 		tv.tv_usec -= 1000000;
 		tv.tv_sec += 1;
 	}
@@ -132,10 +332,38 @@ int gsm_schedule_event(struct allogsm_modul *gsm, int ms, void (*function)(void
 	gsm->gsm_sched[x].callback = function;	/* callback function */
 	gsm->gsm_sched[x].data = data;			/* data */
 
+	/* Queue it */
+	gsm->sched_heap[gsm->sched_heap_len] = x;
+	gsm->sched_heap_len++;
+	sched_heap_up(gsm, gsm->sched_heap_len - 1);
+	sched_arm(gsm);
+
 	/* return schedule id */
 	return x;
 }
 
+/******************************************************************************
+ * set schedule
+ * param:
+ *		gsm: struct allogsm_modul
+ *		ms: delay (ms)
+ *		function: set callback function 
+ *		data: user data
+ * return:
+ *		int: schedule id (0 < id < ALLO_MAX_SCHED)
+ * e.g.
+ *		gsm->restart_timer = gsm_schedule_event(gsm, 10000, em200_error_hard, gsm);
+ ******************************************************************************/
+int gsm_schedule_event_lTime(struct allogsm_modul *gsm, long int ms, void (*function)(void *data), void *data)
+{
+	return __gsm_schedule_event(gsm, ms, function, data);
+}
+
+int gsm_schedule_event(struct allogsm_modul *gsm, int ms, void (*function)(void *data), void *data)
+{
+	return __gsm_schedule_event(gsm, ms, function, data);
+}
+
 
 /******************************************************************************
  * get next schedule time
@@ -152,19 +380,36 @@ int gsm_schedule_event(struct allogsm_modul *gsm, int ms, void (*function)(void
  ******************************************************************************/
 struct timeval *allogsm_schedule_next(struct allogsm_modul *gsm)
 {
-	struct timeval *closest = NULL;
-	int x;
-	
-	for (x=1;x<ALLO_MAX_SCHED;x++) {
-		if ((gsm->gsm_sched[x].callback) && 
-			(!closest || (closest->tv_sec > gsm->gsm_sched[x].when.tv_sec) || 
-						 ((closest->tv_sec == gsm->gsm_sched[x].when.tv_sec) && 
-							(closest->tv_usec > gsm->gsm_sched[x].when.tv_usec)))
-		)
-		closest = &gsm->gsm_sched[x].when;
+	if (!gsm->sched_heap_len) {
+		return NULL;
+	}
+
+	return &gsm->gsm_sched[gsm->sched_heap[0]].when;
+}
+
+
+/******************************************************************************
+ * get time left until the next schedule
+ * param:
+ *		gsm: struct allogsm_modul
+ * return:
+ *		int: milliseconds, 0 if a schedule is already due
+ *		-1: no schedule queued
+ ******************************************************************************/
+int allogsm_schedule_next_ms(struct allogsm_modul *gsm)
+{
+	struct timeval *next;
+	struct timeval tv;
+	long ms;
+
+	if (!(next = allogsm_schedule_next(gsm))) {
+		return -1;
 	}
-	
-	return closest;
+
+	sched_now(&tv);
+	ms = (next->tv_sec - tv.tv_sec) * 1000 + (next->tv_usec - tv.tv_usec + 999) / 1000;
+
+	return (ms < 0) ? 0 : (int)ms;
 }
 
 
@@ -179,29 +424,32 @@ struct timeval *allogsm_schedule_next(struct allogsm_modul *gsm)
 static allogsm_event *__gsm_schedule_run(struct allogsm_modul *gsm, struct timeval *tv)
 {
 	int x;
+	int budget;
 	void (*callback)(void *);
 	void *data;
-	for (x=1;x<ALLO_MAX_SCHED;x++) {
-		if (gsm->gsm_sched[x].callback &&
-			((gsm->gsm_sched[x].when.tv_sec < tv->tv_sec) ||
-			 ((gsm->gsm_sched[x].when.tv_sec == tv->tv_sec) &&
-			  (gsm->gsm_sched[x].when.tv_usec <= tv->tv_usec)))) {
-			/* get callback and data */  
-			gsm->schedev = 0;
-			callback = gsm->gsm_sched[x].callback;
-			data = gsm->gsm_sched[x].data;
-
-			/* clear gsm_sched info */
-			gsm->gsm_sched[x].callback = NULL;
-			gsm->gsm_sched[x].data = NULL;
-
-			/* call schedule routin */
-			callback(data);
-
-			/* get allogsm_event */
-			if (gsm->schedev) {
-				return &gsm->ev;
-			}
+
+	/* Bound the pass so callbacks rescheduling with 0 ms can't spin us here */
+	budget = gsm->sched_heap_len;
+	while (budget-- > 0 && gsm->sched_heap_len) {
+		x = gsm->sched_heap[0];
+		if (sched_before(tv, &gsm->gsm_sched[x].when)) {
+			break;
+		}
+
+		/* get callback and data */  
+		gsm->schedev = 0;
+		callback = gsm->gsm_sched[x].callback;
+		data = gsm->gsm_sched[x].data;
+
+		/* clear gsm_sched info */
+		sched_release(gsm, x);
+
+		/* call schedule routin */
+		callback(data);
+
+		/* get allogsm_event */
+		if (gsm->schedev) {
+			return &gsm->ev;
 		}
 	}
 	return NULL;
@@ -219,11 +467,48 @@ allogsm_event *allogsm_schedule_run(struct allogsm_modul *gsm)
 {
 	struct timeval tv;
 
-	/* Get current time without tz */
-	gettimeofday(&tv, NULL);
+	allogsm_event *e;
+
+	/* Get current time */
+	sched_now(&tv);
+	sched_ack(gsm);
 
 	/* run schedule */
-	return __gsm_schedule_run(gsm, &tv);
+	e = __gsm_schedule_run(gsm, &tv);
+	sched_arm(gsm);
+
+	return e;
+}
+
+
+/******************************************************************************
+ * run every due schedule in one pass
+ * param:
+ *		gsm: struct allogsm_modul
+ *		events: array receiving the reported events
+ *		max: size of events
+ * return:
+ *		int: number of events stored in events
+ * e.g.
+ *		n = allogsm_schedule_run_batch(gsm, evs, sizeof(evs) / sizeof(evs[0]));
+ ******************************************************************************/
+int allogsm_schedule_run_batch(struct allogsm_modul *gsm, allogsm_event *events, int max)
+{
+	struct timeval tv;
+	allogsm_event *e;
+	int n = 0;
+
+	/* Get current time */
+	sched_now(&tv);
+	sched_ack(gsm);
+
+	/* gsm->ev is reused by the next callback, so copy each event out */
+	while ((n < max) && (e = __gsm_schedule_run(gsm, &tv))) {
+		events[n++] = *e;
+	}
+	sched_arm(gsm);
+
+	return n;
 }
 
 
@@ -238,10 +523,17 @@ allogsm_event *allogsm_schedule_run(struct allogsm_modul *gsm)
  ******************************************************************************/
 void gsm_schedule_del(struct allogsm_modul *gsm,int id)
 {
-	if ((id >= ALLO_MAX_SCHED) || (id < 0)) { /* [0, 127] */
+	if ((id >= ALLO_MAX_SCHED) || (id < 0)) { /* [0, ALLO_MAX_SCHED) */
 		gsm_error(gsm, "Asked to delete sched id %d???\n", id);
+		return;
 	}
-	
-	gsm->gsm_sched[id].callback = NULL;
+
+	/* Already fired or never set */
+	if (!id || (id > gsm->sched_top) || !gsm->gsm_sched[id].heap) {
+		return;
+	}
+
+	sched_release(gsm, id);
+	sched_arm(gsm);
 }
 
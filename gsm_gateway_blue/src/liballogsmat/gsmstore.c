@@ -0,0 +1,312 @@
+/*
+ * liballogsmat: An implementation of ALLO GSM cards
+ *
+ * Messages the module keeps in its SIM/ME storage
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "liballogsmat.h"
+#include "gsm_internal.h"
+#include "gsm_config.h"
+
+/*
+ * Most SMS arrive as +CMT and never touch the storage, but the module stores
+ * some (class 2, or whatever the +CNMI setting routes there) and only says
+ * +CMTI.  Those are read in bulk: +CMTI lines are gathered for
+ * GSM_STORE_SCAN_MS, then one AT+CMGL lists every unread message, each of
+ * which becomes an ALLOGSM_EVENT_SMS_RECEIVED.  Listing marks them read.
+ * Read messages are left in place until the storage is GSM_STORE_HWM percent
+ * full, then one AT+CMGD deletes them all and AT+CPMS? counts what is left.
+ *
+ * The steps run one after another through the AT command queue, so a scan
+ * never interrupts a call or an SMS being sent.  Listing parses PDUs, and a
+ * text mode send leaves the module in text mode, so every listing is
+ * preceded by AT+CMGF=0; sends set the mode they need themselves.
+ */
+
+#define GSM_STORE_SCAN_MS	1000	/* Wait for more +CMTI before listing */
+#define GSM_STORE_HWM		80		/* Percent of the storage used before deleting */
+#define GSM_STORE_BATCH		10		/* Read messages deleted at once if the size is unknown */
+#define GSM_STORE_TIMEOUT	20000	/* ms for AT+CMGL over a full SIM */
+
+static void gsm_store_scan(void *data);
+static void gsm_store_list(struct allogsm_modul *gsm);
+static void gsm_store_count(struct allogsm_modul *gsm);
+
+/* Messages stored before the read ones are deleted */
+static int gsm_store_limit(struct allogsm_modul *gsm)
+{
+	int limit;
+
+	if (gsm->store_total <= 0) {
+		return GSM_STORE_BATCH;
+	}
+
+	limit = gsm->store_total * GSM_STORE_HWM / 100;
+	return (limit > 0) ? limit : 1;
+}
+
+/* Scan again in GSM_STORE_SCAN_MS unless one is already due */
+static void gsm_store_schedule(struct allogsm_modul *gsm)
+{
+	if (gsm->store_sched) {
+		return;
+	}
+	gsm->store_sched = gsm_schedule_event(gsm, GSM_STORE_SCAN_MS, gsm_store_scan, gsm);
+	if (gsm->store_sched < 0) {
+		gsm->store_sched = 0;
+	}
+}
+
+static void gsm_store_end(struct allogsm_modul *gsm)
+{
+	gsm->store_busy = 0;
+	gsm->store_index = -1;
+
+	/* +CMTI came in while this scan ran */
+	if (gsm->store_again) {
+		gsm->store_again = 0;
+		gsm_store_schedule(gsm);
+	}
+}
+
+/* Queue one step of a scan, ending it if the queue is full */
+static void gsm_store_queue(struct allogsm_modul *gsm, int cmds_id, struct gsm_at_cmd *tmpl)
+{
+	struct gsm_at_cmd *cmd;
+
+	if (!(cmd = gsm_at_cmd_new(gsm, get_at(gsm->switchtype, cmds_id)))) {
+		gsm_error(gsm, "Span %d: AT command queue full, SIM messages not read\n", gsm->span);
+		gsm_store_end(gsm);
+		return;
+	}
+
+	cmd->infos = tmpl->infos;
+	cmd->info = tmpl->info;
+	cmd->done = tmpl->done;
+	if (tmpl->timeout) {
+		cmd->timeout = tmpl->timeout;
+	}
+
+	if (gsm_at_queue(gsm, cmd)) {
+		gsm_error(gsm, "Span %d: AT command queue full, SIM messages not read\n", gsm->span);
+		gsm_store_end(gsm);
+	}
+}
+
+static void gsm_store_cmgd_done(struct allogsm_modul *gsm, struct gsm_at_cmd *cmd, int token, const char *line)
+{
+	(void)cmd;
+	(void)line;
+
+	if (GSM_TOKEN_OK != token) {
+		gsm_store_end(gsm);
+		return;
+	}
+
+	gsm->store_read = 0;
+	gsm_store_count(gsm);
+}
+
+/* Delete the read messages if the storage is filling up, else end the scan */
+static void gsm_store_trim(struct allogsm_modul *gsm)
+{
+	struct gsm_at_cmd tmpl = { .done = gsm_store_cmgd_done };
+
+	if (gsm->store_read <= 0 || gsm->store_used < gsm_store_limit(gsm)) {
+		gsm_store_end(gsm);
+		return;
+	}
+
+	gsm_store_queue(gsm, AT_DEL_READ_MSG, &tmpl);
+}
+
+static void gsm_store_cmgl_info(struct allogsm_modul *gsm, struct gsm_at_cmd *cmd, const char *line)
+{
+	char pdu[sizeof(gsm->sms_recv_buffer)];
+	int index;
+
+	(void)cmd;
+
+	/* +CMGL: <index>,<stat>,[<alpha>],<length>, the PDU is the next line */
+	if (gsm_line_is(gsm, GSM_TOKEN_CMGL)) {
+		gsm->store_index = (1 == sscanf(line, "+CMGL: %d", &index)) ? index : -1;
+		return;
+	}
+
+	if (gsm->store_index < 0) {
+		return;
+	}
+
+	strncpy(pdu, line, sizeof(pdu) - 1);
+	pdu[sizeof(pdu) - 1] = '\0';
+	pdu[strcspn(pdu, "\r\n")] = '\0';
+
+	gsm->store_read++;
+	if (gsm_pdu2sm_event(gsm, pdu)) {
+		gsm_error(gsm, "Span %d: can't decode stored SMS %d\n", gsm->span, gsm->store_index);
+	} else {
+		gsm->ev.e = ALLOGSM_EVENT_SMS_RECEIVED;
+		gsm->at_event = 1;
+	}
+	gsm->store_index = -1;
+}
+
+static void gsm_store_cmgl_done(struct allogsm_modul *gsm, struct gsm_at_cmd *cmd, int token, const char *line)
+{
+	(void)cmd;
+	(void)line;
+
+	gsm->store_index = -1;
+
+	if (GSM_TOKEN_OK != token) {
+		gsm_store_end(gsm);
+		return;
+	}
+
+	/* Whatever is stored has been read now */
+	if (gsm->store_used < gsm->store_read) {
+		gsm->store_used = gsm->store_read;
+	}
+	gsm_store_trim(gsm);
+}
+
+static void gsm_store_cmgf_done(struct allogsm_modul *gsm, struct gsm_at_cmd *cmd, int token, const char *line)
+{
+	struct gsm_at_cmd tmpl = {
+		.infos = GSM_TOKEN_MASK(GSM_TOKEN_CMGL) | GSM_TOKEN_MASK(GSM_TOKEN_NONE),
+		.info = gsm_store_cmgl_info,
+		.done = gsm_store_cmgl_done,
+		.timeout = GSM_STORE_TIMEOUT,
+	};
+
+	(void)cmd;
+	(void)line;
+
+	if (GSM_TOKEN_OK != token) {
+		gsm_store_end(gsm);
+		return;
+	}
+
+	gsm->store_index = -1;
+	gsm_store_queue(gsm, AT_LIST_UNREAD_MSG, &tmpl);
+}
+
+/* List the unread messages, which marks them read, in PDU mode */
+static void gsm_store_list(struct allogsm_modul *gsm)
+{
+	struct gsm_at_cmd tmpl = { .done = gsm_store_cmgf_done };
+
+	gsm_store_queue(gsm, AT_SEND_SMS_PDU_MODE, &tmpl);
+}
+
+static void gsm_store_cpms_info(struct allogsm_modul *gsm, struct gsm_at_cmd *cmd, const char *line)
+{
+	int used;
+	int total;
+
+	(void)cmd;
+
+	/* +CPMS: "SM",3,30,"SM",3,30,"SM",3,30 */
+	if (2 == sscanf(line, "+CPMS: %*[^,],%d,%d", &used, &total)) {
+		gsm->store_used = used;
+		gsm->store_total = total;
+	}
+}
+
+static void gsm_store_cpms_done(struct allogsm_modul *gsm, struct gsm_at_cmd *cmd, int token, const char *line)
+{
+	(void)cmd;
+	(void)line;
+
+	if (GSM_TOKEN_OK != token) {
+		gsm_store_end(gsm);
+		return;
+	}
+
+	/* Some of what is stored has not been read yet */
+	if (gsm->store_used > gsm->store_read) {
+		gsm_store_list(gsm);
+	} else {
+		gsm_store_trim(gsm);
+	}
+}
+
+/* Count what is stored and how much room there is */
+static void gsm_store_count(struct allogsm_modul *gsm)
+{
+	struct gsm_at_cmd tmpl = {
+		.infos = GSM_TOKEN_MASK(GSM_TOKEN_CPMS),
+		.info = gsm_store_cpms_info,
+		.done = gsm_store_cpms_done,
+	};
+
+	gsm_store_queue(gsm, AT_GET_MSG_STORE, &tmpl);
+}
+
+static void gsm_store_scan(void *data)
+{
+	struct allogsm_modul *gsm = data;
+
+	gsm->store_sched = 0;
+	if (gsm->store_busy) {
+		gsm->store_again = 1;
+		return;
+	}
+
+	gsm->store_busy = 1;
+	gsm_store_list(gsm);
+}
+
+/******************************************************************************
+ * Learn the size of the message storage and read what is waiting in it,
+ * called once the module is ready
+ * param:
+ *		gsm: gsm module
+ * return:
+ *		void
+ ******************************************************************************/
+void gsm_store_check(struct allogsm_modul *gsm)
+{
+	if (gsm->store_busy) {
+		gsm->store_again = 1;
+		return;
+	}
+
+	gsm->store_busy = 1;
+	gsm_store_count(gsm);
+}
+
+/******************************************************************************
+ * Line handler for +CMTI, a message was put in the storage
+ * param:
+ *		gsm: gsm module
+ *		buf: e.g. +CMTI: "SM",3
+ * return:
+ *		NULL: the message is read a little later, with any that follow it
+ ******************************************************************************/
+allogsm_event *gsm_store_indication(struct allogsm_modul *gsm, struct alloat_call *call, char *buf, int i)
+{
+	(void)call;
+	(void)buf;
+	(void)i;
+
+	gsm->store_used++;
+
+	if (gsm->store_busy) {
+		gsm->store_again = 1;
+	} else {
+		gsm_store_schedule(gsm);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,378 @@
+/*
+ * liballogsmat: An implementation of ALLO GSM cards
+ *
+ * UCS2 text of SMS, and iconv for the other charsets
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <iconv.h>
+
+#include "liballogsmat.h"
+#include "gsm_internal.h"
+
+/*
+ * UCS2 user data is big endian UTF-16: characters outside the BMP, emoji
+ * mostly, come as surrogate pairs.  UTF-8, the charset of nearly every span,
+ * is converted here without iconv and without allocating.  Other charsets go
+ * through iconv with descriptors kept open per thread, so a converter is
+ * opened once per thread and charset pair instead of once per message.
+ */
+
+#define GSM_REPLACEMENT_CHAR	0xFFFD
+
+/* Descriptors kept open by each thread */
+#define GSM_ICONV_CACHE		4
+
+struct gsm_iconv_entry {
+	char from[32];
+	char to[32];
+	iconv_t cd;
+};
+
+struct gsm_iconv_cache {
+	int next;					/* Entry to reuse when all are taken */
+	struct gsm_iconv_entry entry[GSM_ICONV_CACHE];
+};
+
+static pthread_key_t iconv_key;
+static pthread_once_t iconv_once = PTHREAD_ONCE_INIT;
+static int iconv_key_made;
+
+/******************************************************************************
+ * UCS2 (UTF-16BE) to UTF-8
+ * param:
+ *		in: UCS2 bytes, an odd last byte is ignored
+ *		inlen: bytes in in
+ *		out: UTF-8, always NUL terminated
+ *		outlen: size of out, text that does not fit is cut at a character
+ * return:
+ *		bytes written to out, without the NUL
+ * e.g.
+ *		{0x4F, 0x60, 0xD8, 0x3D, 0xDE, 0x00} --> "\xE4\xBD\xA0\xF0\x9F\x98\x80"
+ ******************************************************************************/
+int gsm_ucs2_to_utf8(const unsigned char *in, int inlen, char *out, int outlen)
+{
+	unsigned char *p = (unsigned char *)out;
+	unsigned int cp, lo;
+	int i, k = 0, n;
+
+	if (outlen <= 0) {
+		return 0;
+	}
+
+	for (i = 0; i + 1 < inlen; i += 2) {
+		cp = in[i] << 8 | in[i + 1];
+		if (cp >= 0xD800 && cp <= 0xDFFF) {
+			lo = (i + 3 < inlen) ? (unsigned int)(in[i + 2] << 8 | in[i + 3]) : 0;
+			if (cp <= 0xDBFF && lo >= 0xDC00 && lo <= 0xDFFF) {
+				cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+				i += 2;
+			} else {
+				cp = GSM_REPLACEMENT_CHAR;
+			}
+		}
+
+		n = cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+		if (k + n >= outlen) {
+			break;
+		}
+		switch (n) {
+		case 1:
+			p[k++] = cp;
+			break;
+		case 2:
+			p[k++] = 0xC0 | cp >> 6;
+			p[k++] = 0x80 | (cp & 0x3F);
+			break;
+		case 3:
+			p[k++] = 0xE0 | cp >> 12;
+			p[k++] = 0x80 | ((cp >> 6) & 0x3F);
+			p[k++] = 0x80 | (cp & 0x3F);
+			break;
+		default:
+			p[k++] = 0xF0 | cp >> 18;
+			p[k++] = 0x80 | ((cp >> 12) & 0x3F);
+			p[k++] = 0x80 | ((cp >> 6) & 0x3F);
+			p[k++] = 0x80 | (cp & 0x3F);
+			break;
+		}
+	}
+	p[k] = '\0';
+
+	return k;
+}
+
+/* Code point of the UTF-8 sequence at in, *len set to the bytes it takes */
+unsigned int gsm_utf8_next(const unsigned char *in, int inlen, int *len)
+{
+	unsigned int cp, min;
+	int n, i;
+
+	if (in[0] < 0x80) {
+		*len = 1;
+		return in[0];
+	} else if ((in[0] & 0xE0) == 0xC0) {
+		n = 2;
+		cp = in[0] & 0x1F;
+		min = 0x80;
+	} else if ((in[0] & 0xF0) == 0xE0) {
+		n = 3;
+		cp = in[0] & 0x0F;
+		min = 0x800;
+	} else if ((in[0] & 0xF8) == 0xF0) {
+		n = 4;
+		cp = in[0] & 0x07;
+		min = 0x10000;
+	} else {
+		*len = 1;
+		return GSM_REPLACEMENT_CHAR;
+	}
+
+	for (i = 1; i < n; i++) {
+		if (i >= inlen || (in[i] & 0xC0) != 0x80) {
+			*len = i;
+			return GSM_REPLACEMENT_CHAR;
+		}
+		cp = cp << 6 | (in[i] & 0x3F);
+	}
+	*len = n;
+
+	/* Overlong forms, UTF-16 surrogates and beyond Unicode */
+	if (cp < min || (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+		return GSM_REPLACEMENT_CHAR;
+	}
+
+	return cp;
+}
+
+/******************************************************************************
+ * UTF-8 to UCS2 (UTF-16BE)
+ * param:
+ *		in: UTF-8, bad sequences are sent as U+FFFD
+ *		inlen: bytes in in
+ *		out: UCS2, not terminated
+ *		outlen: size of out, text that does not fit is cut at a character
+ * return:
+ *		bytes written to out
+ ******************************************************************************/
+int gsm_utf8_to_ucs2(const unsigned char *in, int inlen, unsigned char *out, int outlen)
+{
+	unsigned int cp;
+	int i = 0, k = 0, len;
+
+	while (i < inlen) {
+		cp = gsm_utf8_next(&in[i], inlen - i, &len);
+		if (cp >= 0x10000) {
+			if (k + 4 > outlen) {
+				break;
+			}
+			cp -= 0x10000;
+			out[k++] = (0xD800 | cp >> 10) >> 8;
+			out[k++] = (0xD800 | cp >> 10) & 0xFF;
+			out[k++] = (0xDC00 | (cp & 0x3FF)) >> 8;
+			out[k++] = (0xDC00 | (cp & 0x3FF)) & 0xFF;
+		} else {
+			if (k + 2 > outlen) {
+				break;
+			}
+			out[k++] = cp >> 8;
+			out[k++] = cp & 0xFF;
+		}
+		i += len;
+	}
+
+	return k;
+}
+
+/******************************************************************************
+ * UTF-8 to Latin-1, the bytes the GSM 7 bit encoder maps
+ * param:
+ *		in: UTF-8
+ *		inlen: bytes in in
+ *		out: Latin-1, always NUL terminated, characters past U+00FF are '?'
+ *		outlen: size of out
+ * return:
+ *		bytes written to out, without the NUL
+ ******************************************************************************/
+int gsm_utf8_to_latin1(const unsigned char *in, int inlen, char *out, int outlen)
+{
+	unsigned int cp;
+	int i = 0, k = 0, len;
+
+	if (outlen <= 0) {
+		return 0;
+	}
+
+	while (i < inlen && k + 1 < outlen) {
+		cp = gsm_utf8_next(&in[i], inlen - i, &len);
+		out[k++] = cp < 0x100 ? cp : '?';
+		i += len;
+	}
+	out[k] = '\0';
+
+	return k;
+}
+
+static void gsm_iconv_cache_free(void *data)
+{
+	struct gsm_iconv_cache *cache = data;
+	int i;
+
+	for (i = 0; i < GSM_ICONV_CACHE; i++) {
+		if (cache->entry[i].from[0]) {
+			iconv_close(cache->entry[i].cd);
+		}
+	}
+	free(cache);
+}
+
+static void gsm_iconv_key_init(void)
+{
+	iconv_key_made = !pthread_key_create(&iconv_key, gsm_iconv_cache_free);
+}
+
+/* Give the key back when the library is unloaded, so a dlclose()d copy leaves no
+   destructor behind; caches of threads other than this one can't be reached any more */
+static void __attribute__((destructor)) gsm_iconv_key_delete(void)
+{
+	struct gsm_iconv_cache *cache;
+
+	if (!iconv_key_made) {
+		return;
+	}
+	cache = pthread_getspecific(iconv_key);
+	if (cache) {
+		pthread_setspecific(iconv_key, NULL);
+		gsm_iconv_cache_free(cache);
+	}
+	pthread_key_delete(iconv_key);
+	iconv_key_made = 0;
+}
+
+/* Open descriptor of this thread for from -> to, in its initial state */
+static iconv_t gsm_iconv_get(const char *from, const char *to)
+{
+	struct gsm_iconv_cache *cache;
+	struct gsm_iconv_entry *entry;
+	iconv_t cd;
+	int i;
+
+	if (strlen(from) >= sizeof(entry->from) || strlen(to) >= sizeof(entry->to)) {
+		return (iconv_t)-1;
+	}
+
+	pthread_once(&iconv_once, gsm_iconv_key_init);
+	if (!iconv_key_made) {
+		return (iconv_t)-1;
+	}
+	cache = pthread_getspecific(iconv_key);
+	if (!cache) {
+		cache = calloc(1, sizeof(*cache));
+		if (!cache || pthread_setspecific(iconv_key, cache)) {
+			free(cache);
+			return (iconv_t)-1;
+		}
+	}
+
+	for (i = 0; i < GSM_ICONV_CACHE; i++) {
+		entry = &cache->entry[i];
+		if (entry->from[0] && !strcmp(entry->from, from) && !strcmp(entry->to, to)) {
+			iconv(entry->cd, NULL, NULL, NULL, NULL);
+			return entry->cd;
+		}
+	}
+
+	cd = iconv_open(to, from);
+	if ((iconv_t)-1 == cd) {
+		return cd;
+	}
+
+	entry = &cache->entry[cache->next];
+	cache->next = (cache->next + 1) % GSM_ICONV_CACHE;
+	if (entry->from[0]) {
+		iconv_close(entry->cd);
+	}
+	strcpy(entry->from, from);
+	strcpy(entry->to, to);
+	entry->cd = cd;
+
+	return cd;
+}
+
+/******************************************************************************
+ * Convert between any two charsets iconv knows
+ * param:
+ *		from_charset, to_charset: iconv charset names
+ *		inbuf, inlen: text to convert
+ *		outbuf, outlen: zeroed, then filled with the converted text
+ * return:
+ *		bytes of outbuf left unused
+ *		-1: unknown charset, bad input or outbuf too small
+ ******************************************************************************/
+int gsm_code_convert(const char *from_charset, const char *to_charset, char *inbuf, size_t inlen, char *outbuf, size_t outlen)
+{
+	iconv_t cd;
+
+	cd = gsm_iconv_get(from_charset, to_charset);
+	if ((iconv_t)-1 == cd) {
+		return -1;
+	}
+
+	memset(outbuf, 0, outlen);
+	if (iconv(cd, &inbuf, &inlen, &outbuf, &outlen) == (size_t)-1) {
+		return -1;
+	}
+
+	return outlen;
+}
+
+/******************************************************************************
+ * Find how much of a text fits in a given room once converted
+ * param:
+ *		from_charset, to_charset: iconv charset names
+ *		inbuf, inlen: text to convert
+ *		outlen: room in to_charset bytes, 256 at most
+ *		used: if not NULL, set to the bytes of to_charset the fitting part takes
+ * return:
+ *		bytes of inbuf that fit, always whole characters
+ *		-1: unknown charset or bad input
+ * e.g.
+ *		gsm_code_fit("GB2312", "UTF-16BE", text, strlen(text), 134, &octets)
+ ******************************************************************************/
+int gsm_code_fit(const char *from_charset, const char *to_charset, const char *inbuf, size_t inlen, size_t outlen, int *used)
+{
+	char out[256];
+	char *in = (char *)inbuf;
+	char *outp = out;
+	size_t inleft = inlen, outleft;
+	iconv_t cd;
+
+	if (outlen > sizeof(out)) {
+		outlen = sizeof(out);
+	}
+	outleft = outlen;
+
+	cd = gsm_iconv_get(from_charset, to_charset);
+	if ((iconv_t)-1 == cd) {
+		return -1;
+	}
+
+	/* E2BIG stops at the last character that fits, EINVAL at one cut off by inlen */
+	if (iconv(cd, &in, &inleft, &outp, &outleft) == (size_t)-1 && errno != E2BIG && errno != EINVAL) {
+		return -1;
+	}
+	if (used) {
+		*used = outlen - outleft;
+	}
+
+	return inlen - inleft;
+}
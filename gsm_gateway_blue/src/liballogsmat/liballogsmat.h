@@ -20,6 +20,7 @@
 
 
 
+#include <stdio.h>
 #include <sys/time.h>
 
 #define NEED_CHECK_PHONE 1
@@ -34,6 +35,20 @@
 
 /* No more than 128 scheduled events */
 #define ALLO_MAX_SCHED	10000//128
+/* Scheduler pool starts this small and doubles up to ALLO_MAX_SCHED */
+#define ALLO_MIN_SCHED	32
+
+/* Hot fields of allogsm_modul are kept apart on their own cache lines */
+#define ALLOGSM_CACHELINE	64
+
+/* AT response ring buffer, must be a power of two */
+#define ALLOGSM_SANBUF_SIZE	4096
+#define ALLOGSM_SANBUF_MASK	(ALLOGSM_SANBUF_SIZE - 1)
+
+/* D-channel output ring, must be a power of two, and the frames it can hold */
+#define ALLOGSM_TXBUF_SIZE	4096
+#define ALLOGSM_TXBUF_MASK	(ALLOGSM_TXBUF_SIZE - 1)
+#define ALLOGSM_TXFRAMES	256
 
 #define MAX_TIMERS	32
 
@@ -67,6 +82,10 @@
 #define ALLOGSM_SWITCH_SIERRA_Q2687RD 	7
 
 #define QUEUE_SMS 1
+/* Outgoing SMS a span may hold, queued or in flight, see allogsm_set_sms_queue_depth() */
+#define ALLOGSM_SMS_QUEUE_DEPTH	256
+/* A queued SMS moves up one lane for every ALLOGSM_SMS_AGING_MS it waits, see allogsm_set_sms_aging() */
+#define ALLOGSM_SMS_AGING_MS	30000
 #define PDU_LONG
 /* EXTEND D-Channel Events */
 enum EVENT_DEFINE {
@@ -513,6 +532,93 @@ typedef struct gsm_sms_pdu{
 	int part_num;	
 	unsigned char message_split[16][256];
 }gsm_sms_pdu;
+
+/* Journal of received SMS, see allogsm_journal_open() */
+#define ALLOGSM_JOURNAL_SEGMENT_SIZE	(1024 * 1024)
+#define ALLOGSM_JOURNAL_SEGMENTS		64
+
+/* One record of <dir>/<span>/index, the file is an array of them */
+struct allogsm_journal_entry {
+	long long time;				/* Received, seconds since the epoch */
+	unsigned int usec;
+	unsigned int segment;		/* Record is in <dir>/<span>/<segment>.jnl, %08u */
+	unsigned int offset;		/* at this byte */
+	unsigned int len;			/* and takes this many */
+	int span;
+	unsigned int sender_hash;	/* FNV-1a of sender */
+	char sender[32];			/* Cut to 31 characters, the record has it in full */
+};
+
+typedef int (*allogsm_journal_cb)(const struct allogsm_journal_entry *entry, const char *record, void *data);
+
+/* Sent and failed SMS of each campaign id, see allogsm_count_open() */
+#define ALLOGSM_COUNT_RECORDS		4096
+#define ALLOGSM_COUNT_RECORD_SIZE	128
+#define ALLOGSM_COUNT_ID_LEN		96
+
+/* One record of the counter table, ALLOGSM_COUNT_RECORD_SIZE bytes */
+struct allogsm_sms_count {
+	char id[ALLOGSM_COUNT_ID_LEN];	/* Campaign id, "" if the record is free */
+	unsigned int sent;
+	unsigned int failed;
+	unsigned int hash;			/* FNV-1a of id */
+	unsigned int dirty;			/* Changed since the last flush */
+	long long updated;			/* Last counted, seconds since the epoch */
+	char reserved[8];
+};
+
+typedef int (*allogsm_count_cb)(const struct allogsm_sms_count *count, void *data);
+
+/* How a text is sent, see allogsm_sms_classify() */
+#define ALLOGSM_SMS_MAX_SEGMENTS	16
+
+struct allogsm_sms_plan {
+	const char *coding;			/* "GSM7", "UCS2" or the configured coding, for allogsm_encode_pdu_ucs2() */
+	int ucs2;					/* Sent as UCS2, else GSM 7 bit with the extension table */
+	int units;					/* Septets, or octets for UCS2, of the whole text */
+	int segments;				/* SMS the text is sent as */
+	int offset[ALLOGSM_SMS_MAX_SEGMENTS + 1];	/* Byte each segment starts at, offset[segments] is the length */
+};
+
+/* A message encoded once for many numbers, see allogsm_pdu_template_init() */
+#define ALLOGSM_PDU_TEMPLATE_PARTS	16
+
+struct allogsm_pdu_template {
+	int total_parts;
+	char sca[40];				/* SMS center field, hex; the SMS center has 20 digits at most */
+	int sca_len;
+	char ud[ALLOGSM_PDU_TEMPLATE_PARTS][513];	/* TP-PID to the end of TP-UD of each part, hex */
+	int ud_len[ALLOGSM_PDU_TEMPLATE_PARTS];
+};
+
+/* Recipients allogsm_bulk_read() reads ahead of allogsm_send_bulk() */
+#define ALLOGSM_BULK_AHEAD		32
+
+/* One message to a list of numbers, see allogsm_bulk_new() */
+struct allogsm_bulk {
+	FILE *list;					/* Recipients, read a line at a time */
+	unsigned char message[ALLOGSM_MAX_SMS_LENGTH];
+	char id[512];
+	int prio;					/* enum allogsm_sms_prio */
+	int pdu;					/* Send in PDU mode */
+	char smsc[64];
+	char coding[64];			/* GSM7, UCS2 or the charset given, found once */
+	gsm_sms_pdu parts;			/* message split once, PDU mode */
+	struct allogsm_pdu_template tpl;	/* parts encoded once, PDU mode */
+	/* Only allogsm_bulk_read() and allogsm_send_bulk() use these */
+	char ahead[ALLOGSM_BULK_AHEAD][ALLOGSM_MAX_PHONE_NUMBER + 1];	/* Read but not queued yet */
+	int ahead_next;				/* First of ahead not queued */
+	int ahead_len;
+	int ahead_read;				/* Lines read, not counted in read yet */
+	int ahead_invalid;			/* Of them, lines without a usable number */
+	int list_eof;				/* Whole list read into ahead */
+	/* Counted by allogsm_send_bulk() only */
+	int eof;					/* Whole list read and queued */
+	int read;					/* Lines read */
+	int invalid;				/* Lines without a usable number */
+	int queued;					/* Recipients handed to a span */
+	int sms;					/* SMS handed to a span, a long message is several */
+};
 typedef union {
 	int e;
 	gsm_event_generic 	gen;		/* Generic view */
@@ -582,6 +688,8 @@ struct gsm_sched {
 	struct timeval when;
 	void (*callback)(void *data);
 	void *data;
+	int heap;			/* Position in sched_heap + 1, 0 when not queued */
+	int next_free;		/* Next id on the free list */
 };
 
 typedef struct sms_txt_info_s {
@@ -592,6 +700,8 @@ typedef struct sms_txt_info_s {
 	char destination[512];
 	char text[1024];		//no use
 	int len;				//no use
+	int prio;				/* enum allogsm_sms_prio */
+	int flags;				/* ALLOGSM_SMS_FAILOVER */
 } sms_txt_info_t;
 
 typedef struct sms_pdu_info_s {
@@ -602,6 +712,8 @@ typedef struct sms_pdu_info_s {
 	char destination[512];	//Freedom Add 2012-01-29 14:30
 	char text[1024];		//Freedom Add 2012-02-13 16:44
 	int len;
+	int prio;				/* enum allogsm_sms_prio */
+	int flags;				/* ALLOGSM_SMS_FAILOVER */
 } sms_pdu_info_t;
 
 
@@ -649,15 +761,59 @@ enum creg_state_t {
 	CREG_5_REGISTERED_ROAMING
 };
 
+/* Outgoing SMS priority, lower lanes are sent first */
+enum allogsm_sms_prio {
+	ALLOGSM_SMS_PRIO_HIGH = 0,		/* One time passwords, alerts */
+	ALLOGSM_SMS_PRIO_NORMAL,		/* Default of allogsm_send_text/allogsm_send_pdu */
+	ALLOGSM_SMS_PRIO_BULK,			/* Campaigns */
+	ALLOGSM_SMS_PRIO_SUM,
+};
+
+/* Or'ed into the prio of allogsm_send_text_prio/allogsm_send_pdu_prio */
+#define ALLOGSM_SMS_PRIO_MASK	0xff
+#define ALLOGSM_SMS_FAILOVER	(1 << 8)	/* Sender may retry it on another span if it fails, and counts the failure */
+#define ALLOGSM_SMS_TAG_SHIFT	16
+#define ALLOGSM_SMS_TAG_MASK	0x7fff
+#define ALLOGSM_SMS_TAG(tag)	(((tag) & ALLOGSM_SMS_TAG_MASK) << ALLOGSM_SMS_TAG_SHIFT)	/* Sender's own tag, 0 for none */
+#define ALLOGSM_SMS_TAG_OF(flags)	(((flags) >> ALLOGSM_SMS_TAG_SHIFT) & ALLOGSM_SMS_TAG_MASK)	/* Tag of sms_info flags */
+
+/* Per lane figures of the outgoing SMS queue, times in ms */
+struct allogsm_sms_lane_stats {
+	int depth;					/* Messages waiting */
+	unsigned int sent;			/* Messages taken off the lane */
+	unsigned int wait_avg;		/* Average wait of the messages taken off */
+	unsigned int wait_max;		/* Longest wait of the messages taken off */
+	unsigned int wait_oldest;	/* Wait so far of the first message waiting */
+};
+
 #ifdef QUEUE_SMS 
 typedef struct queueNodeTag {
         //queueElementT element;
         sms_info_u sms_info;
         struct queueNodeTag *next;
+        int prio;					/* enum allogsm_sms_prio */
+        int pdu;					/* sms_info holds pdu_info, else txt_info */
+        long long enter_ms;			/* Monotonic time QueueEnter() was called */
+        int segments;				/* SMS the message goes out as */
 } queueNodeT;
 
-typedef struct queueCDT {
+typedef struct queueLaneTag {
         queueNodeT *front, *rear;
+        int depth;					/* Messages linked in the lane */
+        unsigned int sent;			/* Messages taken off */
+        unsigned long long wait_sum;	/* Total wait of those, ms */
+        unsigned int wait_max;		/* Longest wait of those, ms */
+} queueLaneT;
+
+typedef struct queueCDT {
+        queueLaneT lane[ALLOGSM_SMS_PRIO_SUM];
+        queueNodeT *free;			/* Unused slots */
+        struct queueSlabTag *slabs;	/* Storage of every slot */
+        int depth;					/* Messages linked in the queue */
+        int segments;				/* SMS those messages go out as */
+        int used;					/* Slots handed out, queued or in flight */
+        int max_depth;				/* Limit on used */
+        int aging_ms;				/* Wait worth one lane, 0 to never promote */
 } queueCDT;
 
 //typedef char queueElementT;
@@ -665,20 +821,28 @@ typedef struct queueCDT *queueADT;
 #endif
 
 struct allogsm_modul {
+	/* Hot: touched for every byte received, keep on one cache line */
 	int fd;				/* File descriptor for D-Channel */
+	int state;			/* State of D-channel */
+	int debug;			/* Debug stuff */
+	unsigned int sanhead;	/* Offset of the first unread byte in sanbuf */
+	int sanidx;			/* Unread bytes in sanbuf */
+	int sanskip;
+	int schedev;
+	int switchtype;		/* Switch type */
+	int span;			/* Span number */
+	int line_token;		/* GSM_TOKEN_* of the line being parsed */
+	unsigned int line_tokens;	/* GSM_TOKEN_MASK of every response the line is */
+	unsigned int line_found;	/* GSM_TOKEN_MASK of every response found in the line */
 	allogsm_rio_cb read_func;		/* Read data callback */
 	allogsm_wio_cb write_func;		/* Write data callback */
 	void *userdata;
-	struct gsm_sched gsm_sched[ALLO_MAX_SCHED];	/* Scheduled events */
-	int span;			/* Span number */
-	int debug;			/* Debug stuff */
-	int state;			/* State of D-channel */
-	int sim_state;		/* State of Sim Card / UIM Card*/
-	int switchtype;		/* Switch type */
-	int localtype;		/* Local network type (unknown, network, cpe) */
-	int remotetype;		/* Remote network type (unknown, network, cpe) */
 
 	/* AT Stuff */
+	char sanbuf[ALLOGSM_SANBUF_SIZE] __attribute__((aligned(ALLOGSM_CACHELINE)));	/* Ring of received AT data */
+	char sanline[1024];		/* Linear copy of a line that wraps around sanbuf */
+	int debug_at_fd;
+	int debug_at_flag;
 	char at_last_recv[1024];		/* Last Received command from dchan */
 	int at_last_recv_idx;	/* at_lastrecv lenght */
 	char at_last_sent[1024];		/* Last sent command to dchan */
@@ -686,14 +850,35 @@ struct allogsm_modul {
 	char *at_lastsent;
 	
 	char at_pre_recv[1024];
-	
-	char pin[16];				/* sim pin */
-	char manufacturer[256];			/* gsm modem manufacturer */
-	char sim_smsc[128];					/* gsm get SMSC AT+CSCA? */
-	char model_name[256];			/* gsm modem name */
-	char revision[256];			/* gsm modem revision */
-	char imei[64];				/* span imei */
-	char imsi[64];				/* sim imsi */
+
+	/* Frames written as the D-channel accepts them, see allogsm_tx_flush() */
+	char txbuf[ALLOGSM_TXBUF_SIZE];
+	unsigned int txhead;	/* Offset of the first unsent byte in txbuf */
+	int txlen;				/* Unsent bytes in txbuf */
+	unsigned short txframe[ALLOGSM_TXFRAMES];	/* Length of each queued frame */
+	int txframe_head;
+	int txframe_cnt;
+	int tx_fifo;			/* Largest frame payload the driver takes, 0 if unknown */
+	int tx_gap;				/* ms between paced frames, from AT_SMS_CHUNK_GAP */
+	int tx_sched;			/* Pending resume of a paced flush */
+	int tx_held;			/* Last frames held back until the queued AT command in flight is answered */
+	int tx_wake_fd;			/* eventfd written when frames wait for POLLOUT, -1 if unavailable */
+
+	/* Used by scheduler */
+	struct gsm_sched *gsm_sched;	/* Scheduled events, grown on demand */
+	int *sched_heap;	/* Min-heap of sched ids ordered by deadline */
+	int sched_size;		/* Entries allocated in gsm_sched and sched_heap */
+	int sched_heap_len;	/* Number of queued events */
+	int sched_top;		/* Highest sched id ever handed out */
+	int sched_free;		/* Head of the free id list, 0 if empty */
+	int sched_timer_fd;	/* timerfd armed at the next deadline, -1 if unavailable */
+	struct timeval sched_armed;	/* Deadline sched_timer_fd is currently armed for */
+	struct timeval tv;
+	allogsm_event ev;		/* Static event thingy */
+
+	int sim_state;		/* State of Sim Card / UIM Card*/
+	int localtype;		/* Local network type (unknown, network, cpe) */
+	int remotetype;		/* Remote network type (unknown, network, cpe) */
 
 	int network;			/* 0 unregistered - 1 home - 2 roaming */
 	int coverage;			/* net coverage -1 not signal */
@@ -724,15 +909,9 @@ struct allogsm_modul {
 	ussd_info_t *ussd_info;
 #ifdef QUEUE_SMS 
 	queueADT sms_queue;
-	sms_info_u last_sms;
 #endif
-	
-    char sanbuf[4096];
-    int sanidx;
-	int sanskip;
+	struct gsm_journal *journal;	/* Received SMS journal, NULL if not kept */
 
-	char net_name[64];			/* Network friendly name */
-	
 	int cref;			/* Next call reference value */
 	
 	int busy;			/* Peer is busy */
@@ -743,11 +922,6 @@ struct allogsm_modul {
 	/* All ISDN Timer values */
 	int timers[MAX_TIMERS];
 
-	/* Used by scheduler */
-	struct timeval tv;
-	int schedev;
-	allogsm_event ev;		/* Static event thingy */
-	
 	/* Q.931 calls */
 	struct alloat_call **callpool;
 	struct alloat_call *localpool;
@@ -765,10 +939,7 @@ struct allogsm_modul {
         int vol;
         int mic;
         int echocanval;
-	int debug_at_fd;
-        int debug_at_flag;
         int call_waiting_enabled;
-        char call_waiting_caller_id[256];
         int answer_retry;
 
 	int dial_initiated;  /*	flag to know the time when dialing starts(1) and number is dialed(0)
@@ -787,6 +958,36 @@ struct allogsm_modul {
 	unsigned char sched_command[128];	/*The command to be resceduled will he stored here.. 
 						  so before scheduling a schedular, copy command here. MUST*/
 	int sched_state;			/*Jump to following state for command given above*/
+
+	/* AT command queue, see gsmatqueue.c */
+	struct gsm_at_cmd *atq_head;	/* Command in flight or next to send */
+	struct gsm_at_cmd *atq_tail;
+	struct gsm_at_cmd *atq_free;	/* Released commands kept for reuse */
+	int atq_len;
+	int atq_sched;			/* Deadline of the command in flight */
+	int at_pending;			/* State machine command still waiting for its final result */
+	int at_raw_sched;		/* Deadline of a command written around the queue */
+	int at_event;			/* A queued command filled ev for module_receive to return */
+
+	/* SIM/ME message storage, see gsmstore.c */
+	int store_used;			/* Messages stored, from AT+CPMS? and +CMTI */
+	int store_total;		/* Size of the storage, 0 until known */
+	int store_read;			/* Read by AT+CMGL and not deleted yet */
+	int store_index;		/* Index of the +CMGL whose PDU comes next, -1 if none */
+	int store_busy;			/* A scan is queued or running */
+	int store_again;		/* +CMTI during the scan, scan once more */
+	int store_sched;		/* Timer of the next scan, 0 if none */
+
+	/* Cold: identity strings, only read by CLI and status queries */
+	char pin[16] __attribute__((aligned(ALLOGSM_CACHELINE)));	/* sim pin */
+	char manufacturer[256];			/* gsm modem manufacturer */
+	char sim_smsc[128];					/* gsm get SMSC AT+CSCA? */
+	char model_name[256];			/* gsm modem name */
+	char revision[256];			/* gsm modem revision */
+	char imei[64];				/* span imei */
+	char imsi[64];				/* sim imsi */
+	char net_name[64];			/* Network friendly name */
+	char call_waiting_caller_id[256];
 };
 
 
@@ -808,6 +1009,21 @@ int allogsm_get_debug(struct allogsm_modul *gsm);
 /* Check for an outstanding event on the EXTEND */
 allogsm_event *allogsm_check_event(struct allogsm_modul *gsm);
 
+/* Read once and parse every complete line, copying up to max events into events[] */
+int allogsm_check_event_batch(struct allogsm_modul *gsm, allogsm_event *events, int max);
+
+/* Write queued AT data the D-channel accepts, returns frames still queued */
+int allogsm_tx_flush(struct allogsm_modul *gsm);
+
+/* Frames waiting for the D-channel, poll for POLLOUT while non zero */
+int allogsm_tx_pending(struct allogsm_modul *gsm);
+
+/* Descriptor that becomes readable when another thread queued frames, -1 if unsupported */
+int allogsm_wake_fd(struct allogsm_modul *gsm);
+
+/* Largest frame the D-channel driver accepts, SMS chunks are capped to it */
+void allogsm_set_tx_fifo(struct allogsm_modul *gsm, int bytes);
+
 /* Give a name to a given event ID */
 char *allogsm_event2str(int id);
 
@@ -875,11 +1091,20 @@ int allogsm_reset(struct allogsm_modul *gsm, int channel);
 /* Create a new call */
 struct alloat_call *allogsm_new_call(struct allogsm_modul *gsm);
 
-/* How long until you need to poll for a new event */
+/* How long until you need to poll for a new event (CLOCK_MONOTONIC deadline) */
 struct timeval *allogsm_schedule_next(struct allogsm_modul *v);
 
+/* Milliseconds until the next schedule event, 0 if overdue, -1 if none */
+extern int allogsm_schedule_next_ms(struct allogsm_modul *gsm);
+
+/* Descriptor that becomes readable when a schedule event is due, -1 if unsupported */
+extern int allogsm_timer_fd(struct allogsm_modul *gsm);
+
 /* Run any pending schedule events */
 extern allogsm_event *allogsm_schedule_run(struct allogsm_modul *gsm);
+
+/* Run every due schedule event, copying up to max reported events into events[] */
+extern int allogsm_schedule_run_batch(struct allogsm_modul *gsm, allogsm_event *events, int max);
 //extern allogsm_event *allogsm_schedule_run_tv(struct allogsm_modul *gsm, const struct timeval *now);
 
 int allogsm_call(struct allogsm_modul *gsm, struct alloat_call *c, int transmode, int channel,
@@ -925,6 +1150,34 @@ extern int allogsm_send_ussd(struct allogsm_modul *gsm, char *message);
 extern int allogsm_send_operator_list(struct allogsm_modul *gsm);
 extern int allogsm_send_text(struct allogsm_modul *gsm, char *destination, unsigned char *message, char *id);
 extern int allogsm_send_pdu(struct allogsm_modul *gsm,  char *message, unsigned char *text, char *id); 
+extern int allogsm_send_text_prio(struct allogsm_modul *gsm, char *destination, unsigned char *message, char *id, int prio);
+extern int allogsm_send_pdu_prio(struct allogsm_modul *gsm, char *message, unsigned char *text, char *id, int prio);
+extern char *allogsm_sms_prio2str(int prio);
+extern int allogsm_str2sms_prio(const char *str);
+extern int allogsm_sms_load(struct allogsm_modul *gsm);
+extern void allogsm_sms_release(struct allogsm_modul *gsm);
+extern struct allogsm_bulk *allogsm_bulk_new(FILE *list, const unsigned char *message, const char *id, int prio, int pdu, const char *smsc, const char *coding);
+extern int allogsm_bulk_read(struct allogsm_bulk *bulk);
+extern int allogsm_send_bulk(struct allogsm_modul *gsm, struct allogsm_bulk *bulk, int max);
+extern void allogsm_bulk_free(struct allogsm_bulk *bulk);
+extern int allogsm_journal_open(struct allogsm_modul *gsm, const char *dir, int segment_size, int segments);
+extern int allogsm_journal_append(struct allogsm_modul *gsm, const gsm_event_sms_received *sms, const char *date);
+extern void allogsm_journal_close(struct allogsm_modul *gsm);
+extern int allogsm_count_open(const char *path, const char *export);
+extern int allogsm_count_add(struct allogsm_modul *gsm, const char *id, int sent, int failed);
+extern int allogsm_count_get(const char *id, struct allogsm_sms_count *count);
+extern int allogsm_count_walk(allogsm_count_cb cb, void *data);
+extern void allogsm_count_flush(void);
+extern void allogsm_count_close(void);
+extern int allogsm_journal_query(const char *dir, int span, time_t from, time_t to, const char *sender,
+	allogsm_journal_cb cb, void *data);
+#ifdef QUEUE_SMS
+extern int allogsm_set_sms_queue_depth(struct allogsm_modul *gsm, int depth);
+extern int allogsm_sms_queue_depth(struct allogsm_modul *gsm);
+extern int allogsm_sms_queue_segments(struct allogsm_modul *gsm);
+extern int allogsm_set_sms_aging(struct allogsm_modul *gsm, int ms);
+extern int allogsm_sms_queue_stats(struct allogsm_modul *gsm, int prio, struct allogsm_sms_lane_stats *stats);
+#endif
 extern int allogsm_decode_pdu(struct allogsm_modul *gsm, char *pdu, struct gsm_sms_pdu_info *pdu_info);
 extern int allogsm_send_pin(struct allogsm_modul *gsm, char *pin);
 extern int allogsm_transmit(struct allogsm_modul *gsm, const char *at);
@@ -991,6 +1244,11 @@ int allogsm_encode_pdu_ucs2(const char* SCA, const char* TPA, unsigned char* TP_
 int allogsm_encode_pdu_ucs2(const char* SCA, const char* TPA, char* TP_UD, const char* code, char* pDst);
 #endif
 int allogsm_forward_pdu(const char* src_pdu,const char* TPA,const char* SCA, char* pDst);
+int allogsm_pdu_template_init(struct allogsm_pdu_template *tpl, const char *smsc, gsm_sms_pdu *long_pdu, const char *coding);
+int allogsm_pdu_template_fill(const struct allogsm_pdu_template *tpl, int part, const char *dest, unsigned char *pdu);
+int allogsm_sms_classify(const unsigned char *text, struct allogsm_sms_plan *plan);
+int allogsm_sms_classify_coding(const unsigned char *text, const char *coding, struct allogsm_sms_plan *plan);
+int allogsm_sms_plan_split(const unsigned char *text, const struct allogsm_sms_plan *plan, gsm_sms_pdu *long_pdu);
 
 #ifdef CONFIG_CHECK_PHONE
 void allogsm_set_check_phone_mode(struct allogsm_modul *gsm,int mode);